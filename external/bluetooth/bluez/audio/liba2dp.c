@@ -38,6 +38,7 @@
 #include <netinet/in.h>
 #include <sys/poll.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
@@ -85,6 +86,13 @@
 /* Number of packets to buffer in the stream socket */
 #define PACKET_BUFFER_COUNT		10
 
+/* Number of packets the encoder can fill ahead of avdtp_write(), must
+ * stay below PACKET_BUFFER_COUNT so a whole batch fits in the socket */
+#define PACKET_RING_SIZE		8
+
+/* microseconds of audio sent in one burst, the sink has to buffer it */
+#define BATCH_LATENCY			50000
+
 /* timeout in milliseconds to prevent poll() from hanging indefinitely */
 #define POLL_TIMEOUT			1000
 
@@ -118,6 +126,18 @@ typedef enum {
 	A2DP_CMD_QUIT,
 } a2dp_command_t;
 
+struct a2dp_packet {
+	uint8_t buffer[BUFFER_SIZE];		/* RTP headers and SBC frames */
+	int count;				/* Bytes used in buffer */
+	int frame_count;			/* SBC frames in buffer */
+};
+
+/* sendmmsg() argument as the kernel sees it, bionic does not define it */
+struct a2dp_mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+
 struct bluetooth_data {
 	unsigned int link_mtu;			/* MTU for transport channel */
 	struct pollfd stream;			/* Audio stream filedescriptor */
@@ -136,12 +156,13 @@ struct bluetooth_data {
 	int	frame_duration;			/* length of an SBC frame in microseconds */
 	int codesize;				/* SBC codesize */
 	int samples;				/* Number of encoded samples */
-	uint8_t buffer[BUFFER_SIZE];		/* Codec transfer buffer */
-	int count;				/* Codec transfer buffer counter */
+	struct a2dp_packet packets[PACKET_RING_SIZE];	/* RTP packet ring */
+	int head;				/* Packet being encoded into */
+	int queued;				/* Full packets waiting for avdtp_write */
+	int batch;				/* Packets per avdtp_write */
 
 	int nsamples;				/* Cumulative number of codec samples */
 	uint16_t seq_num;			/* Cumulative packet sequence */
-	int frame_count;			/* Current frames in buffer*/
 
 	char	address[20];
 	int	rate;
@@ -213,6 +234,33 @@ static int l2cap_set_flushable(int fd, int flushable)
 	return 0;
 }
 
+static void a2dp_packet_reset(struct a2dp_packet *packet)
+{
+	packet->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
+	packet->frame_count = 0;
+}
+
+/* Sizes the batches of packets to the latency budget for the agreed MTU */
+static void bluetooth_batch_setup(struct bluetooth_data *data)
+{
+	int frame_length, frames;
+	long duration;
+
+	frame_length = sbc_get_frame_length(&data->sbc);
+	frames = ((int) MIN(data->link_mtu, BUFFER_SIZE) -
+			(int) sizeof(struct rtp_header) -
+			(int) sizeof(struct rtp_payload)) / frame_length;
+	duration = (long) MAX(frames, 1) * data->frame_duration;
+
+	data->batch = duration > 0 ? BATCH_LATENCY / duration : 1;
+	data->batch = MIN(MAX(data->batch, 1), PACKET_RING_SIZE - 1);
+	DBG("sending up to %d packets at once", data->batch);
+
+	data->head = 0;
+	data->queued = 0;
+	a2dp_packet_reset(&data->packets[0]);
+}
+
 static int bluetooth_start(struct bluetooth_data *data)
 {
 	char c = 'w';
@@ -259,12 +307,10 @@ static int bluetooth_start(struct bluetooth_data *data)
 	setsockopt(data->stream.fd, SOL_SOCKET, SO_SNDBUF, &bytes,
 			sizeof(bytes));
 
-	data->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
-	data->frame_count = 0;
+	bluetooth_batch_setup(data);
 	data->samples = 0;
 	data->nsamples = 0;
 	data->seq_num = 0;
-	data->frame_count = 0;
 	data->next_write = 0;
 
 	set_state(data, A2DP_STATE_STARTED);
@@ -633,30 +679,90 @@ static int bluetooth_a2dp_hw_params(struct bluetooth_data *data)
 	return 0;
 }
 
-static int avdtp_write(struct bluetooth_data *data)
+static int a2dp_sendmmsg(int fd, struct a2dp_mmsghdr *msgs,
+				unsigned int vlen, int flags)
 {
-	int ret = 0;
+	unsigned int i;
+	int ret;
+
+#ifdef __NR_sendmmsg
+	static int nosys = 0;
+
+	/* Kernels before 3.0 do not have it */
+	if (!nosys) {
+		ret = syscall(__NR_sendmmsg, fd, msgs, vlen, flags);
+		if (ret >= 0 || errno != ENOSYS)
+			return ret;
+		nosys = 1;
+	}
+#endif
+
+	for (i = 0; i < vlen; i++) {
+		ret = sendmsg(fd, &msgs[i].msg_hdr, flags);
+		if (ret < 0)
+			return i ? (int) i : -1;
+		msgs[i].msg_len = ret;
+	}
+
+	return i;
+}
+
+/* Fills in the RTP headers of the packet being encoded into, queues it
+ * and moves the encoder on to the next packet of the ring */
+static void avdtp_queue(struct bluetooth_data *data)
+{
+	struct a2dp_packet *packet = &data->packets[data->head];
 	struct rtp_header *header;
 	struct rtp_payload *payload;
 
+	header = (struct rtp_header *)packet->buffer;
+	payload = (struct rtp_payload *)(packet->buffer + sizeof(*header));
+
+	memset(packet->buffer, 0, sizeof(*header) + sizeof(*payload));
+
+	payload->frame_count = packet->frame_count;
+	header->v = 2;
+	header->pt = 1;
+	header->sequence_number = htons(data->seq_num);
+	header->timestamp = htonl(data->nsamples);
+	header->ssrc = htonl(1);
+
+	data->samples = 0;
+	data->seq_num++;
+	data->queued++;
+	data->head = (data->head + 1) % PACKET_RING_SIZE;
+	a2dp_packet_reset(&data->packets[data->head]);
+}
+
+static int avdtp_write(struct bluetooth_data *data)
+{
+	int ret = 0;
+	struct a2dp_mmsghdr msgs[PACKET_RING_SIZE];
+	struct iovec iov[PACKET_RING_SIZE];
+	int i, n = data->queued, sent, frame_count = 0;
+
 	uint64_t now;
-	long duration = data->frame_duration * data->frame_count;
+	long duration;
 #ifdef ENABLE_TIMING
 	uint64_t begin, end, begin2, end2;
 	begin = get_microseconds();
 #endif
 
-	header = (struct rtp_header *)data->buffer;
-	payload = (struct rtp_payload *)(data->buffer + sizeof(*header));
+	if (n == 0)
+		return 0;
 
-	memset(data->buffer, 0, sizeof(*header) + sizeof(*payload));
+	memset(msgs, 0, n * sizeof(msgs[0]));
+	for (i = 0; i < n; i++) {
+		struct a2dp_packet *packet = &data->packets[(data->head +
+				PACKET_RING_SIZE - n + i) % PACKET_RING_SIZE];
 
-	payload->frame_count = data->frame_count;
-	header->v = 2;
-	header->pt = 1;
-	header->sequence_number = htons(data->seq_num);
-	header->timestamp = htonl(data->nsamples);
-	header->ssrc = htonl(1);
+		iov[i].iov_base = packet->buffer;
+		iov[i].iov_len = packet->count;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		frame_count += packet->frame_count;
+	}
+	duration = data->frame_duration * frame_count;
 
 	data->stream.revents = 0;
 #ifdef ENABLE_TIMING
@@ -671,6 +777,7 @@ static int avdtp_write(struct bluetooth_data *data)
 		long ahead = 0;
 		now = get_microseconds();
 
+		/* The batch is due when its first packet is */
 		if (data->next_write) {
 			ahead = data->next_write - now;
 #ifdef ENABLE_TIMING
@@ -694,14 +801,20 @@ static int avdtp_write(struct bluetooth_data *data)
 #ifdef ENABLE_TIMING
 		begin2 = get_microseconds();
 #endif
-		ret = send(data->stream.fd, data->buffer, data->count, MSG_NOSIGNAL);
+		/* Blocking socket, only a partial batch on errors */
+		for (sent = 0; sent < n; sent += ret) {
+			ret = a2dp_sendmmsg(data->stream.fd, msgs + sent,
+						n - sent, MSG_NOSIGNAL);
+			if (ret <= 0)
+				break;
+		}
 #ifdef ENABLE_TIMING
 		end2 = get_microseconds();
-		print_time("send", begin2, end2);
+		print_time("sendmmsg", begin2, end2);
 #endif
 		if (ret < 0) {
 			/* can happen during normal remote disconnect */
-			VDBG("send() failed: %d (errno %s)", ret, strerror(errno));
+			VDBG("sendmmsg() failed: %d (errno %s)", ret, strerror(errno));
 		}
 		if (ret == -EPIPE) {
 			bluetooth_close(data);
@@ -713,11 +826,8 @@ static int avdtp_write(struct bluetooth_data *data)
 		data->next_write = 0;
 	}
 
-	/* Reset buffer of data to send */
-	data->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
-	data->frame_count = 0;
-	data->samples = 0;
-	data->seq_num++;
+	/* Packets are sent or lost, the ring slots are free again */
+	data->queued = 0;
 
 #ifdef ENABLE_TIMING
 	end = get_microseconds();
@@ -1197,10 +1307,13 @@ int a2dp_write(a2dpData d, const void* buffer, int count)
 	codesize = data->codesize;
 
 	while (frames_left >= codesize) {
-		/* Enough data to encode (sbc wants 512 byte blocks) */
+		struct a2dp_packet *packet = &data->packets[data->head];
+
+		/* Enough data to encode (sbc wants 512 byte blocks), straight
+		 * into the packet that will be sent */
 		encoded = sbc_encode(&(data->sbc), src, codesize,
-					data->buffer + data->count,
-					sizeof(data->buffer) - data->count,
+					packet->buffer + packet->count,
+					sizeof(packet->buffer) - packet->count,
 					&written);
 		if (encoded <= 0) {
 			ERR("Encoding error %d", encoded);
@@ -1210,20 +1323,24 @@ int a2dp_write(a2dpData d, const void* buffer, int count)
 			encoded, codesize, written);
 
 		src += encoded;
-		data->count += written;
-		data->frame_count++;
+		packet->count += written;
+		packet->frame_count++;
 		data->samples += encoded;
 		data->nsamples += encoded;
 
-		/* No space left for another frame then send */
-		if ((data->count + written >= data->link_mtu) ||
-				(data->count + written >= BUFFER_SIZE)) {
-			VDBG("sending packet %d, count %d, link_mtu %u",
-					data->seq_num, data->count,
+		/* No space left for another frame then queue it, and send
+		 * once the batch holds as much audio as we allow */
+		if ((packet->count + written >= data->link_mtu) ||
+				(packet->count + written >= BUFFER_SIZE)) {
+			VDBG("queueing packet %d, count %d, link_mtu %u",
+					data->seq_num, packet->count,
 					data->link_mtu);
-			err = avdtp_write(data);
-			if (err < 0)
-				return err;
+			avdtp_queue(data);
+			if (data->queued >= data->batch) {
+				err = avdtp_write(data);
+				if (err < 0)
+					return err;
+			}
 		}
 
 		ret += encoded;
@@ -1234,6 +1351,11 @@ int a2dp_write(a2dpData d, const void* buffer, int count)
 		ERR("%ld bytes left at end of a2dp_write\n", frames_left);
 
 done:
+	/* Do not keep full packets across calls */
+	err = avdtp_write(data);
+	if (err < 0)
+		return err;
+
 #ifdef ENABLE_TIMING
 	end = get_microseconds();
 	print_time("a2dp_write total", begin, end);
@@ -34,6 +34,7 @@
 #include <pthread.h>
 #include <signal.h>
 #include <limits.h>
+#include <sys/syscall.h>
 
 #include <netinet/in.h>
 
@@ -52,6 +53,12 @@
 
 #define BUFFER_SIZE 2048
 
+/* RTP packets the encoder can fill before they have to go out */
+#define PACKET_RING_SIZE 8
+
+/* Most audio, in microseconds, handed to the socket by one send */
+#define BATCH_LATENCY 50000
+
 #ifdef ENABLE_DEBUG
 #define DBG(fmt, arg...)  printf("DEBUG: %s: " fmt "\n" , __FUNCTION__ , ## arg)
 #else
@@ -92,18 +99,31 @@
 		}							\
 	} while (0)
 
+struct a2dp_packet {
+	uint8_t buffer[BUFFER_SIZE];		/* RTP headers and SBC frames */
+	unsigned int count;			/* Bytes used in buffer */
+	int frame_count;			/* SBC frames in buffer */
+};
+
+/* Kernel layout of the sendmmsg() argument, not every C library has it */
+struct a2dp_mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+
 struct bluetooth_a2dp {
 	sbc_capabilities_t sbc_capabilities;
 	sbc_t sbc;				/* Codec data */
 	int sbc_initialized;			/* Keep track if the encoder is initialized */
 	unsigned int codesize;			/* SBC codesize */
 	int samples;				/* Number of encoded samples */
-	uint8_t buffer[BUFFER_SIZE];		/* Codec transfer buffer */
-	unsigned int count;			/* Codec transfer buffer counter */
+	struct a2dp_packet packets[PACKET_RING_SIZE];	/* RTP packet ring */
+	unsigned int head;			/* Packet being encoded into */
+	unsigned int queued;			/* Complete packets not sent yet */
+	unsigned int batch;			/* Packets to send per system call */
 
 	int nsamples;				/* Cumulative number of codec samples */
 	uint16_t seq_num;			/* Cumulative packet sequence */
-	int frame_count;			/* Current frames in buffer*/
 };
 
 struct bluetooth_alsa_config {
@@ -617,9 +637,17 @@ static int bluetooth_a2dp_init(struct bluetooth_data *data,
 	return 0;
 }
 
-static void bluetooth_a2dp_setup(struct bluetooth_a2dp *a2dp)
+static void a2dp_packet_reset(struct a2dp_packet *packet)
+{
+	packet->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
+	packet->frame_count = 0;
+}
+
+static void bluetooth_a2dp_setup(struct bluetooth_a2dp *a2dp,
+						unsigned int link_mtu)
 {
 	sbc_capabilities_t active_capabilities = a2dp->sbc_capabilities;
+	int frame_length, frames, duration;
 
 	if (a2dp->sbc_initialized)
 		sbc_reinit(&a2dp->sbc, 0);
@@ -681,7 +709,19 @@ static void bluetooth_a2dp_setup(struct bluetooth_a2dp *a2dp)
 
 	a2dp->sbc.bitpool = active_capabilities.max_bitpool;
 	a2dp->codesize = sbc_get_codesize(&a2dp->sbc);
-	a2dp->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
+
+	/* Batch as many packets as fit in the latency budget */
+	frame_length = sbc_get_frame_length(&a2dp->sbc);
+	frames = ((int) MIN(link_mtu, BUFFER_SIZE) -
+			(int) sizeof(struct rtp_header) -
+			(int) sizeof(struct rtp_payload)) / frame_length;
+	duration = MAX(frames, 1) * sbc_get_frame_duration(&a2dp->sbc);
+	a2dp->batch = MIN(MAX(BATCH_LATENCY / duration, 1),
+							PACKET_RING_SIZE - 1);
+
+	a2dp->head = 0;
+	a2dp->queued = 0;
+	a2dp_packet_reset(&a2dp->packets[0]);
 }
 
 static int bluetooth_a2dp_hw_params(snd_pcm_ioplug_t *io,
@@ -749,7 +789,7 @@ static int bluetooth_a2dp_hw_params(snd_pcm_ioplug_t *io,
 	data->link_mtu = rsp->link_mtu;
 
 	/* Setup SBC encoder now we agree on parameters */
-	bluetooth_a2dp_setup(a2dp);
+	bluetooth_a2dp_setup(a2dp, data->link_mtu);
 
 	DBG("\tallocation=%u\n\tsubbands=%u\n\tblocks=%u\n\tbitpool=%u\n",
 		a2dp->sbc.allocation, a2dp->sbc.subbands, a2dp->sbc.blocks,
@@ -964,40 +1004,134 @@ static snd_pcm_sframes_t bluetooth_a2dp_read(snd_pcm_ioplug_t *io,
 	return ret;
 }
 
-static int avdtp_write(struct bluetooth_data *data)
+static int a2dp_sendmmsg(int fd, struct a2dp_mmsghdr *msgs,
+					unsigned int vlen, int flags)
 {
-	int ret = 0;
+	unsigned int i;
+	int ret;
+
+#ifdef __NR_sendmmsg
+	static int nosys = 0;
+
+	if (!nosys) {
+		ret = syscall(__NR_sendmmsg, fd, msgs, vlen, flags);
+		if (ret >= 0 || errno != ENOSYS)
+			return ret;
+		nosys = 1;
+	}
+#endif
+
+	for (i = 0; i < vlen; i++) {
+		ret = sendmsg(fd, &msgs[i].msg_hdr, flags);
+		if (ret < 0)
+			return i ? (int) i : -1;
+		msgs[i].msg_len = ret;
+	}
+
+	return i;
+}
+
+/* Closes the packet being encoded into and queues it for avdtp_write() */
+static void avdtp_queue(struct bluetooth_data *data)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	struct a2dp_packet *packet = &a2dp->packets[a2dp->head];
 	struct rtp_header *header;
 	struct rtp_payload *payload;
-	struct bluetooth_a2dp *a2dp = &data->a2dp;
 
-	header = (void *) a2dp->buffer;
-	payload = (void *) (a2dp->buffer + sizeof(*header));
+	header = (void *) packet->buffer;
+	payload = (void *) (packet->buffer + sizeof(*header));
 
-	memset(a2dp->buffer, 0, sizeof(*header) + sizeof(*payload));
+	memset(packet->buffer, 0, sizeof(*header) + sizeof(*payload));
 
-	payload->frame_count = a2dp->frame_count;
+	payload->frame_count = packet->frame_count;
 	header->v = 2;
 	header->pt = 1;
 	header->sequence_number = htons(a2dp->seq_num);
 	header->timestamp = htonl(a2dp->nsamples);
 	header->ssrc = htonl(1);
 
-	ret = send(data->stream.fd, a2dp->buffer, a2dp->count, MSG_DONTWAIT);
-	if (ret < 0) {
-		DBG("send returned %d errno %s.", ret, strerror(errno));
-		ret = -errno;
-	}
+	DBG("queued packet %d, count %u, link_mtu %u", a2dp->seq_num,
+					packet->count, data->link_mtu);
 
-	/* Reset buffer of data to send */
-	a2dp->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
-	a2dp->frame_count = 0;
 	a2dp->samples = 0;
 	a2dp->seq_num++;
+	a2dp->queued++;
+	a2dp->head = (a2dp->head + 1) % PACKET_RING_SIZE;
+	a2dp_packet_reset(&a2dp->packets[a2dp->head]);
+}
+
+/* Sends all queued packets with one system call, the socket does not
+ * block so packets that do not fit in it are dropped */
+static int avdtp_write(struct bluetooth_data *data)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	struct a2dp_mmsghdr msgs[PACKET_RING_SIZE];
+	struct iovec iov[PACKET_RING_SIZE];
+	unsigned int i, n = a2dp->queued;
+	int ret;
+
+	if (n == 0)
+		return 0;
+
+	memset(msgs, 0, n * sizeof(msgs[0]));
+	for (i = 0; i < n; i++) {
+		struct a2dp_packet *packet = &a2dp->packets[(a2dp->head +
+				PACKET_RING_SIZE - n + i) % PACKET_RING_SIZE];
+
+		iov[i].iov_base = packet->buffer;
+		iov[i].iov_len = packet->count;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = a2dp_sendmmsg(data->stream.fd, msgs, n, MSG_DONTWAIT);
+	if (ret < 0) {
+		DBG("sendmmsg returned %d errno %s.", ret, strerror(errno));
+		ret = -errno;
+	} else if ((unsigned int) ret < n)
+		DBG("sent %d of %u packets", ret, n);
+
+	a2dp->queued = 0;
 
 	return ret;
 }
 
+/* Encodes one SBC frame into the packet ring, sending full batches */
+static int a2dp_encode(struct bluetooth_data *data, const uint8_t *pcm,
+							int frame_size)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	struct a2dp_packet *packet = &a2dp->packets[a2dp->head];
+	ssize_t written;
+	int encoded;
+
+	/* Enough data to encode (sbc wants 1k blocks) */
+	encoded = sbc_encode(&a2dp->sbc, pcm, a2dp->codesize,
+				packet->buffer + packet->count,
+				sizeof(packet->buffer) - packet->count,
+								&written);
+	if (encoded <= 0) {
+		DBG("Encoding error %d", encoded);
+		return encoded;
+	}
+
+	/* Increment a2dp buffers */
+	packet->count += written;
+	packet->frame_count++;
+	a2dp->samples += encoded / frame_size;
+	a2dp->nsamples += encoded / frame_size;
+
+	/* No space left for another frame then queue it */
+	if (packet->count + written >= MIN(data->link_mtu, BUFFER_SIZE)) {
+		avdtp_queue(data);
+		if (a2dp->queued >= a2dp->batch)
+			avdtp_write(data);
+	}
+
+	return encoded;
+}
+
 static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 				const snd_pcm_channel_area_t *areas,
 				snd_pcm_uframes_t offset, snd_pcm_uframes_t size)
@@ -1007,7 +1141,6 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 	snd_pcm_sframes_t ret = 0;
 	unsigned int bytes_left;
 	int frame_size, encoded;
-	ssize_t written;
 	uint8_t *buff;
 
 	DBG("areas->step=%u areas->first=%u offset=%lu size=%lu",
@@ -1050,35 +1183,15 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 	}
 
 	/* Check if we have any left over data from the last write */
-	if (data->count > 0 && (bytes_left - data->count) >= a2dp->codesize) {
+	if (data->count > 0 && data->count + bytes_left >= a2dp->codesize) {
 		int additional_bytes_needed = a2dp->codesize - data->count;
 
 		memcpy(data->buffer + data->count, buff,
 						additional_bytes_needed);
 
-		/* Enough data to encode (sbc wants 1k blocks) */
-		encoded = sbc_encode(&a2dp->sbc, data->buffer, a2dp->codesize,
-					a2dp->buffer + a2dp->count,
-					sizeof(a2dp->buffer) - a2dp->count,
-								&written);
-		if (encoded <= 0) {
-			DBG("Encoding error %d", encoded);
+		encoded = a2dp_encode(data, data->buffer, frame_size);
+		if (encoded <= 0)
 			goto done;
-		}
-
-		/* Increment a2dp buffers */
-		a2dp->count += written;
-		a2dp->frame_count++;
-		a2dp->samples += encoded / frame_size;
-		a2dp->nsamples += encoded / frame_size;
-
-		/* No space left for another frame then send */
-		if (a2dp->count + written >= data->link_mtu) {
-			avdtp_write(data);
-			DBG("sending packet %d, count %d, link_mtu %u",
-					a2dp->seq_num, a2dp->count,
-							data->link_mtu);
-		}
 
 		/* Increment up buff pointer to take into account
 		 * the data processed */
@@ -1089,37 +1202,17 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 		data->count = 0;
 	}
 
-
-	/* Process this buffer in full chunks */
+	/* Process this buffer in full chunks, straight from the
+	 * application buffer into the packet ring */
 	while (bytes_left >= a2dp->codesize) {
-		/* Enough data to encode (sbc wants 1k blocks) */
-		encoded = sbc_encode(&a2dp->sbc, buff, a2dp->codesize,
-					a2dp->buffer + a2dp->count,
-					sizeof(a2dp->buffer) - a2dp->count,
-								&written);
-		if (encoded <= 0) {
-			DBG("Encoding error %d", encoded);
+		encoded = a2dp_encode(data, buff, frame_size);
+		if (encoded <= 0)
 			goto done;
-		}
 
 		/* Increment up buff pointer to take into account
 		 * the data processed */
 		buff += a2dp->codesize;
 		bytes_left -= a2dp->codesize;
-
-		/* Increment a2dp buffers */
-		a2dp->count += written;
-		a2dp->frame_count++;
-		a2dp->samples += encoded / frame_size;
-		a2dp->nsamples += encoded / frame_size;
-
-		/* No space left for another frame then send */
-		if (a2dp->count + written >= data->link_mtu) {
-			avdtp_write(data);
-			DBG("sending packet %d, count %d, link_mtu %u",
-						a2dp->seq_num, a2dp->count,
-							data->link_mtu);
-		}
 	}
 
 	/* Copy the extra to our temp buffer for the next write */
@@ -1130,6 +1223,9 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 	}
 
 done:
+	/* Whatever is complete goes out now, the hw thread paces us */
+	avdtp_write(data);
+
 	DBG("returning %ld", size - bytes_left / frame_size);
 
 	return size - bytes_left / frame_size;
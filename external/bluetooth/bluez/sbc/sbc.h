@@ -64,6 +64,10 @@ extern "C" {
 #define SBC_LE			0x00
 #define SBC_BE			0x01
 
+/* sbc_init() and sbc_reinit() flags */
+/* Only use the reference C code, not the CPU specific optimizations */
+#define SBC_FLAG_GENERIC	0x01
+
 struct sbc_struct {
 	unsigned long flags;
 
@@ -33,6 +33,7 @@
 
 #include "sbc_primitives.h"
 #include "sbc_primitives_mmx.h"
+#include "sbc_primitives_sse.h"
 #include "sbc_primitives_neon.h"
 #include "sbc_primitives_armv6.h"
 
@@ -515,10 +516,112 @@ static int sbc_calc_scalefactors_j(
 	return joint;
 }
 
+/*
+ * Reference C code of the synthesis filters, used by the decoder.
+ */
+
+static SBC_ALWAYS_INLINE int16_t sbc_clip16(int32_t s)
+{
+	if (s > 0x7FFF)
+		return 0x7FFF;
+	else if (s < -0x8000)
+		return -0x8000;
+	else
+		return s;
+}
+
+static void sbc_synthesize_4s(struct sbc_decoder_state *state,
+			const int32_t *sb_sample, int16_t *pcm, int ch)
+{
+	int i, k, idx;
+	int32_t *v = state->V[ch];
+	int *offset = state->offset[ch];
+
+	for (i = 0; i < 8; i++) {
+		/* Shifting */
+		offset[i]--;
+		if (offset[i] < 0) {
+			offset[i] = 79;
+			memcpy(v + 80, v, 9 * sizeof(*v));
+		}
+
+		/* Distribute the new matrix value to the shifted position */
+		v[offset[i]] = SCALE4_STAGED1(
+			MULA(synmatrix4[i][0], sb_sample[0],
+			MULA(synmatrix4[i][1], sb_sample[1],
+			MULA(synmatrix4[i][2], sb_sample[2],
+			MUL (synmatrix4[i][3], sb_sample[3])))));
+	}
+
+	/* Compute the samples */
+	for (idx = 0, i = 0; i < 4; i++, idx += 5) {
+		k = (i + 4) & 0xf;
+
+		/* Store in output, Q0 */
+		pcm[i] = sbc_clip16(SCALE4_STAGED1(
+			MULA(v[offset[i] + 0], sbc_proto_4_40m0[idx + 0],
+			MULA(v[offset[k] + 1], sbc_proto_4_40m1[idx + 0],
+			MULA(v[offset[i] + 2], sbc_proto_4_40m0[idx + 1],
+			MULA(v[offset[k] + 3], sbc_proto_4_40m1[idx + 1],
+			MULA(v[offset[i] + 4], sbc_proto_4_40m0[idx + 2],
+			MULA(v[offset[k] + 5], sbc_proto_4_40m1[idx + 2],
+			MULA(v[offset[i] + 6], sbc_proto_4_40m0[idx + 3],
+			MULA(v[offset[k] + 7], sbc_proto_4_40m1[idx + 3],
+			MULA(v[offset[i] + 8], sbc_proto_4_40m0[idx + 4],
+			MUL( v[offset[k] + 9], sbc_proto_4_40m1[idx + 4]))))))))))));
+	}
+}
+
+static void sbc_synthesize_8s(struct sbc_decoder_state *state,
+			const int32_t *sb_sample, int16_t *pcm, int ch)
+{
+	int i, j, k, idx;
+	int *offset = state->offset[ch];
+
+	for (i = 0; i < 16; i++) {
+		/* Shifting */
+		offset[i]--;
+		if (offset[i] < 0) {
+			offset[i] = 159;
+			for (j = 0; j < 9; j++)
+				state->V[ch][j + 160] = state->V[ch][j];
+		}
+
+		/* Distribute the new matrix value to the shifted position */
+		state->V[ch][offset[i]] = SCALE8_STAGED1(
+			MULA(synmatrix8[i][0], sb_sample[0],
+			MULA(synmatrix8[i][1], sb_sample[1],
+			MULA(synmatrix8[i][2], sb_sample[2],
+			MULA(synmatrix8[i][3], sb_sample[3],
+			MULA(synmatrix8[i][4], sb_sample[4],
+			MULA(synmatrix8[i][5], sb_sample[5],
+			MULA(synmatrix8[i][6], sb_sample[6],
+			MUL( synmatrix8[i][7], sb_sample[7])))))))));
+	}
+
+	/* Compute the samples */
+	for (idx = 0, i = 0; i < 8; i++, idx += 5) {
+		k = (i + 8) & 0xf;
+
+		/* Store in output, Q0 */
+		pcm[i] = sbc_clip16(SCALE8_STAGED1(
+			MULA(state->V[ch][offset[i] + 0], sbc_proto_8_80m0[idx + 0],
+			MULA(state->V[ch][offset[k] + 1], sbc_proto_8_80m1[idx + 0],
+			MULA(state->V[ch][offset[i] + 2], sbc_proto_8_80m0[idx + 1],
+			MULA(state->V[ch][offset[k] + 3], sbc_proto_8_80m1[idx + 1],
+			MULA(state->V[ch][offset[i] + 4], sbc_proto_8_80m0[idx + 2],
+			MULA(state->V[ch][offset[k] + 5], sbc_proto_8_80m1[idx + 2],
+			MULA(state->V[ch][offset[i] + 6], sbc_proto_8_80m0[idx + 3],
+			MULA(state->V[ch][offset[k] + 7], sbc_proto_8_80m1[idx + 3],
+			MULA(state->V[ch][offset[i] + 8], sbc_proto_8_80m0[idx + 4],
+			MUL( state->V[ch][offset[k] + 9], sbc_proto_8_80m1[idx + 4]))))))))))));
+	}
+}
+
 /*
  * Detect CPU features and setup function pointers
  */
-void sbc_init_primitives(struct sbc_encoder_state *state)
+void sbc_init_primitives(struct sbc_encoder_state *state, int generic)
 {
 	/* Default implementation for analyze functions */
 	state->sbc_analyze_4b_4s = sbc_analyze_4b_4s_simd;
@@ -535,10 +638,16 @@ void sbc_init_primitives(struct sbc_encoder_state *state)
 	state->sbc_calc_scalefactors_j = sbc_calc_scalefactors_j;
 	state->implementation_info = "Generic C";
 
+	if (generic)
+		return;
+
 	/* X86/AMD64 optimizations */
 #ifdef SBC_BUILD_WITH_MMX_SUPPORT
 	sbc_init_primitives_mmx(state);
 #endif
+#ifdef SBC_BUILD_WITH_SSE_SUPPORT
+	sbc_init_primitives_sse(state);
+#endif
 
 	/* ARM optimizations */
 #ifdef SBC_BUILD_WITH_ARMV6_SUPPORT
@@ -548,3 +657,19 @@ void sbc_init_primitives(struct sbc_encoder_state *state)
 	sbc_init_primitives_neon(state);
 #endif
 }
+
+void sbc_init_primitives_dec(struct sbc_decoder_state *state, int generic)
+{
+	/* Default implementation for synthesis functions */
+	state->sbc_synthesize_4s = sbc_synthesize_4s;
+	state->sbc_synthesize_8s = sbc_synthesize_8s;
+	state->implementation_info = "Generic C";
+
+	if (generic)
+		return;
+
+	/* X86/AMD64 optimizations */
+#ifdef SBC_BUILD_WITH_SSE_SUPPORT
+	sbc_init_primitives_dec_sse(state);
+#endif
+}
@@ -70,11 +70,29 @@ struct sbc_encoder_state {
 	const char *implementation_info;
 };
 
+struct sbc_decoder_state {
+	int subbands;
+	int32_t V[2][170];
+	int offset[2][16];
+	/* Polyphase synthesis filter for 4 subbands configuration,
+	 * it handles one block of one channel */
+	void (*sbc_synthesize_4s)(struct sbc_decoder_state *state,
+			const int32_t *sb_sample, int16_t *pcm, int ch);
+	/* Polyphase synthesis filter for 8 subbands configuration,
+	 * it handles one block of one channel */
+	void (*sbc_synthesize_8s)(struct sbc_decoder_state *state,
+			const int32_t *sb_sample, int16_t *pcm, int ch);
+	const char *implementation_info;
+};
+
 /*
  * Initialize pointers to the functions which are the basic "building bricks"
  * of SBC codec. Best implementation is selected based on target CPU
- * capabilities.
+ * capabilities, unless "generic" asks for the reference C code.
  */
-void sbc_init_primitives(struct sbc_encoder_state *encoder_state);
+void sbc_init_primitives(struct sbc_encoder_state *encoder_state,
+							int generic);
+void sbc_init_primitives_dec(struct sbc_decoder_state *decoder_state,
+							int generic);
 
 #endif
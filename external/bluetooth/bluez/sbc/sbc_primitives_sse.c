@@ -0,0 +1,482 @@
+/*
+ *
+ *  Bluetooth low-complexity, subband codec (SBC) library
+ *
+ *  Copyright (C) 2008-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *  Copyright (C) 2004-2005  Henryk Ploetz <henryk@ploetzli.ch>
+ *  Copyright (C) 2005-2006  Brad Midgley <bmidgley@xmission.com>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include "sbc.h"
+#include "sbc_math.h"
+#include "sbc_tables.h"
+
+#include "sbc_primitives_sse.h"
+
+/*
+ * SSE2 and AVX2 optimizations
+ *
+ * SSE2 is always there on x86-64, AVX2 is detected at runtime and only
+ * used for the functions where the wider registers pay off: 8 subbands
+ * analysis, scale factors and the synthesis filters, which need its
+ * 32-bit multiplications and gathers.
+ */
+
+#ifdef SBC_BUILD_WITH_SSE_SUPPORT
+
+#include <emmintrin.h>
+
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#include <immintrin.h>
+#define SBC_BUILD_WITH_AVX2_SUPPORT
+#define SBC_AVX2 __attribute__((target("avx2")))
+#endif
+
+#define LOAD128(p) _mm_loadu_si128((const __m128i *) (p))
+#define STORE128(p, v) _mm_storeu_si128((__m128i *) (p), (v))
+
+static inline void sbc_analyze_four_sse(const int16_t *in, int32_t *out,
+					const FIXED_T *consts)
+{
+	__m128i t1, t2;
+	int hop;
+
+	/* rounding coefficient */
+	t1 = _mm_set1_epi32(1 << (SBC_PROTO_FIXED4_SCALE - 1));
+
+	/* low pass polyphase filter */
+	for (hop = 0; hop < 40; hop += 8)
+		t1 = _mm_add_epi32(t1, _mm_madd_epi16(LOAD128(in + hop),
+						LOAD128(consts + hop)));
+
+	/* scaling */
+	t1 = _mm_srai_epi32(t1, SBC_PROTO_FIXED4_SCALE);
+	t2 = _mm_packs_epi32(t1, t1);
+
+	/* do the cos transform */
+	t1 = _mm_madd_epi16(_mm_shuffle_epi32(t2, 0x00), LOAD128(consts + 40));
+	t1 = _mm_add_epi32(t1, _mm_madd_epi16(_mm_shuffle_epi32(t2, 0x55),
+						LOAD128(consts + 48)));
+
+	STORE128(out, t1);
+}
+
+static inline void sbc_analyze_eight_sse(const int16_t *in, int32_t *out,
+					const FIXED_T *consts)
+{
+	__m128i t1l, t1h, t2, p;
+	int hop, i;
+
+	/* rounding coefficient */
+	t1l = t1h = _mm_set1_epi32(1 << (SBC_PROTO_FIXED8_SCALE - 1));
+
+	/* low pass polyphase filter */
+	for (hop = 0; hop < 80; hop += 16) {
+		t1l = _mm_add_epi32(t1l, _mm_madd_epi16(LOAD128(in + hop),
+						LOAD128(consts + hop)));
+		t1h = _mm_add_epi32(t1h, _mm_madd_epi16(LOAD128(in + hop + 8),
+						LOAD128(consts + hop + 8)));
+	}
+
+	/* scaling */
+	t2 = _mm_packs_epi32(_mm_srai_epi32(t1l, SBC_PROTO_FIXED8_SCALE),
+			     _mm_srai_epi32(t1h, SBC_PROTO_FIXED8_SCALE));
+
+	/* do the cos transform, two inputs at a time */
+	t1l = t1h = _mm_setzero_si128();
+	for (i = 0; i < 4; i++) {
+		switch (i) {
+		case 0: p = _mm_shuffle_epi32(t2, 0x00); break;
+		case 1: p = _mm_shuffle_epi32(t2, 0x55); break;
+		case 2: p = _mm_shuffle_epi32(t2, 0xaa); break;
+		default: p = _mm_shuffle_epi32(t2, 0xff); break;
+		}
+		t1l = _mm_add_epi32(t1l, _mm_madd_epi16(p,
+					LOAD128(consts + 80 + i * 16)));
+		t1h = _mm_add_epi32(t1h, _mm_madd_epi16(p,
+					LOAD128(consts + 80 + i * 16 + 8)));
+	}
+
+	STORE128(out, t1l);
+	STORE128(out + 4, t1h);
+}
+
+static inline void sbc_analyze_4b_4s_sse(int16_t *x, int32_t *out,
+						int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_four_sse(x + 12, out, analysis_consts_fixed4_simd_odd);
+	out += out_stride;
+	sbc_analyze_four_sse(x + 8, out, analysis_consts_fixed4_simd_even);
+	out += out_stride;
+	sbc_analyze_four_sse(x + 4, out, analysis_consts_fixed4_simd_odd);
+	out += out_stride;
+	sbc_analyze_four_sse(x + 0, out, analysis_consts_fixed4_simd_even);
+}
+
+static inline void sbc_analyze_4b_8s_sse(int16_t *x, int32_t *out,
+						int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_eight_sse(x + 24, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_sse(x + 16, out, analysis_consts_fixed8_simd_even);
+	out += out_stride;
+	sbc_analyze_eight_sse(x + 8, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_sse(x + 0, out, analysis_consts_fixed8_simd_even);
+}
+
+/* (abs(x) - 1) for non-zero x, 0 for zero, like the C scale factors code */
+static inline __m128i sbc_abs_dec_sse(__m128i x)
+{
+	__m128i zero = _mm_setzero_si128();
+
+	x = _mm_add_epi32(x, _mm_cmpgt_epi32(x, zero));
+	return _mm_xor_si128(x, _mm_cmpgt_epi32(zero, x));
+}
+
+static inline uint32_t sbc_scalefactor(uint32_t x)
+{
+	return (31 - SCALE_OUT_BITS) - __builtin_clz(x);
+}
+
+static void sbc_calc_scalefactors_sse(
+	int32_t sb_sample_f[16][2][8],
+	uint32_t scale_factor[2][8],
+	int blocks, int channels, int subbands)
+{
+	uint32_t SBC_ALIGNED x[4];
+	int ch, sb, blk, i;
+	__m128i acc;
+
+	for (ch = 0; ch < channels; ch++) {
+		for (sb = 0; sb < subbands; sb += 4) {
+			acc = _mm_set1_epi32(1 << SCALE_OUT_BITS);
+			for (blk = 0; blk < blocks; blk++)
+				acc = _mm_or_si128(acc, sbc_abs_dec_sse(
+					LOAD128(&sb_sample_f[blk][ch][sb])));
+			STORE128(x, acc);
+			for (i = 0; i < 4; i++)
+				scale_factor[ch][sb + i] = sbc_scalefactor(x[i]);
+		}
+	}
+}
+
+static int sbc_calc_scalefactors_j_sse(
+	int32_t sb_sample_f[16][2][8],
+	uint32_t scale_factor[2][8],
+	int blocks, int subbands)
+{
+	int32_t SBC_ALIGNED sb_sample_j[16][2][4];
+	uint32_t SBC_ALIGNED x[4], y[4], xj[4], yj[4];
+	int32_t SBC_ALIGNED use_j[4];
+	int sb, blk, i, joint = 0;
+	__m128i a, b, ja, jb, ax, ay, ajx, ajy, mask;
+
+	for (sb = 0; sb < subbands; sb += 4) {
+		ax = ay = ajx = ajy = _mm_set1_epi32(1 << SCALE_OUT_BITS);
+		for (blk = 0; blk < blocks; blk++) {
+			a = LOAD128(&sb_sample_f[blk][0][sb]);
+			b = LOAD128(&sb_sample_f[blk][1][sb]);
+			ja = _mm_add_epi32(_mm_srai_epi32(a, 1),
+					   _mm_srai_epi32(b, 1));
+			jb = _mm_sub_epi32(_mm_srai_epi32(a, 1),
+					   _mm_srai_epi32(b, 1));
+			STORE128(sb_sample_j[blk][0], ja);
+			STORE128(sb_sample_j[blk][1], jb);
+			ax = _mm_or_si128(ax, sbc_abs_dec_sse(a));
+			ay = _mm_or_si128(ay, sbc_abs_dec_sse(b));
+			ajx = _mm_or_si128(ajx, sbc_abs_dec_sse(ja));
+			ajy = _mm_or_si128(ajy, sbc_abs_dec_sse(jb));
+		}
+		STORE128(x, ax);
+		STORE128(y, ay);
+		STORE128(xj, ajx);
+		STORE128(yj, ajy);
+
+		for (i = 0; i < 4; i++) {
+			uint32_t sx = sbc_scalefactor(x[i]);
+			uint32_t sy = sbc_scalefactor(y[i]);
+			uint32_t sjx = sbc_scalefactor(xj[i]);
+			uint32_t sjy = sbc_scalefactor(yj[i]);
+
+			/* last subband does not use joint stereo */
+			use_j[i] = sb + i < subbands - 1 && sx + sy > sjx + sjy;
+			if (use_j[i]) {
+				joint |= 1 << (subbands - 1 - (sb + i));
+				sx = sjx;
+				sy = sjy;
+				use_j[i] = -1;
+			}
+			scale_factor[0][sb + i] = sx;
+			scale_factor[1][sb + i] = sy;
+		}
+		if (!(use_j[0] | use_j[1] | use_j[2] | use_j[3]))
+			continue;
+
+		mask = LOAD128(use_j);
+		for (blk = 0; blk < blocks; blk++) {
+			a = LOAD128(&sb_sample_f[blk][0][sb]);
+			b = LOAD128(&sb_sample_f[blk][1][sb]);
+			a = _mm_or_si128(_mm_andnot_si128(mask, a),
+				_mm_and_si128(mask, LOAD128(sb_sample_j[blk][0])));
+			b = _mm_or_si128(_mm_andnot_si128(mask, b),
+				_mm_and_si128(mask, LOAD128(sb_sample_j[blk][1])));
+			STORE128(&sb_sample_f[blk][0][sb], a);
+			STORE128(&sb_sample_f[blk][1][sb], b);
+		}
+	}
+
+	/* bitmask with the information about subbands using joint stereo */
+	return joint;
+}
+
+#ifdef SBC_BUILD_WITH_AVX2_SUPPORT
+
+#define LOAD256(p) _mm256_loadu_si256((const __m256i *) (p))
+#define STORE256(p, v) _mm256_storeu_si256((__m256i *) (p), (v))
+
+static inline SBC_AVX2 void sbc_analyze_eight_avx2(const int16_t *in,
+					int32_t *out, const FIXED_T *consts)
+{
+	__m256i t1, t2, p;
+	int hop, i;
+
+	/* rounding coefficient */
+	t1 = _mm256_set1_epi32(1 << (SBC_PROTO_FIXED8_SCALE - 1));
+
+	/* low pass polyphase filter */
+	for (hop = 0; hop < 80; hop += 16)
+		t1 = _mm256_add_epi32(t1, _mm256_madd_epi16(LOAD256(in + hop),
+						LOAD256(consts + hop)));
+
+	/* scaling: pairs of 16-bit values end up in dwords 0, 1, 4, 5 */
+	t1 = _mm256_srai_epi32(t1, SBC_PROTO_FIXED8_SCALE);
+	t2 = _mm256_packs_epi32(t1, t1);
+
+	/* do the cos transform, two inputs at a time */
+	t1 = _mm256_setzero_si256();
+	for (i = 0; i < 4; i++) {
+		p = _mm256_permutevar8x32_epi32(t2,
+				_mm256_set1_epi32((i & 1) + (i & 2) * 2));
+		t1 = _mm256_add_epi32(t1, _mm256_madd_epi16(p,
+					LOAD256(consts + 80 + i * 16)));
+	}
+
+	STORE256(out, t1);
+}
+
+static SBC_AVX2 void sbc_analyze_4b_8s_avx2(int16_t *x, int32_t *out,
+						int out_stride)
+{
+	/* Analyze blocks */
+	sbc_analyze_eight_avx2(x + 24, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_avx2(x + 16, out, analysis_consts_fixed8_simd_even);
+	out += out_stride;
+	sbc_analyze_eight_avx2(x + 8, out, analysis_consts_fixed8_simd_odd);
+	out += out_stride;
+	sbc_analyze_eight_avx2(x + 0, out, analysis_consts_fixed8_simd_even);
+}
+
+static inline SBC_AVX2 __m256i sbc_abs_dec_avx2(__m256i x)
+{
+	__m256i zero = _mm256_setzero_si256();
+
+	x = _mm256_add_epi32(x, _mm256_cmpgt_epi32(x, zero));
+	return _mm256_xor_si256(x, _mm256_cmpgt_epi32(zero, x));
+}
+
+static SBC_AVX2 void sbc_calc_scalefactors_avx2(
+	int32_t sb_sample_f[16][2][8],
+	uint32_t scale_factor[2][8],
+	int blocks, int channels, int subbands)
+{
+	uint32_t SBC_ALIGNED x[8];
+	int ch, blk, i;
+	__m256i acc;
+
+	if (subbands != 8) {
+		sbc_calc_scalefactors_sse(sb_sample_f, scale_factor,
+					  blocks, channels, subbands);
+		return;
+	}
+
+	for (ch = 0; ch < channels; ch++) {
+		acc = _mm256_set1_epi32(1 << SCALE_OUT_BITS);
+		for (blk = 0; blk < blocks; blk++)
+			acc = _mm256_or_si256(acc, sbc_abs_dec_avx2(
+					LOAD256(sb_sample_f[blk][ch])));
+		STORE256(x, acc);
+		for (i = 0; i < 8; i++)
+			scale_factor[ch][i] = sbc_scalefactor(x[i]);
+	}
+}
+
+/*
+ * Synthesis filters. The matrixing step gives all new V entries of a
+ * block at once; they are then stored one by one, in the same order as
+ * the C code does, because the ring buffer wraparound copies V[0..8] in
+ * the middle of the updates. The windowing step gathers the ten V taps
+ * of every output sample. All arithmetic is done modulo 2^32 like in the
+ * C code, so the output is bit exact.
+ */
+
+static SBC_AVX2 void sbc_synthesize_4s_avx2(struct sbc_decoder_state *state,
+			const int32_t *sb_sample, int16_t *pcm, int ch)
+{
+	int32_t SBC_ALIGNED m[8];
+	int32_t *v = state->V[ch];
+	int *offset = state->offset[ch];
+	__m256i t;
+	__m128i offi, offk, acc;
+	int i;
+
+	/* Matrixing */
+	t = _mm256_setzero_si256();
+	for (i = 0; i < 4; i++)
+		t = _mm256_add_epi32(t, _mm256_mullo_epi32(
+				_mm256_set1_epi32(sb_sample[i]),
+				LOAD256(synmatrix4_simd + i * 8)));
+	STORE256(m, _mm256_srai_epi32(t, SCALE4_STAGED1_BITS));
+
+	for (i = 0; i < 8; i++) {
+		/* Shifting */
+		offset[i]--;
+		if (offset[i] < 0) {
+			offset[i] = 79;
+			memcpy(v + 80, v, 9 * sizeof(*v));
+		}
+
+		/* Distribute the new matrix value to the shifted position */
+		v[offset[i]] = m[i];
+	}
+
+	/* Compute the samples */
+	offi = LOAD128(offset);
+	offk = LOAD128(offset + 4);
+	acc = _mm_setzero_si128();
+	for (i = 0; i < 5; i++) {
+		acc = _mm_add_epi32(acc, _mm_mullo_epi32(
+			_mm_i32gather_epi32(v + 2 * i, offi, 4),
+			LOAD128(sbc_proto_4_40m0_simd + i * 4)));
+		acc = _mm_add_epi32(acc, _mm_mullo_epi32(
+			_mm_i32gather_epi32(v + 2 * i + 1, offk, 4),
+			LOAD128(sbc_proto_4_40m1_simd + i * 4)));
+	}
+	acc = _mm_srai_epi32(acc, SCALE4_STAGED1_BITS);
+
+	/* Store in output, Q0, saturated like sbc_clip16() */
+	_mm_storel_epi64((__m128i *) pcm, _mm_packs_epi32(acc, acc));
+}
+
+static SBC_AVX2 void sbc_synthesize_8s_avx2(struct sbc_decoder_state *state,
+			const int32_t *sb_sample, int16_t *pcm, int ch)
+{
+	int32_t SBC_ALIGNED m[16];
+	int32_t *v = state->V[ch];
+	int *offset = state->offset[ch];
+	__m256i lo, hi, s, offi, offk, acc;
+	int i;
+
+	/* Matrixing */
+	lo = hi = _mm256_setzero_si256();
+	for (i = 0; i < 8; i++) {
+		s = _mm256_set1_epi32(sb_sample[i]);
+		lo = _mm256_add_epi32(lo, _mm256_mullo_epi32(s,
+				LOAD256(synmatrix8_simd + i * 16)));
+		hi = _mm256_add_epi32(hi, _mm256_mullo_epi32(s,
+				LOAD256(synmatrix8_simd + i * 16 + 8)));
+	}
+	STORE256(m, _mm256_srai_epi32(lo, SCALE8_STAGED1_BITS));
+	STORE256(m + 8, _mm256_srai_epi32(hi, SCALE8_STAGED1_BITS));
+
+	for (i = 0; i < 16; i++) {
+		/* Shifting */
+		offset[i]--;
+		if (offset[i] < 0) {
+			offset[i] = 159;
+			memcpy(v + 160, v, 9 * sizeof(*v));
+		}
+
+		/* Distribute the new matrix value to the shifted position */
+		v[offset[i]] = m[i];
+	}
+
+	/* Compute the samples */
+	offi = LOAD256(offset);
+	offk = LOAD256(offset + 8);
+	acc = _mm256_setzero_si256();
+	for (i = 0; i < 5; i++) {
+		acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(
+			_mm256_i32gather_epi32(v + 2 * i, offi, 4),
+			LOAD256(sbc_proto_8_80m0_simd + i * 8)));
+		acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(
+			_mm256_i32gather_epi32(v + 2 * i + 1, offk, 4),
+			LOAD256(sbc_proto_8_80m1_simd + i * 8)));
+	}
+	acc = _mm256_srai_epi32(acc, SCALE8_STAGED1_BITS);
+
+	/* Store in output, Q0, saturated like sbc_clip16() */
+	STORE128(pcm, _mm_packs_epi32(_mm256_castsi256_si128(acc),
+				      _mm256_extracti128_si256(acc, 1)));
+}
+
+static int check_avx2_support(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+void sbc_init_primitives_sse(struct sbc_encoder_state *state)
+{
+	state->sbc_analyze_4b_4s = sbc_analyze_4b_4s_sse;
+	state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_sse;
+	state->sbc_calc_scalefactors = sbc_calc_scalefactors_sse;
+	state->sbc_calc_scalefactors_j = sbc_calc_scalefactors_j_sse;
+	state->implementation_info = "SSE2";
+
+#ifdef SBC_BUILD_WITH_AVX2_SUPPORT
+	if (check_avx2_support()) {
+		state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_avx2;
+		state->sbc_calc_scalefactors = sbc_calc_scalefactors_avx2;
+		state->implementation_info = "AVX2";
+	}
+#endif
+}
+
+void sbc_init_primitives_dec_sse(struct sbc_decoder_state *state)
+{
+#ifdef SBC_BUILD_WITH_AVX2_SUPPORT
+	if (check_avx2_support()) {
+		state->sbc_synthesize_4s = sbc_synthesize_4s_avx2;
+		state->sbc_synthesize_8s = sbc_synthesize_8s_avx2;
+		state->implementation_info = "AVX2";
+	}
+#endif
+}
+
+#endif
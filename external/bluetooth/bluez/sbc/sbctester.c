@@ -29,13 +29,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sndfile.h>
 #include <math.h>
 #include <string.h>
+#include <sys/time.h>
+
+#include "sbc.h"
 
 #define MAXCHANNELS 2
 #define DEFACCURACY 7
 
+/* Bit exactness sweep length and benchmark length, in seconds */
+#define BITEXACT_SECONDS 2
+#define BENCH_SECONDS 10
+
 static double sampletobits(short sample16, int verbose)
 {
 	double bits = 0;
@@ -245,6 +253,284 @@ static int check_absolute_diff(SNDFILE * sndref, SF_INFO * infosref,
 	return verdict;
 }
 
+struct sbc_config {
+	int subbands;
+	int blocks;
+	int mode;
+	int allocation;
+	int bitpool;
+};
+
+static const char *mode_names[] = { "mono", "dual", "stereo", "joint" };
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void sbc_setup(sbc_t *sbc, unsigned long flags,
+					const struct sbc_config *cfg)
+{
+	sbc_init(sbc, flags);
+	sbc->frequency = SBC_FREQ_44100;
+	sbc->subbands = cfg->subbands == 8 ? SBC_SB_8 : SBC_SB_4;
+	sbc->blocks = cfg->blocks / 4 - 1;
+	sbc->mode = cfg->mode;
+	sbc->allocation = cfg->allocation;
+	sbc->bitpool = cfg->bitpool;
+}
+
+/* Encodes all of pcm, returns the number of bytes of SBC output */
+static size_t encode_all(unsigned long flags, const struct sbc_config *cfg,
+				const int16_t *pcm, size_t len, uint8_t *out,
+				size_t size, int *frames, const char **impl)
+{
+	const uint8_t *p = (const uint8_t *) pcm;
+	size_t total = 0;
+	ssize_t encoded, written;
+	sbc_t sbc;
+
+	sbc_setup(&sbc, flags, cfg);
+	*frames = 0;
+	while (len >= sbc_get_codesize(&sbc)) {
+		encoded = sbc_encode(&sbc, p, len, out + total, size - total,
+								&written);
+		if (encoded <= 0 || written <= 0)
+			break;
+		p += encoded;
+		len -= encoded;
+		total += written;
+		(*frames)++;
+	}
+	if (impl)
+		*impl = sbc_get_implementation_info(&sbc);
+	sbc_finish(&sbc);
+
+	return total;
+}
+
+/* Decodes all of in, returns the number of bytes of PCM output */
+static size_t decode_all(unsigned long flags, const uint8_t *in, size_t len,
+				int16_t *pcm, size_t size, int *frames,
+				const char **impl)
+{
+	uint8_t *out = (uint8_t *) pcm;
+	size_t total = 0, written;
+	ssize_t framelen;
+	sbc_t sbc;
+
+	sbc_init(&sbc, flags);
+	*frames = 0;
+	while (len > 0) {
+		framelen = sbc_decode(&sbc, in, len, out + total, size - total,
+								&written);
+		if (framelen <= 0)
+			break;
+		in += framelen;
+		len -= framelen;
+		total += written;
+		(*frames)++;
+	}
+	if (impl)
+		*impl = sbc_get_implementation_info(&sbc);
+	sbc_finish(&sbc);
+
+	return total;
+}
+
+/*
+ * Encodes and decodes pcm with the reference C code and with the
+ * optimized code selected for this CPU, for every codec configuration,
+ * and checks that both produce the very same bytes.
+ */
+static int check_bitexact(const int16_t *pcm, size_t len, int channels)
+{
+	static const int modes_stereo[] = { SBC_MODE_DUAL_CHANNEL,
+				SBC_MODE_STEREO, SBC_MODE_JOINT_STEREO };
+	static const int modes_mono[] = { SBC_MODE_MONO };
+	static const int bitpools[] = { 18, 35, 53 };
+	const int *modes = channels == 2 ? modes_stereo : modes_mono;
+	int nmodes = channels == 2 ? 3 : 1;
+	size_t size = len + 4096, n_ref, n_tst;
+	uint8_t *sbc_ref = malloc(size), *sbc_tst = malloc(size);
+	int16_t *pcm_ref = malloc(len + 4096), *pcm_tst = malloc(len + 4096);
+	struct sbc_config cfg;
+	int sb, blk, m, am, bp, frames, failed = 0, tested = 0;
+	const char *impl_enc = NULL, *impl_dec = NULL;
+
+	if (!sbc_ref || !sbc_tst || !pcm_ref || !pcm_tst) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+
+	for (sb = 4; sb <= 8; sb += 4)
+	for (blk = 4; blk <= 16; blk += 4)
+	for (m = 0; m < nmodes; m++)
+	for (am = SBC_AM_LOUDNESS; am <= SBC_AM_SNR; am++)
+	for (bp = 0; bp < 3; bp++) {
+		cfg.subbands = sb;
+		cfg.blocks = blk;
+		cfg.mode = modes[m];
+		cfg.allocation = am;
+		cfg.bitpool = bitpools[bp];
+		tested++;
+
+		n_ref = encode_all(SBC_FLAG_GENERIC, &cfg, pcm, len,
+					sbc_ref, size, &frames, NULL);
+		n_tst = encode_all(0, &cfg, pcm, len, sbc_tst, size,
+					&frames, &impl_enc);
+		if (n_ref != n_tst || memcmp(sbc_ref, sbc_tst, n_ref)) {
+			printf("Encoder mismatch: %d subbands, %d blocks, %s, "
+				"%s, bitpool %d\n", sb, blk,
+				mode_names[cfg.mode], am ? "snr" : "loudness",
+				cfg.bitpool);
+			failed++;
+			continue;
+		}
+
+		n_ref = decode_all(SBC_FLAG_GENERIC, sbc_ref, n_ref, pcm_ref,
+					len + 4096, &frames, NULL);
+		n_tst = decode_all(0, sbc_ref, n_tst, pcm_tst, len + 4096,
+					&frames, &impl_dec);
+		if (n_ref != n_tst || memcmp(pcm_ref, pcm_tst, n_ref)) {
+			printf("Decoder mismatch: %d subbands, %d blocks, %s, "
+				"%s, bitpool %d\n", sb, blk,
+				mode_names[cfg.mode], am ? "snr" : "loudness",
+				cfg.bitpool);
+			failed++;
+		}
+	}
+
+	printf("Bit exactness: %d of %d configurations match "
+		"(encoder %s, decoder %s)\n", tested - failed, tested,
+		impl_enc, impl_dec);
+
+	free(sbc_ref);
+	free(sbc_tst);
+	free(pcm_ref);
+	free(pcm_tst);
+
+	return failed == 0;
+}
+
+/* Frames per second of the reference and optimized code, A2DP settings */
+static void benchmark(const int16_t *pcm, size_t len, int channels)
+{
+	struct sbc_config cfg = { 8, 16, SBC_MODE_JOINT_STEREO,
+						SBC_AM_LOUDNESS, 53 };
+	uint8_t *sbc = malloc(len + 4096);
+	int16_t *out = malloc(len + 4096);
+	const char *impl;
+	size_t n = 0;
+	double t, fps;
+	int i, frames;
+
+	if (!sbc || !out) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	if (channels == 1)
+		cfg.mode = SBC_MODE_MONO;
+
+	printf("Benchmark: %d subbands, %d blocks, %s, bitpool %d\n",
+		cfg.subbands, cfg.blocks, mode_names[cfg.mode], cfg.bitpool);
+
+	for (i = 0; i < 2; i++) {
+		unsigned long flags = i ? 0 : SBC_FLAG_GENERIC;
+
+		t = now();
+		n = encode_all(flags, &cfg, pcm, len, sbc, len + 4096,
+							&frames, &impl);
+		fps = frames / (now() - t);
+		printf("\tencode %-10s %10.0f frames/s (%.0fx realtime)\n",
+			impl, fps, fps * cfg.subbands * cfg.blocks / 44100);
+
+		t = now();
+		decode_all(flags, sbc, n, out, len + 4096, &frames, &impl);
+		fps = frames / (now() - t);
+		printf("\tdecode %-10s %10.0f frames/s (%.0fx realtime)\n",
+			impl, fps, fps * cfg.subbands * cfg.blocks / 44100);
+	}
+
+	free(sbc);
+	free(out);
+}
+
+/* Stereo test signal: tone sweeps over noise, with loud and silent parts */
+static int16_t *make_signal(int seconds, size_t *len)
+{
+	size_t i, n = (size_t) seconds * 44100;
+	int16_t *pcm = malloc(n * 2 * sizeof(int16_t));
+	uint32_t seed = 1;
+	double f, amp;
+
+	if (!pcm) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++) {
+		double t = (double) i / 44100;
+
+		seed = seed * 1103515245 + 12345;
+		f = 50 + 20000 * fmod(t, 1.0);
+		amp = (i / 22050) % 4 == 3 ? 0 : (i / 22050) % 4 * 10000;
+		pcm[2 * i] = amp * sin(2 * M_PI * f * t) +
+					(int16_t) (seed >> 16) / 64;
+		pcm[2 * i + 1] = 32767 * sin(2 * M_PI * 440 * t) *
+					((i / 44100) % 2) +
+					(int16_t) (seed >> 8) / 256;
+	}
+
+	*len = n * 2 * sizeof(int16_t);
+	return pcm;
+}
+
+static int run_bitexact(const char *name)
+{
+	int16_t *pcm;
+	size_t len, check;
+	int channels = 2, pass;
+
+	if (name) {
+		SF_INFO info;
+		SNDFILE *snd = sf_open(name, SFM_READ, &info);
+
+		if (!snd) {
+			printf("Failed to open %s\n", name);
+			return 1;
+		}
+		if (info.channels > 2) {
+			printf("Too many channels\n");
+			sf_close(snd);
+			return 1;
+		}
+		channels = info.channels;
+		pcm = malloc(info.frames * channels * sizeof(int16_t));
+		if (!pcm) {
+			printf("Out of memory\n");
+			sf_close(snd);
+			return 1;
+		}
+		len = sf_readf_short(snd, pcm, info.frames) *
+					channels * sizeof(int16_t);
+		sf_close(snd);
+	} else
+		pcm = make_signal(BENCH_SECONDS, &len);
+
+	check = (size_t) BITEXACT_SECONDS * 44100 * channels * sizeof(int16_t);
+	pass = check_bitexact(pcm, len < check ? len : check, channels);
+	benchmark(pcm, len, channels);
+	free(pcm);
+
+	printf("Verdict: %s\n", pass ? "pass" : "fail");
+
+	return pass ? 0 : 1;
+}
+
 static void usage()
 {
 	printf("SBC conformance test ver %s\n", VERSION);
@@ -254,6 +540,7 @@ static void usage()
 	printf("Usage:\n"
 		"\tsbctester reference.wav checkfile.wav\n"
 		"\tsbctester integer\n"
+		"\tsbctester -b [input.wav]\n"
 		"\n");
 
 	printf("To test the encoder:\n");
@@ -264,6 +551,12 @@ static void usage()
 
 	printf("\tA file called out.csv is generated to use the data in a\n");
 	printf("\tspreadsheet application or database.\n\n");
+
+	printf("To test the optimized code (-b):\n");
+	printf("\tinput.wav, or a generated signal, is encoded and decoded\n");
+	printf("\twith the reference C code and with the code optimized for\n");
+	printf("\tthis CPU, in every configuration; the outputs must be\n");
+	printf("\tidentical. Both are then timed in frames per second.\n\n");
 }
 
 int main(int argc, char *argv[])
@@ -276,6 +569,9 @@ int main(int argc, char *argv[])
 	char *tst;
 	int pass_rms, pass_absolute, pass, accuracy;
 
+	if (argc >= 2 && strcmp(argv[1], "-b") == 0)
+		return run_bitexact(argc > 2 ? argv[2] : NULL);
+
 	if (argc == 2) {
 		double db;
 
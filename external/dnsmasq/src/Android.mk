@@ -4,7 +4,7 @@ LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES :=  bpf.c cache.c dbus.c dhcp.c dnsmasq.c forward.c helper.c lease.c log.c \
-                    netlink.c network.c option.c rfc1035.c rfc2131.c tftp.c util.c
+                    netlink.c network.c option.c poll.c rfc1035.c rfc2131.c tftp.c util.c
 
 LOCAL_MODULE := dnsmasq
 
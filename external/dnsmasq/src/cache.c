@@ -17,6 +17,7 @@
 #include "dnsmasq.h"
 
 static struct crec *cache_head = NULL, *cache_tail = NULL, **hash_table = NULL;
+static struct crec **addr_table = NULL;
 #ifdef HAVE_DHCP
 static struct crec *dhcp_spare = NULL;
 #endif
@@ -27,6 +28,45 @@ static int bignames_left, hash_size;
 static int uid = 0;
 static char *addrbuff = NULL;
 
+/* Refreshes wanted by cache_hit(), sent once the current answer is done. */
+static struct {
+  struct crec *crecp;
+  int uid;
+  unsigned short type;
+} prefetch_queue[PREFETCH_MAX];
+static int prefetch_count = 0, refresh_insert = 0;
+
+/* --cache-file format: a header, then one record per entry followed by
+   its name and, for CNAMEs, the name of the target. */
+#define CACHE_FILE_MAGIC 0x64637331 /* also catches a change of byte-order */
+
+struct cache_file_header {
+  unsigned int magic, count;
+  long long saved; /* wall-clock time */
+};
+
+struct cache_file_rec {
+  unsigned int ttl;
+  unsigned short flags, namelen, targetlen;
+  unsigned short same; /* same name as the previous record */
+  struct all_addr addr;
+};
+
+static int cache_restored = 0, restoring = 0;
+
+/* Entries from hosts files are carved out of large blocks, which
+   cache_reload() frees all together, rather than malloced one by one. */
+struct hosts_block {
+  struct hosts_block *next;
+  size_t used, size;
+};
+
+#define HOSTS_ALIGN(n) (((n) + 7) & ~((size_t)7))
+
+static struct hosts_block *hosts_blocks = NULL;
+static size_t hosts_reserve = 0;
+static void *hosts_last = NULL;
+
 /* type->string mapping: this is also used by the name-hash function as a mixing table. */
 static const struct {
   unsigned int type;
@@ -69,6 +109,8 @@ static void cache_unlink(struct crec *crecp);
 static void cache_link(struct crec *crecp);
 static void rehash(int size);
 static void cache_hash(struct crec *crecp);
+static void addr_unhash(struct crec *crecp);
+static void cache_unhash(struct crec *crecp);
 
 void cache_init(void)
 {
@@ -98,11 +140,12 @@ void cache_init(void)
 
 /* In most cases, we create the hash table once here by calling this with (hash_table == NULL)
    but if the hosts file(s) are big (some people have 50000 ad-block entries), the table
-   will be much too small, so the hosts reading code calls rehash every 1000 addresses, to
-   expand the table. */
+   will be much too small, so the hosts reading code counts the names in each file and
+   calls rehash to expand the table before loading it. The address index is the same size as the name hash table and is
+   rebuilt along with it. */
 static void rehash(int size)
 {
-  struct crec **new, **old, *p, *tmp;
+  struct crec **new, **new_addr, **old, **old_addr, *p, *tmp;
   int i, new_size, old_size;
 
   /* hash_size is a power of two. */
@@ -110,16 +153,26 @@ static void rehash(int size)
   
   /* must succeed in getting first instance, failure later is non-fatal */
   if (!hash_table)
-    new = safe_malloc(new_size * sizeof(struct crec *));
+    {
+      new = safe_malloc(new_size * sizeof(struct crec *));
+      new_addr = safe_malloc(new_size * sizeof(struct crec *));
+    }
   else if (new_size <= hash_size || !(new = whine_malloc(new_size * sizeof(struct crec *))))
     return;
+  else if (!(new_addr = whine_malloc(new_size * sizeof(struct crec *))))
+    {
+      free(new);
+      return;
+    }
 
   for(i = 0; i < new_size; i++)
-    new[i] = NULL;
+    new[i] = new_addr[i] = NULL;
 
   old = hash_table;
+  old_addr = addr_table;
   old_size = hash_size;
   hash_table = new;
+  addr_table = new_addr;
   hash_size = new_size;
   
   if (old)
@@ -131,6 +184,7 @@ static void rehash(int size)
 	    cache_hash(p);
 	  }
       free(old);
+      free(old_addr);
     }
 }
   
@@ -151,6 +205,26 @@ static struct crec **hash_bucket(char *name)
   return hash_table + ((val ^ (val >> 16)) & (hash_size - 1));
 }
 
+static struct crec **addr_bucket(struct all_addr *addr, unsigned short flags)
+{
+  unsigned int c, val = 017465;
+  const unsigned char *mix_tab = (const unsigned char*)typestr; 
+  const unsigned char *p = (const unsigned char *)addr;
+#ifdef HAVE_IPV6
+  int len = (flags & F_IPV6) ? IN6ADDRSZ : INADDRSZ;
+#else
+  int len = INADDRSZ;
+#endif
+
+  while (len--)
+    {
+      c = *p++;
+      val = ((val << 7) | (val >> (32 - 7))) + (mix_tab[(val + c) & 0x3F] ^ c);
+    }
+
+  return addr_table + ((val ^ (val >> 16)) & (hash_size - 1));
+}
+
 static void cache_hash(struct crec *crecp)
 {
   /* maintain an invariant that all entries with F_REVERSE set
@@ -171,6 +245,45 @@ static void cache_hash(struct crec *crecp)
     }
   crecp->hash_next = *up;
   *up = crecp;
+
+  /* Entries with F_REVERSE are also indexed by address, for PTR lookups. */
+  if (crecp->flags & F_REVERSE)
+    {
+      up = addr_bucket(&crecp->addr.addr, crecp->flags);
+      if ((crecp->addr_next = *up))
+	(*up)->addr_up = &crecp->addr_next;
+      crecp->addr_up = up;
+      *up = crecp;
+    }
+  else
+    crecp->addr_up = NULL;
+}
+
+/* Remove an entry from the address index. Must be called whenever an entry 
+   is taken off its hash chain. */
+static void addr_unhash(struct crec *crecp)
+{
+  if (crecp->addr_up)
+    {
+      if ((*crecp->addr_up = crecp->addr_next))
+	crecp->addr_next->addr_up = crecp->addr_up;
+      crecp->addr_up = NULL;
+    }
+}
+
+/* Remove an entry from both indexes when it was found through the address index. */
+static void cache_unhash(struct crec *crecp)
+{
+  struct crec **up;
+
+  for (up = hash_bucket(cache_get_name(crecp)); *up; up = &((*up)->hash_next))
+    if (*up == crecp)
+      {
+	*up = crecp->hash_next;
+	break;
+      }
+  
+  addr_unhash(crecp);
 }
  
 static void cache_free(struct crec *crecp)
@@ -254,13 +367,23 @@ static int is_expired(time_t now, struct crec *crecp)
   return 1;
 }
 
+/* Expired entries may still be given out, with a short TTL, for
+   --serve-stale seconds while a refresh is in flight. */
+static int is_stale(time_t now, struct crec *crecp)
+{
+  if (daemon->stale_time == 0 || (crecp->flags & (F_HOSTS | F_DHCP)))
+    return 0;
+
+  return difftime(now, crecp->ttd) < daemon->stale_time;
+}
+
 static int cache_scan_free(char *name, struct all_addr *addr, time_t now, unsigned short flags)
 {
   /* Scan and remove old entries.
      If (flags & F_FORWARD) then remove any forward entries for name and any expired
      entries but only in the same hash bucket as name.
      If (flags & F_REVERSE) then remove any reverse entries for addr and any expired
-     entries in the whole cache.
+     entries with the same address hash.
      If (flags == 0) remove any expired entries in the whole cache. 
 
      In the flags & F_FORWARD case, the return code is valid, and returns zero if the
@@ -277,6 +400,7 @@ static int cache_scan_free(char *name, struct all_addr *addr, time_t now, unsign
 	if (is_expired(now, crecp) || is_outdated_cname_pointer(crecp))
 	  { 
 	    *up = crecp->hash_next;
+	    addr_unhash(crecp);
 	    if (!(crecp->flags & (F_HOSTS | F_DHCP)))
 	      {
 		cache_unlink(crecp);
@@ -290,27 +414,27 @@ static int cache_scan_free(char *name, struct all_addr *addr, time_t now, unsign
 	    if (crecp->flags & (F_HOSTS | F_DHCP))
 	      return 0;
 	    *up = crecp->hash_next;
+	    addr_unhash(crecp);
 	    cache_unlink(crecp);
 	    cache_free(crecp);
 	  }
 	else
 	  up = &crecp->hash_next;
     }
-  else
+  else if (flags & F_REVERSE)
     {
-      int i;
+      struct crec *next;
 #ifdef HAVE_IPV6
       int addrlen = (flags & F_IPV6) ? IN6ADDRSZ : INADDRSZ;
 #else
       int addrlen = INADDRSZ;
 #endif 
-      for (i = 0; i < hash_size; i++)
-	for (crecp = hash_table[i], up = &hash_table[i]; 
-	     crecp && ((crecp->flags & F_REVERSE) || !(crecp->flags & F_IMMORTAL));
-	     crecp = crecp->hash_next)
+      for (crecp = *addr_bucket(addr, flags); crecp; crecp = next)
+	{
+	  next = crecp->addr_next;
 	  if (is_expired(now, crecp))
 	    {
-	      *up = crecp->hash_next;
+	      cache_unhash(crecp);
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP)))
 		{ 
 		  cache_unlink(crecp);
@@ -318,14 +442,32 @@ static int cache_scan_free(char *name, struct all_addr *addr, time_t now, unsign
 		}
 	    }
 	  else if (!(crecp->flags & (F_HOSTS | F_DHCP)) &&
-		   (flags & crecp->flags & F_REVERSE) && 
 		   (flags & crecp->flags & (F_IPV4 | F_IPV6)) &&
 		   memcmp(&crecp->addr.addr, addr, addrlen) == 0)
 	    {
-	      *up = crecp->hash_next;
+	      cache_unhash(crecp);
 	      cache_unlink(crecp);
 	      cache_free(crecp);
 	    }
+	}
+    }
+  else
+    {
+      int i;
+      for (i = 0; i < hash_size; i++)
+	for (crecp = hash_table[i], up = &hash_table[i]; 
+	     crecp && ((crecp->flags & F_REVERSE) || !(crecp->flags & F_IMMORTAL));
+	     crecp = crecp->hash_next)
+	  if (is_expired(now, crecp))
+	    {
+	      *up = crecp->hash_next;
+	      addr_unhash(crecp);
+	      if (!(crecp->flags & (F_HOSTS | F_DHCP)))
+		{ 
+		  cache_unlink(crecp);
+		  cache_free(crecp);
+		}
+	    }
 	  else
 	    up = &crecp->hash_next;
     }
@@ -361,10 +503,11 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
 {
   struct crec *new;
   union bigname *big_name = NULL;
-  int freed_all = flags & F_REVERSE;
+  int freed_all = 0;
   int free_avail = 0;
 
-  log_query(flags | F_UPSTREAM, name, addr, NULL);
+  if (!restoring)
+    log_query(flags | F_UPSTREAM, name, addr, NULL);
 
   /* CONFIG bit means something else when stored in cache entries */
   flags &= ~F_CONFIG;
@@ -446,6 +589,8 @@ struct crec *cache_insert(char *name, struct all_addr *addr,
   }
   
   new->flags = flags;
+  new->hits = 0;
+  new->refresh = refresh_insert ? REFRESH_DONE : 0;
   if (big_name)
     {
       new->name.bname = big_name;
@@ -509,7 +654,8 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 	{
 	  next = crecp->hash_next;
 	  
-	  if (!is_expired(now, crecp) && !is_outdated_cname_pointer(crecp))
+	  if ((!is_expired(now, crecp) || is_stale(now, crecp)) && 
+	      !is_outdated_cname_pointer(crecp))
 	    {
 	      if ((crecp->flags & F_FORWARD) && 
 		  (crecp->flags & prot) &&
@@ -554,8 +700,16 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 	    }
 	  else
 	    {
-	      /* expired entry, free it */
+	      /* expired entry, free it. If it was popular enough to be 
+		 refreshed and is wanted again, the refresh was too late. */
+	      if (((crecp->refresh & REFRESH_SENT) || 
+		   (daemon->prefetch != 0 && crecp->hits >= daemon->prefetch)) &&
+		  (crecp->flags & prot) &&
+		  hostname_isequal(cache_get_name(crecp), name))
+		daemon->prefetch_missed++;
+
 	      *up = crecp->hash_next;
+	      addr_unhash(crecp);
 	      if (!(crecp->flags & (F_HOSTS | F_DHCP)))
 		{ 
 		  cache_unlink(crecp);
@@ -591,45 +745,42 @@ struct crec *cache_find_by_addr(struct crec *crecp, struct all_addr *addr,
   else
     {  
       /* first search, look for relevant entries and push to top of list
-	 also free anything which has expired. All the reverse entries are at the
-	 start of the hash chain, so we can give up when we find the first 
-	 non-REVERSE one.  */
-       int i;
-       struct crec **up, **chainp = &ans;
-       
-       for (i=0; i<hash_size; i++)
-	 for (crecp = hash_table[i], up = &hash_table[i]; 
-	      crecp && (crecp->flags & F_REVERSE);
-	      crecp = crecp->hash_next)
-	   if (!is_expired(now, crecp))
-	     {      
-	       if ((crecp->flags & prot) &&
-		   memcmp(&crecp->addr.addr, addr, addrlen) == 0)
-		 {	    
-		   if (crecp->flags & (F_HOSTS | F_DHCP))
-		     {
-		       *chainp = crecp;
-		       chainp = &crecp->next;
-		     }
-		   else
-		     {
-		       cache_unlink(crecp);
-		       cache_link(crecp);
-		     }
-		 }
-	       up = &crecp->hash_next;
-	     }
-	   else
-	     {
-	       *up = crecp->hash_next;
-	       if (!(crecp->flags & (F_HOSTS | F_DHCP)))
-		 {
-		   cache_unlink(crecp);
-		   cache_free(crecp);
-		 }
-	     }
-       
-       *chainp = cache_head;
+	 also free anything which has expired. All the reverse entries for
+	 an address are on the same chain of the address index. */
+      struct crec *next, **chainp = &ans;
+      
+      for (crecp = *addr_bucket(addr, prot); crecp; crecp = next)
+	{
+	  next = crecp->addr_next;
+	  if (!is_expired(now, crecp))
+	    {      
+	      if ((crecp->flags & prot) &&
+		  memcmp(&crecp->addr.addr, addr, addrlen) == 0)
+		{	    
+		  if (crecp->flags & (F_HOSTS | F_DHCP))
+		    {
+		      *chainp = crecp;
+		      chainp = &crecp->next;
+		    }
+		  else
+		    {
+		      cache_unlink(crecp);
+		      cache_link(crecp);
+		    }
+		}
+	    }
+	  else
+	    {
+	      cache_unhash(crecp);
+	      if (!(crecp->flags & (F_HOSTS | F_DHCP)))
+		{
+		  cache_unlink(crecp);
+		  cache_free(crecp);
+		}
+	    }
+	}
+      
+      *chainp = cache_head;
     }
   
   if (ans && 
@@ -641,11 +792,68 @@ struct crec *cache_find_by_addr(struct crec *crecp, struct all_addr *addr,
   return NULL;
 }
 
+static void *hosts_alloc(size_t size)
+{
+  struct hosts_block *block = hosts_blocks;
+  size_t head = HOSTS_ALIGN(sizeof(struct hosts_block));
+
+  size = HOSTS_ALIGN(size);
+
+  if (!block || block->size - block->used < size)
+    {
+      size_t bsize = head + (hosts_reserve > size ? hosts_reserve : size);
+      
+      if (bsize < HOSTS_BLOCK)
+	bsize = HOSTS_BLOCK;
+      
+      /* A big reservation is only a hint, fall back to small blocks. */
+      if (!(block = malloc(bsize)) && 
+	  (bsize = head + (size > HOSTS_BLOCK ? size : HOSTS_BLOCK), 
+	   !(block = whine_malloc(bsize))))
+	return NULL;
+      
+      block->size = bsize;
+      block->used = head;
+      block->next = hosts_blocks;
+      hosts_blocks = block;
+      hosts_reserve = 0;
+    }
+  
+  hosts_last = ((char *)block) + block->used;
+  block->used += size;
+
+  return hosts_last;
+}
+
+/* Give back the last allocation, when it turns out to be a duplicate. */
+static void hosts_unalloc(void *p)
+{
+  if (p == hosts_last)
+    {
+      hosts_blocks->used = (char *)p - (char *)hosts_blocks;
+      hosts_last = NULL;
+    }
+}
+
+static void hosts_free(void)
+{
+  struct hosts_block *tmp;
+  
+  while (hosts_blocks)
+    {
+      tmp = hosts_blocks->next;
+      free(hosts_blocks);
+      hosts_blocks = tmp;
+    }
+  
+  hosts_last = NULL;
+}
+
 static void add_hosts_entry(struct crec *cache, struct all_addr *addr, int addrlen, 
 			    unsigned short flags, int index, int addr_dup)
 {
   struct crec *lookup = cache_find_by_name(NULL, cache->name.sname, 0, flags & (F_IPV4 | F_IPV6));
-  int i, nameexists = 0;
+  int nameexists = 0;
   struct cname *a;
 
   /* Remove duplicates in hosts files. */
@@ -654,7 +862,7 @@ static void add_hosts_entry(struct crec *cache, struct all_addr *addr, int addrl
       nameexists = 1;
       if (memcmp(&lookup->addr.addr, addr, addrlen) == 0)
 	{
-	  free(cache);
+	  hosts_unalloc(cache);
 	  return;
 	}
     }
@@ -665,24 +873,20 @@ static void add_hosts_entry(struct crec *cache, struct all_addr *addr, int addrl
      file with thousands of entries for the same address.
      Then we search and bail at the first matching address that came from
      a HOSTS file. Since the first host entry gets reverse, we know 
-     then that it must exist without searching exhaustively for it. */
+     then that it must exist without searching exhaustively for it, 
+     and that it is in the address index. */
   
   if (addr_dup)
     flags &= ~F_REVERSE;
   else
-    for (i=0; i<hash_size; i++)
-      {
-	for (lookup = hash_table[i]; lookup; lookup = lookup->hash_next)
-	  if ((lookup->flags & F_HOSTS) && 
-	      (lookup->flags & flags & (F_IPV4 | F_IPV6)) &&
-	      memcmp(&lookup->addr.addr, addr, addrlen) == 0)
-	    {
-	      flags &= ~F_REVERSE;
-	      break;
-	    }
-	if (lookup)
+    for (lookup = *addr_bucket(addr, flags); lookup; lookup = lookup->addr_next)
+      if ((lookup->flags & F_HOSTS) && 
+	  (lookup->flags & flags & (F_IPV4 | F_IPV6)) &&
+	  memcmp(&lookup->addr.addr, addr, addrlen) == 0)
+	{
+	  flags &= ~F_REVERSE;
 	  break;
-      }
+	}
   
   cache->flags = flags;
   cache->uid = index;
@@ -693,7 +897,7 @@ static void add_hosts_entry(struct crec *cache, struct all_addr *addr, int addrl
   if (!nameexists)
     for (a = daemon->cnames; a; a = a->next)
       if (hostname_isequal(cache->name.sname, a->target) &&
-	  (lookup = whine_malloc(sizeof(struct crec))))
+	  (lookup = hosts_alloc(sizeof(struct crec))))
 	{
 	  lookup->flags = F_FORWARD | F_IMMORTAL | F_CONFIG | F_HOSTS | F_CNAME;
 	  lookup->name.namep = a->alias;
@@ -703,71 +907,156 @@ static void add_hosts_entry(struct crec *cache, struct all_addr *addr, int addrl
 	}
 }
 
-static int eatspace(FILE *f)
+/* Hosts files are mapped into memory and tokenised in place. */
+static char *hosts_map(char *filename, size_t *len, int *mapped)
 {
-  int c, nl = 0;
+  struct stat statbuf;
+  char *map = NULL, *tmp;
+  size_t size = 0;
+  ssize_t n;
+  int fd;
 
-  while (1)
+  if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &statbuf) == -1)
     {
-      if ((c = getc(f)) == '#')
-	while (c != '\n' && c != EOF)
-	  c = getc(f);
-      
-      if (c == EOF)
-	return 1;
+      my_syslog(LOG_ERR, _("failed to load names from %s: %s"), filename, strerror(errno));
+      if (fd != -1)
+	close(fd);
+      return NULL;
+    }
 
-      if (!isspace(c))
+  *mapped = 0;
+  *len = 0;
+  
+  if (S_ISREG(statbuf.st_mode) && statbuf.st_size > 0 &&
+      (map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED)
+    {
+      madvise(map, statbuf.st_size, MADV_SEQUENTIAL);
+      *mapped = 1;
+      *len = statbuf.st_size;
+    }
+  else
+    {
+      /* Not a regular file or can't map it, read it all instead. */
+      for (map = NULL; 1; *len += n)
 	{
-	  ungetc(c, f);
-	  return nl;
-	}
+	  if (*len == size)
+	    {
+	      if (!(tmp = whine_malloc(size += HOSTS_BLOCK)))
+		break;
+	      if (map)
+		{
+		  memcpy(tmp, map, *len);
+		  free(map);
+		}
+	      map = tmp;
+	    }
 
-      if (c == '\n')
-	nl = 1;
+	  if ((n = read(fd, map + *len, size - *len)) <= 0)
+	    {
+	      if (n == -1 && errno == EINTR)
+		{
+		  n = 0;
+		  continue;
+		}
+	      break;
+	    }
+	}
     }
+
+  close(fd);
+  return map;
 }
-	 
-static int gettok(FILE *f, char *token)
+
+static int eatspace(char **pp, char *end)
 {
-  int c, count = 0;
- 
+  char *p = *pp;
+  int nl = 0;
+
   while (1)
     {
-      if ((c = getc(f)) == EOF)
-	return (count == 0) ? EOF : 1;
-
-      if (isspace(c) || c == '#')
+      if (p != end && *p == '#')
+	while (p != end && *p != '\n')
+	  p++;
+      
+      if (p == end)
 	{
-	  ungetc(c, f);
-	  return eatspace(f);
+	  *pp = p;
+	  return 1;
 	}
       
-      if (count < (MAXDNAME - 1))
+      if (!isspace((unsigned char)*p))
 	{
-	  token[count++] = c;
-	  token[count] = 0;
+	  *pp = p;
+	  return nl;
 	}
+      
+      if (*p++ == '\n')
+	nl = 1;
     }
 }
+	 
+static int gettok(char **pp, char *end, char *token)
+{
+  char *p = *pp;
+  int count = 0;
+ 
+  if (p == end)
+    return EOF;
+  
+  while (p != end && !isspace((unsigned char)*p) && *p != '#')
+    {
+      if (count < (MAXDNAME - 1))
+	token[count++] = *p;
+      p++;
+    }
+  
+  token[count] = 0;
+  *pp = p;
+  
+  return eatspace(pp, end);
+}
 
 static int read_hostsfile(char *filename, int index, int cache_size)
 {  
-  FILE *f = fopen(filename, "r");
-  char *token = daemon->namebuff, *domain_suffix = NULL;
-  int addr_count = 0, name_count = cache_size, lineno = 0;
+  char *token = daemon->namebuff, *domain_suffix = NULL, *map, *p, *end;
+  int addr_count = 0, name_count = cache_size, lineno = 0, mapped;
   unsigned short flags = 0, saved_flags = 0;
   struct all_addr addr, saved_addr;
   int atnl, addrlen = 0, addr_dup;
+  size_t len, names = 0, bytes = 0;
 
-  if (!f)
+  if (!(map = hosts_map(filename, &len, &mapped)))
+    return 0;
+  
+  end = map + len;
+  
+  /* Count the names first, so that the hash table only has to be 
+     grown once and the entries fit in one block of memory. The table 
+     is sized for two or three names per bucket, rather than the usual 
+     ten, since walking the chains to find duplicates is most of the 
+     cost of loading a big file. */
+  p = map;
+  eatspace(&p, end);
+  while ((atnl = gettok(&p, end, token)) != EOF)
+    while (atnl == 0 && (atnl = gettok(&p, end, token)) != EOF)
+      {
+	names++;
+	bytes += HOSTS_ALIGN(sizeof(struct crec) + strlen(token) + 1 - SMALLDNAME);
+      }
+
+  if (daemon->options & OPT_EXPAND)
     {
-      my_syslog(LOG_ERR, _("failed to load names from %s: %s"), filename, strerror(errno));
-      return 0;
+      names *= 2;
+      bytes *= 2;
     }
+
+  rehash((name_count + names) * 4);
+  hosts_reserve = bytes;
+    
+  p = map;
+  eatspace(&p, end);
   
-  eatspace(f);
-  
-  while ((atnl = gettok(f, token)) != EOF)
+  while ((atnl = gettok(&p, end, token)) != EOF)
     {
       addr_dup = 0;
       lineno++;
@@ -797,7 +1086,7 @@ static int read_hostsfile(char *filename, int index, int cache_size)
 	{
 	  my_syslog(LOG_ERR, _("bad address at %s line %d"), filename, lineno); 
 	  while (atnl == 0)
-	    atnl = gettok(f, token);
+	    atnl = gettok(&p, end, token);
 	  continue;
 	}
       
@@ -811,30 +1100,31 @@ static int read_hostsfile(char *filename, int index, int cache_size)
       
       addr_count++;
       
-      /* rehash every 1000 names. */
-      if ((name_count - cache_size) > 1000)
-	{
-	  rehash(name_count);
-	  cache_size = name_count;
-	} 
-      
       while (atnl == 0)
 	{
 	  struct crec *cache;
 	  int fqdn, nomem;
 	  char *canon;
 	  
-	  if ((atnl = gettok(f, token)) == EOF)
+	  if ((atnl = gettok(&p, end, token)) == EOF)
 	    break;
 
 	  fqdn = !!strchr(token, '.');
 
-	  if ((canon = canonicalise(token, &nomem)))
+#ifdef LOCALEDIR
+	  canon = canonicalise(token, &nomem);
+#else
+	  /* Without IDN, canonicalise() would only check and copy the name. */
+	  canon = check_name(token) ? token : NULL;
+	  nomem = 0;
+#endif
+	  
+	  if (canon)
 	    {
 	      /* If set, add a version of the name with a default domain appended */
 	      if ((daemon->options & OPT_EXPAND) && domain_suffix && !fqdn && 
-		  (cache = whine_malloc(sizeof(struct crec) + 
-					strlen(canon)+2+strlen(domain_suffix)-SMALLDNAME)))
+		  (cache = hosts_alloc(sizeof(struct crec) + 
+				       strlen(canon)+2+strlen(domain_suffix)-SMALLDNAME)))
 		{
 		  strcpy(cache->name.sname, canon);
 		  strcat(cache->name.sname, ".");
@@ -843,21 +1133,25 @@ static int read_hostsfile(char *filename, int index, int cache_size)
 		  addr_dup = 1;
 		  name_count++;
 		}
-	      if ((cache = whine_malloc(sizeof(struct crec) + strlen(canon)+1-SMALLDNAME)))
+	      if ((cache = hosts_alloc(sizeof(struct crec) + strlen(canon)+1-SMALLDNAME)))
 		{
 		  strcpy(cache->name.sname, canon);
 		  add_hosts_entry(cache, &addr, addrlen, flags, index, addr_dup);
 		  name_count++;
 		}
-	      free(canon);
-	      
+	      if (canon != token)
+		free(canon);
 	    }
 	  else if (!nomem)
 	    my_syslog(LOG_ERR, _("bad name at %s line %d"), filename, lineno); 
 	}
     } 
 
-  fclose(f);
+  if (mapped)
+    munmap(map, len);
+  else
+    free(map);
+  
   rehash(name_count);
   
   my_syslog(LOG_INFO, _("read %s - %d addresses"), filename, addr_count);
@@ -879,12 +1173,14 @@ void cache_reload(void)
 	tmp = cache->hash_next;
 	if (cache->flags & F_HOSTS)
 	  {
+	    /* memory is freed by hosts_free() below */
 	    *up = cache->hash_next;
-	    free(cache);
+	    addr_unhash(cache);
 	  }
 	else if (!(cache->flags & F_DHCP))
 	  {
 	    *up = cache->hash_next;
+	    addr_unhash(cache);
 	    if (cache->flags & F_BIGNAME)
 	      {
 		cache->name.bname->next = big_free;
@@ -895,6 +1191,8 @@ void cache_reload(void)
 	else
 	  up = &cache->hash_next;
       }
+
+  hosts_free();
   
   if ((daemon->options & OPT_NO_HOSTS) && !daemon->addn_hosts)
     {
@@ -1002,6 +1300,274 @@ void cache_reload(void)
       total_size = read_hostsfile(ah->fname, ah->index, total_size);
 } 
 
+/* Called for each name answered from the cache, with the first entry
+   found. Popular entries are queued for a refresh shortly before they
+   expire, so that the next query doesn't have to wait for upstream, 
+   and so are stale ones given out under --serve-stale. */
+void cache_hit(struct crec *crecp, unsigned short type, time_t now)
+{
+  int stale;
+
+  if ((daemon->prefetch == 0 && daemon->stale_time == 0) ||
+      (crecp->flags & (F_HOSTS | F_DHCP | F_IMMORTAL)))
+    return;
+  
+  if (crecp->refresh & REFRESH_DONE)
+    {
+      crecp->refresh &= ~REFRESH_DONE;
+      daemon->prefetch_hit++;
+    }
+
+  if (crecp->hits != 65535)
+    crecp->hits++;
+  
+  if ((stale = is_expired(now, crecp)))
+    daemon->stale_answered++;
+  
+  /* The hit count restarts when a refresh is sent, so another is sent only
+     if the entry is still being used after a while and the first was lost. */
+  if (stale)
+    {
+      if ((crecp->refresh & REFRESH_SENT) && crecp->hits < PREFETCH_HITS)
+	return;
+    }
+  else if (daemon->prefetch == 0 || crecp->hits < daemon->prefetch ||
+	   difftime(crecp->ttd, now) > PREFETCH_TIME)
+    return;
+
+  if (prefetch_count < PREFETCH_MAX)
+    {
+      crecp->hits = 0;
+      crecp->refresh |= REFRESH_SENT;
+      prefetch_queue[prefetch_count].crecp = crecp;
+      prefetch_queue[prefetch_count].uid = crecp->uid;
+      prefetch_queue[prefetch_count].type = type;
+      prefetch_count++;
+    }
+}
+
+/* Return the name of the next entry queued by cache_hit(), or NULL. */
+char *cache_get_prefetch(unsigned short *type)
+{
+  while (prefetch_count != 0)
+    {
+      prefetch_count--;
+      /* entry may have been re-used since it was queued. */
+      if (prefetch_queue[prefetch_count].uid == prefetch_queue[prefetch_count].crecp->uid)
+	{
+	  *type = prefetch_queue[prefetch_count].type;
+	  return cache_get_name(prefetch_queue[prefetch_count].crecp);
+	}
+    }
+  
+  return NULL;
+}
+
+/* Entries inserted while this is set come from a refresh. */
+void cache_refresh_insert(int on)
+{
+  refresh_insert = on;
+}
+
+/* Entries which came from upstream and are still good. CNAMEs are
+   written after everything else, so that their targets exist when
+   they are read back. */
+static int cache_saveable(struct crec *crecp, int cname, time_t now)
+{
+  return (crecp->flags & (F_FORWARD | F_REVERSE)) &&
+    !(crecp->flags & (F_HOSTS | F_DHCP | F_IMMORTAL)) &&
+    (cname == 0) == ((crecp->flags & F_CNAME) == 0) &&
+    !is_expired(now, crecp) && !is_outdated_cname_pointer(crecp);
+}
+
+static int cache_save_rec(FILE *f, struct crec *crecp, int same, time_t now)
+{
+  struct cache_file_rec rec;
+  char *name = cache_get_name(crecp), *target = NULL;
+  
+  memset(&rec, 0, sizeof(rec));
+  rec.ttl = (unsigned int)difftime(crecp->ttd, now);
+  rec.flags = crecp->flags & ~F_BIGNAME;
+  rec.namelen = strlen(name);
+  rec.same = same;
+  if (crecp->flags & F_CNAME)
+    rec.targetlen = strlen(target = cache_get_name(crecp->addr.cname.cache));
+  else
+    rec.addr = crecp->addr.addr;
+  
+  return fwrite(&rec, sizeof(rec), 1, f) == 1 && 
+    fwrite(name, 1, rec.namelen, f) == rec.namelen &&
+    (!target || fwrite(target, 1, rec.targetlen, f) == rec.targetlen);
+}
+
+/* Write the answers in the cache which came from upstream to
+   --cache-file, so that cache_restore() can load them after a restart. */
+void cache_save(time_t now)
+{
+  struct cache_file_header header;
+  struct crec *crecp, *prev;
+  char *tmp, *name;
+  FILE *f;
+  int i, cname, same, ok;
+  
+  /* Don't overwrite the file before it has been read. */
+  if (!daemon->cache_file || !cache_restored)
+    return;
+  
+  if (!(tmp = whine_malloc(strlen(daemon->cache_file) + 5)))
+    return;
+  
+  strcpy(tmp, daemon->cache_file);
+  strcat(tmp, ".new");
+
+  if (!(f = fopen(tmp, "w")))
+    {
+      my_syslog(LOG_WARNING, _("failed to write %s: %s"), tmp, strerror(errno));
+      free(tmp);
+      return;
+    }
+
+  header.magic = CACHE_FILE_MAGIC;
+  header.count = 0;
+  header.saved = (long long)time(NULL);
+  ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+  /* All the entries for a name are in the same hash chain. Write them 
+     together, when we meet the first, so they can be inserted together. */
+  for (cname = 0; cname < 2 && ok; cname++)
+    for (i = 0; i < hash_size && ok; i++)
+      for (crecp = hash_table[i]; crecp && ok; crecp = crecp->hash_next)
+	{
+	  if (!cache_saveable(crecp, cname, now))
+	    continue;
+	  
+	  name = cache_get_name(crecp);
+	  for (prev = hash_table[i]; prev != crecp; prev = prev->hash_next)
+	    if (cache_saveable(prev, cname, now) && hostname_isequal(cache_get_name(prev), name))
+	      break;
+	  
+	  if (prev != crecp)
+	    continue;
+	  
+	  for (same = 0; crecp && ok; crecp = crecp->hash_next)
+	    if (cache_saveable(crecp, cname, now) && hostname_isequal(cache_get_name(crecp), name))
+	      {
+		ok = cache_save_rec(f, crecp, same, now);
+		header.count++;
+		same = 1;
+	      }
+	  
+	  /* carry on after the first, the rest will be skipped */
+	  crecp = prev;
+	}
+  
+  if (ok)
+    ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+  
+  if (fclose(f) != 0 || !ok || rename(tmp, daemon->cache_file) == -1)
+    {
+      my_syslog(LOG_WARNING, _("failed to write %s: %s"), daemon->cache_file, strerror(errno));
+      unlink(tmp);
+    }
+  else
+    my_syslog(LOG_INFO, _("saved %u cache entries to %s"), header.count, daemon->cache_file);
+  
+  free(tmp);
+}
+
+/* Load the file written by cache_save(), dropping anything which has
+   expired since. */
+void cache_restore(time_t now)
+{
+  struct cache_file_header header;
+  struct cache_file_rec rec;
+  struct crec *crecp, *target;
+  char *name = daemon->namebuff, *tname;
+  long long elapsed;
+  unsigned int i, count = 0;
+  FILE *f;
+  
+  if (!daemon->cache_file || daemon->port == 0 || daemon->cachesize == 0)
+    return;
+
+  /* From now on, cache_save() may overwrite the file. */
+  cache_restored = 1;
+
+  if (!(f = fopen(daemon->cache_file, "r")))
+    {
+      if (errno != ENOENT)
+	my_syslog(LOG_WARNING, _("failed to read %s: %s"), daemon->cache_file, strerror(errno));
+      return;
+    }
+  
+  if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != CACHE_FILE_MAGIC)
+    {
+      my_syslog(LOG_WARNING, _("ignoring %s: bad format"), daemon->cache_file);
+      fclose(f);
+      return;
+    }
+
+  if (!(tname = whine_malloc(MAXDNAME)))
+    {
+      fclose(f);
+      return;
+    }
+
+  if ((elapsed = (long long)time(NULL) - header.saved) < 0)
+    elapsed = 0;
+  
+  restoring = 1;
+  cache_start_insert();
+
+  for (i = 0; i < header.count; i++)
+    {
+      if (fread(&rec, sizeof(rec), 1, f) != 1 ||
+	  rec.namelen >= MAXDNAME || rec.targetlen >= MAXDNAME ||
+	  fread(name, 1, rec.namelen, f) != rec.namelen ||
+	  fread(tname, 1, rec.targetlen, f) != rec.targetlen)
+	{
+	  my_syslog(LOG_WARNING, _("ignoring rest of %s: truncated"), daemon->cache_file);
+	  break;
+	}
+      
+      name[rec.namelen] = 0;
+      tname[rec.targetlen] = 0;
+
+      /* Entries for one name go in together, as they came from one reply. */
+      if (!rec.same)
+	{
+	  cache_end_insert();
+	  cache_start_insert();
+	}
+      
+      if (rec.ttl <= elapsed)
+	continue;
+      
+      target = NULL;
+      if ((rec.flags & F_CNAME) && 
+	  !(target = cache_find_by_name(NULL, tname, now, F_IPV4 | F_IPV6 | F_CNAME)))
+	continue;
+      
+      if ((crecp = cache_insert(name, (rec.flags & F_CNAME) ? NULL : &rec.addr, now, 
+				rec.ttl - elapsed, rec.flags)))
+	{
+	  if (target)
+	    {
+	      crecp->addr.cname.cache = target;
+	      crecp->addr.cname.uid = target->uid;
+	    }
+	  count++;
+	}
+    }
+
+  cache_end_insert();
+  restoring = 0;
+  fclose(f);
+  free(tname);
+  
+  my_syslog(LOG_INFO, _("restored %u of %u cache entries from %s"), count, header.count, daemon->cache_file);
+}
+
 char *get_domain(struct in_addr addr)
 {
   struct cond_domain *c;
@@ -1025,6 +1591,7 @@ void cache_unhash_dhcp(void)
       if (cache->flags & F_DHCP)
 	{
 	  *up = cache->hash_next;
+	  addr_unhash(cache);
 	  cache->next = dhcp_spare;
 	  dhcp_spare = cache;
 	}
@@ -1131,6 +1698,12 @@ void dump_cache(time_t now)
 	    daemon->cachesize, cache_live_freed, cache_inserted);
   my_syslog(LOG_INFO, _("queries forwarded %u, queries answered locally %u"), 
 	    daemon->queries_forwarded, daemon->local_answer);
+  my_syslog(LOG_INFO, _("queries outstanding %u (max %u), forwarding records %u, timed out %u, dropped when full %u"),
+	    daemon->frecs_outstanding, daemon->frecs_outstanding_max, daemon->frecs_allocated,
+	    daemon->frecs_timed_out, daemon->frecs_table_full);
+  if (daemon->prefetch != 0 || daemon->stale_time != 0)
+    my_syslog(LOG_INFO, _("prefetches sent %u, prefetch hits %u, prefetch misses %u, stale answers %u"),
+	      daemon->prefetch_sent, daemon->prefetch_hit, daemon->prefetch_missed, daemon->stale_answered);
 
   if (!addrbuff && !(addrbuff = whine_malloc(ADDRSTRLEN)))
     return;
@@ -17,8 +17,14 @@
 #define VERSION "2.51"
 
 #define FTABSIZ 150 /* max number of outstanding requests (default) */
-#define MAX_PROCS 20 /* max no children for TCP requests */
-#define CHILD_LIFETIME 150 /* secs 'till terminated (RFC1035 suggests > 120s) */
+#define TCP_MAX_CONNECTIONS 100 /* max simultaneous TCP clients */
+#define TCP_MAX_QUERIES 20 /* max queries in progress on one TCP connection */
+#define TCP_IDLE 150 /* close idle TCP connections after this many secs (RFC1035 suggests > 120s) */
+#define PREFETCH_HITS 4 /* default answers from a cache entry before --prefetch refreshes it */
+#define PREFETCH_TIME 10 /* refresh popular cache entries this many secs before they expire */
+#define PREFETCH_MAX 8 /* max refreshes started by one query */
+#define STALE_TIME 86400 /* default time --serve-stale answers from expired entries */
+#define STALE_TTL 30 /* TTL given with stale answers, as RFC 8767 suggests */
 #define EDNS_PKTSZ 1280 /* default max EDNS.0 UDP packet from RFC2671 */
 #define TIMEOUT 10 /* drop UDP queries after TIMEOUT seconds */
 #define FORWARD_TEST 50 /* try all servers every 50 queries */
@@ -27,12 +33,14 @@
 #define LEASE_RETRY 60 /* on error, retry writing leasefile after LEASE_RETRY seconds */
 #define CACHESIZ 150 /* default cache size */
 #define MAXLEASES 150 /* maximum number of DHCP leases */
+#define LEASE_JOURNAL 64 /* rewrite leasefile when journal exceeds twice the leases plus this */
 #define PING_WAIT 3 /* wait for ping address-in-use test */
 #define PING_CACHE_TIME 30 /* Ping test assumed to be valid this long. */
 #define DECLINE_BACKOFF 600 /* disable DECLINEd static addresses for this long */
 #define DHCP_PACKET_MAX 16384 /* hard limit on DHCP packet size */
 #define SMALLDNAME 40 /* most domain names are smaller than this */
 #define HOSTSFILE "/etc/hosts"
+#define HOSTS_BLOCK 65536 /* least size of memory blocks for hosts file entries */
 #define ETHERSFILE "/etc/ethers"
 #ifdef __uClinux__
 #  define RESOLVFILE "/etc/config/resolv.conf"
@@ -70,6 +78,7 @@
 #define DHCP_CLIENT_ALTPORT 1068
 #define TFTP_PORT 69
 #define TFTP_MAX_CONNECTIONS 50 /* max simultaneous connections */
+#define TFTP_MAX_WINDOW 64 /* max blocks in flight with RFC 7440 windowsize */
 #define LOG_MAX 5 /* log-queue length */
 #define RANDFILE "/dev/urandom"
 #define DAD_WAIT 20 /* retry binding IPv6 sockets for this long */
@@ -148,10 +157,15 @@ HAVE_DBUS
    define some methods to allow (re)configuration of the upstream DNS 
    servers via DBus.
 
+HAVE_EPOLL
+   define this to use epoll() rather than select() in the main loop 
+   (Linux). select() is still used if epoll() is not available at run time.
+
 NOTES:
    For Linux you should define 
       HAVE_LINUX_NETWORK
       HAVE_GETOPT_LONG
+      HAVE_EPOLL
   you should NOT define 
       HAVE_ARC4RANDOM
       HAVE_SOCKADDR_SA_LEN
@@ -215,6 +229,7 @@ NOTES:
 #if !defined(__ARCH_HAS_MMU__) && !defined(__UCLIBC_HAS_MMU__)
 #  define NO_FORK
 #endif
+#define HAVE_EPOLL
 #if defined(__UCLIBC_HAS_IPV6__)
 #  ifndef IPV6_V6ONLY
 #    define IPV6_V6ONLY 26
@@ -225,6 +240,7 @@ NOTES:
 #elif defined(__linux__)
 #define HAVE_LINUX_NETWORK
 #define HAVE_GETOPT_LONG
+#define HAVE_EPOLL
 #undef HAVE_ARC4RANDOM
 #undef HAVE_SOCKADDR_SA_LEN
 
@@ -288,6 +304,11 @@ NOTES:
 #  define ADDRSTRLEN 16 /* 4*3 + 3 dots + NULL */
 #endif
 
+/* Allow epoll to be disabled with COPTS=-DNO_EPOLL */
+#ifdef NO_EPOLL
+#  undef HAVE_EPOLL
+#endif
+
 /* Can't do scripts without fork */
 #ifdef NOFORK
 #  undef HAVE_SCRIPT
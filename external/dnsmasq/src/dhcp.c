@@ -535,10 +535,10 @@ int address_allocate(struct dhcp_context *context,
      a particular hwaddr/clientid/hostname in our configuration.
      Try to return from contexts which match netids first. */
 
-  struct in_addr start, addr;
+  struct in_addr addr;
   struct dhcp_context *c, *d;
   int i, pass;
-  unsigned int j; 
+  unsigned int j, k, off, seed, size; 
 
   /* hash hwaddr */
   for (j = 0, i = 0; i < hw_len; i++)
@@ -553,11 +553,22 @@ int address_allocate(struct dhcp_context *context,
       else
 	{
 	  /* pick a seed based on hwaddr then iterate until we find a free address. */
-	  start.s_addr = addr.s_addr = 
-	    htonl(ntohl(c->start.s_addr) + 
-		  ((j + c->addr_epoch) % (1 + ntohl(c->end.s_addr) - ntohl(c->start.s_addr))));
+	  size = 1 + ntohl(c->end.s_addr) - ntohl(c->start.s_addr);
+	  seed = (j + c->addr_epoch) % size;
 	  
-	  do {
+	  for (k = 0; k < size; k++) {
+	    off = (seed + k) % size;
+
+	    /* leased addresses are in the bitmap, skip full words at once. */
+	    if (c->used && (c->used[off / 32] & (1u << (off & 31))))
+	      {
+		if ((off & 31) == 0 && c->used[off / 32] == 0xffffffff)
+		  k += 31;
+		continue;
+	      }
+
+	    addr.s_addr = htonl(ntohl(c->start.s_addr) + off);
+
 	    /* eliminate addresses in use by the server. */
 	    for (d = context; d; d = d->current)
 	      if (addr.s_addr == d->router.s_addr)
@@ -621,13 +632,7 @@ int address_allocate(struct dhcp_context *context,
 		    return 1;
 		  }
 	      }
-
-	    addr.s_addr = htonl(ntohl(addr.s_addr) + 1);
-	    
-	    if (addr.s_addr == htonl(ntohl(c->end.s_addr) + 1))
-	      addr = c->start;
-	    
-	  } while (addr.s_addr != start.s_addr);
+	  }
 	}
   return 0;
 }
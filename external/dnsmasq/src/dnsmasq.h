@@ -67,6 +67,7 @@
 #include <sys/sockio.h>
 #endif
 #include <sys/select.h>
+#include <poll.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/un.h>
@@ -95,6 +96,7 @@
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <syslog.h>
 #include <dirent.h>
 #ifndef HAVE_LINUX_NETWORK
@@ -259,6 +261,7 @@ union bigname {
 
 struct crec { 
   struct crec *next, *prev, *hash_next;
+  struct crec *addr_next, **addr_up; /* chain in the address index, F_REVERSE only */
   time_t ttd; /* time to die */
   int uid; 
   union {
@@ -269,6 +272,8 @@ struct crec {
     } cname;
   } addr;
   unsigned short flags;
+  unsigned short hits;    /* answers given from this entry, for --prefetch */
+  unsigned short refresh; /* REFRESH_* below */
   union {
     char sname[SMALLDNAME];
     union bigname *bname;
@@ -293,6 +298,9 @@ struct crec {
 #define F_CNAME     16384
 #define F_NOERR     32768
 
+#define REFRESH_SENT 1 /* a refresh query has been sent for this entry */
+#define REFRESH_DONE 2 /* entry was inserted by a refresh and not yet used */
+
 /* struct sockaddr is not large enough to hold any address,
    and specifically not big enough to hold an IPv6 address.
    Blech. Roll our own. */
@@ -333,9 +341,10 @@ struct server {
   char interface[IF_NAMESIZE+1];
   struct serverfd *sfd; 
   char *domain; /* set if this server only handles a domain. */ 
-  int flags, tcpfd;
+  int flags;
   unsigned int queries, failed_queries;
   struct server *next; 
+  struct server *domain_next; /* next server for the same domain, see index_server_domains() */
 };
 
 struct irec {
@@ -390,7 +399,56 @@ struct frec {
   int fd, forwardall;
   unsigned int crc;
   time_t time;
-  struct frec *next;
+  int flags;
+  struct frec *next;                     /* all records */
+  struct frec *id_next, **id_up;         /* hashed by new_id */
+  struct frec *sender_next, **sender_up; /* hashed by orig_id, source and crc */
+  struct frec *queue_next, *queue_prev;  /* timeout queue or free list */
+};
+
+#define FREC_ACTIVE  1 /* hashed and on the timeout queue */
+#define FREC_FREE    2 /* on the free list */
+
+/* DNS over TCP: each message is preceded by its length in two bytes. */
+struct tcp_buf {
+  struct tcp_buf *next;
+  size_t len;                 /* including the length bytes */
+  unsigned char *data;
+};
+
+struct tcp_stream {
+  int fd, out_count;
+  unsigned char len[2];
+  size_t got, out_done;       /* bytes read of the message in, written of the first out */
+  struct tcp_buf *in, *out, **out_tail;
+  time_t last_active;
+};
+
+struct tcp_client {
+  struct tcp_stream stream;
+  union mysockaddr peer;
+  struct in_addr local_addr, netmask;
+  int pending, closing;       /* queries sent upstream, no more queries to come */
+  struct tcp_client *next;
+};
+
+struct tcp_query {
+  struct tcp_client *client;  /* NULL if the client has gone */
+  struct server *last;        /* last server tried */
+  struct tcp_buf *query;      /* as received, with the client's ID */
+  unsigned short id;          /* ID used upstream */
+  unsigned int crc;
+  int tried;
+  time_t sent;
+  struct tcp_query *next;
+};
+
+struct tcp_upstream {
+  struct tcp_stream stream;
+  struct server *server;      /* NULL if the server has gone */
+  int connecting;
+  struct tcp_query *queries;
+  struct tcp_upstream *next;
 };
 
 /* actions in the daemon->helper RPC */
@@ -410,6 +468,7 @@ struct dhcp_lease {
   char new;              /* newly created */
   char changed;          /* modified */
   char aux_changed;      /* CLID or expiry changed */
+  char unsaved;          /* changed since last written to leasefile */
   time_t expires;        /* lease expiry */
 #ifdef HAVE_BROKEN_RTC
   unsigned int length;
@@ -420,7 +479,7 @@ struct dhcp_lease {
   unsigned char *vendorclass, *userclass, *supplied_hostname;
   unsigned int vendorclass_len, userclass_len, supplied_hostname_len;
   int last_interface;
-  struct dhcp_lease *next;
+  struct dhcp_lease *next, *addr_next, *hw_next, *clid_next;
 };
 
 struct dhcp_netid {
@@ -542,6 +601,7 @@ struct dhcp_context {
   struct in_addr netmask, broadcast;
   struct in_addr local, router;
   struct in_addr start, end; /* range of available addresses */
+  unsigned int *used; /* bitmap of leased addresses in start..end */
   int flags;
   struct dhcp_netid netid, *filter;
   struct dhcp_context *next, *current;
@@ -576,6 +636,7 @@ struct ping_result {
 struct tftp_file {
   int refcount, fd;
   off_t size;
+  unsigned char *map; /* whole file, or NULL to read() it */
   dev_t dev;
   ino_t inode;
   char filename[];
@@ -586,9 +647,11 @@ struct tftp_transfer {
   time_t timeout;
   int backoff;
   unsigned int block, blocksize, expansion;
+  unsigned int windowsize, last_block, resent;
   off_t offset;
+  struct timeval start;
   struct sockaddr_in peer;
-  char opt_blocksize, opt_transize, netascii, carrylf;
+  char opt_blocksize, opt_transize, opt_windowsize, netascii, carrylf, sent_all;
   struct tftp_file *file;
   struct tftp_transfer *next;
 };
@@ -624,6 +687,8 @@ extern struct daemon {
   int cachesize, ftabsize;
   int port, query_port, min_port;
   unsigned long local_ttl, neg_ttl;
+  int prefetch, stale_time; /* --prefetch hits and --serve-stale time, zero if off */
+  char *cache_file;
   struct hostsfile *addn_hosts;
   struct dhcp_context *dhcp;
   struct dhcp_config *dhcp_conf;
@@ -648,6 +713,9 @@ extern struct daemon {
   int packet_buff_sz; /* size of above */
   char *namebuff; /* MAXDNAME size buffer */
   unsigned int local_answer, queries_forwarded;
+  unsigned int frecs_allocated, frecs_outstanding, frecs_outstanding_max;
+  unsigned int frecs_timed_out, frecs_table_full;
+  unsigned int prefetch_sent, prefetch_hit, prefetch_missed, stale_answered;
   struct frec *frec_list;
   struct serverfd *sfds;
   struct irec *interfaces;
@@ -658,7 +726,9 @@ extern struct daemon {
   struct server *srv_save; /* Used for resend on DoD */
   size_t packet_len;       /*      "        "        */
   struct randfd *rfd_save; /*      "        "        */
-  pid_t tcp_pids[MAX_PROCS];
+  struct tcp_client *tcp_clients;
+  struct tcp_upstream *tcp_upstreams;
+  int tcp_client_count;
   struct randfd randomsocks[RANDOM_SOCKS];
 
   /* DHCP state */
@@ -705,6 +775,11 @@ void cache_add_dhcp_entry(char *host_name, struct in_addr *host_address, time_t
 void cache_unhash_dhcp(void);
 void dump_cache(time_t now);
 char *cache_get_name(struct crec *crecp);
+void cache_hit(struct crec *crecp, unsigned short type, time_t now);
+char *cache_get_prefetch(unsigned short *type);
+void cache_refresh_insert(int on);
+void cache_save(time_t now);
+void cache_restore(time_t now);
 char *get_domain(struct in_addr addr);
 
 /* rfc1035.c */
@@ -729,6 +804,7 @@ size_t resize_packet(HEADER *header, size_t plen,
 void rand_init(void);
 unsigned short rand16(void);
 int legal_hostname(char *c);
+int check_name(char *in);
 char *canonicalise(char *s, int *nomem);
 unsigned char *do_rfc1035_name(unsigned char *p, char *sval);
 void *safe_malloc(size_t size);
@@ -756,8 +832,8 @@ void die(char *message, char *arg1, int exit_code);
 int log_start(struct passwd *ent_pw, int errfd);
 int log_reopen(char *log_file);
 void my_syslog(int priority, const char *format, ...);
-void set_log_writer(fd_set *set, int *maxfdp);
-void check_log_writer(fd_set *set);
+void set_log_writer(void);
+void check_log_writer(int force);
 void flush_log(void);
 
 /* option.c */
@@ -768,10 +844,13 @@ void reread_dhcp(void);
 /* forward.c */
 void reply_query(int fd, int family, time_t now);
 void receive_query(struct listener *listen, time_t now);
-unsigned char *tcp_request(int confd, time_t now,
-			   struct in_addr local_addr, struct in_addr netmask);
+void prefetch_queries(time_t now);
+void tcp_accept(int confd, struct in_addr local_addr, struct in_addr netmask, time_t now);
+void set_tcp_listeners(void);
+void check_tcp_listeners(time_t now);
 void server_gone(struct server *server);
 struct frec *get_new_frec(time_t now, int *wait);
+void index_server_domains(void);
 
 /* network.c */
 int indextoname(int fd, int index, char *name);
@@ -873,8 +952,8 @@ int iface_enumerate(void *parm, int (*ipv4_callback)(), int (*ipv6_callback)());
 /* dbus.c */
 #ifdef HAVE_DBUS
 char *dbus_init(void);
-void check_dbus_listeners(fd_set *rset, fd_set *wset, fd_set *eset);
-void set_dbus_listeners(int *maxfdp, fd_set *rset, fd_set *wset, fd_set *eset);
+void check_dbus_listeners(void);
+void set_dbus_listeners(void);
 void emit_dbus_signal(int action, struct dhcp_lease *lease, char *hostname);
 #endif
 
@@ -890,5 +969,15 @@ int helper_buf_empty(void);
 /* tftp.c */
 #ifdef HAVE_TFTP
 void tftp_request(struct listener *listen, time_t now);
-void check_tftp_listeners(fd_set *rset, time_t now);
+void check_tftp_listeners(time_t now);
 #endif
+
+/* poll.c */
+void poll_reset(void);
+void poll_listen(int fd, short event);
+int poll_check(int fd, short event);
+void poll_remove(int fd);
+int poll_save(void);
+void poll_restore(void);
+int poll_init(void);
+int do_poll(int timeout);
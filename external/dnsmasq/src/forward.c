@@ -22,8 +22,30 @@ static struct frec *lookup_frec_by_sender(unsigned short id,
 					  unsigned int crc);
 static unsigned short get_id(int force, unsigned short force_id, unsigned int crc);
 static void free_frec(struct frec *f);
+static void activate_frec(struct frec *f);
 static struct randfd *allocate_rfd(int family);
 
+/* Forwarding records in use are hashed by the ID we sent upstream, and by the 
+   ID, address and question of the original query. They are also queued in the
+   order they were sent: every record has the same timeout, so the oldest one
+   is always at the front. Unused records are kept on a free list. */
+static struct frec **frec_id_hash = NULL, **frec_sender_hash = NULL;
+static struct frec *frec_oldest = NULL, *frec_newest = NULL, *frec_free = NULL;
+static int frec_hash_size;
+
+/* --server and --address rules with a domain are hashed by domain, the servers 
+   for each domain being chained through domain_next in list order. Servers for
+   unqualified names are chained the same way. */
+struct server_domain {
+  unsigned int hash;
+  struct server *first, *last;
+  struct server_domain *next;
+};
+
+static struct server_domain **domain_hash = NULL, *domain_entries = NULL;
+static struct server *nodots_servers = NULL;
+static int domain_hash_size;
+
 /* Send a UDP packet with its source address set as "source" 
    unless nowild is true, when we just send it with the kernel default */
 static void send_from(int fd, int nowild, char *packet, size_t len, 
@@ -110,6 +132,149 @@ static void send_from(int fd, int nowild, char *packet, size_t len,
     }
 }
           
+static unsigned int domain_hash_val(char *name)
+{
+  unsigned int c, val = 2166136261u;
+
+  while ((c = (unsigned char) *name++))
+    {
+      /* don't use tolower and friends here - they may be messed up by LOCALE */
+      if (c >= 'A' && c <= 'Z')
+	c += 'a' - 'A';
+      val = (val ^ c) * 16777619u;
+    }
+
+  return val;
+}
+
+static void free_server_domains(void)
+{
+  free(domain_hash);
+  free(domain_entries);
+  domain_hash = NULL;
+  domain_entries = NULL;
+  nodots_servers = NULL;
+}
+
+/* Called whenever daemon->servers has changed. If the index can't be built,
+   search_servers() falls back to scanning the server list. */
+void index_server_domains(void)
+{
+  struct server *serv, **nodots_up = &nodots_servers;
+  struct server_domain *entry, **up;
+  int i, count = 0, domains = 0;
+  unsigned int hash;
+  size_t mem;
+
+  free_server_domains();
+
+  for (serv = daemon->servers; serv; serv = serv->next)
+    if (serv->flags & SERV_HAS_DOMAIN)
+      count++;
+
+  /* hash size is a power of two */
+  for (domain_hash_size = 16; domain_hash_size < count; domain_hash_size <<= 1);
+  
+  if (!(domain_hash = whine_malloc(domain_hash_size * sizeof(struct server_domain *))) ||
+      (count != 0 && !(domain_entries = whine_malloc(count * sizeof(struct server_domain)))))
+    {
+      free_server_domains();
+      return;
+    }
+
+  for (i = 0; i < domain_hash_size; i++)
+    domain_hash[i] = NULL;
+
+  for (serv = daemon->servers; serv; serv = serv->next)
+    {
+      serv->domain_next = NULL;
+      
+      if (serv->flags & SERV_FOR_NODOTS)
+	{
+	  *nodots_up = serv;
+	  nodots_up = &serv->domain_next;
+	}
+      else if (serv->flags & SERV_HAS_DOMAIN)
+	{
+	  hash = domain_hash_val(serv->domain);
+	  up = &domain_hash[hash & (domain_hash_size - 1)];
+	  
+	  for (entry = *up; entry; entry = entry->next)
+	    if (entry->hash == hash && hostname_isequal(entry->first->domain, serv->domain))
+	      break;
+	  
+	  if (entry)
+	    {
+	      entry->last->domain_next = serv;
+	      entry->last = serv;
+	    }
+	  else
+	    {
+	      entry = &domain_entries[domains++];
+	      entry->hash = hash;
+	      entry->first = entry->last = serv;
+	      entry->next = *up;
+	      *up = entry;
+	    }
+	}
+    }
+  
+  if (count != 0)
+    {
+      mem = domain_hash_size * sizeof(struct server_domain *) + 
+	count * (sizeof(struct server_domain) + sizeof(struct server *));
+      my_syslog(LOG_INFO, _("indexed %d server and address rules for %d domains, using %u bytes (%u per rule)"), 
+		count, domains, (unsigned int)mem, (unsigned int)(mem / count));
+    }
+}
+
+/* First server for exactly this domain, or the first server for
+   unqualified names if domain is NULL. */
+static struct server *domain_servers(char *domain)
+{
+  struct server *serv;
+
+  if (domain_hash)
+    {
+      struct server_domain *entry;
+      unsigned int hash;
+
+      if (!domain)
+	return nodots_servers;
+
+      hash = domain_hash_val(domain);
+      for (entry = domain_hash[hash & (domain_hash_size - 1)]; entry; entry = entry->next)
+	if (entry->hash == hash && hostname_isequal(entry->first->domain, domain))
+	  return entry->first;
+      
+      return NULL;
+    }
+
+  for (serv = daemon->servers; serv; serv = serv->next)
+    if (domain ? 
+	((serv->flags & SERV_HAS_DOMAIN) && hostname_isequal(serv->domain, domain)) :
+	(serv->flags & SERV_FOR_NODOTS))
+      return serv;
+  
+  return NULL;
+}
+
+static struct server *next_domain_server(struct server *serv)
+{
+  struct server *next;
+
+  if (domain_hash)
+    return serv->domain_next;
+
+  for (next = serv->next; next; next = next->next)
+    if ((serv->flags & SERV_FOR_NODOTS) ? 
+	(next->flags & SERV_FOR_NODOTS) :
+	((next->flags & SERV_HAS_DOMAIN) && hostname_isequal(next->domain, serv->domain)))
+      return next;
+
+  return NULL;
+}
+
 static unsigned short search_servers(time_t now, struct all_addr **addrpp, 
 				     unsigned short qtype, char *qdomain, int *type, char **domain)
 			      
@@ -119,66 +284,57 @@ static unsigned short search_servers(time_t now, struct all_addr **addrpp,
      domain.org and sub.domain.org to exist. */
   
   unsigned int namelen = strlen(qdomain);
-  unsigned int matchlen = 0;
   struct server *serv;
   unsigned short flags = 0;
+  char *p, *dot;
   
-  for (serv = daemon->servers; serv; serv=serv->next)
-    /* domain matches take priority over NODOTS matches */
-    if ((serv->flags & SERV_FOR_NODOTS) && *type != SERV_HAS_DOMAIN && !strchr(qdomain, '.') && namelen != 0)
-      {
-	unsigned short sflag = serv->addr.sa.sa_family == AF_INET ? F_IPV4 : F_IPV6; 
-	*type = SERV_FOR_NODOTS;
-	if (serv->flags & SERV_NO_ADDR)
-	  flags = F_NXDOMAIN;
-	else if (serv->flags & SERV_LITERAL_ADDRESS) 
-	  { 
-	    if (sflag & qtype)
-	      {
-		flags = sflag;
-		if (serv->addr.sa.sa_family == AF_INET) 
-		  *addrpp = (struct all_addr *)&serv->addr.in.sin_addr;
-#ifdef HAVE_IPV6
-		else
-		  *addrpp = (struct all_addr *)&serv->addr.in6.sin6_addr;
-#endif 
-	      }
-	    else if (!flags || (flags & F_NXDOMAIN))
-	      flags = F_NOERR;
-	  } 
-      }
-    else if (serv->flags & SERV_HAS_DOMAIN)
-      {
-	unsigned int domainlen = strlen(serv->domain);
-	char *matchstart = qdomain + namelen - domainlen;
-	if (namelen >= domainlen &&
-	    hostname_isequal(matchstart, serv->domain) &&
-	    domainlen >= matchlen &&
-	    (domainlen == 0 || namelen == domainlen || *(serv->domain) == '.' || *(matchstart-1) == '.' ))
-	  {
-	    unsigned short sflag = serv->addr.sa.sa_family == AF_INET ? F_IPV4 : F_IPV6;
-	    *type = SERV_HAS_DOMAIN;
-	    *domain = serv->domain;
-	    matchlen = domainlen;
-	    if (serv->flags & SERV_NO_ADDR)
-	      flags = F_NXDOMAIN;
-	    else if (serv->flags & SERV_LITERAL_ADDRESS)
-	      {
-		if (sflag & qtype)
-		  {
-		    flags = sflag;
-		    if (serv->addr.sa.sa_family == AF_INET) 
-		      *addrpp = (struct all_addr *)&serv->addr.in.sin_addr;
+  /* Look up each suffix of the name which starts at a label, both with and 
+     without the dot before it, longest first. An empty domain matches everything. */
+  for (p = qdomain; ; p = dot + 1)
+    {
+      if (p != qdomain && (serv = domain_servers(p - 1)))
+	break;
+      if ((serv = domain_servers(p)))
+	break;
+      if (!(dot = strchr(p, '.')))
+	{
+	  serv = *p ? domain_servers("") : NULL;
+	  break;
+	}
+    }
+
+  if (serv)
+    *type = SERV_HAS_DOMAIN;
+  /* domain matches take priority over NODOTS matches */
+  else if (*type != SERV_HAS_DOMAIN && !strchr(qdomain, '.') && namelen != 0 &&
+	   (serv = domain_servers(NULL)))
+    *type = SERV_FOR_NODOTS;
+
+  for (; serv; serv = next_domain_server(serv))
+    {
+      unsigned short sflag = serv->addr.sa.sa_family == AF_INET ? F_IPV4 : F_IPV6;
+      
+      if (serv->flags & SERV_HAS_DOMAIN)
+	*domain = serv->domain;
+      
+      if (serv->flags & SERV_NO_ADDR)
+	flags = F_NXDOMAIN;
+      else if (serv->flags & SERV_LITERAL_ADDRESS)
+	{
+	  if (sflag & qtype)
+	    {
+	      flags = sflag;
+	      if (serv->addr.sa.sa_family == AF_INET) 
+		*addrpp = (struct all_addr *)&serv->addr.in.sin_addr;
 #ifdef HAVE_IPV6
-		    else
-		      *addrpp = (struct all_addr *)&serv->addr.in6.sin6_addr;
+	      else
+		*addrpp = (struct all_addr *)&serv->addr.in6.sin6_addr;
 #endif
-		  }
-		else if (!flags || (flags & F_NXDOMAIN))
-		  flags = F_NOERR;
-	      }
-	  } 
-      }
+	    }
+	  else if (!flags || (flags & F_NXDOMAIN))
+	    flags = F_NOERR;
+	}
+    }
 
   if (flags == 0 && !(qtype & F_BIGNAME) && 
       (daemon->options & OPT_NODOTS_LOCAL) && !strchr(qdomain, '.') && namelen != 0)
@@ -237,8 +393,11 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 	flags = search_servers(now, &addrp, gotname, daemon->namebuff, &type, &domain);
       
       if (!flags && !(forward = get_new_frec(now, NULL)))
-	/* table full - server failure. */
-	flags = F_NEG;
+	{
+	  /* table full - server failure. */
+	  daemon->frecs_table_full++;
+	  flags = F_NEG;
+	}
       
       if (forward)
 	{
@@ -255,6 +414,7 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 	  forward->crc = crc;
 	  forward->forwardall = 0;
 	  header->id = htons(forward->new_id);
+	  activate_frec(forward);
 
 	  /* In strict_order mode, or when using domain specific servers
 	     always try servers in the order specified in resolv.conf,
@@ -547,7 +707,12 @@ void reply_query(int fd, int family, time_t now)
   if (forward->forwardall == 0 || --forward->forwardall == 1 || 
       (header->rcode != REFUSED && header->rcode != SERVFAIL))
     {
-      if ((nn = process_reply(header, now, server, (size_t)n)))
+      /* no fd: a refresh from prefetch_queries(), only the cache wants it. */
+      cache_refresh_insert(forward->fd == -1);
+      nn = process_reply(header, now, server, (size_t)n);
+      cache_refresh_insert(0);
+
+      if (nn && forward->fd != -1)
 	{
 	  header->id = htons(forward->orig_id);
 	  header->ra = 1; /* recursion if available */
@@ -712,180 +877,690 @@ void receive_query(struct listener *listen, time_t now)
     daemon->queries_forwarded++;
   else
     daemon->local_answer++;
+
+  prefetch_queries(now);
 }
 
-/* The daemon forks before calling this: it should deal with one connection,
-   blocking as neccessary, and then return. Note, need to be a bit careful
-   about resources for debug mode, when the fork is suppressed: that's
-   done by the caller. */
-unsigned char *tcp_request(int confd, time_t now,
-			   struct in_addr local_addr, struct in_addr netmask)
+/* Send queries for the cache entries which cache_hit() wants refreshed.
+   These go out like a client's query, but with no fd to answer on, so
+   reply_query() only caches the result. */
+void prefetch_queries(time_t now)
 {
-  int size = 0;
-  size_t m;
-  unsigned short qtype, gotname;
-  unsigned char c1, c2;
-  /* Max TCP packet + slop */
-  unsigned char *packet = whine_malloc(65536 + MAXDNAME + RRFIXEDSZ);
-  HEADER *header;
-  struct server *last_server;
+  HEADER *header = (HEADER *)daemon->packet;
+  union mysockaddr source;
+  struct all_addr dest;
+  unsigned short type;
+  unsigned char *p;
+  char *name;
+
+  memset(&source, 0, sizeof(source));
+  memset(&dest, 0, sizeof(dest));
   
-  while (1)
+  while ((name = cache_get_prefetch(&type)))
     {
-      if (!packet ||
-	  !read_write(confd, &c1, 1, 1) || !read_write(confd, &c2, 1, 1) ||
-	  !(size = c1 << 8 | c2) ||
-	  !read_write(confd, packet, size, 1))
-       	return packet; 
-  
-      if (size < (int)sizeof(HEADER))
-	continue;
+      memset(header, 0, sizeof(HEADER));
+      header->id = htons(rand16());
+      header->opcode = QUERY;
+      header->rd = 1;
+      header->qdcount = htons(1);
       
-      header = (HEADER *)packet;
+      p = do_rfc1035_name((unsigned char *)(header + 1), name);
+      *p++ = 0;
+      PUTSHORT(type, p);
+      PUTSHORT(C_IN, p);
+      
+      if (forward_query(-1, &source, &dest, 0, header, p - (unsigned char *)header, now, NULL))
+	daemon->prefetch_sent++;
+    }
+}
+
+/* TCP queries are handled in the main process. Several queries may arrive on a 
+   connection before the first is answered. Each is answered from the cache if 
+   possible, or else sent upstream over a TCP connection which is kept open and 
+   shared with other queries for the same server. Answers go back to the client 
+   in the order they become available, as RFC 1035 allows. */
+
+static unsigned char *tcp_packet = NULL; /* Max TCP packet + slop */
+
+static struct tcp_buf *tcp_buf_new(size_t len)
+{
+  struct tcp_buf *buf = whine_malloc(sizeof(struct tcp_buf) + len + 2);
+  
+  if (buf)
+    {
+      buf->next = NULL;
+      buf->len = len + 2;
+      buf->data = (unsigned char *)(buf + 1);
+      buf->data[0] = len >> 8;
+      buf->data[1] = len;
+    }
+
+  return buf;
+}
+
+static void stream_init(struct tcp_stream *s, int fd, time_t now)
+{
+  s->fd = fd;
+  s->got = s->out_done = 0;
+  s->out_count = 0;
+  s->in = s->out = NULL;
+  s->out_tail = &s->out;
+  s->last_active = now;
+}
+
+static void stream_free(struct tcp_stream *s)
+{
+  struct tcp_buf *buf;
+
+  poll_remove(s->fd);
+  shutdown(s->fd, SHUT_RDWR);
+  close(s->fd);
+  
+  free(s->in);
+  while ((buf = s->out))
+    {
+      s->out = buf->next;
+      free(buf);
+    }
+}
+
+/* Returns the next complete message, or NULL if there isn't one yet. 
+   Sets *closed if the connection has been closed or has failed. */
+static struct tcp_buf *stream_read(struct tcp_stream *s, int *closed, time_t now)
+{
+  struct tcp_buf *buf;
+  ssize_t n;
+
+  while (1)
+    {
+      if (!s->in)
+	n = read(s->fd, s->len + s->got, 2 - s->got);
+      else
+	n = read(s->fd, s->in->data + s->got, s->in->len - s->got);
       
-      if ((gotname = extract_request(header, (unsigned int)size, daemon->namebuff, &qtype)))
+      if (n == 0 || (n == -1 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
+	{
+	  *closed = 1;
+	  return NULL;
+	}
+
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return NULL;
+	}
+
+      s->got += n;
+      s->last_active = now;
+
+      if (!s->in)
 	{
-	  union mysockaddr peer_addr;
-	  socklen_t peer_len = sizeof(union mysockaddr);
+	  if (s->got < 2)
+	    continue;
 	  
-	  if (getpeername(confd, (struct sockaddr *)&peer_addr, &peer_len) != -1)
+	  /* a zero length message closes the connection */
+	  if ((s->len[0] == 0 && s->len[1] == 0) ||
+	      !(s->in = tcp_buf_new((s->len[0] << 8) | s->len[1])))
 	    {
-	      char types[20];
+	      *closed = 1;
+	      return NULL;
+	    }
+	}
+      else if (s->got == s->in->len)
+	{
+	  buf = s->in;
+	  s->in = NULL;
+	  s->got = 0;
+	  return buf;
+	}
+    }
+}
 
-	      querystr(types, qtype);
+/* Returns zero if the connection has failed. */
+static int stream_write(struct tcp_stream *s, time_t now)
+{
+  struct tcp_buf *buf;
+  ssize_t n;
+
+  while ((buf = s->out))
+    {
+      if ((n = write(s->fd, buf->data + s->out_done, buf->len - s->out_done)) == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return errno == EAGAIN || errno == EWOULDBLOCK;
+	}
+
+      s->last_active = now;
+
+      if ((s->out_done += n) == buf->len)
+	{
+	  if (!(s->out = buf->next))
+	    s->out_tail = &s->out;
+	  s->out_done = 0;
+	  s->out_count--;
+	  free(buf);
+	}
+    }
+
+  return 1;
+}
+
+static void stream_queue(struct tcp_stream *s, struct tcp_buf *buf)
+{
+  buf->next = NULL;
+  *s->out_tail = buf;
+  s->out_tail = &buf->next;
+  s->out_count++;
+}
+
+static void log_tcp_query(union mysockaddr *peer, unsigned short qtype)
+{
+  char types[20];
 
-	      if (peer_addr.sa.sa_family == AF_INET) 
-		log_query(F_QUERY | F_IPV4 | F_FORWARD, daemon->namebuff, 
-			  (struct all_addr *)&peer_addr.in.sin_addr, types);
+  querystr(types, qtype);
+  
+  if (peer->sa.sa_family == AF_INET) 
+    log_query(F_QUERY | F_IPV4 | F_FORWARD, daemon->namebuff, 
+	      (struct all_addr *)&peer->in.sin_addr, types);
 #ifdef HAVE_IPV6
-	      else
-		log_query(F_QUERY | F_IPV6 | F_FORWARD, daemon->namebuff, 
-			  (struct all_addr *)&peer_addr.in6.sin6_addr, types);
+  else
+    log_query(F_QUERY | F_IPV6 | F_FORWARD, daemon->namebuff, 
+	      (struct all_addr *)&peer->in6.sin6_addr, types);
 #endif
-	    }
+}
+
+static void tcp_respond(struct tcp_client *client, unsigned char *packet, size_t len, time_t now)
+{
+  struct tcp_buf *buf;
+
+  if (len != 0 && (buf = tcp_buf_new(len)))
+    {
+      memcpy(buf->data + 2, packet, len);
+      stream_queue(&client->stream, buf);
+      stream_write(&client->stream, now);
+    }
+}
+
+static int server_wanted(struct server *serv, int type, char *domain)
+{
+  return type == (serv->flags & SERV_TYPE) &&
+    (type != SERV_HAS_DOMAIN || hostname_isequal(domain, serv->domain)) &&
+    !(serv->flags & (SERV_LITERAL_ADDRESS | SERV_NO_ADDR));
+}
+
+/* An existing connection to serv on which id is not in use, or a new one. 
+   NULL if the server isn't keeping up with the queries already queued for it. */
+static struct tcp_upstream *get_upstream(struct server *serv, unsigned short id, time_t now)
+{
+  struct tcp_upstream *up;
+  struct tcp_query *q;
+  int fd;
+  
+  for (up = daemon->tcp_upstreams; up; up = up->next)
+    if (up->server == serv)
+      {
+	if (up->stream.out_count >= TCP_MAX_QUERIES)
+	  return NULL;
+	for (q = up->queries; q; q = q->next)
+	  if (q->id == id)
+	    break;
+	if (!q)
+	  return up;
+      }
+
+  if ((fd = socket(serv->addr.sa.sa_family, SOCK_STREAM, 0)) == -1)
+    return NULL;
+  
+  if (!fix_fd(fd) ||
+      !local_bind(fd, &serv->source_addr, serv->interface, 1) ||
+      (connect(fd, &serv->addr.sa, sa_len(&serv->addr)) == -1 && errno != EINPROGRESS) ||
+      !(up = whine_malloc(sizeof(struct tcp_upstream))))
+    {
+      close(fd);
+      return NULL;
+    }
+
+  stream_init(&up->stream, fd, now);
+  up->server = serv;
+  up->connecting = 1;
+  up->queries = NULL;
+  up->next = daemon->tcp_upstreams;
+  daemon->tcp_upstreams = up;
+  
+  return up;
+}
+
+/* Send a query to the next server which will take it. Returns zero if there
+   are no more servers to try. */
+static int tcp_forward(struct tcp_query *q, int type, char *domain, time_t now)
+{
+  HEADER *header = (HEADER *)(q->query->data + 2);
+  size_t plen, n = q->query->len - 2;
+  unsigned short id = ntohs(header->id);
+  struct tcp_upstream *up = NULL, *open;
+  struct server *serv, *start;
+  struct tcp_buf *buf;
+  unsigned char *psave;
+  int is_sign, count = 0;
+  
+  /* We change the ID so that queries from different clients can share a 
+     connection, except for signed packets. */
+  find_pseudoheader(header, n, &plen, &psave, &is_sign);
+  
+  /* First try, use a connection which is already open if there is one. */
+  if (q->tried == 0)
+    for (open = daemon->tcp_upstreams; open; open = open->next)
+      if (open->server && server_wanted(open->server, type, domain) && 
+	  (up = is_sign ? get_upstream(open->server, id, now) : 
+	   (open->stream.out_count < TCP_MAX_QUERIES ? open : NULL)))
+	break;
+      
+  if (!up)
+    {
+      for (serv = daemon->servers; serv; serv = serv->next)
+	count++;
+      
+      if (q->last)
+	start = q->last->next;
+      else if (type != 0 || (daemon->options & OPT_ORDER) || !daemon->last_server)
+	start = daemon->servers;
+      else
+	start = daemon->last_server;
+      
+      /* q->tried counts each server looked at once, whether or not it took 
+	 the query. */
+      for (serv = start; q->tried < count; serv = serv->next)
+	{
+	  if (!serv)
+	    serv = daemon->servers;
+
+	  q->tried++;
+
+	  if (server_wanted(serv, type, domain) && 
+	      (up = get_upstream(serv, id, now)))
+	    break;
 	}
+
+      if (!up)
+	return 0;
+    }
+  else
+    q->tried++;
+  
+  q->last = up->server;
+  q->sent = now;
+
+  if (is_sign)
+    q->id = id;
+  else
+    {
+      struct tcp_query *t;
       
-      /* m > 0 if answered from cache */
-      m = answer_request(header, ((char *) header) + 65536, (unsigned int)size, 
-			 local_addr, netmask, now);
+      do {
+	q->id = rand16();
+	for (t = up->queries; t; t = t->next)
+	  if (t->id == q->id)
+	    break;
+      } while (t);
+    }
+  
+  q->next = up->queries;
+  up->queries = q;
+  
+  if ((buf = tcp_buf_new(n)))
+    {
+      memcpy(buf->data + 2, header, n);
+      ((HEADER *)(buf->data + 2))->id = htons(q->id);
+      stream_queue(&up->stream, buf);
+      if (!up->connecting)
+	stream_write(&up->stream, now);
+    }
 
-      /* Do this by steam now we're not in the select() loop */
-      check_log_writer(NULL); 
+  if (up->server->addr.sa.sa_family == AF_INET)
+    log_query(F_SERVER | F_IPV4 | F_FORWARD, daemon->namebuff, 
+	      (struct all_addr *)&up->server->addr.in.sin_addr, NULL); 
+#ifdef HAVE_IPV6
+  else
+    log_query(F_SERVER | F_IPV6 | F_FORWARD, daemon->namebuff, 
+	      (struct all_addr *)&up->server->addr.in6.sin6_addr, NULL);
+#endif 
+  
+  return 1;
+}
+
+static void tcp_query_done(struct tcp_query *q)
+{
+  if (q->client)
+    q->client->pending--;
+  free(q->query);
+  free(q);
+}
+
+/* Used when the upstream connection has gone: try another server or give up. */
+static void tcp_retry(struct tcp_query *q, time_t now)
+{
+  HEADER *header = (HEADER *)(q->query->data + 2);
+  size_t n = q->query->len - 2, m;
+  unsigned short flags = 0, gotname;
+  struct all_addr *addrp = NULL;
+  int type = 0;
+  char *domain = NULL;
+  
+  if (q->client)
+    {
+      if ((gotname = extract_request(header, n, daemon->namebuff, NULL)))
+	flags = search_servers(now, &addrp, gotname, daemon->namebuff, &type, &domain);
+      else
+	strcpy(daemon->namebuff, "query");
+
+      if (!flags && tcp_forward(q, type, domain, now))
+	return;
       
-      if (m == 0)
+      memcpy(tcp_packet, header, n);
+      m = setup_reply((HEADER *)tcp_packet, n, addrp, flags, daemon->local_ttl);
+      tcp_respond(q->client, tcp_packet, m, now);
+    }
+
+  tcp_query_done(q);
+}
+
+static void tcp_upstream_free(struct tcp_upstream *up, time_t now)
+{
+  struct tcp_upstream **upp;
+  struct tcp_query *q, *tmp;
+
+  for (upp = &daemon->tcp_upstreams; *upp; upp = &(*upp)->next)
+    if (*upp == up)
+      {
+	*upp = up->next;
+	break;
+      }
+
+  stream_free(&up->stream);
+  
+  for (q = up->queries; q; q = tmp)
+    {
+      tmp = q->next;
+      tcp_retry(q, now);
+    }
+
+  free(up);
+}
+
+static void tcp_client_free(struct tcp_client *client)
+{
+  struct tcp_upstream *up;
+  struct tcp_query *q;
+
+  /* answers to queries still outstanding are thrown away */
+  if (client->pending != 0)
+    for (up = daemon->tcp_upstreams; up; up = up->next)
+      for (q = up->queries; q; q = q->next)
+	if (q->client == client)
+	  q->client = NULL;
+  
+  stream_free(&client->stream);
+  daemon->tcp_client_count--;
+  free(client);
+}
+
+static void tcp_reply(struct tcp_upstream *up, struct tcp_buf *buf, time_t now)
+{
+  HEADER *header = (HEADER *)(buf->data + 2);
+  size_t n = buf->len - 2;
+  struct tcp_query *q, **qp;
+  
+  if (n >= sizeof(HEADER))
+    for (qp = &up->queries; (q = *qp); qp = &q->next)
+      if (q->id == ntohs(header->id))
 	{
-	  unsigned short flags = 0;
-	  struct all_addr *addrp = NULL;
-	  int type = 0;
-	  char *domain = NULL;
+	  *qp = q->next;
 	  
-	  if (gotname)
-	    flags = search_servers(now, &addrp, gotname, daemon->namebuff, &type, &domain);
+	  /* If the crc of the question section doesn't match the crc we sent, then
+	     someone might be attempting to insert bogus values into the cache by 
+	     sending replies containing questions and bogus answers. */
+	  if (q->crc == questions_crc(header, n, daemon->namebuff))
+	    n = process_reply(header, now, up->server, n);
 	  
-	  if (type != 0  || (daemon->options & OPT_ORDER) || !daemon->last_server)
-	    last_server = daemon->servers;
-	  else
-	    last_server = daemon->last_server;
-      
-	  if (!flags && last_server)
+	  if (q->client && n != 0)
 	    {
-	      struct server *firstsendto = NULL;
-	      unsigned int crc = questions_crc(header, (unsigned int)size, daemon->namebuff);
+	      header->id = ((HEADER *)(q->query->data + 2))->id;
+	      buf->len = n + 2;
+	      buf->data[0] = n >> 8;
+	      buf->data[1] = n;
+	      stream_queue(&q->client->stream, buf);
+	      stream_write(&q->client->stream, now);
+	      buf = NULL;
+	    }
 
-	      /* Loop round available servers until we succeed in connecting to one.
-	         Note that this code subtley ensures that consecutive queries on this connection
-	         which can go to the same server, do so. */
-	      while (1) 
-		{
-		  if (!firstsendto)
-		    firstsendto = last_server;
-		  else
-		    {
-		      if (!(last_server = last_server->next))
-			last_server = daemon->servers;
-		      
-		      if (last_server == firstsendto)
-			break;
-		    }
-	      
-		  /* server for wrong domain */
-		  if (type != (last_server->flags & SERV_TYPE) ||
-		      (type == SERV_HAS_DOMAIN && !hostname_isequal(domain, last_server->domain)))
-		    continue;
-		  
-		  if ((last_server->tcpfd == -1) &&
-		      (last_server->tcpfd = socket(last_server->addr.sa.sa_family, SOCK_STREAM, 0)) != -1 &&
-		      (!local_bind(last_server->tcpfd,  &last_server->source_addr, last_server->interface, 1) ||
-		       connect(last_server->tcpfd, &last_server->addr.sa, sa_len(&last_server->addr)) == -1))
-		    {
-		      close(last_server->tcpfd);
-		      last_server->tcpfd = -1;
-		    }
-		  
-		  if (last_server->tcpfd == -1)	
-		    continue;
+	  tcp_query_done(q);
+	  break;
+	}
+  
+  free(buf);
+}
 
-		  c1 = size >> 8;
-		  c2 = size;
-		  
-		  if (!read_write(last_server->tcpfd, &c1, 1, 0) ||
-		      !read_write(last_server->tcpfd, &c2, 1, 0) ||
-		      !read_write(last_server->tcpfd, packet, size, 0) ||
-		      !read_write(last_server->tcpfd, &c1, 1, 1) ||
-		      !read_write(last_server->tcpfd, &c2, 1, 1))
-		    {
-		      close(last_server->tcpfd);
-		      last_server->tcpfd = -1;
-		      continue;
-		    } 
-		  
-		  m = (c1 << 8) | c2;
-		  if (!read_write(last_server->tcpfd, packet, m, 1))
-		    return packet;
-		  
-		  if (!gotname)
-		    strcpy(daemon->namebuff, "query");
-		  if (last_server->addr.sa.sa_family == AF_INET)
-		    log_query(F_SERVER | F_IPV4 | F_FORWARD, daemon->namebuff, 
-			      (struct all_addr *)&last_server->addr.in.sin_addr, NULL); 
-#ifdef HAVE_IPV6
-		  else
-		    log_query(F_SERVER | F_IPV6 | F_FORWARD, daemon->namebuff, 
-			      (struct all_addr *)&last_server->addr.in6.sin6_addr, NULL);
-#endif 
-		  
-		  /* There's no point in updating the cache, since this process will exit and
-		     lose the information after a few queries. We make this call for the alias and 
-		     bogus-nxdomain side-effects. */
-		  /* If the crc of the question section doesn't match the crc we sent, then
-		     someone might be attempting to insert bogus values into the cache by 
-		     sending replies containing questions and bogus answers. */
-		  if (crc == questions_crc(header, (unsigned int)m, daemon->namebuff))
-		    m = process_reply(header, now, last_server, (unsigned int)m);
-		  
-		  break;
-		}
-	    }
+static void tcp_query(struct tcp_client *client, struct tcp_buf *buf, time_t now)
+{
+  HEADER *header = (HEADER *)tcp_packet;
+  size_t size = buf->len - 2, m;
+  unsigned short qtype, gotname;
+  struct tcp_query *q;
+  
+  if (size < sizeof(HEADER))
+    {
+      free(buf);
+      return;
+    }
+  
+  memcpy(tcp_packet, buf->data + 2, size);
+
+  if ((gotname = extract_request(header, size, daemon->namebuff, &qtype)))
+    log_tcp_query(&client->peer, qtype);
+  
+  /* m > 0 if answered from cache */
+  m = answer_request(header, ((char *) header) + 65536, size, 
+		     client->local_addr, client->netmask, now);
+  
+  if (m == 0)
+    {
+      unsigned short flags = 0;
+      struct all_addr *addrp = NULL;
+      int type = 0;
+      char *domain = NULL;
+      
+      if (gotname)
+	flags = search_servers(now, &addrp, gotname, daemon->namebuff, &type, &domain);
+      else
+	strcpy(daemon->namebuff, "query");
+
+      if (!flags && (q = whine_malloc(sizeof(struct tcp_query))))
+	{
+	  q->client = client;
+	  q->query = buf;
+	  q->last = NULL;
+	  q->tried = 0;
+	  q->crc = questions_crc(header, size, daemon->namebuff);
 	  
-	  /* In case of local answer or no connections made. */
-	  if (m == 0)
-	    m = setup_reply(header, (unsigned int)size, addrp, flags, daemon->local_ttl);
+	  if (tcp_forward(q, type, domain, now))
+	    {
+	      client->pending++;
+	      return;
+	    }
+
+	  free(q);
 	}
+      
+      /* In case of local answer or no connections made. */
+      m = setup_reply(header, size, addrp, flags, daemon->local_ttl);
+    }
+  
+  free(buf);
+  tcp_respond(client, tcp_packet, m, now);
+  prefetch_queries(now);
+}
 
-      check_log_writer(NULL);
+void tcp_accept(int confd, struct in_addr local_addr, struct in_addr netmask, time_t now)
+{
+  struct tcp_client *client;
+  socklen_t peer_len = sizeof(union mysockaddr);
+
+  /* Linux doesn't pass the non-blocking attribute of the
+     listening socket on to the connected one. */
+  if (!fix_fd(confd) ||
+      (!tcp_packet && !(tcp_packet = whine_malloc(65536 + MAXDNAME + RRFIXEDSZ))) ||
+      !(client = whine_malloc(sizeof(struct tcp_client))))
+    {
+      shutdown(confd, SHUT_RDWR);
+      close(confd);
+      return;
+    }
+
+  stream_init(&client->stream, confd, now);
+  client->local_addr = local_addr;
+  client->netmask = netmask;
+  client->pending = client->closing = 0;
+  if (getpeername(confd, (struct sockaddr *)&client->peer, &peer_len) == -1)
+    client->peer.sa.sa_family = 0;
+  client->next = daemon->tcp_clients;
+  daemon->tcp_clients = client;
+  daemon->tcp_client_count++;
+}
+
+void set_tcp_listeners(void)
+{
+  struct tcp_client *client;
+  struct tcp_upstream *up;
+  
+  for (client = daemon->tcp_clients; client; client = client->next)
+    {
+      /* stop reading queries from clients which aren't reading answers */
+      if (!client->closing && client->pending + client->stream.out_count < TCP_MAX_QUERIES)
+	poll_listen(client->stream.fd, POLLIN);
+      if (client->stream.out)
+	poll_listen(client->stream.fd, POLLOUT);
+    }
+
+  for (up = daemon->tcp_upstreams; up; up = up->next)
+    {
+      poll_listen(up->stream.fd, POLLIN);
+      if (up->connecting || up->stream.out)
+	poll_listen(up->stream.fd, POLLOUT);
+    }
+}
+
+void check_tcp_listeners(time_t now)
+{
+  struct tcp_client *client, *tmp_client, **cp;
+  struct tcp_upstream *up, *tmp_up;
+  struct tcp_query *q, **qp;
+  struct tcp_buf *buf;
+  int closed, reading;
+
+  /* we overwrite the buffer... */
+  daemon->srv_save = NULL;
+  
+  for (up = daemon->tcp_upstreams; up; up = tmp_up)
+    {
+      tmp_up = up->next;
+      closed = !up->server;
+      
+      if (!closed && up->connecting && poll_check(up->stream.fd, POLLOUT))
+	{
+	  int err;
+	  socklen_t len = sizeof(err);
+	  
+	  if (getsockopt(up->stream.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)
+	    closed = 1;
+	  else
+	    up->connecting = 0;
+	}
+      
+      if (!closed && !up->connecting && poll_check(up->stream.fd, POLLOUT))
+	closed = !stream_write(&up->stream, now);
+      
+      if (!closed && poll_check(up->stream.fd, POLLIN))
+	while ((buf = stream_read(&up->stream, &closed, now)))
+	  tcp_reply(up, buf, now);
+      
+      /* Give up on servers which have gone quiet, and close idle connections. */
+      if (closed || 
+	  (up->queries && difftime(now, up->stream.last_active) >= (float)TIMEOUT) ||
+	  (!up->queries && difftime(now, up->stream.last_active) >= (float)TCP_IDLE))
+	{
+	  tcp_upstream_free(up, now);
+	  continue;
+	}
+      
+      /* The server is still talking, so only the queries it has sat on are 
+	 sent elsewhere; the others keep the connection. Nothing is given up 
+	 while an answer is arriving until we know which query it is for. */
+      if (up->stream.got != 0 && up->stream.got < 4)
+	continue;
+      
+      reading = up->stream.got == 0 ? -1 : (up->stream.in->data[2] << 8) | up->stream.in->data[3];
+      
+      for (qp = &up->queries; (q = *qp); )
+	if (difftime(now, q->sent) >= (float)TIMEOUT && q->id != reading)
+	  {
+	    *qp = q->next;
+	    tcp_retry(q, now);
+	  }
+	else
+	  qp = &q->next;
+    }
+  
+  for (client = daemon->tcp_clients, cp = &daemon->tcp_clients; client; client = tmp_client)
+    {
+      tmp_client = client->next;
+      closed = 0;
+      
+      if (client->stream.out && poll_check(client->stream.fd, POLLOUT))
+	closed = !stream_write(&client->stream, now);
+      
+      if (!closed && poll_check(client->stream.fd, POLLIN))
+	while (!client->closing && client->pending + client->stream.out_count < TCP_MAX_QUERIES &&
+	       (buf = stream_read(&client->stream, &client->closing, now)))
+	  tcp_query(client, buf, now);
+      
+      /* Once the client has finished sending, close when everything is answered.
+	 A client which stops reading its answers times out like an idle one,
+	 otherwise it would hold its connection slot for ever; stream_free()
+	 drops the answers still queued. */
+      if (closed || 
+	  (client->pending == 0 && !client->stream.out && client->closing) ||
+	  ((client->pending == 0 || client->stream.out) &&
+	   difftime(now, client->stream.last_active) >= (float)TCP_IDLE))
+	{
+	  *cp = tmp_client;
+	  tcp_client_free(client);
+	  continue;
+	}
       
-      c1 = m>>8;
-      c2 = m;
-      if (!read_write(confd, &c1, 1, 0) ||
-	  !read_write(confd, &c2, 1, 0) || 
-	  !read_write(confd, packet, m, 0))
-	return packet;
+      cp = &client->next;
     }
 }
 
+/* New records go on the free list. */
 static struct frec *allocate_frec(time_t now)
 {
   struct frec *f;
+  int i;
+
+  if (!frec_id_hash)
+    {
+      /* hash size is a power of two */
+      for (frec_hash_size = 64; frec_hash_size < daemon->ftabsize; frec_hash_size <<= 1);
+      
+      if (!(frec_id_hash = whine_malloc(2 * frec_hash_size * sizeof(struct frec *))))
+	return NULL;
+      
+      frec_sender_hash = frec_id_hash + frec_hash_size;
+      for (i = 0; i < 2 * frec_hash_size; i++)
+	frec_id_hash[i] = NULL;
+    }
   
   if ((f = (struct frec *)whine_malloc(sizeof(struct frec))))
     {
@@ -896,7 +1571,11 @@ static struct frec *allocate_frec(time_t now)
 #ifdef HAVE_IPV6
       f->rfd6 = NULL;
 #endif
+      f->flags = FREC_FREE;
+      f->queue_next = frec_free;
+      frec_free = f;
       daemon->frec_list = f;
+      daemon->frecs_allocated++;
     }
 
   return f;
@@ -938,20 +1617,123 @@ static struct randfd *allocate_rfd(int family)
   return NULL; /* doom */
 }
 
+static struct frec **frec_id_bucket(unsigned short id)
+{
+  return frec_id_hash + (id & (frec_hash_size - 1));
+}
+
+static struct frec **frec_sender_bucket(unsigned short id, union mysockaddr *addr, unsigned int crc)
+{
+  unsigned int val = id ^ crc;
+
+  if (addr->sa.sa_family == AF_INET)
+    val ^= addr->in.sin_addr.s_addr ^ addr->in.sin_port;
+#ifdef HAVE_IPV6
+  else if (addr->sa.sa_family == AF_INET6)
+    {
+      u32 *a = (u32 *)&addr->in6.sin6_addr;
+      val ^= a[0] ^ a[1] ^ a[2] ^ a[3] ^ addr->in6.sin6_port;
+    }
+#endif
+
+  val ^= val >> 16;
+  return frec_sender_hash + (val & (frec_hash_size - 1));
+}
+
+/* Called once the IDs, source and question of a record are filled in. */
+static void activate_frec(struct frec *f)
+{
+  struct frec **up;
+
+  up = frec_id_bucket(f->new_id);
+  if ((f->id_next = *up))
+    (*up)->id_up = &f->id_next;
+  f->id_up = up;
+  *up = f;
+
+  up = frec_sender_bucket(f->orig_id, &f->source, f->crc);
+  if ((f->sender_next = *up))
+    (*up)->sender_up = &f->sender_next;
+  f->sender_up = up;
+  *up = f;
+
+  f->queue_next = NULL;
+  if ((f->queue_prev = frec_newest))
+    frec_newest->queue_next = f;
+  else
+    frec_oldest = f;
+  frec_newest = f;
+
+  f->flags = FREC_ACTIVE;
+  if (++daemon->frecs_outstanding > daemon->frecs_outstanding_max)
+    daemon->frecs_outstanding_max = daemon->frecs_outstanding;
+}
+
 static void free_frec(struct frec *f)
 {
+  if (f->flags & FREC_FREE)
+    return;
+
   if (f->rfd4 && --(f->rfd4->refcount) == 0)
-    close(f->rfd4->fd);
+    {
+      poll_remove(f->rfd4->fd);
+      close(f->rfd4->fd);
+    }
     
   f->rfd4 = NULL;
   f->sentto = NULL;
   
 #ifdef HAVE_IPV6
   if (f->rfd6 && --(f->rfd6->refcount) == 0)
-    close(f->rfd6->fd);
+    {
+      poll_remove(f->rfd6->fd);
+      close(f->rfd6->fd);
+    }
     
   f->rfd6 = NULL;
 #endif
+
+  if (f->flags & FREC_ACTIVE)
+    {
+      if ((*f->id_up = f->id_next))
+	f->id_next->id_up = f->id_up;
+      if ((*f->sender_up = f->sender_next))
+	f->sender_next->sender_up = f->sender_up;
+      
+      if (f->queue_prev)
+	f->queue_prev->queue_next = f->queue_next;
+      else
+	frec_oldest = f->queue_next;
+      if (f->queue_next)
+	f->queue_next->queue_prev = f->queue_prev;
+      else
+	frec_newest = f->queue_prev;
+
+      daemon->frecs_outstanding--;
+    }
+
+  f->flags = FREC_FREE;
+  f->queue_next = frec_free;
+  frec_free = f;
+}
+
+/* Return the record at the head of the free list, and take it off the list
+   unless we're only checking for availability. */
+static struct frec *take_free_frec(time_t now, int *wait)
+{
+  struct frec *f = frec_free;
+
+  if (f)
+    {
+      if (!wait)
+	{
+	  frec_free = f->queue_next;
+	  f->flags = 0;
+	}
+      f->time = now;
+    }
+
+  return f;
 }
 
 /* if wait==NULL return a free or older than TIMEOUT record.
@@ -960,32 +1742,19 @@ static void free_frec(struct frec *f)
    limit of 4*TIMEOUT before we wipe things (for random sockets) */
 struct frec *get_new_frec(time_t now, int *wait)
 {
-  struct frec *f, *oldest, *target;
-  int count;
+  struct frec *oldest;
   
   if (wait)
     *wait = 0;
 
-  for (f = daemon->frec_list, oldest = NULL, target =  NULL, count = 0; f; f = f->next, count++)
-    if (!f->sentto)
-      target = f;
-    else 
-      {
-	if (difftime(now, f->time) >= 4*TIMEOUT)
-	  {
-	    free_frec(f);
-	    target = f;
-	  }
-	
-	if (!oldest || difftime(f->time, oldest->time) <= 0)
-	  oldest = f;
-      }
-
-  if (target)
+  while ((oldest = frec_oldest) && difftime(now, oldest->time) >= 4*TIMEOUT)
     {
-      target->time = now;
-      return target;
+      free_frec(oldest);
+      daemon->frecs_timed_out++;
     }
+
+  if (frec_free)
+    return take_free_frec(now, wait);
   
   /* can't find empty one, use oldest if there is one
      and it's older than timeout */
@@ -994,31 +1763,35 @@ struct frec *get_new_frec(time_t now, int *wait)
       /* keep stuff for twice timeout if we can by allocating a new
 	 record instead */
       if (difftime(now, oldest->time) < 2*TIMEOUT && 
-	  count <= daemon->ftabsize &&
-	  (f = allocate_frec(now)))
-	return f;
+	  (int)daemon->frecs_allocated <= daemon->ftabsize &&
+	  allocate_frec(now))
+	return take_free_frec(now, wait);
 
-      if (!wait)
-	{
-	  free_frec(oldest);
-	  oldest->time = now;
-	}
-      return oldest;
+      if (wait)
+	return oldest;
+      
+      free_frec(oldest);
+      daemon->frecs_timed_out++;
+      return take_free_frec(now, wait);
     }
   
   /* none available, calculate time 'till oldest record expires */
-  if (count > daemon->ftabsize)
+  if ((int)daemon->frecs_allocated > daemon->ftabsize)
     {
       if (oldest && wait)
 	*wait = oldest->time + (time_t)TIMEOUT - now;
       return NULL;
     }
   
-  if (!(f = allocate_frec(now)) && wait)
-    /* wait one second on malloc failure */
-    *wait = 1;
+  if (!allocate_frec(now))
+    {
+      /* wait one second on malloc failure */
+      if (wait)
+	*wait = 1;
+      return NULL;
+    }
 
-  return f; /* OK if malloc fails and this is NULL */
+  return take_free_frec(now, wait);
 }
  
 /* crc is all-ones if not known. */
@@ -1026,7 +1799,10 @@ static struct frec *lookup_frec(unsigned short id, unsigned int crc)
 {
   struct frec *f;
 
-  for(f = daemon->frec_list; f; f = f->next)
+  if (!frec_id_hash)
+    return NULL;
+
+  for (f = *frec_id_bucket(id); f; f = f->id_next)
     if (f->sentto && f->new_id == id && 
 	(f->crc == crc || crc == 0xffffffff))
       return f;
@@ -1040,7 +1816,10 @@ static struct frec *lookup_frec_by_sender(unsigned short id,
 {
   struct frec *f;
   
-  for(f = daemon->frec_list; f; f = f->next)
+  if (!frec_id_hash)
+    return NULL;
+
+  for (f = *frec_sender_bucket(id, addr, crc); f; f = f->sender_next)
     if (f->sentto &&
 	f->orig_id == id && 
 	f->crc == crc &&
@@ -1054,16 +1833,31 @@ static struct frec *lookup_frec_by_sender(unsigned short id,
 void server_gone(struct server *server)
 {
   struct frec *f;
+  struct tcp_upstream *up;
+  struct tcp_query *q;
   
   for (f = daemon->frec_list; f; f = f->next)
     if (f->sentto && f->sentto == server)
       free_frec(f);
   
+  /* TCP connections to the server are closed, and their queries retried,
+     by check_tcp_listeners() */
+  for (up = daemon->tcp_upstreams; up; up = up->next)
+    if (up->server == server)
+      {
+	up->server = NULL;
+	for (q = up->queries; q; q = q->next)
+	  q->last = NULL;
+      }
+  
   if (daemon->last_server == server)
     daemon->last_server = NULL;
 
   if (daemon->srv_save == server)
     daemon->srv_save = NULL;
+
+  /* the index is rebuilt by check_servers() */
+  free_server_domains();
 }
 
 /* return unique random ids.
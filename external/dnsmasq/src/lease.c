@@ -21,12 +21,142 @@
 static struct dhcp_lease *leases = NULL, *old_leases = NULL;
 static int dns_dirty, file_dirty, leases_left;
 
+/* Leases are hashed by address and by hardware address and client-id,
+   each context has a bitmap of the leased addresses in its range. */
+static struct dhcp_lease **addr_hash, **hw_hash, **clid_hash;
+static unsigned int lease_hash_mask;
+
+/* The leasefile is a journal: changed leases are appended and
+   deleted ones recorded as "- <address>", last record wins. It is
+   compacted by rewriting it when it grows much larger than the
+   set of leases. */
+static struct in_addr *dead_addrs;
+static int dead_count, dead_max, journal_lines, compact;
+
+static unsigned int hash_bytes(unsigned char *p, int len, int type)
+{
+  unsigned int val = type;
+
+  while (len-- > 0)
+    val = (val << 5) + val + *p++;
+
+  return val & lease_hash_mask;
+}
+
+static struct dhcp_lease **addr_bucket(struct in_addr addr)
+{
+  return &addr_hash[ntohl(addr.s_addr) & lease_hash_mask];
+}
+
+static void mark_addr(struct in_addr addr, int used)
+{
+  struct dhcp_context *context;
+  unsigned int a = ntohl(addr.s_addr), off;
+
+  for (context = daemon->dhcp; context; context = context->next)
+    if (context->used && 
+	a >= ntohl(context->start.s_addr) && a <= ntohl(context->end.s_addr))
+      {
+	off = a - ntohl(context->start.s_addr);
+	if (used)
+	  context->used[off / 32] |= 1u << (off & 31);
+	else
+	  context->used[off / 32] &= ~(1u << (off & 31));
+      }
+}
+
+static void hash_client(struct dhcp_lease *lease)
+{
+  struct dhcp_lease **up;
+
+  /* hwaddr_len is out of range until lease_set_hwaddr is called */
+  if (lease->hwaddr_len <= DHCP_CHADDR_MAX)
+    {
+      up = &hw_hash[hash_bytes(lease->hwaddr, lease->hwaddr_len, lease->hwaddr_type)];
+      lease->hw_next = *up;
+      *up = lease;
+    }
+
+  if (lease->clid && lease->clid_len != 0)
+    {
+      up = &clid_hash[hash_bytes(lease->clid, lease->clid_len, 0)];
+      lease->clid_next = *up;
+      *up = lease;
+    }
+}
+
+static void unhash_client(struct dhcp_lease *lease)
+{
+  struct dhcp_lease **up;
+
+  if (lease->hwaddr_len <= DHCP_CHADDR_MAX)
+    for (up = &hw_hash[hash_bytes(lease->hwaddr, lease->hwaddr_len, lease->hwaddr_type)]; *up; up = &(*up)->hw_next)
+      if (*up == lease)
+	{
+	  *up = lease->hw_next;
+	  break;
+	}
+
+  if (lease->clid && lease->clid_len != 0)
+    for (up = &clid_hash[hash_bytes(lease->clid, lease->clid_len, 0)]; *up; up = &(*up)->clid_next)
+      if (*up == lease)
+	{
+	  *up = lease->clid_next;
+	  break;
+	}
+}
+
+static void unhash_lease(struct dhcp_lease *lease)
+{
+  struct dhcp_lease **up;
+  
+  for (up = addr_bucket(lease->addr); *up; up = &(*up)->addr_next)
+    if (*up == lease)
+      {
+	*up = lease->addr_next;
+	break;
+      }
+
+  unhash_client(lease);
+  mark_addr(lease->addr, 0);
+}
+
+static void lease_dead(struct in_addr addr)
+{
+  if (!daemon->lease_stream || compact)
+    return;
+
+  if (dead_count == dead_max)
+    {
+      struct in_addr *new;
+      
+      if (!(new = whine_malloc((dead_max + 16) * 2 * sizeof(struct in_addr))))
+	{
+	  /* can't journal it, rewrite the whole file instead. */
+	  compact = 1;
+	  return;
+	}
+      
+      if (dead_addrs)
+	{
+	  memcpy(new, dead_addrs, dead_count * sizeof(struct in_addr));
+	  free(dead_addrs);
+	}
+      dead_addrs = new;
+      dead_max = (dead_max + 16) * 2;
+    }
+  
+  dead_addrs[dead_count++] = addr;
+}
+
 void lease_init(time_t now)
 {
   unsigned long ei;
   struct in_addr addr;
-  struct dhcp_lease *lease;
+  struct dhcp_lease *lease, *tmp, **up;
+  struct dhcp_context *context;
   int clid_len, hw_len, hw_type;
+  unsigned int size;
   FILE *leasestream;
   
   /* These two each hold a DHCP option max size 255
@@ -36,6 +166,24 @@ void lease_init(time_t now)
   
   leases_left = daemon->dhcp_max;
 
+  for (size = 64; size < (unsigned int)daemon->dhcp_max && size < 65536; size <<= 1);
+  lease_hash_mask = size - 1;
+  addr_hash = safe_malloc(size * sizeof(struct dhcp_lease *));
+  hw_hash = safe_malloc(size * sizeof(struct dhcp_lease *));
+  clid_hash = safe_malloc(size * sizeof(struct dhcp_lease *));
+  memset(addr_hash, 0, size * sizeof(struct dhcp_lease *));
+  memset(hw_hash, 0, size * sizeof(struct dhcp_lease *));
+  memset(clid_hash, 0, size * sizeof(struct dhcp_lease *));
+
+  for (context = daemon->dhcp; context; context = context->next)
+    if (!(context->flags & (CONTEXT_STATIC | CONTEXT_PROXY)) &&
+	ntohl(context->end.s_addr) >= ntohl(context->start.s_addr))
+      {
+	size = ((ntohl(context->end.s_addr) - ntohl(context->start.s_addr)) / 32) + 1;
+	context->used = safe_malloc(size * sizeof(unsigned int));
+	memset(context->used, 0, size * sizeof(unsigned int));
+      }
+
   if (daemon->options & OPT_LEASE_RO)
     {
       /* run "<lease_change_script> init" once to get the
@@ -72,10 +220,33 @@ void lease_init(time_t now)
   /* client-id max length is 255 which is 255*2 digits + 254 colons 
      borrow DNS packet buffer which is always larger than 1000 bytes */
   if (leasestream)
-    while (fscanf(leasestream, "%lu %255s %16s %255s %764s",
-		  &ei, daemon->dhcp_buff2, daemon->namebuff, 
-		  daemon->dhcp_buff, daemon->packet) == 5)
+    while (fscanf(leasestream, "%255s", daemon->dhcp_buff2) == 1)
       {
+	journal_lines++;
+
+	/* journalled deletion: mark dead and free below, so that
+	   deleted leases don't reach the script. */
+	if (strcmp(daemon->dhcp_buff2, "-") == 0)
+	  {
+	    if (fscanf(leasestream, "%16s", daemon->namebuff) != 1)
+	      break;
+	    addr.s_addr = inet_addr(daemon->namebuff);
+	    if ((lease = lease_find_by_addr(addr)))
+	      {
+		unhash_lease(lease);
+		lease->addr.s_addr = 0;
+		leases_left++;
+	      }
+	    continue;
+	  }
+
+	ei = strtoul(daemon->dhcp_buff2, NULL, 10);
+	
+	if (fscanf(leasestream, "%255s %16s %255s %764s",
+		   daemon->dhcp_buff2, daemon->namebuff, 
+		   daemon->dhcp_buff, daemon->packet) != 4)
+	  break;
+
 	hw_len = parse_hex(daemon->dhcp_buff2, (unsigned char *)daemon->dhcp_buff2, DHCP_CHADDR_MAX, NULL, &hw_type);
 	/* For backwards compatibility, no explict MAC address type means ether. */
 	if (hw_type == 0 && hw_len != 0)
@@ -88,7 +259,21 @@ void lease_init(time_t now)
 	if (strcmp(daemon->packet, "*") != 0)
 	  clid_len = parse_hex(daemon->packet, (unsigned char *)daemon->packet, 255, NULL, NULL);
 	
-	if (!(lease = lease_allocate(addr)))
+	/* A later record for an address replaces the earlier one. */
+	if ((lease = lease_find_by_addr(addr)))
+	  {
+	    if (clid_len == 0 && lease->clid)
+	      {
+		unhash_client(lease);
+		free(lease->clid);
+		lease->clid = NULL;
+		lease->clid_len = 0;
+		hash_client(lease);
+	      }
+	    if (strcmp(daemon->dhcp_buff, "*") == 0)
+	      lease_set_hostname(lease, NULL, 0);
+	  }
+	else if (!(lease = lease_allocate(addr)))
 	  die (_("too many stored leases"), NULL, EC_MISC);
        	
 #ifdef HAVE_BROKEN_RTC
@@ -110,8 +295,26 @@ void lease_init(time_t now)
 
 	/* set these correctly: the "old" events are generated later from
 	   the startup synthesised SIGHUP. */
-	lease->new = lease->changed = 0;
+	lease->new = lease->changed = lease->unsaved = 0;
+	free(lease->old_hostname);
+	lease->old_hostname = NULL;
       }
+
+  for (lease = leases, up = &leases; lease; lease = tmp)
+    {
+      tmp = lease->next;
+      if (lease->addr.s_addr == 0)
+	{
+	  *up = lease->next;
+	  free(lease->hostname);
+	  free(lease->fqdn);
+	  free(lease->old_hostname);
+	  free(lease->clid);
+	  free(lease);
+	}
+      else
+	up = &lease->next;
+    }
   
 #ifdef HAVE_SCRIPT
   if (!daemon->lease_stream)
@@ -140,6 +343,10 @@ void lease_init(time_t now)
   file_dirty = 0;
   lease_prune(NULL, now);
   dns_dirty = 1;
+
+  /* compact the journal at the first write. */
+  if (daemon->lease_stream && journal_lines != daemon->dhcp_max - leases_left)
+    compact = file_dirty = 1;
 }
 
 void lease_update_from_configs(void)
@@ -170,6 +377,37 @@ static void ourprintf(int *errp, char *format, ...)
   va_end(ap);
 }
 
+static void write_lease(int *errp, struct dhcp_lease *lease)
+{
+  int i;
+
+#ifdef HAVE_BROKEN_RTC
+  ourprintf(errp, "%u ", lease->length);
+#else
+  ourprintf(errp, "%lu ", (unsigned long)lease->expires);
+#endif
+  if (lease->hwaddr_type != ARPHRD_ETHER || lease->hwaddr_len == 0) 
+    ourprintf(errp, "%.2x-", lease->hwaddr_type);
+  for (i = 0; i < lease->hwaddr_len; i++)
+    {
+      ourprintf(errp, "%.2x", lease->hwaddr[i]);
+      if (i != lease->hwaddr_len - 1)
+	ourprintf(errp, ":");
+    }
+  
+  ourprintf(errp, " %s ", inet_ntoa(lease->addr));
+  ourprintf(errp, "%s ", lease->hostname ? lease->hostname : "*");
+  
+  if (lease->clid && lease->clid_len != 0)
+    {
+      for (i = 0; i < lease->clid_len - 1; i++)
+	ourprintf(errp, "%.2x:", lease->clid[i]);
+      ourprintf(errp, "%.2x\n", lease->clid[i]);
+    }
+  else
+    ourprintf(errp, "*\n");	  
+}
+
 void lease_update_file(time_t now)
 {
   struct dhcp_lease *lease;
@@ -179,45 +417,45 @@ void lease_update_file(time_t now)
   if (file_dirty != 0 && daemon->lease_stream)
     {
       errno = 0;
-      rewind(daemon->lease_stream);
-      if (errno != 0 || ftruncate(fileno(daemon->lease_stream), 0) != 0)
-	err = errno;
-      
-      for (lease = leases; lease; lease = lease->next)
-	{
-#ifdef HAVE_BROKEN_RTC
-	  ourprintf(&err, "%u ", lease->length);
-#else
-	  ourprintf(&err, "%lu ", (unsigned long)lease->expires);
-#endif
-	  if (lease->hwaddr_type != ARPHRD_ETHER || lease->hwaddr_len == 0) 
-	    ourprintf(&err, "%.2x-", lease->hwaddr_type);
-	  for (i = 0; i < lease->hwaddr_len; i++)
-	    {
-	      ourprintf(&err, "%.2x", lease->hwaddr[i]);
-	      if (i != lease->hwaddr_len - 1)
-		ourprintf(&err, ":");
-	    }
 
-	  ourprintf(&err, " %s ", inet_ntoa(lease->addr));
-	  ourprintf(&err, "%s ", lease->hostname ? lease->hostname : "*");
-	  	  
-	  if (lease->clid && lease->clid_len != 0)
-	    {
-	      for (i = 0; i < lease->clid_len - 1; i++)
-		ourprintf(&err, "%.2x:", lease->clid[i]);
-	      ourprintf(&err, "%.2x\n", lease->clid[i]);
-	    }
-	  else
-	    ourprintf(&err, "*\n");	  
+      if (compact || journal_lines > 2 * (daemon->dhcp_max - leases_left) + LEASE_JOURNAL)
+	{
+	  rewind(daemon->lease_stream);
+	  if (errno != 0 || ftruncate(fileno(daemon->lease_stream), 0) != 0)
+	    err = errno;
+	  
+	  for (journal_lines = 0, lease = leases; lease; lease = lease->next, journal_lines++)
+	    write_lease(&err, lease);
+	}
+      else
+	{
+	  /* append only what changed, deletions first, since a
+	     pruned address may have been leased again. */
+	  for (i = 0; i < dead_count; i++, journal_lines++)
+	    ourprintf(&err, "- %s\n", inet_ntoa(dead_addrs[i]));
+	  
+	  for (lease = leases; lease; lease = lease->next)
+	    if (lease->unsaved)
+	      {
+		write_lease(&err, lease);
+		journal_lines++;
+	      }
 	}
       
       if (fflush(daemon->lease_stream) != 0 ||
 	  fsync(fileno(daemon->lease_stream)) < 0)
 	err = errno;
       
-      if (!err)
-	file_dirty = 0;
+      /* After a failure the file may end with a partial record, 
+	 so the retry rewrites it in full. */
+      if (err)
+	compact = 1;
+      else
+	{
+	  file_dirty = compact = dead_count = 0;
+	  for (lease = leases; lease; lease = lease->next)
+	    lease->unsaved = 0;
+	}
     }
   
   /* Set alarm for when the first lease expires + slop. */
@@ -275,6 +513,8 @@ void lease_prune(struct dhcp_lease *target, time_t now)
 	    dns_dirty = 1;
 	  
 	  *up = lease->next; /* unlink */
+	  unhash_lease(lease);
+	  lease_dead(lease->addr);
 	  
 	  /* Put on old_leases list 'till we
 	     can run the script */
@@ -295,12 +535,12 @@ struct dhcp_lease *lease_find_by_client(unsigned char *hwaddr, int hw_len, int h
   struct dhcp_lease *lease;
 
   if (clid)
-    for (lease = leases; lease; lease = lease->next)
+    for (lease = clid_hash[hash_bytes(clid, clid_len, 0)]; lease; lease = lease->clid_next)
       if (lease->clid && clid_len == lease->clid_len &&
 	  memcmp(clid, lease->clid, clid_len) == 0)
 	return lease;
   
-  for (lease = leases; lease; lease = lease->next)	
+  for (lease = hw_hash[hash_bytes(hwaddr, hw_len, hw_type)]; lease; lease = lease->hw_next)	
     if ((!lease->clid || !clid) && 
 	hw_len != 0 && 
 	lease->hwaddr_len == hw_len &&
@@ -315,7 +555,7 @@ struct dhcp_lease *lease_find_by_addr(struct in_addr addr)
 {
   struct dhcp_lease *lease;
 
-  for (lease = leases; lease; lease = lease->next)
+  for (lease = *addr_bucket(addr); lease; lease = lease->addr_next)
     if (lease->addr.s_addr == addr.s_addr)
       return lease;
   
@@ -339,8 +579,11 @@ struct dhcp_lease *lease_allocate(struct in_addr addr)
 #endif
   lease->next = leases;
   leases = lease;
+  lease->addr_next = *addr_bucket(addr);
+  *addr_bucket(addr) = lease;
+  mark_addr(addr, 1);
   
-  file_dirty = 1;
+  lease->unsaved = file_dirty = 1;
   leases_left--;
 
   return lease;
@@ -361,7 +604,7 @@ void lease_set_expires(struct dhcp_lease *lease, unsigned int len, time_t now)
       dns_dirty = 1;
       lease->expires = exp;
 #ifndef HAVE_BROKEN_RTC
-      lease->aux_changed = file_dirty = 1;
+      lease->aux_changed = lease->unsaved = file_dirty = 1;
 #endif
     }
   
@@ -369,7 +612,7 @@ void lease_set_expires(struct dhcp_lease *lease, unsigned int len, time_t now)
   if (len != lease->length)
     {
       lease->length = len;
-      lease->aux_changed = file_dirty = 1; 
+      lease->aux_changed = lease->unsaved = file_dirty = 1; 
     }
 #endif
 } 
@@ -377,6 +620,8 @@ void lease_set_expires(struct dhcp_lease *lease, unsigned int len, time_t now)
 void lease_set_hwaddr(struct dhcp_lease *lease, unsigned char *hwaddr,
 		      unsigned char *clid, int hw_len, int hw_type, int clid_len)
 {
+  unhash_client(lease);
+
   if (hw_len != lease->hwaddr_len ||
       hw_type != lease->hwaddr_type || 
       (hw_len != 0 && memcmp(lease->hwaddr, hwaddr, hw_len) != 0))
@@ -384,7 +629,7 @@ void lease_set_hwaddr(struct dhcp_lease *lease, unsigned char *hwaddr,
       memcpy(lease->hwaddr, hwaddr, hw_len);
       lease->hwaddr_len = hw_len;
       lease->hwaddr_type = hw_type;
-      lease->changed = file_dirty = 1; /* run script on change */
+      lease->changed = lease->unsaved = file_dirty = 1; /* run script on change */
     }
 
   /* only update clid when one is available, stops packets
@@ -397,18 +642,21 @@ void lease_set_hwaddr(struct dhcp_lease *lease, unsigned char *hwaddr,
 
       if (lease->clid_len != clid_len)
 	{
-	  lease->aux_changed = file_dirty = 1;
+	  lease->aux_changed = lease->unsaved = file_dirty = 1;
 	  free(lease->clid);
-	  if (!(lease->clid = whine_malloc(clid_len)))
-	    return;
+	  lease->clid = whine_malloc(clid_len);
 	}
       else if (memcmp(lease->clid, clid, clid_len) != 0)
-	lease->aux_changed = file_dirty = 1;
+	lease->aux_changed = lease->unsaved = file_dirty = 1;
 	  
-      lease->clid_len = clid_len;
-      memcpy(lease->clid, clid, clid_len);
+      if (lease->clid)
+	{
+	  lease->clid_len = clid_len;
+	  memcpy(lease->clid, clid, clid_len);
+	}
     }
 
+  hash_client(lease);
 }
 
 static void kill_name(struct dhcp_lease *lease)
@@ -488,6 +736,7 @@ void lease_set_hostname(struct dhcp_lease *lease, char *name, int auth)
 	    }
 	
 	  kill_name(lease_tmp);
+	  lease_tmp->unsaved = 1;
 	  break;
 	}
     }
@@ -501,7 +750,7 @@ void lease_set_hostname(struct dhcp_lease *lease, char *name, int auth)
   
   file_dirty = 1;
   dns_dirty = 1; 
-  lease->changed = 1; /* run script on change */
+  lease->changed = lease->unsaved = 1; /* run script on change */
 }
 
 void lease_set_interface(struct dhcp_lease *lease, int interface)
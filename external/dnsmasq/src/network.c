@@ -735,6 +735,7 @@ void check_servers(void)
     }
   
   daemon->servers = ret;
+  index_server_domains();
 }
 
 #ifdef __ANDROID__
@@ -102,6 +102,9 @@ struct myoption {
 #define LOPT_PXE_PROMT 291
 #define LOPT_PXE_SERV  292
 #define LOPT_TEST      293
+#define LOPT_PREFETCH  294
+#define LOPT_STALE     295
+#define LOPT_CACHEFILE 296
 
 #ifdef HAVE_GETOPT_LONG
 static const struct option opts[] =  
@@ -209,6 +212,9 @@ static const struct myoption opts[] =
     { "pxe-prompt", 1, 0, LOPT_PXE_PROMT },
     { "pxe-service", 1, 0, LOPT_PXE_SERV },
     { "test", 0, 0, LOPT_TEST },
+    { "prefetch", 2, 0, LOPT_PREFETCH },
+    { "serve-stale", 2, 0, LOPT_STALE },
+    { "cache-file", 1, 0, LOPT_CACHEFILE },
     { NULL, 0, 0, 0 }
   };
 
@@ -323,6 +329,9 @@ static struct {
   { LOPT_PXE_PROMT, ARG_DUP, "<prompt>,[<timeout>]", gettext_noop("Prompt to send to PXE clients."), NULL },
   { LOPT_PXE_SERV, ARG_DUP, "<service>", gettext_noop("Boot service for PXE menu."), NULL },
   { LOPT_TEST, 0, NULL, gettext_noop("Check configuration syntax."), NULL },
+  { LOPT_PREFETCH, ARG_ONE, "[=<hits>]", gettext_noop("Refresh cached names used this often before they expire."), NULL },
+  { LOPT_STALE, ARG_ONE, "[=<time>]", gettext_noop("Answer from expired cache entries while refreshing them."), NULL },
+  { LOPT_CACHEFILE, ARG_ONE, "<path>", gettext_noop("Keep the DNS cache in this file across restarts."), NULL },
   { 0, 0, NULL, NULL, NULL }
 }; 
 
@@ -1590,6 +1599,18 @@ static char *one_opt(int option, char *arg, char *gen_prob, int nest)
 	  daemon->local_ttl = (unsigned long)ttl;
 	break;
       }
+
+    case LOPT_PREFETCH: /* --prefetch */
+      daemon->prefetch = PREFETCH_HITS; /* default */
+      if (arg && (!atoi_check(arg, &daemon->prefetch) || daemon->prefetch < 1))
+	option = '?';
+      break;
+
+    case LOPT_STALE: /* --serve-stale */
+      daemon->stale_time = STALE_TIME; /* default */
+      if (arg && (!atoi_check(arg, &daemon->stale_time) || daemon->stale_time < 1))
+	option = '?';
+      break;
       
 #ifdef HAVE_DHCP
     case 'X': /* --dhcp-lease-max */
@@ -1604,6 +1625,10 @@ static char *one_opt(int option, char *arg, char *gen_prob, int nest)
 	option = '?';
       break;  
 
+    case LOPT_CACHEFILE: /* --cache-file */
+      daemon->cache_file = opt_string_alloc(arg);
+      break;
+
     case LOPT_PREFIX: /* --tftp-prefix */
       daemon->tftp_prefix = opt_string_alloc(arg);
       break;
@@ -1668,6 +1693,7 @@ static char *one_opt(int option, char *arg, char *gen_prob, int nest)
 	new->router.s_addr = 0;
 	new->netid.net = NULL;
 	new->filter = NULL;
+	new->used = NULL;
 	new->flags = 0;
 	
 	gen_prob = _("bad dhcp-range");
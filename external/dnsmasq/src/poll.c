@@ -0,0 +1,412 @@
+/* dnsmasq is Copyright (c) 2000-2009 Simon Kelley
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; version 2 dated June, 1991, or
+   (at your option) version 3 dated 29 June, 2007.
+ 
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+     
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "dnsmasq.h"
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+/* Each time around the main loop, the set_* functions call poll_listen() for 
+   the fds they are interested in, do_poll() waits, and the check_* functions 
+   call poll_check(). With epoll, fds stay registered with the kernel between
+   calls, and only changes in what is wanted cost a system call, so a wakeup 
+   doesn't cost time proportional to the number of sockets open. 
+   If epoll is not available, select() is used instead. */
+
+struct pollwatch {
+  short want, registered, revents;
+};
+
+static struct pollwatch *watches = NULL;
+static int watches_size = 0;
+
+/* fds passed to poll_listen() since the last poll_reset(), and before that. */
+static int *listening = NULL, *last_listening = NULL;
+static int listen_count = 0, last_count = 0, listen_size = 0;
+
+#ifdef HAVE_EPOLL
+static int epoll_fd = -1, epoll_failed = 0;
+static struct epoll_event *epoll_events = NULL;
+static int epoll_events_size = 0;
+#endif
+
+static struct pollwatch *get_watch(int fd)
+{
+  if (fd < 0)
+    return NULL;
+  
+  if (fd >= watches_size)
+    {
+      int i, new_size = watches_size == 0 ? 64 : watches_size;
+      struct pollwatch *new;
+
+      while (new_size <= fd)
+	new_size <<= 1;
+
+      if (!(new = whine_malloc(new_size * sizeof(struct pollwatch))))
+	return NULL;
+
+      if (watches)
+	{
+	  memcpy(new, watches, watches_size * sizeof(struct pollwatch));
+	  free(watches);
+	}
+
+      for (i = watches_size; i < new_size; i++)
+	new[i].want = new[i].registered = new[i].revents = 0;
+      
+      watches = new;
+      watches_size = new_size;
+    }
+
+  return &watches[fd];
+}
+
+void poll_reset(void)
+{
+  int i, *tmp;
+  
+  for (i = 0; i < listen_count; i++)
+    watches[listening[i]].want = watches[listening[i]].revents = 0;
+
+  /* keep the old list so that do_poll() can drop fds which are no longer wanted. */
+  tmp = last_listening;
+  last_listening = listening;
+  listening = tmp;
+  last_count = listen_count;
+  listen_count = 0;
+}
+
+void poll_listen(int fd, short event)
+{
+  struct pollwatch *w = get_watch(fd);
+
+  if (!w)
+    return;
+
+  if (w->want == 0)
+    {
+      if (listen_count == listen_size)
+	{
+	  int new_size = listen_size == 0 ? 64 : listen_size << 1;
+	  int *new, *new_last;
+	  
+	  if (!(new = whine_malloc(new_size * sizeof(int))))
+	    return;
+	  if (!(new_last = whine_malloc(new_size * sizeof(int))))
+	    {
+	      free(new);
+	      return;
+	    }
+	  
+	  if (listening)
+	    {
+	      memcpy(new, listening, listen_count * sizeof(int));
+	      memcpy(new_last, last_listening, last_count * sizeof(int));
+	      free(listening);
+	      free(last_listening);
+	    }
+	  
+	  listening = new;
+	  last_listening = new_last;
+	  listen_size = new_size;
+	}
+
+      listening[listen_count++] = fd;
+    }
+
+  w->want |= event;
+}
+
+int poll_check(int fd, short event)
+{
+  return fd >= 0 && fd < watches_size && (watches[fd].revents & event);
+}
+
+/* Must be called before closing an fd which was passed to poll_listen(). A 
+   TCP child may still hold a copy of it, in which case the kernel would keep 
+   it registered after the close. */
+void poll_remove(int fd)
+{
+  if (fd < 0 || fd >= watches_size)
+    return;
+
+#ifdef HAVE_EPOLL
+  if (watches[fd].registered && epoll_fd != -1)
+    {
+      struct epoll_event ev;
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+    }
+#endif
+
+  watches[fd].want = watches[fd].registered = watches[fd].revents = 0;
+}
+
+/* icmp_ping() waits for its reply from inside the check phase of the main 
+   loop. It saves the main loop's poll results first and puts them back when 
+   it has finished, so that the check functions which run after it see the 
+   main loop's results rather than its own. */
+struct pollsaved {
+  int fd;
+  short want, revents;
+};
+
+static struct pollsaved *saved = NULL;
+static int saved_count = 0, saved_size = 0;
+
+int poll_save(void)
+{
+  int i;
+
+  if (saved_size < listen_count)
+    {
+      struct pollsaved *new;
+      int new_size = saved_size == 0 ? 64 : saved_size;
+
+      while (new_size < listen_count)
+	new_size <<= 1;
+
+      if (!(new = whine_malloc(new_size * sizeof(struct pollsaved))))
+	return 0;
+
+      free(saved);
+      saved = new;
+      saved_size = new_size;
+    }
+
+  for (i = 0; i < listen_count; i++)
+    {
+      saved[i].fd = listening[i];
+      saved[i].want = watches[listening[i]].want;
+      saved[i].revents = watches[listening[i]].revents;
+    }
+  saved_count = listen_count;
+
+  return 1;
+}
+
+void poll_restore(void)
+{
+  int i;
+
+  poll_reset();
+  
+  for (i = 0; i < saved_count; i++)
+    {
+      poll_listen(saved[i].fd, saved[i].want);
+      if (saved[i].fd < watches_size)
+	watches[saved[i].fd].revents = saved[i].revents;
+    }
+}
+
+static int do_select(int timeout)
+{
+  fd_set rset, wset, eset;
+  struct timeval t, *tp = NULL;
+  int i, fd, maxfd = -1, ret;
+  
+  FD_ZERO(&rset);
+  FD_ZERO(&wset);
+  FD_ZERO(&eset);
+  
+  for (i = 0; i < listen_count; i++)
+    {
+      fd = listening[i];
+
+#ifdef FD_SETSIZE
+      if (fd >= FD_SETSIZE)
+	continue;
+#endif
+      
+      if (watches[fd].want & POLLIN)
+	FD_SET(fd, &rset);
+      if (watches[fd].want & POLLOUT)
+	FD_SET(fd, &wset);
+      if (watches[fd].want & POLLERR)
+	FD_SET(fd, &eset);
+      bump_maxfd(fd, &maxfd);
+    }
+
+  if (timeout >= 0)
+    {
+      t.tv_sec = timeout / 1000;
+      t.tv_usec = (timeout % 1000) * 1000;
+      tp = &t;
+    }
+  
+  if ((ret = select(maxfd+1, &rset, &wset, &eset, tp)) <= 0)
+    return ret;
+  
+  for (i = 0; i < listen_count; i++)
+    {
+      fd = listening[i];
+      
+#ifdef FD_SETSIZE
+      if (fd >= FD_SETSIZE)
+	continue;
+#endif
+
+      if (FD_ISSET(fd, &rset))
+	watches[fd].revents |= POLLIN;
+      if (FD_ISSET(fd, &wset))
+	watches[fd].revents |= POLLOUT;
+      if (FD_ISSET(fd, &eset))
+	watches[fd].revents |= POLLERR;
+    }
+
+  return ret;
+}
+
+#ifdef HAVE_EPOLL
+static int epoll_update(int fd, struct pollwatch *w)
+{
+  struct epoll_event ev;
+  int op = w->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  
+  ev.events = 0;
+  if (w->want & POLLIN)
+    ev.events |= EPOLLIN;
+  if (w->want & POLLOUT)
+    ev.events |= EPOLLOUT;
+  ev.data.fd = fd;
+
+  /* Our idea of what's registered is out of date if the fd has been closed 
+     and the number re-used. */
+  if (epoll_ctl(epoll_fd, op, fd, &ev) == -1 &&
+      (errno != (op == EPOLL_CTL_MOD ? ENOENT : EEXIST) ||
+       epoll_ctl(epoll_fd, op == EPOLL_CTL_MOD ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) == -1))
+    return 0;
+
+  w->registered = w->want;
+  return 1;
+}
+
+static int do_epoll(int timeout)
+{
+  int i, fd, n, always = 0;
+  struct pollwatch *w;
+  
+  /* Stop listening on fds which were wanted last time and aren't now. */
+  for (i = 0; i < last_count; i++)
+    {
+      w = &watches[fd = last_listening[i]];
+      if (w->want == 0 && w->registered)
+	{
+	  struct epoll_event ev;
+	  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+	  w->registered = 0;
+	}
+    }
+
+  for (i = 0; i < listen_count; i++)
+    {
+      w = &watches[fd = listening[i]];
+      
+      /* epoll refuses regular files, which are always ready. */
+      if (w->registered != w->want && !epoll_update(fd, w))
+	{
+	  if (errno != EPERM)
+	    return -1;
+	  w->revents = w->want & (POLLIN | POLLOUT);
+	  always = 1;
+	}
+    }
+
+  if (epoll_events_size < listen_count)
+    {
+      struct epoll_event *new;
+      int new_size = epoll_events_size == 0 ? 64 : epoll_events_size;
+
+      while (new_size < listen_count)
+	new_size <<= 1;
+      
+      if ((new = whine_malloc(new_size * sizeof(struct epoll_event))))
+	{
+	  free(epoll_events);
+	  epoll_events = new;
+	  epoll_events_size = new_size;
+	}
+    }
+  
+  if ((n = epoll_wait(epoll_fd, epoll_events, epoll_events_size, always ? 0 : timeout)) < 0)
+    return n;
+
+  for (i = 0; i < n; i++)
+    {
+      fd = epoll_events[i].data.fd;
+      if (fd >= watches_size || (w = &watches[fd])->want == 0)
+	continue;
+
+      /* as with select(), errors make the fd readable or writable */
+      if (epoll_events[i].events & (EPOLLERR | EPOLLHUP))
+	w->revents |= w->want;
+      if (epoll_events[i].events & EPOLLIN)
+	w->revents |= POLLIN;
+      if (epoll_events[i].events & EPOLLOUT)
+	w->revents |= POLLOUT;
+    }
+
+  return always ? n + 1 : n;
+}
+#endif
+
+/* Returns zero if select() is in use, so only fds below FD_SETSIZE can be 
+   waited for. */
+int poll_init(void)
+{
+#ifdef HAVE_EPOLL
+  if (epoll_fd == -1 && !epoll_failed)
+    {
+      /* children, including the script helper, mustn't inherit it */
+      if ((epoll_fd = epoll_create(64)) == -1 || !fix_fd(epoll_fd) ||
+	  fcntl(epoll_fd, F_SETFD, FD_CLOEXEC) == -1)
+	{
+	  if (epoll_fd != -1)
+	    close(epoll_fd);
+	  epoll_fd = -1;
+	  epoll_failed = 1;
+	  my_syslog(LOG_WARNING, _("cannot use epoll, falling back to select: %s"), strerror(errno));
+	}
+    }
+
+  return epoll_fd != -1;
+#else
+  return 0;
+#endif
+}
+
+/* Wait for up to timeout milliseconds, or forever if timeout is negative. */
+int do_poll(int timeout)
+{
+#ifdef HAVE_EPOLL
+  if (poll_init())
+    {
+      int ret = do_epoll(timeout);
+      
+      if (ret != -1 || errno == EINTR)
+	return ret;
+      
+      /* Something unexpected from epoll_ctl, carry on with select() */
+      my_syslog(LOG_WARNING, _("cannot use epoll, falling back to select: %s"), strerror(errno));
+      close(epoll_fd);
+      epoll_fd = -1;
+      epoll_failed = 1;
+    }
+#endif
+
+  return do_select(timeout);
+}
@@ -1120,6 +1120,10 @@ static unsigned long crec_ttl(struct crec *crecp, time_t now)
   if  (crecp->flags & (F_IMMORTAL | F_DHCP))
     return daemon->local_ttl;
   
+  /* expired, answered under --serve-stale */
+  if (difftime(crecp->ttd, now) <= 0)
+    return STALE_TTL;
+
   return crecp->ttd - now;
 }
   
@@ -1374,6 +1378,9 @@ size_t answer_request(HEADER *header, char *limit, size_t qlen,
 		{
 		  int localise = 0;
 		  
+		  if (!dryrun)
+		    cache_hit(crecp, type, now);
+
 		  /* See if a putative address is on the network from which we recieved
 		     the query, is so we'll filter other answers. */
 		  if (local_addr.s_addr != 0 && (daemon->options & OPT_LOCALISE) && flag == F_IPV4)
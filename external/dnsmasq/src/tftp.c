@@ -22,7 +22,9 @@ static struct tftp_file *check_tftp_fileperm(ssize_t *len);
 static void free_transfer(struct tftp_transfer *transfer);
 static ssize_t tftp_err(int err, char *packet, char *mess, char *file);
 static ssize_t tftp_err_oops(char *packet, char *file);
-static ssize_t get_block(char *packet, struct tftp_transfer *transfer);
+static ssize_t get_block(char *packet, struct tftp_transfer *transfer, unsigned int i);
+static int send_window(struct tftp_transfer *transfer);
+static void log_transfer(struct tftp_transfer *transfer);
 static char *next(char **p, char *end);
 
 #define OP_RRQ  1
@@ -155,10 +157,12 @@ void tftp_request(struct listener *listen, time_t now)
   transfer->backoff = 1;
   transfer->block = 1;
   transfer->blocksize = 512;
+  transfer->windowsize = 1;
+  transfer->last_block = transfer->resent = transfer->expansion = 0;
   transfer->offset = 0;
   transfer->file = NULL;
-  transfer->opt_blocksize = transfer->opt_transize = 0;
-  transfer->netascii = transfer->carrylf = 0;
+  transfer->opt_blocksize = transfer->opt_transize = transfer->opt_windowsize = 0;
+  transfer->netascii = transfer->carrylf = transfer->sent_all = 0;
 
   /* if we have a nailed-down range, iterate until we find a free one. */
   while (1)
@@ -221,6 +225,20 @@ void tftp_request(struct listener *listen, time_t now)
 	      transfer->opt_transize = 1;
 	      transfer->block = 0;
 	    }
+	  /* netascii blocks depend on the one before, so only one in flight. */
+	  else if (strcasecmp(opt, "windowsize") == 0)
+	    {
+	      if ((opt = next(&p, end)) && !transfer->netascii)
+		{
+		  transfer->windowsize = atoi(opt);
+		  if (transfer->windowsize < 1)
+		    transfer->windowsize = 1;
+		  if (transfer->windowsize > TFTP_MAX_WINDOW)
+		    transfer->windowsize = TFTP_MAX_WINDOW;
+		  transfer->opt_windowsize = 1;
+		  transfer->block = 0;
+		}
+	    }
 	}
 
       /* cope with backslashes from windows boxen. */
@@ -265,18 +283,20 @@ void tftp_request(struct listener *listen, time_t now)
       /* check permissions and open file */
       if ((transfer->file = check_tftp_fileperm(&len)))
 	{
-	  if ((len = get_block(packet, transfer)) == -1)
+	  gettimeofday(&transfer->start, NULL);
+	  if (send_window(transfer) == -1)
 	    len = tftp_err_oops(packet, daemon->namebuff);
 	  else
 	    is_err = 0;
 	}
     }
   
-  while (sendto(transfer->sockfd, packet, len, 0, 
-		(struct sockaddr *)&peer, sizeof(peer)) == -1 && errno == EINTR);
-  
   if (is_err)
-    free_transfer(transfer);
+    {
+      while (sendto(transfer->sockfd, packet, len, 0, 
+		    (struct sockaddr *)&peer, sizeof(peer)) == -1 && errno == EINTR);
+      free_transfer(transfer);
+    }
   else
     {
       my_syslog(MS_TFTP | LOG_INFO, _("TFTP sent %s to %s"), daemon->namebuff, inet_ntoa(peer.sin_addr));
@@ -348,6 +368,20 @@ static struct tftp_file *check_tftp_fileperm(ssize_t *len)
 
   file->fd = fd;
   file->size = statbuf.st_size;
+  file->map = NULL;
+  
+  /* Map the file so that blocks are sent straight from the page cache,
+     shared by all transfers of the file. Fall back to read() if that
+     isn't possible. */
+  if (statbuf.st_size != 0 && (off_t)(size_t)statbuf.st_size == statbuf.st_size &&
+      (file->map = mmap(NULL, (size_t)statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    file->map = NULL;
+  
+#ifdef MADV_SEQUENTIAL
+  if (file->map)
+    madvise(file->map, (size_t)statbuf.st_size, MADV_SEQUENTIAL);
+#endif
+
   file->dev = statbuf.st_dev;
   file->inode = statbuf.st_ino;
   file->refcount = 1;
@@ -368,7 +402,7 @@ static struct tftp_file *check_tftp_fileperm(ssize_t *len)
   return NULL;
 }
 
-void check_tftp_listeners(fd_set *rset, time_t now)
+void check_tftp_listeners(time_t now)
 {
   struct tftp_transfer *transfer, *tmp, **up;
   ssize_t len;
@@ -382,20 +416,30 @@ void check_tftp_listeners(fd_set *rset, time_t now)
     {
       tmp = transfer->next;
       
-      if (FD_ISSET(transfer->sockfd, rset))
+      if (poll_check(transfer->sockfd, POLLIN))
 	{
 	  /* we overwrote the buffer... */
 	  daemon->srv_save = NULL;
 	  
 	  if ((len = recv(transfer->sockfd, daemon->packet, daemon->packet_buff_sz, 0)) >= (ssize_t)sizeof(struct ack))
 	    {
-	      if (ntohs(mess->op) == OP_ACK && ntohs(mess->block) == (unsigned short)transfer->block) 
+	      /* An ACK for any block in the window acknowledges everything
+		 up to it, the next window starts after it. */
+	      unsigned short delta = ntohs(mess->block) - (unsigned short)transfer->block;
+
+	      if (ntohs(mess->op) == OP_ACK && transfer->last_block >= transfer->block &&
+		  delta <= transfer->last_block - transfer->block) 
 		{
 		  /* Got ack, ensure we take the (re)transmit path */
 		  transfer->timeout = now;
 		  transfer->backoff = 0;
-		  if (transfer->block++ != 0)
-		    transfer->offset += transfer->blocksize - transfer->expansion;
+		  if (transfer->block == 0)
+		    transfer->block = 1;
+		  else
+		    {
+		      transfer->offset += (off_t)delta * transfer->blocksize + transfer->blocksize - transfer->expansion;
+		      transfer->block += delta + 1;
+		    }
 		}
 	      else if (ntohs(mess->op) == OP_ERR)
 		{
@@ -420,13 +464,14 @@ void check_tftp_listeners(fd_set *rset, time_t now)
 		  /* Got err, ensure we take abort */
 		  transfer->timeout = now;
 		  transfer->backoff = 100;
+		  transfer->sent_all = 0;
 		}
 	    }
 	}
       
       if (difftime(now, transfer->timeout) >= 0.0)
 	{
-	  int endcon = 0;
+	  int endcon = 0, sent;
 
 	  /* timeout, retransmit */
 	  transfer->timeout += 1 + (1<<transfer->backoff);
@@ -434,26 +479,31 @@ void check_tftp_listeners(fd_set *rset, time_t now)
 	  /* we overwrote the buffer... */
 	  daemon->srv_save = NULL;
 	 
-	  if ((len = get_block(daemon->packet, transfer)) == -1)
-	    {
-	      len = tftp_err_oops(daemon->packet, transfer->file->filename);
-	      endcon = 1;
-	    }
-	  else if (++transfer->backoff > 5)
+	  if (++transfer->backoff > 5)
 	    {
 	      /* don't complain about timeout when we're awaiting the last
 		 ACK, some clients never send it */
-	      if (len != 0)
+	      if (transfer->sent_all)
+		log_transfer(transfer);
+	      else
 		my_syslog(MS_TFTP | LOG_ERR, _("TFTP failed sending %s to %s"), 
 			  transfer->file->filename, inet_ntoa(transfer->peer.sin_addr));
-	      len = 0;
+	      endcon = 1;
+	    }
+	  else if ((sent = send_window(transfer)) == -1)
+	    {
+	      len = tftp_err_oops(daemon->packet, transfer->file->filename);
+	      while(sendto(transfer->sockfd, daemon->packet, len, 0, 
+			   (struct sockaddr *)&transfer->peer, sizeof(transfer->peer)) == -1 && errno == EINTR);
+	      endcon = 1;
+	    }
+	  else if (sent == 0)
+	    {
+	      log_transfer(transfer);
+	      endcon = 1;
 	    }
 	  
-	  if (len != 0)
-	    while(sendto(transfer->sockfd, daemon->packet, len, 0, 
-			 (struct sockaddr *)&transfer->peer, sizeof(transfer->peer)) == -1 && errno == EINTR);
-	  
-	  if (endcon || len == 0)
+	  if (endcon)
 	    {
 	      /* unlink */
 	      *up = tmp;
@@ -468,15 +518,120 @@ void check_tftp_listeners(fd_set *rset, time_t now)
 
 static void free_transfer(struct tftp_transfer *transfer)
 {
+  poll_remove(transfer->sockfd);
   close(transfer->sockfd);
   if (transfer->file && (--transfer->file->refcount) == 0)
     {
+      if (transfer->file->map)
+	munmap(transfer->file->map, (size_t)transfer->file->size);
       close(transfer->file->fd);
       free(transfer->file);
     }
   free(transfer);
 }
 
+/* Send the window of blocks starting at transfer->block, an OACK is a 
+   window on its own. Return -1 for error, zero for done, 
+   else the number of blocks sent. */
+static int send_window(struct tftp_transfer *transfer)
+{
+  struct tftp_file *file = transfer->file;
+  unsigned int i, count = transfer->block == 0 ? 1 : transfer->windowsize;
+  struct stat statbuf;
+  ssize_t len;
+  int sent = 0;
+
+  /* a mapped file which shrinks under us would fault. */
+  if (file->map)
+    {
+      if (fstat(file->fd, &statbuf) == -1)
+	return -1;
+      if (statbuf.st_size < file->size)
+	{
+	  errno = ESTALE;
+	  return -1;
+	}
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      if (transfer->block != 0 && file->map && !transfer->netascii)
+	{
+	  /* send the data straight from the mapped file. */
+	  off_t offset = transfer->offset + (off_t)i * transfer->blocksize;
+	  unsigned short head[2];
+	  struct iovec iov[2];
+	  struct msghdr msg;
+	  size_t size;
+	  
+	  if (offset > file->size)
+	    break; /* finished */
+
+	  size = file->size - offset;
+	  if (size > transfer->blocksize)
+	    size = transfer->blocksize;
+	  
+	  head[0] = htons(OP_DATA);
+	  head[1] = htons((unsigned short)(transfer->block + i));
+	  iov[0].iov_base = head;
+	  iov[0].iov_len = sizeof(head);
+	  iov[1].iov_base = file->map + offset;
+	  iov[1].iov_len = size;
+	  
+	  /* a short block is the last one */
+	  if (size < transfer->blocksize)
+	    transfer->sent_all = 1;
+	  
+	  memset(&msg, 0, sizeof(msg));
+	  msg.msg_name = &transfer->peer;
+	  msg.msg_namelen = sizeof(transfer->peer);
+	  msg.msg_iov = iov;
+	  msg.msg_iovlen = 2;
+	  
+	  while (sendmsg(transfer->sockfd, &msg, 0) == -1 && errno == EINTR);
+	}
+      else
+	{
+	  if ((len = get_block(daemon->packet, transfer, i)) == -1)
+	    return -1;
+	  
+	  if (len == 0)
+	    break;
+	  
+	  if (transfer->block != 0 && len < (ssize_t)transfer->blocksize + 4)
+	    transfer->sent_all = 1;
+	  
+	  while (sendto(transfer->sockfd, daemon->packet, len, 0, 
+			(struct sockaddr *)&transfer->peer, sizeof(transfer->peer)) == -1 && errno == EINTR);
+	}
+      
+      if (transfer->block != 0 && transfer->block + i <= transfer->last_block)
+	transfer->resent++;
+      sent++;
+    }
+  
+  if (sent != 0)
+    transfer->last_block = transfer->block + sent - 1;
+  
+  return sent;
+}
+
+static void log_transfer(struct tftp_transfer *transfer)
+{
+  struct timeval tv;
+  long ms;
+
+  gettimeofday(&tv, NULL);
+  ms = (tv.tv_sec - transfer->start.tv_sec) * 1000 + (tv.tv_usec - transfer->start.tv_usec) / 1000;
+  if (ms <= 0)
+    ms = 1;
+  
+  my_syslog(MS_TFTP | LOG_INFO, _("TFTP sent %s to %s: %lu bytes in %ld.%03lds (%lu kB/s), window %u, %u blocks resent"),
+	    transfer->file->filename, inet_ntoa(transfer->peer.sin_addr),
+	    (unsigned long)transfer->file->size, ms / 1000, ms % 1000,
+	    (unsigned long)(transfer->file->size / ms), transfer->windowsize, transfer->resent);
+}
+
 static char *next(char **p, char *end)
 {
   char *ret = *p;
@@ -513,8 +668,9 @@ static ssize_t tftp_err_oops(char *packet, char *file)
   return tftp_err(ERR_NOTDEF, packet, _("cannot read %s: %s"), file);
 }
 
-/* return -1 for error, zero for done. */
-static ssize_t get_block(char *packet, struct tftp_transfer *transfer)
+/* Send the i'th block of the window.
+   return -1 for error, zero for done. */
+static ssize_t get_block(char *packet, struct tftp_transfer *transfer, unsigned int i)
 {
   if (transfer->block == 0)
     {
@@ -537,6 +693,11 @@ static ssize_t get_block(char *packet, struct tftp_transfer *transfer)
 	  p += (sprintf(p,"tsize") + 1);
 	  p += (sprintf(p, "%u", (unsigned int)transfer->file->size) + 1);
 	}
+      if (transfer->opt_windowsize)
+	{
+	  p += (sprintf(p, "windowsize") + 1);
+	  p += (sprintf(p, "%u", transfer->windowsize) + 1);
+	}
 
       return p - packet;
     }
@@ -548,18 +709,19 @@ static ssize_t get_block(char *packet, struct tftp_transfer *transfer)
 	unsigned char data[];
       } *mess = (struct datamess *)packet;
       
-      size_t size = transfer->file->size - transfer->offset; 
+      off_t offset = transfer->offset + (off_t)i * transfer->blocksize;
+      size_t size = transfer->file->size - offset; 
       
-      if (transfer->offset > transfer->file->size)
+      if (offset > transfer->file->size)
 	return 0; /* finished */
       
       if (size > transfer->blocksize)
 	size = transfer->blocksize;
       
       mess->op = htons(OP_DATA);
-      mess->block = htons((unsigned short)(transfer->block));
+      mess->block = htons((unsigned short)(transfer->block + i));
       
-      if (lseek(transfer->file->fd, transfer->offset, SEEK_SET) == (off_t)-1 ||
+      if (lseek(transfer->file->fd, offset, SEEK_SET) == (off_t)-1 ||
 	  !read_write(transfer->file->fd, mess->data, size, 1))
 	return -1;
       
@@ -98,7 +98,7 @@ unsigned short rand16(void)
 
 #endif
 
-static int check_name(char *in)
+int check_name(char *in)
 {
   /* remove trailing . 
      also fail empty string and label > 63 chars */
@@ -15,6 +15,7 @@ struct rtnl_handle
 	struct sockaddr_nl	peer;
 	__u32			seq;
 	__u32			dump;
+	struct rtnl_batch	*batch;
 };
 
 extern int rcvbuf;
@@ -24,6 +25,7 @@ extern int rtnl_open_byproto(struct rtnl_handle *rth, unsigned subscriptions, in
 extern void rtnl_close(struct rtnl_handle *rth);
 extern int rtnl_wilddump_request(struct rtnl_handle *rth, int fam, int type);
 extern int rtnl_dump_request(struct rtnl_handle *rth, int type, void *req, int len);
+extern int rtnl_dump_request_n(struct rtnl_handle *rth, struct nlmsghdr *n);
 
 typedef int (*rtnl_filter_t)(const struct sockaddr_nl *,
 			     struct nlmsghdr *n, void *);
@@ -50,6 +52,18 @@ extern int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 extern int rtnl_send(struct rtnl_handle *rth, const char *buf, int);
 extern int rtnl_send_check(struct rtnl_handle *rth, const char *buf, int);
 
+/* Pipelined batch mode: rtnl_talk() requests that want no answer are
+ * queued and sent up to "window" at a time.  Only failures are reported,
+ * through the callback, tagged with the cookie set when they were queued.
+ */
+typedef void (*rtnl_batch_err_t)(int cookie, void *arg);
+
+extern int rtnl_batch_start(struct rtnl_handle *rth, unsigned window,
+			    rtnl_batch_err_t err, void *arg);
+extern void rtnl_batch_cookie(struct rtnl_handle *rth, int cookie);
+extern int rtnl_batch_flush(struct rtnl_handle *rth);
+extern int rtnl_batch_end(struct rtnl_handle *rth);
+
 extern int addattr32(struct nlmsghdr *n, int maxlen, int type, __u32 data);
 extern int addattr_l(struct nlmsghdr *n, int maxlen, int type, const void *data, int alen);
 extern int addraw_l(struct nlmsghdr *n, int maxlen, const void *data, int len);
@@ -76,6 +90,23 @@ extern int rtnl_listen(struct rtnl_handle *, rtnl_filter_t handler,
 extern int rtnl_from_file(FILE *, rtnl_filter_t handler,
 		       void *jarg);
 
+/* rtnl_listen() for high event rates: reads many datagrams per system
+ * call and counts receive buffer overruns instead of just logging them.
+ * idle() runs whenever the socket is drained and returns how long to
+ * wait for more (in ms, -1 for ever) before it is called again.
+ */
+struct rtnl_listen_ctl
+{
+	int		(*idle)(void *jarg);
+	volatile int	stop;
+	unsigned long	reads;
+	unsigned long	msgs;
+	unsigned long	overruns;
+};
+
+extern int rtnl_listen_batch(struct rtnl_handle *, rtnl_filter_t handler,
+			     void *jarg, struct rtnl_listen_ctl *ctl);
+
 #define NLMSG_TAIL(nmsg) \
 	((struct rtattr *) (((void *) (nmsg)) + NLMSG_ALIGN((nmsg)->nlmsg_len)))
 
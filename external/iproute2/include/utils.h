@@ -15,6 +15,7 @@ extern int show_details;
 extern int show_raw;
 extern int resolve_hosts;
 extern int oneline;
+extern int compact;
 extern int timestamp;
 extern char * _SL_;
 
@@ -28,9 +28,11 @@ int show_stats = 0;
 int show_details = 0;
 int resolve_hosts = 0;
 int oneline = 0;
+int compact = 0;
 int timestamp = 0;
 char * _SL_ = NULL;
 char *batch_file = NULL;
+unsigned int batch_window = 0;
 int force = 0;
 struct rtnl_handle rth = { .fd = -1 };
 
@@ -40,12 +42,13 @@ static void usage(void)
 {
 	fprintf(stderr,
 "Usage: ip [ OPTIONS ] OBJECT { COMMAND | help }\n"
-"       ip [ -force ] -batch filename\n"
+"       ip [ -force ] [ -window N ] -batch filename\n"
 "where  OBJECT := { link | addr | addrlabel | route | rule | neigh | ntable |\n"
 "                   tunnel | maddr | mroute | monitor | xfrm }\n"
 "       OPTIONS := { -V[ersion] | -s[tatistics] | -d[etails] | -r[esolve] |\n"
 "                    -f[amily] { inet | inet6 | ipx | dnet | link } |\n"
-"                    -o[neline] | -t[imestamp] | -b[atch] [filename] |\n"
+"                    -o[neline] | -c[ompact] | -t[imestamp] |\n"
+"                    -b[atch] [filename] |\n"
 "                    -rc[vbuf] [size]}\n");
 	exit(-1);
 }
@@ -85,6 +88,9 @@ static const struct cmd {
 } cmds[] = {
 	{ "route",	do_iproute },
 	{ "rule",	do_iprule },
+#ifndef ANDROID
+	{ "monitor",	do_ipmonitor },
+#endif
 	{ 0 }
 };
 #endif
@@ -104,12 +110,26 @@ static int do_cmd(const char *argv0, int argc, char **argv)
 
 #ifndef ANDROID
 
+static int batch_failed;
+
+static void batch_error(int lineno, void *arg)
+{
+	fprintf(stderr, "Command failed %s:%d\n", (char *)arg, lineno);
+	batch_failed = 1;
+}
+
+/* A command that exit()s still gets the lines queued before it sent. */
+static void batch_exit(void)
+{
+	if (rth.batch)
+		rtnl_batch_end(&rth);
+}
+
 static int batch(const char *name)
 {
 	char *line = NULL;
 	size_t len = 0;
 	int ret = 0;
-	int lineno = 0;
 
 	if (name && strcmp(name, "-") != 0) {
 		if (freopen(name, "r", stdin) == NULL) {
@@ -124,6 +144,16 @@ static int batch(const char *name)
 		return -1;
 	}
 
+	if (batch_window > 1) {
+		if (rtnl_batch_start(&rth, batch_window, batch_error,
+				     (void *)name) < 0) {
+			fprintf(stderr, "Cannot start netlink batch\n");
+			return -1;
+		}
+		atexit(batch_exit);
+	}
+
+	cmdlineno = 0;
 	while (getcmdline(&line, &len, stdin) != -1) {
 		char *largv[100];
 		int largc;
@@ -132,8 +162,14 @@ static int batch(const char *name)
 		if (largc == 0)
 			continue;	/* blank line */
 
+		rtnl_batch_cookie(&rth, cmdlineno);
 		if (do_cmd(largv[0], largc, largv)) {
-			fprintf(stderr, "Command failed %s:%d\n", name, lineno);
+			fprintf(stderr, "Command failed %s:%d\n", name, cmdlineno);
+			ret = 1;
+			if (!force)
+				break;
+		}
+		if (batch_failed) {
 			ret = 1;
 			if (!force)
 				break;
@@ -142,6 +178,9 @@ static int batch(const char *name)
 	if (line)
 		free(line);
 
+	if (rtnl_batch_end(&rth) < 0 || batch_failed)
+		ret = 1;
+
 	rtnl_close(&rth);
 	return ret;
 }
@@ -205,6 +244,8 @@ int main(int argc, char **argv)
 			++resolve_hosts;
 		} else if (matches(opt, "-oneline") == 0) {
 			++oneline;
+		} else if (matches(opt, "-compact") == 0) {
+			++compact;
 		} else if (matches(opt, "-timestamp") == 0) {
 			++timestamp;
 #if 0
@@ -224,6 +265,16 @@ int main(int argc, char **argv)
 			if (argc <= 1)
 				usage();
 			batch_file = argv[1];
+		} else if (matches(opt, "-window") == 0) {
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			if (get_unsigned(&batch_window, argv[1], 0)) {
+				fprintf(stderr, "Invalid window size '%s'\n",
+					argv[1]);
+				exit(-1);
+			}
 		} 
 #endif
             else if (matches(opt, "-rcvbuf") == 0) {
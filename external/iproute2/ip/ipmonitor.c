@@ -19,8 +19,13 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <limits.h>
+#include <signal.h>
 #include <time.h>
+#include <sys/time.h>
+#include <linux/if_addrlabel.h>
 
+#include "rt_names.h"
 #include "utils.h"
 #include "ip_common.h"
 
@@ -29,10 +34,51 @@ int prefix_banner;
 
 static void usage(void)
 {
-	fprintf(stderr, "Usage: ip monitor [ all | LISTofOBJECTS ]\n");
+	fprintf(stderr, "Usage: ip monitor [ all | LISTofOBJECTS ] [ dev STRING ] [ table TABLE_ID ]\n");
+	fprintf(stderr, "                  [ coalesce [ MSEC ] ] [ file FILE ]\n");
 	exit(-1);
 }
 
+/* Receive buffer asked for by default: a route flap storm queues tens
+ * of thousands of notifications faster than they can be printed.
+ */
+#define MON_RCVBUF	(16 * 1024 * 1024)
+
+/* With "coalesce", events wait in arrival order until the socket is
+ * drained (or MSEC after the first one); a newer update for the same
+ * object replaces the waiting message in place.
+ */
+#define MON_HASH	4096
+#define MON_PENDING_MAX	65536
+#define MON_KEY		64
+
+struct mon_event
+{
+	struct mon_event	*next;
+	struct mon_event	*hnext;
+	unsigned		hash;
+	int			klen;
+	unsigned char		key[MON_KEY];
+	struct nlmsghdr		*n;
+};
+
+static struct
+{
+	int			ifindex;
+	__u32			table;
+	int			coalesce;
+	struct rtnl_listen_ctl	ctl;
+	unsigned long		filtered;
+	unsigned long		coalesced;
+	struct mon_event	*head;
+	struct mon_event	**tail;
+	struct mon_event	*hash[MON_HASH];
+	int			pending;
+	struct timeval		first;
+} mon;
+
+static const struct sockaddr_nl mon_who = { .nl_family = AF_NETLINK };
+
 
 int accept_msg(const struct sockaddr_nl *who,
 	       struct nlmsghdr *n, void *arg)
@@ -109,6 +155,285 @@ int accept_msg(const struct sockaddr_nl *who,
 	return 0;
 }
 
+static int mon_put(unsigned char *key, int len, const void *data, int dlen)
+{
+	if (len < 0 || len + dlen > MON_KEY)
+		return -1;
+	memcpy(key + len, data, dlen);
+	return len + dlen;
+}
+
+static int mon_put_attr(unsigned char *key, int len, struct rtattr *rta)
+{
+	if (rta == NULL)
+		return mon_put(key, len, "", 1);
+	return mon_put(key, len, RTA_DATA(rta), RTA_PAYLOAD(rta));
+}
+
+/* Check an event against the dev/table/family filters, before anything
+ * is formatted, and build the key identifying the object it is about.
+ * *klen is 0 when such events are never coalesced.
+ */
+static int mon_match(struct nlmsghdr *n, unsigned char *key, int *klen)
+{
+	int family = AF_UNSPEC, ifindex = -1, len;
+	__u32 table = 0;
+	int has_table = 0;
+
+	*klen = 0;
+	key[0] = n->nlmsg_type & ~3;
+	len = 1;
+
+	switch (n->nlmsg_type) {
+	case RTM_NEWROUTE:
+	case RTM_DELROUTE:
+	case RTM_NEWRULE:
+	case RTM_DELRULE: {
+		struct rtmsg *r = NLMSG_DATA(n);
+		struct rtattr *tb[RTA_MAX+1];
+
+		if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*r)))
+			return 1;
+		parse_rtattr(tb, RTA_MAX, RTM_RTA(r),
+			     n->nlmsg_len - NLMSG_LENGTH(sizeof(*r)));
+		family = r->rtm_family;
+		table = tb[RTA_TABLE] ? *(__u32 *)RTA_DATA(tb[RTA_TABLE]) :
+					r->rtm_table;
+		has_table = 1;
+		if (n->nlmsg_type == RTM_NEWRULE || n->nlmsg_type == RTM_DELRULE)
+			break;
+		ifindex = tb[RTA_OIF] ? *(int *)RTA_DATA(tb[RTA_OIF]) : 0;
+		/* routes appended to the same prefix differ only in
+		 * their nexthops */
+		len = mon_put(key, len, &r->rtm_family, 1);
+		len = mon_put(key, len, &r->rtm_dst_len, 1);
+		len = mon_put(key, len, &r->rtm_tos, 1);
+		len = mon_put(key, len, &r->rtm_type, 1);
+		len = mon_put(key, len, &table, sizeof(table));
+		len = mon_put(key, len, &ifindex, sizeof(ifindex));
+		len = mon_put_attr(key, len, tb[RTA_PRIORITY]);
+		len = mon_put_attr(key, len, tb[RTA_GATEWAY]);
+		len = mon_put_attr(key, len, tb[RTA_MULTIPATH]);
+		*klen = mon_put_attr(key, len, tb[RTA_DST]);
+		break;
+	}
+	case RTM_NEWLINK:
+	case RTM_DELLINK: {
+		struct ifinfomsg *ifi = NLMSG_DATA(n);
+
+		if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+			return 1;
+		family = ifi->ifi_family;
+		ifindex = ifi->ifi_index;
+		*klen = mon_put(key, len, &ifi->ifi_index, sizeof(int));
+		break;
+	}
+	case RTM_NEWADDR:
+	case RTM_DELADDR: {
+		struct ifaddrmsg *ifa = NLMSG_DATA(n);
+		struct rtattr *tb[IFA_MAX+1];
+
+		if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+			return 1;
+		parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa),
+			     n->nlmsg_len - NLMSG_LENGTH(sizeof(*ifa)));
+		family = ifa->ifa_family;
+		ifindex = ifa->ifa_index;
+		len = mon_put(key, len, &ifa->ifa_family, 1);
+		len = mon_put(key, len, &ifa->ifa_prefixlen, 1);
+		len = mon_put(key, len, &ifa->ifa_index, sizeof(int));
+		*klen = mon_put_attr(key, len, tb[IFA_LOCAL] ? tb[IFA_LOCAL] :
+						tb[IFA_ADDRESS]);
+		break;
+	}
+	case RTM_NEWNEIGH:
+	case RTM_DELNEIGH: {
+		struct ndmsg *ndm = NLMSG_DATA(n);
+		struct rtattr *tb[NDA_MAX+1];
+
+		if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ndm)))
+			return 1;
+		parse_rtattr(tb, NDA_MAX, NDA_RTA(ndm),
+			     n->nlmsg_len - NLMSG_LENGTH(sizeof(*ndm)));
+		family = ndm->ndm_family;
+		ifindex = ndm->ndm_ifindex;
+		len = mon_put(key, len, &ndm->ndm_family, 1);
+		len = mon_put(key, len, &ndm->ndm_ifindex, sizeof(int));
+		*klen = mon_put_attr(key, len, tb[NDA_DST]);
+		break;
+	}
+	case RTM_NEWPREFIX: {
+		struct prefixmsg *prefix = NLMSG_DATA(n);
+
+		if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*prefix)))
+			return 1;
+		family = prefix->prefix_family;
+		ifindex = prefix->prefix_ifindex;
+		break;
+	}
+	case RTM_NEWADDRLABEL:
+	case RTM_DELADDRLABEL: {
+		struct ifaddrlblmsg *ifal = NLMSG_DATA(n);
+
+		if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifal)))
+			return 1;
+		family = ifal->ifal_family;
+		break;
+	}
+	default:
+		return 1;
+	}
+
+	if (*klen < 0)
+		*klen = 0;
+	if (preferred_family && family != AF_UNSPEC && family != preferred_family)
+		return 0;
+	if (mon.ifindex && ifindex != mon.ifindex)
+		return 0;
+	if (mon.table && (!has_table || table != mon.table))
+		return 0;
+	return 1;
+}
+
+static unsigned mon_hash(const unsigned char *key, int klen)
+{
+	unsigned h = 0;
+
+	while (klen--)
+		h = h * 31 + *key++;
+	return h;
+}
+
+static void mon_flush(FILE *fp)
+{
+	struct mon_event *e, *next;
+
+	for (e = mon.head; e; e = next) {
+		next = e->next;
+		accept_msg(&mon_who, e->n, fp);
+		mon.hash[e->hash % MON_HASH] = NULL;
+		free(e->n);
+		free(e);
+	}
+	mon.head = NULL;
+	mon.tail = &mon.head;
+	mon.pending = 0;
+}
+
+/* Milliseconds until the events held since mon.first are due. */
+static long mon_left(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return mon.coalesce - (now.tv_sec - mon.first.tv_sec) * 1000L -
+	       (now.tv_usec - mon.first.tv_usec) / 1000;
+}
+
+static int mon_hold(struct nlmsghdr *n, unsigned char *key, int klen,
+		    FILE *fp)
+{
+	struct mon_event *e = NULL;
+	struct nlmsghdr *copy;
+	unsigned h = 0;
+
+	copy = malloc(n->nlmsg_len);
+	if (copy == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	memcpy(copy, n, n->nlmsg_len);
+
+	if (klen) {
+		h = mon_hash(key, klen);
+		for (e = mon.hash[h % MON_HASH]; e; e = e->hnext)
+			if (e->hash == h && e->klen == klen &&
+			    memcmp(e->key, key, klen) == 0)
+				break;
+	}
+	if (e) {
+		free(e->n);
+		e->n = copy;
+		mon.coalesced++;
+		goto check;
+	}
+
+	e = malloc(sizeof(*e));
+	if (e == NULL) {
+		perror("malloc");
+		free(copy);
+		return -1;
+	}
+	e->next = NULL;
+	e->hash = h;
+	e->klen = klen;
+	memcpy(e->key, key, klen);
+	e->n = copy;
+	e->hnext = NULL;
+	if (klen) {
+		e->hnext = mon.hash[h % MON_HASH];
+		mon.hash[h % MON_HASH] = e;
+	}
+	*mon.tail = e;
+	mon.tail = &e->next;
+	if (mon.pending++ == 0)
+		gettimeofday(&mon.first, NULL);
+check:
+	/* In a storm the socket never drains and mon_idle() is not called,
+	 * so the deadline is checked here as well.
+	 */
+	if (mon.pending >= MON_PENDING_MAX ||
+	    (mon.coalesce > 0 && mon_left() <= 0)) {
+		mon_flush(fp);
+		fflush(fp);
+	}
+	return 0;
+}
+
+static int mon_accept(const struct sockaddr_nl *who,
+		      struct nlmsghdr *n, void *arg)
+{
+	unsigned char key[MON_KEY];
+	int klen;
+
+	if (n->nlmsg_type == RTM_NEWLINK || n->nlmsg_type == RTM_DELLINK)
+		ll_remember_index(who, n, NULL);
+	if (!mon_match(n, key, &klen)) {
+		mon.filtered++;
+		return 0;
+	}
+	if (mon.coalesce < 0)
+		return accept_msg(who, n, arg);
+	return mon_hold(n, key, klen, arg);
+}
+
+static int mon_idle(void *arg)
+{
+	FILE *fp = (FILE *)arg;
+
+	if (mon.pending && mon.coalesce > 0) {
+		long left = mon_left();
+
+		if (left > 0)
+			return left;
+	}
+	mon_flush(fp);
+	fflush(fp);
+	return -1;
+}
+
+static void mon_stop(int sig)
+{
+	mon.ctl.stop = 1;
+}
+
+static void mon_stats(void)
+{
+	fprintf(stderr, "%lu events in %lu reads, %lu filtered, "
+		"%lu coalesced, %lu overruns\n", mon.ctl.msgs, mon.ctl.reads,
+		mon.filtered, mon.coalesced, mon.ctl.overruns);
+}
+
 int do_ipmonitor(int argc, char **argv)
 {
 	char *file = NULL;
@@ -118,6 +443,13 @@ int do_ipmonitor(int argc, char **argv)
 	int lroute=0;
 	int lprefix=0;
 	int lneigh=0;
+	char *dev = NULL;
+	int size;
+
+	memset(&mon, 0, sizeof(mon));
+	mon.coalesce = -1;
+	mon.tail = &mon.head;
+	mon.ctl.idle = mon_idle;
 
 	rtnl_close(&rth);
 	ipaddr_reset_filter(1);
@@ -143,6 +475,24 @@ int do_ipmonitor(int argc, char **argv)
 		} else if (matches(*argv, "neigh") == 0) {
 			lneigh = 1;
 			groups = 0;
+		} else if (strcmp(*argv, "dev") == 0) {
+			NEXT_ARG();
+			dev = *argv;
+		} else if (matches(*argv, "table") == 0) {
+			NEXT_ARG();
+			if (rtnl_rttable_a2n(&mon.table, *argv))
+				invarg("invalid table ID\n", *argv);
+		} else if (matches(*argv, "coalesce") == 0) {
+			unsigned msec;
+
+			mon.coalesce = 0;
+			if (argc > 1 && get_unsigned(&msec, argv[1], 0) == 0) {
+				if (msec > INT_MAX)
+					invarg("coalesce time is too large",
+					       argv[1]);
+				mon.coalesce = msec;
+				argc--; argv++;
+			}
 		} else if (strcmp(*argv, "all") == 0) {
 			groups = ~RTMGRP_TC;
 			prefix_banner=1;
@@ -183,15 +533,38 @@ int do_ipmonitor(int argc, char **argv)
 			perror("Cannot fopen");
 			exit(-1);
 		}
-		return rtnl_from_file(fp, accept_msg, stdout);
+		if (dev && (mon.ifindex = ll_name_to_index(dev)) == 0) {
+			fprintf(stderr, "Cannot find device \"%s\"\n", dev);
+			exit(-1);
+		}
+		if (rtnl_from_file(fp, mon_accept, stdout) < 0)
+			return -1;
+		mon_flush(stdout);
+		return 0;
 	}
 
 	if (rtnl_open(&rth, groups) < 0)
 		exit(1);
 	ll_init_map(&rth);
+	if (dev && (mon.ifindex = ll_name_to_index(dev)) == 0) {
+		fprintf(stderr, "Cannot find device \"%s\"\n", dev);
+		exit(-1);
+	}
+
+	/* SO_RCVBUFFORCE gets past rmem_max when running privileged. */
+	size = rcvbuf > MON_RCVBUF ? rcvbuf : MON_RCVBUF;
+	if (setsockopt(rth.fd, SOL_SOCKET, SO_RCVBUFFORCE,
+		       &size, sizeof(size)) < 0)
+		setsockopt(rth.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
 
-	if (rtnl_listen(&rth, accept_msg, stdout) < 0)
+	signal(SIGINT, mon_stop);
+	signal(SIGTERM, mon_stop);
+	if (rtnl_listen_batch(&rth, mon_accept, stdout, &mon.ctl) < 0)
 		exit(2);
+	mon_flush(stdout);
+	fflush(stdout);
+	if (show_stats || mon.ctl.overruns)
+		mon_stats();
 
 	return 0;
 }
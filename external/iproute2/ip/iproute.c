@@ -52,6 +52,8 @@ static void usage(void) __attribute__((noreturn));
 static void usage(void)
 {
 	fprintf(stderr, "Usage: ip route { list | flush } SELECTOR\n");
+	fprintf(stderr, "       ip route save SELECTOR\n");
+	fprintf(stderr, "       ip route showdump\n");
 	fprintf(stderr, "       ip route get ADDRESS [ from ADDRESS iif STRING ]\n");
 	fprintf(stderr, "                            [ oif STRING ]  [ tos TOS ]\n");
 	fprintf(stderr, "       ip route { add | del | change | append | replace | monitor } ROUTE\n");
@@ -86,6 +88,7 @@ static struct
 {
 	int tb;
 	int cloned;
+	int save;
 	int flushed;
 	char *flushb;
 	int flushp;
@@ -115,6 +118,41 @@ static int flush_update(void)
 	return 0;
 }
 
+/* One line per route, numeric fields in a fixed order:
+ * PREFIX/LEN TYPE TABLE PROTO SCOPE METRIC GATEWAY DEV PREFSRC
+ */
+static int print_route_compact(FILE *fp, struct rtmsg *r, struct rtattr **tb,
+			       __u32 table, int host_len)
+{
+	static const __u8 any[16];
+	char dst[64];
+	char via[64] = "-";
+	char src[64] = "-";
+	const char *dev = "-";
+	__u32 metric = 0;
+
+	if (tb[RTA_DST])
+		rt_addr_n2a(r->rtm_family, RTA_PAYLOAD(tb[RTA_DST]),
+			    RTA_DATA(tb[RTA_DST]), dst, sizeof(dst));
+	else
+		rt_addr_n2a(r->rtm_family, host_len/8, any, dst, sizeof(dst));
+	if (tb[RTA_GATEWAY])
+		rt_addr_n2a(r->rtm_family, RTA_PAYLOAD(tb[RTA_GATEWAY]),
+			    RTA_DATA(tb[RTA_GATEWAY]), via, sizeof(via));
+	if (tb[RTA_PREFSRC])
+		rt_addr_n2a(r->rtm_family, RTA_PAYLOAD(tb[RTA_PREFSRC]),
+			    RTA_DATA(tb[RTA_PREFSRC]), src, sizeof(src));
+	if (tb[RTA_OIF])
+		dev = ll_index_to_name(*(int*)RTA_DATA(tb[RTA_OIF]));
+	if (tb[RTA_PRIORITY])
+		metric = *(__u32*)RTA_DATA(tb[RTA_PRIORITY]);
+
+	fprintf(fp, "%s/%u %u %u %u %u %u %s %s %s\n",
+		dst, r->rtm_dst_len, r->rtm_type, table, r->rtm_protocol,
+		r->rtm_scope, metric, via, dev, src);
+	return 0;
+}
+
 int print_route(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 {
 	FILE *fp = (FILE*)arg;
@@ -154,6 +192,34 @@ int print_route(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 	else if (r->rtm_family == AF_IPX)
 		host_len = 80;
 
+	/* Reject on the fixed header before paying for the attributes. */
+	if ((filter.protocol^r->rtm_protocol)&filter.protocolmask)
+		return 0;
+	if ((filter.scope^r->rtm_scope)&filter.scopemask)
+		return 0;
+	if ((filter.type^r->rtm_type)&filter.typemask)
+		return 0;
+	if ((filter.tos^r->rtm_tos)&filter.tosmask)
+		return 0;
+	if (filter.rdst.family &&
+	    (r->rtm_family != filter.rdst.family || filter.rdst.bitlen > r->rtm_dst_len))
+		return 0;
+	if (filter.mdst.family &&
+	    (r->rtm_family != filter.mdst.family ||
+	     (filter.mdst.bitlen >= 0 && filter.mdst.bitlen < r->rtm_dst_len)))
+		return 0;
+	if (filter.rsrc.family &&
+	    (r->rtm_family != filter.rsrc.family || filter.rsrc.bitlen > r->rtm_src_len))
+		return 0;
+	if (filter.msrc.family &&
+	    (r->rtm_family != filter.msrc.family ||
+	     (filter.msrc.bitlen >= 0 && filter.msrc.bitlen < r->rtm_src_len)))
+		return 0;
+	if (filter.rvia.family && r->rtm_family != filter.rvia.family)
+		return 0;
+	if (filter.rprefsrc.family && r->rtm_family != filter.rprefsrc.family)
+		return 0;
+
 	parse_rtattr(tb, RTA_MAX, RTM_RTA(r), len);
 	table = rtm_get_table(r, tb);
 
@@ -186,32 +252,6 @@ int print_route(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 		if (filter.tb > 0 && filter.tb != table)
 			return 0;
 	}
-	if ((filter.protocol^r->rtm_protocol)&filter.protocolmask)
-		return 0;
-	if ((filter.scope^r->rtm_scope)&filter.scopemask)
-		return 0;
-	if ((filter.type^r->rtm_type)&filter.typemask)
-		return 0;
-	if ((filter.tos^r->rtm_tos)&filter.tosmask)
-		return 0;
-	if (filter.rdst.family &&
-	    (r->rtm_family != filter.rdst.family || filter.rdst.bitlen > r->rtm_dst_len))
-		return 0;
-	if (filter.mdst.family &&
-	    (r->rtm_family != filter.mdst.family ||
-	     (filter.mdst.bitlen >= 0 && filter.mdst.bitlen < r->rtm_dst_len)))
-		return 0;
-	if (filter.rsrc.family &&
-	    (r->rtm_family != filter.rsrc.family || filter.rsrc.bitlen > r->rtm_src_len))
-		return 0;
-	if (filter.msrc.family &&
-	    (r->rtm_family != filter.msrc.family ||
-	     (filter.msrc.bitlen >= 0 && filter.msrc.bitlen < r->rtm_src_len)))
-		return 0;
-	if (filter.rvia.family && r->rtm_family != filter.rvia.family)
-		return 0;
-	if (filter.rprefsrc.family && r->rtm_family != filter.rprefsrc.family)
-		return 0;
 
 	memset(&dst, 0, sizeof(dst));
 	dst.family = r->rtm_family;
@@ -298,8 +338,18 @@ int print_route(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 			return 0;
 	}
 
+	if (filter.save) {
+		if (fwrite(n, 1, n->nlmsg_len, fp) != n->nlmsg_len) {
+			perror("Failed to save route");
+			return -1;
+		}
+		return 0;
+	}
+
 	if (n->nlmsg_type == RTM_DELROUTE)
 		fprintf(fp, "Deleted ");
+	if (compact)
+		return print_route_compact(fp, r, tb, table, host_len);
 	if (r->rtm_type != RTN_UNICAST && !filter.type)
 		fprintf(fp, "%s ", rtnl_rtntype_n2a(r->rtm_type, b1, sizeof(b1)));
 
@@ -592,7 +642,6 @@ int print_route(const struct sockaddr_nl *who, struct nlmsghdr *n, void *arg)
 		}
 	}
 	fprintf(fp, "\n");
-	fflush(fp);
 	return 0;
 }
 
@@ -1015,6 +1064,38 @@ static int rtnl_rtcache_request(struct rtnl_handle *rth, int family)
 	return sendto(rth->fd, (void*)&req, sizeof(req), 0, (struct sockaddr*)&nladdr, sizeof(nladdr));
 }
 
+/* Pass the selector on to the kernel, so that it can skip routes we
+ * would only throw away.  print_route() still checks every entry.
+ */
+static int iproute_dump_request(struct rtnl_handle *rth, int family)
+{
+	struct {
+		struct nlmsghdr n;
+		struct rtmsg    r;
+		char            buf[64];
+	} req;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req.n.nlmsg_type = RTM_GETROUTE;
+	req.r.rtm_family = family;
+
+	if (filter.tb > 0) {
+		if (filter.tb < 256)
+			req.r.rtm_table = filter.tb;
+		else
+			addattr32(&req.n, sizeof(req), RTA_TABLE, filter.tb);
+	}
+	if (filter.protocolmask == -1)
+		req.r.rtm_protocol = filter.protocol;
+	if (filter.typemask == -1)
+		req.r.rtm_type = filter.type;
+	if (filter.oifmask == -1)
+		addattr32(&req.n, sizeof(req), RTA_OIF, filter.oif);
+
+	return rtnl_dump_request_n(rth, &req.n);
+}
+
 static int iproute_flush_cache(void)
 {
 #define ROUTE_FLUSH_PATH "/proc/sys/net/ipv4/route/flush"
@@ -1039,15 +1120,28 @@ static int iproute_flush_cache(void)
 }
 
 
-static int iproute_list_or_flush(int argc, char **argv, int flush)
+#define IPROUTE_LIST    0
+#define IPROUTE_FLUSH   1
+#define IPROUTE_SAVE    2
+
+static int iproute_list_or_flush(int argc, char **argv, int action)
 {
 	int do_ipv6 = preferred_family;
+	int flush = action == IPROUTE_FLUSH;
 	char *id = NULL;
 	char *od = NULL;
 
 	iproute_reset_filter();
 	filter.tb = RT_TABLE_MAIN;
 
+	if (action == IPROUTE_SAVE) {
+		if (isatty(STDOUT_FILENO)) {
+			fprintf(stderr, "Not sending a binary stream to stdout\n");
+			return -1;
+		}
+		filter.save = 1;
+	}
+
 	if (flush && argc <= 0) {
 		fprintf(stderr, "\"ip route flush\" requires arguments.\n");
 		return -1;
@@ -1218,7 +1312,7 @@ static int iproute_list_or_flush(int argc, char **argv, int flush)
 		filter.flushe = sizeof(flushb);
 
 		for (;;) {
-			if (rtnl_wilddump_request(&rth, do_ipv6, RTM_GETROUTE) < 0) {
+			if (iproute_dump_request(&rth, do_ipv6) < 0) {
 				perror("Cannot send dump request");
 				exit(1);
 			}
@@ -1255,7 +1349,7 @@ static int iproute_list_or_flush(int argc, char **argv, int flush)
 	}
 
 	if (!filter.cloned) {
-		if (rtnl_wilddump_request(&rth, do_ipv6, RTM_GETROUTE) < 0) {
+		if (iproute_dump_request(&rth, do_ipv6) < 0) {
 			perror("Cannot send dump request");
 			exit(1);
 		}
@@ -1440,10 +1534,19 @@ void iproute_reset_filter()
 	filter.msrc.bitlen = -1;
 }
 
+static int iproute_showdump(void)
+{
+	iproute_reset_filter();
+	ll_init_map(&rth);
+	if (rtnl_from_file(stdin, print_route, stdout) < 0)
+		exit(1);
+	exit(0);
+}
+
 int do_iproute(int argc, char **argv)
 {
 	if (argc < 1)
-		return iproute_list_or_flush(0, NULL, 0);
+		return iproute_list_or_flush(0, NULL, IPROUTE_LIST);
 
 	if (matches(*argv, "add") == 0)
 		return iproute_modify(RTM_NEWROUTE, NLM_F_CREATE|NLM_F_EXCL,
@@ -1468,11 +1571,15 @@ int do_iproute(int argc, char **argv)
 				      argc-1, argv+1);
 	if (matches(*argv, "list") == 0 || matches(*argv, "show") == 0
 	    || matches(*argv, "lst") == 0)
-		return iproute_list_or_flush(argc-1, argv+1, 0);
+		return iproute_list_or_flush(argc-1, argv+1, IPROUTE_LIST);
 	if (matches(*argv, "get") == 0)
 		return iproute_get(argc-1, argv+1);
 	if (matches(*argv, "flush") == 0)
-		return iproute_list_or_flush(argc-1, argv+1, 1);
+		return iproute_list_or_flush(argc-1, argv+1, IPROUTE_FLUSH);
+	if (matches(*argv, "save") == 0)
+		return iproute_list_or_flush(argc-1, argv+1, IPROUTE_SAVE);
+	if (matches(*argv, "showdump") == 0)
+		return iproute_showdump();
 	if (matches(*argv, "help") == 0)
 		usage();
 	fprintf(stderr, "Command \"%s\" is unknown, try \"ip route help\".\n", *argv);
@@ -22,13 +22,89 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/uio.h>
+#include <sys/poll.h>
 
 #include "libnetlink.h"
 
+#ifndef SOL_NETLINK
+#define SOL_NETLINK     270
+#endif
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK  12
+#endif
+
 int rcvbuf = 1024 * 1024;
 
+/* Each dump reads into a buffer of its own that only grows; callbacks
+ * may start a nested dump on another socket.  The kernel sizes its dump
+ * skbs after the largest read it has seen, up to 32K, so starting there
+ * gets the most entries per recvmsg().
+ */
+#define RTNL_DUMP_BUF   32768
+
+/* Queue of requests sent in one sendmsg() by the pipelined batch mode.
+ * Every request but the last of a window goes out without NLM_F_ACK, so
+ * the kernel only answers those that fail; the ACK of the last one tells
+ * when the whole window has been processed.
+ */
+#define RTNL_BATCH_BUF  (256 * 1024)
+
+/* rtnl_listen_batch() drains up to RTNL_LISTEN_VLEN datagrams per
+ * recvmmsg(); multicast notifications are at most a page or two each.
+ */
+#define RTNL_LISTEN_VLEN	32
+#define RTNL_LISTEN_BUF		16384
+
+#ifndef MSG_WAITFORONE
+struct mmsghdr {
+	struct msghdr	msg_hdr;
+	unsigned int	msg_len;
+};
+
+static int recvmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen,
+		    int flags, struct timespec *timeout)
+{
+	unsigned int i;
+	int status;
+
+	for (i = 0; i < vlen; i++) {
+		status = recvmsg(fd, &msgs[i].msg_hdr, flags);
+		if (status < 0)
+			return i ? (int)i : -1;
+		msgs[i].msg_len = status;
+	}
+	return i;
+}
+#endif
+
+struct rtnl_batch
+{
+	char            *buf;
+	int             size;
+	int             len;
+	int             last;
+	unsigned        window;
+	unsigned        count;
+	__u32           first_seq;
+	int             cookie;
+	int             *cookies;
+	rtnl_batch_err_t err;
+	void            *arg;
+};
+
+static void rtnl_batch_free(struct rtnl_handle *rth)
+{
+	if (rth->batch) {
+		free(rth->batch->cookies);
+		free(rth->batch->buf);
+		free(rth->batch);
+		rth->batch = NULL;
+	}
+}
+
 void rtnl_close(struct rtnl_handle *rth)
 {
+	rtnl_batch_free(rth);
 	if (rth->fd >= 0) {
 		close(rth->fd);
 		rth->fd = -1;
@@ -96,6 +172,9 @@ int rtnl_wilddump_request(struct rtnl_handle *rth, int family, int type)
 		struct rtgenmsg g;
 	} req;
 
+	if (rth->batch && rtnl_batch_flush(rth) < 0)
+		return -1;
+
 	memset(&req, 0, sizeof(req));
 	req.nlh.nlmsg_len = sizeof(req);
 	req.nlh.nlmsg_type = type;
@@ -109,6 +188,8 @@ int rtnl_wilddump_request(struct rtnl_handle *rth, int family, int type)
 
 int rtnl_send(struct rtnl_handle *rth, const char *buf, int len)
 {
+	if (rth->batch && rtnl_batch_flush(rth) < 0)
+		return -1;
 	return send(rth->fd, buf, len, 0);
 }
 
@@ -118,6 +199,9 @@ int rtnl_send_check(struct rtnl_handle *rth, const char *buf, int len)
 	int status;
 	char resp[1024];
 
+	if (rth->batch && rtnl_batch_flush(rth) < 0)
+		return -1;
+
 	status = send(rth->fd, buf, len, 0);
 	if (status < 0)
 		return status;
@@ -160,6 +244,9 @@ int rtnl_dump_request(struct rtnl_handle *rth, int type, void *req, int len)
 		.msg_iovlen = 2,
 	};
 
+	if (rth->batch && rtnl_batch_flush(rth) < 0)
+		return -1;
+
 	memset(&nladdr, 0, sizeof(nladdr));
 	nladdr.nl_family = AF_NETLINK;
 
@@ -172,8 +259,69 @@ int rtnl_dump_request(struct rtnl_handle *rth, int type, void *req, int len)
 	return sendmsg(rth->fd, &msg, 0);
 }
 
-int rtnl_dump_filter_l(struct rtnl_handle *rth,
-		       const struct rtnl_dump_filter_arg *arg)
+/* Send a dump request built by the caller, with the filter in its header
+ * and attributes.  Kernels that support strict checking apply the filter
+ * themselves.  Strict checking is only turned on for this request, since
+ * it also rejects the short rtgenmsg headers used by other dumps.  Older
+ * kernels ignore the filter, so callers must still check every entry.
+ */
+int rtnl_dump_request_n(struct rtnl_handle *rth, struct nlmsghdr *n)
+{
+	int on = 1, off = 0;
+	int strict, status;
+
+	if (rth->batch && rtnl_batch_flush(rth) < 0)
+		return -1;
+
+	n->nlmsg_flags = NLM_F_ROOT|NLM_F_MATCH|NLM_F_REQUEST;
+	n->nlmsg_pid = 0;
+	n->nlmsg_seq = rth->dump = ++rth->seq;
+
+	strict = setsockopt(rth->fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK,
+			    &on, sizeof(on)) == 0;
+	status = send(rth->fd, n, n->nlmsg_len, 0);
+	if (strict)
+		setsockopt(rth->fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK,
+			   &off, sizeof(off));
+	return status;
+}
+
+/* Peek at the length of the next datagram first, so that a message
+ * larger than the buffer is never silently truncated.
+ */
+static int rtnl_dump_recv(struct rtnl_handle *rth, struct msghdr *msg,
+			  char **bufp, int *lenp)
+{
+	struct iovec *iov = msg->msg_iov;
+	int len;
+
+	iov->iov_base = NULL;
+	iov->iov_len = 0;
+	len = recvmsg(rth->fd, msg, MSG_PEEK|MSG_TRUNC);
+	if (len < 0)
+		return len;
+
+	if (len < RTNL_DUMP_BUF)
+		len = RTNL_DUMP_BUF;
+	if (len > *lenp) {
+		char *buf = realloc(*bufp, len);
+
+		if (buf == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		*bufp = buf;
+		*lenp = len;
+	}
+
+	iov->iov_base = *bufp;
+	iov->iov_len = *lenp;
+	return recvmsg(rth->fd, msg, 0);
+}
+
+static int __rtnl_dump_filter_l(struct rtnl_handle *rth,
+				const struct rtnl_dump_filter_arg *arg,
+				char **bufp, int *lenp)
 {
 	struct sockaddr_nl nladdr;
 	struct iovec iov;
@@ -183,15 +331,12 @@ int rtnl_dump_filter_l(struct rtnl_handle *rth,
 		.msg_iov = &iov,
 		.msg_iovlen = 1,
 	};
-	char buf[16384];
 
-	iov.iov_base = buf;
 	while (1) {
 		int status;
 		const struct rtnl_dump_filter_arg *a;
 
-		iov.iov_len = sizeof(buf);
-		status = recvmsg(rth->fd, &msg, 0);
+		status = rtnl_dump_recv(rth, &msg, bufp, lenp);
 
 		if (status < 0) {
 			if (errno == EINTR || errno == EAGAIN)
@@ -207,7 +352,7 @@ int rtnl_dump_filter_l(struct rtnl_handle *rth,
 		}
 
 		for (a = arg; a->filter; a++) {
-			struct nlmsghdr *h = (struct nlmsghdr*)buf;
+			struct nlmsghdr *h = (struct nlmsghdr*)*bufp;
 
 			while (NLMSG_OK(h, status)) {
 				int err;
@@ -256,6 +401,18 @@ skip_it:
 	}
 }
 
+int rtnl_dump_filter_l(struct rtnl_handle *rth,
+		       const struct rtnl_dump_filter_arg *arg)
+{
+	char *buf = NULL;
+	int len = 0;
+	int ret;
+
+	ret = __rtnl_dump_filter_l(rth, arg, &buf, &len);
+	free(buf);
+	return ret;
+}
+
 int rtnl_dump_filter(struct rtnl_handle *rth,
 		     rtnl_filter_t filter,
 		     void *arg1,
@@ -270,6 +427,180 @@ int rtnl_dump_filter(struct rtnl_handle *rth,
 	return rtnl_dump_filter_l(rth, a);
 }
 
+int rtnl_batch_start(struct rtnl_handle *rth, unsigned window,
+		     rtnl_batch_err_t err, void *arg)
+{
+	struct rtnl_batch *b;
+	int sndbuf = RTNL_BATCH_BUF + 32;
+	socklen_t optlen = sizeof(sndbuf);
+
+	if (rth->batch)
+		return 0;
+
+	/* SO_SNDBUFFORCE gets past rmem_max when running privileged. */
+	if (setsockopt(rth->fd, SOL_SOCKET, SO_SNDBUFFORCE,
+		       &sndbuf, sizeof(sndbuf)) < 0)
+		setsockopt(rth->fd, SOL_SOCKET, SO_SNDBUF,
+			   &sndbuf, sizeof(sndbuf));
+	if (setsockopt(rth->fd, SOL_SOCKET, SO_RCVBUFFORCE,
+		       &rcvbuf, sizeof(rcvbuf)) < 0)
+		setsockopt(rth->fd, SOL_SOCKET, SO_RCVBUF,
+			   &rcvbuf, sizeof(rcvbuf));
+	if (getsockopt(rth->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen) < 0) {
+		perror("SO_SNDBUF");
+		return -1;
+	}
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		return -1;
+	/* netlink_sendmsg() refuses anything larger than sndbuf - 32 */
+	b->size = sndbuf - 32;
+	if (b->size > RTNL_BATCH_BUF)
+		b->size = RTNL_BATCH_BUF;
+	b->window = window ? : 1;
+	b->buf = malloc(b->size);
+	b->cookies = malloc(b->window * sizeof(int));
+	if (b->buf == NULL || b->cookies == NULL) {
+		free(b->buf);
+		free(b->cookies);
+		free(b);
+		return -1;
+	}
+	b->err = err;
+	b->arg = arg;
+	rth->batch = b;
+	return 0;
+}
+
+void rtnl_batch_cookie(struct rtnl_handle *rth, int cookie)
+{
+	if (rth->batch)
+		rth->batch->cookie = cookie;
+}
+
+static int rtnl_batch_recv(struct rtnl_handle *rth, __u32 last_seq)
+{
+	struct rtnl_batch *b = rth->batch;
+	struct sockaddr_nl nladdr;
+	struct iovec iov;
+	struct msghdr msg = {
+		.msg_name = &nladdr,
+		.msg_namelen = sizeof(nladdr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	char buf[32768];
+	int errors = 0;
+
+	iov.iov_base = buf;
+	while (1) {
+		struct nlmsghdr *h;
+		int status;
+
+		iov.iov_len = sizeof(buf);
+		status = recvmsg(rth->fd, &msg, 0);
+
+		if (status < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			/* ENOBUFS means error reports were dropped. */
+			fprintf(stderr, "netlink receive error %s (%d)\n",
+				strerror(errno), errno);
+			return -1;
+		}
+		if (status == 0) {
+			fprintf(stderr, "EOF on netlink\n");
+			return -1;
+		}
+
+		for (h = (struct nlmsghdr*)buf; NLMSG_OK(h, status);
+		     h = NLMSG_NEXT(h, status)) {
+			struct nlmsgerr *err = NLMSG_DATA(h);
+
+			if (nladdr.nl_pid != 0 ||
+			    h->nlmsg_pid != rth->local.nl_pid ||
+			    h->nlmsg_seq - b->first_seq > last_seq - b->first_seq ||
+			    h->nlmsg_type != NLMSG_ERROR)
+				continue;
+
+			if (h->nlmsg_len < NLMSG_LENGTH(sizeof(*err))) {
+				fprintf(stderr, "ERROR truncated\n");
+				errors++;
+			} else if (err->error) {
+				errno = -err->error;
+				perror("RTNETLINK answers");
+				errors++;
+				if (b->err)
+					b->err(b->cookies[h->nlmsg_seq - b->first_seq],
+					       b->arg);
+			}
+			if (h->nlmsg_seq == last_seq)
+				return errors;
+		}
+		if (msg.msg_flags & MSG_TRUNC) {
+			fprintf(stderr, "Message truncated\n");
+			continue;
+		}
+	}
+}
+
+int rtnl_batch_flush(struct rtnl_handle *rth)
+{
+	struct rtnl_batch *b = rth->batch;
+	struct nlmsghdr *last;
+	int status;
+
+	if (b == NULL || b->count == 0)
+		return 0;
+
+	last = (struct nlmsghdr *)(b->buf + b->last);
+	last->nlmsg_flags |= NLM_F_ACK;
+
+	status = send(rth->fd, b->buf, b->len, 0);
+	b->count = 0;
+	b->len = 0;
+	if (status < 0) {
+		perror("Cannot talk to rtnetlink");
+		return -1;
+	}
+	return rtnl_batch_recv(rth, last->nlmsg_seq);
+}
+
+int rtnl_batch_end(struct rtnl_handle *rth)
+{
+	int ret = rtnl_batch_flush(rth);
+
+	rtnl_batch_free(rth);
+	return ret;
+}
+
+static int rtnl_batch_add(struct rtnl_handle *rth, struct nlmsghdr *n)
+{
+	struct rtnl_batch *b = rth->batch;
+	int len = NLMSG_ALIGN(n->nlmsg_len);
+
+	if (b->count == b->window || b->len + len > b->size) {
+		if (rtnl_batch_flush(rth) < 0)
+			return -1;
+	}
+	if (len > b->size) {
+		fprintf(stderr, "Request of %d bytes exceeds batch buffer\n",
+			len);
+		return -1;
+	}
+
+	n->nlmsg_seq = ++rth->seq;
+	n->nlmsg_flags &= ~NLM_F_ACK;
+	if (b->count == 0)
+		b->first_seq = n->nlmsg_seq;
+	b->cookies[b->count++] = b->cookie;
+	b->last = b->len;
+	memcpy(b->buf + b->len, n, n->nlmsg_len);
+	b->len += len;
+	return 0;
+}
+
 int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 	      unsigned groups, struct nlmsghdr *answer,
 	      rtnl_filter_t junk,
@@ -291,6 +622,13 @@ int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n, pid_t peer,
 	};
 	char   buf[16384];
 
+	if (rtnl->batch) {
+		if (answer == NULL && peer == 0 && groups == 0 && junk == NULL)
+			return rtnl_batch_add(rtnl, n);
+		if (rtnl_batch_flush(rtnl) < 0)
+			return -1;
+	}
+
 	memset(&nladdr, 0, sizeof(nladdr));
 	nladdr.nl_family = AF_NETLINK;
 	nladdr.nl_pid = peer;
@@ -470,6 +808,125 @@ int rtnl_listen(struct rtnl_handle *rtnl,
 	}
 }
 
+static int rtnl_listen_msgs(struct rtnl_listen_ctl *ctl, struct msghdr *msg,
+			    int status, rtnl_filter_t handler, void *jarg)
+{
+	struct sockaddr_nl *nladdr = msg->msg_name;
+	struct nlmsghdr *h;
+
+	if (msg->msg_namelen != sizeof(*nladdr)) {
+		fprintf(stderr, "Sender address length == %d\n", msg->msg_namelen);
+		exit(1);
+	}
+	for (h = msg->msg_iov->iov_base; status >= sizeof(*h); ) {
+		int err;
+		int len = h->nlmsg_len;
+		int l = len - sizeof(*h);
+
+		if (l<0 || len>status) {
+			if (msg->msg_flags & MSG_TRUNC) {
+				fprintf(stderr, "Truncated message\n");
+				return -1;
+			}
+			fprintf(stderr, "!!!malformed message: len=%d\n", len);
+			exit(1);
+		}
+
+		ctl->msgs++;
+		err = handler(nladdr, h, jarg);
+		if (err < 0)
+			return err;
+
+		status -= NLMSG_ALIGN(len);
+		h = (struct nlmsghdr*)((char*)h + NLMSG_ALIGN(len));
+	}
+	if (msg->msg_flags & MSG_TRUNC) {
+		fprintf(stderr, "Message truncated\n");
+		return 0;
+	}
+	if (status) {
+		fprintf(stderr, "!!!Remnant of size %d\n", status);
+		exit(1);
+	}
+	return 0;
+}
+
+int rtnl_listen_batch(struct rtnl_handle *rtnl, rtnl_filter_t handler,
+		      void *jarg, struct rtnl_listen_ctl *ctl)
+{
+	struct sockaddr_nl nladdr[RTNL_LISTEN_VLEN];
+	struct iovec iov[RTNL_LISTEN_VLEN];
+	struct mmsghdr msgs[RTNL_LISTEN_VLEN];
+	struct pollfd pfd = { .fd = rtnl->fd, .events = POLLIN };
+	int timeout = -1;
+	int i, cnt, err = 0;
+	char *buf;
+
+	buf = malloc(RTNL_LISTEN_VLEN * RTNL_LISTEN_BUF);
+	if (buf == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < RTNL_LISTEN_VLEN; i++) {
+		iov[i].iov_base = buf + i * RTNL_LISTEN_BUF;
+		iov[i].iov_len = RTNL_LISTEN_BUF;
+		msgs[i].msg_hdr.msg_name = &nladdr[i];
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (!ctl->stop) {
+		for (i = 0; i < RTNL_LISTEN_VLEN; i++)
+			msgs[i].msg_hdr.msg_namelen = sizeof(nladdr[i]);
+		cnt = recvmmsg(rtnl->fd, msgs, RTNL_LISTEN_VLEN, MSG_DONTWAIT,
+			       NULL);
+		if (cnt < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				/* Drained: let the caller flush, then
+				 * sleep until more arrives or its timer.
+				 */
+				if (ctl->idle)
+					timeout = ctl->idle(jarg);
+				if (ctl->stop)
+					break;
+				if (poll(&pfd, 1, timeout) < 0 &&
+				    errno != EINTR) {
+					perror("poll");
+					err = -1;
+					break;
+				}
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				ctl->overruns++;
+				fprintf(stderr, "netlink overrun, events lost "
+					"(%lu overruns)\n", ctl->overruns);
+				continue;
+			}
+			fprintf(stderr, "netlink receive error %s (%d)\n",
+				strerror(errno), errno);
+			err = -1;
+			break;
+		}
+		if (cnt == 0) {
+			fprintf(stderr, "EOF on netlink\n");
+			err = -1;
+			break;
+		}
+		ctl->reads++;
+		for (i = 0; i < cnt && err == 0; i++)
+			err = rtnl_listen_msgs(ctl, &msgs[i].msg_hdr,
+					       msgs[i].msg_len, handler, jarg);
+		if (err < 0)
+			break;
+	}
+	free(buf);
+	return err;
+}
+
 int rtnl_from_file(FILE *rtnl, rtnl_filter_t handler,
 		   void *jarg)
 {
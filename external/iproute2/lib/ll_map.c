@@ -18,6 +18,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <errno.h>
 
 #include "libnetlink.h"
 #include "ll_map.h"
@@ -27,6 +28,7 @@ extern unsigned int if_nametoindex (const char *);
 struct idxmap
 {
 	struct idxmap * next;
+	struct idxmap * name_next;
 	unsigned	index;
 	int		type;
 	int		alen;
@@ -35,7 +37,78 @@ struct idxmap
 	char		name[16];
 };
 
-static struct idxmap *idxmap[16];
+/* Links are hashed both by index and by name.  Nothing is loaded up
+ * front: a miss asks the kernel for that one link, and only after
+ * LL_LAZY_MAX misses is the whole table dumped at once.  Lookups use a
+ * socket of their own, so they are safe from inside a dump callback and
+ * do not disturb a batch queued on the caller's handle.  The map lives
+ * as long as the process, so batch lines reuse it.
+ */
+#define IDXMAP_SIZE     1024
+#define LL_LAZY_MAX     32
+
+static struct idxmap *idxmap[IDXMAP_SIZE];
+static struct idxmap *namemap[IDXMAP_SIZE];
+
+static struct rtnl_handle ll_rth = { .fd = -1 };
+static int ll_misses;
+static int ll_loaded;
+
+static unsigned namehash(const char *name)
+{
+	unsigned h = 0;
+
+	while (*name)
+		h = h * 31 + (unsigned char)*name++;
+	return h & (IDXMAP_SIZE - 1);
+}
+
+static struct idxmap *ll_get_by_index(unsigned idx)
+{
+	struct idxmap *im;
+
+	for (im = idxmap[idx & (IDXMAP_SIZE - 1)]; im; im = im->next)
+		if (im->index == idx)
+			return im;
+	return NULL;
+}
+
+static struct idxmap *ll_get_by_name(const char *name)
+{
+	struct idxmap *im;
+
+	for (im = namemap[namehash(name)]; im; im = im->name_next)
+		if (strcmp(im->name, name) == 0)
+			return im;
+	return NULL;
+}
+
+static void ll_name_unlink(struct idxmap *im)
+{
+	struct idxmap **imp;
+
+	for (imp = &namemap[namehash(im->name)]; *imp; imp = &(*imp)->name_next) {
+		if (*imp == im) {
+			*imp = im->name_next;
+			break;
+		}
+	}
+}
+
+static void ll_forget_index(unsigned idx)
+{
+	struct idxmap **imp, *im;
+
+	for (imp = &idxmap[idx & (IDXMAP_SIZE - 1)]; (im = *imp) != NULL;
+	     imp = &im->next) {
+		if (im->index == idx) {
+			*imp = im->next;
+			ll_name_unlink(im);
+			free(im);
+			return;
+		}
+	}
+}
 
 int ll_remember_index(const struct sockaddr_nl *who,
 		      struct nlmsghdr *n, void *arg)
@@ -44,20 +117,25 @@ int ll_remember_index(const struct sockaddr_nl *who,
 	struct ifinfomsg *ifi = NLMSG_DATA(n);
 	struct idxmap *im, **imp;
 	struct rtattr *tb[IFLA_MAX+1];
+	int rename = 1;
 
-	if (n->nlmsg_type != RTM_NEWLINK)
+	if (n->nlmsg_type != RTM_NEWLINK && n->nlmsg_type != RTM_DELLINK)
 		return 0;
 
 	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(ifi)))
 		return -1;
 
+	if (n->nlmsg_type == RTM_DELLINK) {
+		ll_forget_index(ifi->ifi_index);
+		return 0;
+	}
 
 	memset(tb, 0, sizeof(tb));
 	parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(n));
 	if (tb[IFLA_IFNAME] == NULL)
 		return 0;
 
-	h = ifi->ifi_index&0xF;
+	h = ifi->ifi_index & (IDXMAP_SIZE - 1);
 
 	for (imp=&idxmap[h]; (im=*imp)!=NULL; imp = &im->next)
 		if (im->index == ifi->ifi_index)
@@ -70,6 +148,10 @@ int ll_remember_index(const struct sockaddr_nl *who,
 		im->next = *imp;
 		im->index = ifi->ifi_index;
 		*imp = im;
+	} else if (strcmp(im->name, RTA_DATA(tb[IFLA_IFNAME])) != 0) {
+		ll_name_unlink(im);
+	} else {
+		rename = 0;
 	}
 
 	im->type = ifi->ifi_type;
@@ -84,19 +166,104 @@ int ll_remember_index(const struct sockaddr_nl *who,
 		im->alen = 0;
 		memset(im->addr, 0, sizeof(im->addr));
 	}
-	strcpy(im->name, RTA_DATA(tb[IFLA_IFNAME]));
+	if (rename) {
+		strncpy(im->name, RTA_DATA(tb[IFLA_IFNAME]), sizeof(im->name));
+		im->name[sizeof(im->name) - 1] = 0;
+		h = namehash(im->name);
+		im->name_next = namemap[h];
+		namemap[h] = im;
+	}
 	return 0;
 }
 
+static int ll_open(void)
+{
+	if (ll_rth.fd < 0 && rtnl_open(&ll_rth, 0) < 0)
+		return -1;
+	return 0;
+}
+
+static void ll_load_all(void)
+{
+	ll_loaded = 1;
+	if (ll_open() < 0)
+		return;
+	if (rtnl_wilddump_request(&ll_rth, AF_UNSPEC, RTM_GETLINK) < 0 ||
+	    rtnl_dump_filter(&ll_rth, ll_remember_index, NULL, NULL, NULL) < 0)
+		fprintf(stderr, "Cannot dump links\n");
+}
+
+/* Ask for a single link, by index or by name.  Failures are quiet: the
+ * caller decides whether an unknown link is an error.
+ */
+static struct idxmap *ll_fetch(unsigned idx, const char *name)
+{
+	struct {
+		struct nlmsghdr		n;
+		struct ifinfomsg	i;
+		char			buf[64];
+	} req;
+	char buf[16384];
+	struct nlmsghdr *h;
+	int status;
+
+	if (!ll_loaded && ++ll_misses > LL_LAZY_MAX) {
+		ll_load_all();
+		return name ? ll_get_by_name(name) : ll_get_by_index(idx);
+	}
+	if (ll_open() < 0)
+		return NULL;
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.n.nlmsg_type = RTM_GETLINK;
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.n.nlmsg_seq = ++ll_rth.seq;
+	req.i.ifi_family = AF_UNSPEC;
+	req.i.ifi_index = idx;
+	if (name) {
+		if (strlen(name) >= sizeof(((struct idxmap *)0)->name))
+			return NULL;
+		addattr_l(&req.n, sizeof(req), IFLA_IFNAME, name,
+			  strlen(name) + 1);
+	}
+
+	if (send(ll_rth.fd, &req, req.n.nlmsg_len, 0) < 0)
+		return NULL;
+
+	for (;;) {
+		status = recv(ll_rth.fd, buf, sizeof(buf), 0);
+		if (status < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return NULL;
+		}
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, status);
+		     h = NLMSG_NEXT(h, status)) {
+			if (h->nlmsg_seq != ll_rth.seq)
+				continue;
+			if (h->nlmsg_type != RTM_NEWLINK)
+				return NULL;
+			ll_remember_index(NULL, h, NULL);
+			return name ? ll_get_by_name(name) :
+				      ll_get_by_index(idx);
+		}
+		if (status == 0)
+			return NULL;
+	}
+}
+
 const char *ll_idx_n2a(unsigned idx, char *buf)
 {
 	struct idxmap *im;
 
 	if (idx == 0)
 		return "*";
-	for (im = idxmap[idx&0xF]; im; im = im->next)
-		if (im->index == idx)
-			return im->name;
+	im = ll_get_by_index(idx);
+	if (im == NULL)
+		im = ll_fetch(idx, NULL);
+	if (im)
+		return im->name;
 	snprintf(buf, 16, "if%d", idx);
 	return buf;
 }
@@ -115,10 +282,10 @@ int ll_index_to_type(unsigned idx)
 
 	if (idx == 0)
 		return -1;
-	for (im = idxmap[idx&0xF]; im; im = im->next)
-		if (im->index == idx)
-			return im->type;
-	return -1;
+	im = ll_get_by_index(idx);
+	if (im == NULL)
+		im = ll_fetch(idx, NULL);
+	return im ? im->type : -1;
 }
 
 unsigned ll_index_to_flags(unsigned idx)
@@ -127,11 +294,10 @@ unsigned ll_index_to_flags(unsigned idx)
 
 	if (idx == 0)
 		return 0;
-
-	for (im = idxmap[idx&0xF]; im; im = im->next)
-		if (im->index == idx)
-			return im->flags;
-	return 0;
+	im = ll_get_by_index(idx);
+	if (im == NULL)
+		im = ll_fetch(idx, NULL);
+	return im ? im->flags : 0;
 }
 
 unsigned ll_index_to_addr(unsigned idx, unsigned char *addr,
@@ -141,54 +307,36 @@ unsigned ll_index_to_addr(unsigned idx, unsigned char *addr,
 
 	if (idx == 0)
 		return 0;
-
-	for (im = idxmap[idx&0xF]; im; im = im->next) {
-		if (im->index == idx) {
-			if (alen > sizeof(im->addr))
-				alen = sizeof(im->addr);
-			if (alen > im->alen)
-				alen = im->alen;
-			memcpy(addr, im->addr, alen);
-			return alen;
-		}
-	}
-	return 0;
+	im = ll_get_by_index(idx);
+	if (im == NULL)
+		im = ll_fetch(idx, NULL);
+	if (im == NULL)
+		return 0;
+	if (alen > sizeof(im->addr))
+		alen = sizeof(im->addr);
+	if (alen > im->alen)
+		alen = im->alen;
+	memcpy(addr, im->addr, alen);
+	return alen;
 }
 
 unsigned ll_name_to_index(const char *name)
 {
-	static char ncache[16];
-	static int icache;
 	struct idxmap *im;
-	int i;
 
 	if (name == NULL)
 		return 0;
-	if (icache && strcmp(name, ncache) == 0)
-		return icache;
-	for (i=0; i<16; i++) {
-		for (im = idxmap[i]; im; im = im->next) {
-			if (strcmp(im->name, name) == 0) {
-				icache = im->index;
-				strcpy(ncache, name);
-				return im->index;
-			}
-		}
-	}
+	im = ll_get_by_name(name);
+	if (im == NULL)
+		im = ll_fetch(0, name);
+	if (im)
+		return im->index;
 
 	return if_nametoindex(name);
 }
 
+/* Kept for its callers; the map now fills itself on demand. */
 int ll_init_map(struct rtnl_handle *rth)
 {
-	if (rtnl_wilddump_request(rth, AF_UNSPEC, RTM_GETLINK) < 0) {
-		perror("Cannot send dump request");
-		exit(1);
-	}
-
-	if (rtnl_dump_filter(rth, ll_remember_index, &idxmap, NULL, NULL) < 0) {
-		fprintf(stderr, "Dump terminated\n");
-		exit(1);
-	}
 	return 0;
 }
@@ -212,9 +212,9 @@ static void usage(void)
 #ifdef ANDROID
 			"       tc [-force]\n"
 #else
-			"       tc [-force] -batch filename\n"
+			"       tc [-force] [-window N] -batch filename\n"
 #endif
-	                "where  OBJECT := { qdisc | class | filter | action | monitor }\n"
+	                "where  OBJECT := { qdisc | class | filter | action | monitor | u32tree }\n"
 	                "       OPTIONS := { -s[tatistics] | -d[etails] | -r[aw] | -p[retty] | -b[atch] [filename] }\n");
 }
 
@@ -235,6 +235,9 @@ static int do_cmd(int argc, char **argv)
 	if (matches(*argv, "monitor") == 0)
 		return do_tcmonitor(argc-1, argv+1);
 
+	if (matches(*argv, "u32tree") == 0)
+		return do_u32tree(argc-1, argv+1);
+
 	if (matches(*argv, "help") == 0) {
 		usage();
 		return 0;
@@ -246,6 +249,22 @@ static int do_cmd(int argc, char **argv)
 }
 
 #ifndef ANDROID
+static unsigned int batch_window;
+static int batch_failed;
+
+static void batch_error(int lineno, void *arg)
+{
+	fprintf(stderr, "Command failed %s:%d\n", (char *)arg, lineno);
+	batch_failed = 1;
+}
+
+/* A command that exit()s still gets the lines queued before it sent. */
+static void batch_exit(void)
+{
+	if (rth.batch)
+		rtnl_batch_end(&rth);
+}
+
 static int batch(const char *name)
 {
 	char *line = NULL;
@@ -267,6 +286,15 @@ static int batch(const char *name)
 		return -1;
 	}
 
+	if (batch_window > 1) {
+		if (rtnl_batch_start(&rth, batch_window, batch_error,
+				     (void *)name) < 0) {
+			fprintf(stderr, "Cannot start netlink batch\n");
+			return -1;
+		}
+		atexit(batch_exit);
+	}
+
 	cmdlineno = 0;
 	while (getcmdline(&line, &len, stdin) != -1) {
 		char *largv[100];
@@ -276,16 +304,25 @@ static int batch(const char *name)
 		if (largc == 0)
 			continue;	/* blank line */
 
+		rtnl_batch_cookie(&rth, cmdlineno);
 		if (do_cmd(largc, largv)) {
 			fprintf(stderr, "Command failed %s:%d\n", name, cmdlineno);
 			ret = 1;
 			if (!force)
 				break;
 		}
+		if (batch_failed) {
+			ret = 1;
+			if (!force)
+				break;
+		}
 	}
 	if (line)
 		free(line);
 
+	if (rtnl_batch_end(&rth) < 0 || batch_failed)
+		ret = 1;
+
 	rtnl_close(&rth);
 	return ret;
 }
@@ -327,6 +364,12 @@ int main(int argc, char **argv)
 			if (argc > 2)
 				batchfile = argv[2];
 			argc--;	argv++;
+		} else if (matches(argv[1], "-window") == 0) {
+			if (argc <= 2 || get_unsigned(&batch_window, argv[2], 0)) {
+				fprintf(stderr, "Invalid window size\n");
+				return -1;
+			}
+			argc--;	argv++;
 #endif
 		} else {
 			fprintf(stderr, "Option \"%s\" is unknown, try \"tc -help\".\n", argv[1]);
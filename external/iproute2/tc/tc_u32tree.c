@@ -0,0 +1,490 @@
+/*
+ * tc_u32tree.c		"tc u32tree": build a hashed u32 filter tree
+ *			from a list of IPv4 prefixes.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+#include "tc_util.h"
+#include "tc_common.h"
+
+/*
+ * Each line of the rule list is "PREFIX ARGS...", e.g.
+ *
+ *	10.1.2.3	flowid 1:10
+ *	10.1.3.0/24	classid 1:20 police rate 1mbit burst 10k drop
+ *
+ * The rules are spread over u32 hash tables of 256 buckets.  A bucket
+ * holding more than "leaf" rules becomes a link to a new table, hashed
+ * on whichever remaining address octet separates its rules best.
+ * Rules too short to be hashed on that octet stay in the bucket, after
+ * the link, so longer prefixes are tried first.  Within a bucket, rules
+ * keep the order of the list.
+ */
+
+#define U32TREE_LEAF	8
+#define U32TREE_WINDOW	256
+#define U32TREE_HTBASE	0x100
+#define U32TREE_HTMAX	0xfff
+#define U32TREE_HTROOT	0x800
+
+struct u32_rule
+{
+	__u32		addr;
+	int		plen;
+	int		lineno;
+	char		*args;
+};
+
+struct u32_tree
+{
+	const char	*dev;
+	const char	*parent;
+	const char	*prio;
+	const char	*name;
+	int		src;
+	int		leaf;
+	int		dry;
+	unsigned	next_ht;
+	int		tables;
+	int		depth;
+	int		buckets;
+	int		max_bucket;
+	int		hist[17];
+};
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: tc u32tree dev STRING parent CLASSID [ prio PRIO ]\n");
+	fprintf(stderr, "       [ match { dst | src } ] [ leaf NUMBER ] [ htbase HTID ]\n");
+	fprintf(stderr, "       [ file FILE ] [ dry ]\n");
+	fprintf(stderr, "Where: FILE has one \"PREFIX ARGS...\" rule per line, ARGS being\n");
+	fprintf(stderr, "       u32 options such as \"flowid 1:10\".\n");
+}
+
+static int u32tree_error_seen;
+
+static void u32tree_error(int lineno, void *arg)
+{
+	fprintf(stderr, "u32tree: rule %s:%d failed\n", (char *)arg, lineno);
+	u32tree_error_seen = 1;
+}
+
+static int u32tree_cmd(struct u32_tree *t, int lineno, const char *fmt, ...)
+{
+	char line[1024];
+	char *argv[100];
+	int argc;
+	va_list ap;
+	int len, n;
+
+	len = snprintf(line, sizeof(line), "filter add dev %s parent %s "
+		       "protocol ip prio %s ", t->dev, t->parent, t->prio);
+	if (len < 0 || len >= (int)sizeof(line))
+		goto too_long;
+	va_start(ap, fmt);
+	n = vsnprintf(line + len, sizeof(line) - len, fmt, ap);
+	va_end(ap);
+	if (n < 0 || n >= (int)sizeof(line) - len)
+		goto too_long;
+
+	if (t->dry) {
+		printf("%s\n", line);
+		return 0;
+	}
+
+	argc = makeargs(line, argv, 100);
+	if (rth.batch && t->name)
+		rtnl_batch_cookie(&rth, lineno);
+	if (do_filter(argc - 1, argv + 1)) {
+		fprintf(stderr, "u32tree: rule %s:%d failed\n",
+			t->name ? t->name : "-", lineno);
+		return -1;
+	}
+	return 0;
+
+too_long:
+	fprintf(stderr, "u32tree: rule %s:%d: filter command too long\n",
+		t->name ? t->name : "-", lineno);
+	return -1;
+}
+
+static void u32tree_bucket(struct u32_tree *t, unsigned ht, unsigned bucket,
+			   int size)
+{
+	int i = 0;
+
+	if (show_details)
+		fprintf(t->dry ? stderr : stdout, "u32tree: bucket %x:%x: %d\n",
+			ht, bucket, size);
+
+	while ((1 << i) <= size && i < 16)
+		i++;
+	t->hist[i]++;
+	t->buckets++;
+	if (size > t->max_bucket)
+		t->max_bucket = size;
+}
+
+static const char *u32tree_addr(__u32 addr, char *buf)
+{
+	addr = htonl(addr);
+	return inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
+}
+
+static int u32tree_leaves(struct u32_tree *t, struct u32_rule **r, int n,
+			  unsigned ht, unsigned bucket)
+{
+	char abuf[INET_ADDRSTRLEN];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (u32tree_cmd(t, r[i]->lineno,
+				"u32 ht %x:%x: match ip %s %s/%d %s",
+				ht, bucket, t->src ? "src" : "dst",
+				u32tree_addr(r[i]->addr, abuf),
+				r[i]->plen, r[i]->args))
+			return -1;
+	}
+	return 0;
+}
+
+/* The octet not hashed yet with the most distinct values, or -1. */
+static int u32tree_pick(struct u32_rule **r, int n, unsigned used)
+{
+	int best = -1, best_count = 1;
+	int k;
+
+	for (k = 0; k < 4; k++) {
+		unsigned char seen[256];
+		int i, count = 0;
+
+		if (used & (1 << k))
+			continue;
+		memset(seen, 0, sizeof(seen));
+		for (i = 0; i < n; i++) {
+			unsigned v;
+
+			if (r[i]->plen < 8 * (k + 1))
+				continue;
+			v = (r[i]->addr >> (24 - 8 * k)) & 0xff;
+			if (!seen[v]) {
+				seen[v] = 1;
+				count++;
+			}
+		}
+		if (count > best_count) {
+			best = k;
+			best_count = count;
+		}
+	}
+	return best;
+}
+
+static int u32tree_build(struct u32_tree *t, struct u32_rule **r, int n,
+			 unsigned ht, unsigned bucket, unsigned used, int depth)
+{
+	struct u32_rule **sorted;
+	char abuf[INET_ADDRSTRLEN];
+	int start[257];
+	unsigned diff = 0;
+	__u32 prefix;
+	int k, i, v, nhash, nrest, plen;
+	unsigned child;
+
+	if (depth > t->depth)
+		t->depth = depth;
+
+	k = n > t->leaf ? u32tree_pick(r, n, used) : -1;
+	if (k < 0) {
+		u32tree_bucket(t, ht, bucket, n);
+		return u32tree_leaves(t, r, n, ht, bucket);
+	}
+
+	child = t->next_ht++;
+	if (child == U32TREE_HTROOT)
+		child = t->next_ht++;
+	if (child > U32TREE_HTMAX) {
+		fprintf(stderr, "u32tree: out of hash table IDs\n");
+		return -1;
+	}
+	t->tables++;
+
+	/* Counting sort on octet k; rules too short for it go last. */
+	sorted = malloc(n * sizeof(*sorted));
+	if (sorted == NULL)
+		return -1;
+	memset(start, 0, sizeof(start));
+	for (i = 0; i < n; i++) {
+		v = r[i]->plen >= 8 * (k + 1) ?
+			(r[i]->addr >> (24 - 8 * k)) & 0xff : 256;
+		start[v]++;
+	}
+	nrest = start[256];
+	nhash = n - nrest;
+	for (v = 256, i = n; v >= 0; v--) {
+		i -= start[v];
+		start[v] = i;
+	}
+	for (i = 0; i < n; i++) {
+		v = r[i]->plen >= 8 * (k + 1) ?
+			(r[i]->addr >> (24 - 8 * k)) & 0xff : 256;
+		sorted[start[v]++] = r[i];
+	}
+
+	if (u32tree_cmd(t, r[0]->lineno, "handle %x: u32 divisor 256", child))
+		goto fail;
+
+	for (i = 0; i < nhash; i = start[v]) {
+		v = (sorted[i]->addr >> (24 - 8 * k)) & 0xff;
+		if (u32tree_build(t, sorted + i, start[v] - i, child, v,
+				  used | (1 << k), depth + 1))
+			goto fail;
+	}
+
+	/* Link on the prefix the hashed rules have in common. */
+	plen = 32;
+	for (i = 0; i < nhash; i++) {
+		diff |= sorted[i]->addr ^ sorted[0]->addr;
+		if (sorted[i]->plen < plen)
+			plen = sorted[i]->plen;
+	}
+	for (i = 0; i < plen && !(diff & (0x80000000 >> i)); i++)
+		;
+	plen = i;
+	prefix = plen ? sorted[0]->addr & (~0U << (32 - plen)) : 0;
+
+	if (plen) {
+		if (u32tree_cmd(t, sorted[0]->lineno, "u32 ht %x:%x: match ip %s %s/%d "
+				"hashkey mask 0x%08x at %d link %x:",
+				ht, bucket, t->src ? "src" : "dst",
+				u32tree_addr(prefix, abuf), plen, 0xff000000 >> (8 * k),
+				t->src ? 12 : 16, child))
+			goto fail;
+	} else {
+		if (u32tree_cmd(t, sorted[0]->lineno, "u32 ht %x:%x: match u32 0 0 at 0 "
+				"hashkey mask 0x%08x at %d link %x:",
+				ht, bucket, 0xff000000 >> (8 * k),
+				t->src ? 12 : 16, child))
+			goto fail;
+	}
+
+	u32tree_bucket(t, ht, bucket, 1 + nrest);
+	if (u32tree_leaves(t, sorted + nhash, nrest, ht, bucket))
+		goto fail;
+
+	free(sorted);
+	return 0;
+fail:
+	free(sorted);
+	return -1;
+}
+
+static int u32tree_read(FILE *fp, const char *name, struct u32_rule **rules,
+			int *nrules)
+{
+	struct u32_rule *r = NULL;
+	int n = 0, size = 0, lineno = 0;
+	char line[1024];
+
+	/* fgets() rather than getline(), which bionic lacks */
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *p, *pfx, *args;
+		inet_prefix addr;
+
+		lineno++;
+		if (strchr(line, '\n') == NULL && !feof(fp)) {
+			fprintf(stderr, "u32tree: %s:%d: line too long\n",
+				name, lineno);
+			goto fail;
+		}
+		if ((p = strchr(line, '#')) != NULL)
+			*p = 0;
+		pfx = line + strspn(line, " \t\r\n");
+		if (*pfx == 0)
+			continue;
+		args = pfx + strcspn(pfx, " \t\r\n");
+		if (*args)
+			*args++ = 0;
+		args += strspn(args, " \t");
+		args[strcspn(args, "\r\n")] = 0;
+
+		if (get_prefix_1(&addr, pfx, AF_INET) || addr.family != AF_INET) {
+			fprintf(stderr, "u32tree: %s:%d: \"%s\" is not an IPv4 prefix\n",
+				name, lineno, pfx);
+			goto fail;
+		}
+		if (n == size) {
+			struct u32_rule *nr;
+
+			size = size ? size * 2 : 1024;
+			nr = realloc(r, size * sizeof(*r));
+			if (nr == NULL)
+				goto fail;
+			r = nr;
+		}
+		r[n].addr = ntohl(addr.data[0]);
+		r[n].plen = addr.bitlen;
+		if (r[n].plen < 32)
+			r[n].addr &= r[n].plen ? ~0U << (32 - r[n].plen) : 0;
+		r[n].lineno = lineno;
+		r[n].args = strdup(args);
+		if (r[n].args == NULL)
+			goto fail;
+		n++;
+	}
+	*rules = r;
+	*nrules = n;
+	return 0;
+fail:
+	while (n > 0)
+		free(r[--n].args);
+	free(r);
+	return -1;
+}
+
+static void u32tree_report(struct u32_tree *t, int nrules)
+{
+	FILE *fp = t->dry ? stderr : stdout;
+	int i;
+
+	fprintf(fp, "u32tree: %d rules, %d hash tables, depth %d, "
+		"%d buckets, largest %d\n", nrules, t->tables, t->depth,
+		t->buckets, t->max_bucket);
+	fprintf(fp, "u32tree: bucket sizes:");
+	for (i = 0; i < 17; i++) {
+		if (t->hist[i] == 0)
+			continue;
+		if (i <= 1)
+			fprintf(fp, " %d:%d", i, t->hist[i]);
+		else
+			fprintf(fp, " %d-%d:%d", 1 << (i - 1), (1 << i) - 1,
+				t->hist[i]);
+	}
+	fprintf(fp, "\n");
+}
+
+int do_u32tree(int argc, char **argv)
+{
+	struct u32_tree t;
+	struct u32_rule *rules = NULL, **r;
+	const char *file = NULL;
+	FILE *fp = stdin;
+	int nrules = 0, own_batch = 0;
+	int i, ret = -1;
+
+	memset(&t, 0, sizeof(t));
+	u32tree_error_seen = 0;
+	t.prio = "1";
+	t.leaf = U32TREE_LEAF;
+	t.next_ht = U32TREE_HTBASE;
+
+	while (argc > 0) {
+		if (strcmp(*argv, "dev") == 0) {
+			NEXT_ARG();
+			t.dev = *argv;
+		} else if (strcmp(*argv, "parent") == 0) {
+			NEXT_ARG();
+			t.parent = *argv;
+		} else if (matches(*argv, "priority") == 0 ||
+			   matches(*argv, "preference") == 0) {
+			NEXT_ARG();
+			t.prio = *argv;
+		} else if (strcmp(*argv, "match") == 0) {
+			NEXT_ARG();
+			if (strcmp(*argv, "src") == 0)
+				t.src = 1;
+			else if (strcmp(*argv, "dst") != 0)
+				invarg("match must be \"src\" or \"dst\"", *argv);
+		} else if (strcmp(*argv, "leaf") == 0) {
+			NEXT_ARG();
+			if (get_integer(&t.leaf, *argv, 0) || t.leaf < 1)
+				invarg("invalid leaf size", *argv);
+		} else if (strcmp(*argv, "htbase") == 0) {
+			NEXT_ARG();
+			if (get_unsigned(&t.next_ht, *argv, 16) ||
+			    t.next_ht == 0 || t.next_ht > U32TREE_HTMAX)
+				invarg("invalid hash table ID", *argv);
+		} else if (strcmp(*argv, "file") == 0) {
+			NEXT_ARG();
+			file = *argv;
+		} else if (strcmp(*argv, "dry") == 0) {
+			t.dry = 1;
+		} else if (matches(*argv, "help") == 0) {
+			usage();
+			return 0;
+		} else {
+			fprintf(stderr, "What is \"%s\"? Try \"tc u32tree help\".\n",
+				*argv);
+			return -1;
+		}
+		argc--; argv++;
+	}
+
+	if (t.dev == NULL || t.parent == NULL) {
+		usage();
+		return -1;
+	}
+
+	if (file && strcmp(file, "-") != 0) {
+		fp = fopen(file, "r");
+		if (fp == NULL) {
+			fprintf(stderr, "Cannot open file \"%s\" for reading: %s\n",
+				file, strerror(errno));
+			return -1;
+		}
+	}
+	t.name = file ? file : "-";
+	i = u32tree_read(fp, t.name, &rules, &nrules);
+	if (fp != stdin)
+		fclose(fp);
+	if (i < 0)
+		return -1;
+
+	r = malloc((nrules ? nrules : 1) * sizeof(*r));
+	if (r == NULL)
+		goto out;
+	for (i = 0; i < nrules; i++)
+		r[i] = &rules[i];
+
+	/* Standalone, install through our own pipelined batch; inside
+	 * "tc -batch" the caller's window and error reporting are used.
+	 */
+	if (!t.dry && !rth.batch) {
+		if (rtnl_batch_start(&rth, U32TREE_WINDOW, u32tree_error,
+				     (void *)t.name) < 0) {
+			free(r);
+			goto out;
+		}
+		own_batch = 1;
+	} else if (rth.batch) {
+		t.name = NULL;
+	}
+
+	ret = u32tree_build(&t, r, nrules, U32TREE_HTROOT, 0, 0, 0);
+	if (own_batch && (rtnl_batch_end(&rth) != 0 || u32tree_error_seen))
+		ret = -1;
+	if (ret == 0)
+		u32tree_report(&t, nrules);
+	free(r);
+out:
+	for (i = 0; i < nrules; i++)
+		free(rules[i].args);
+	free(rules);
+	return ret;
+}
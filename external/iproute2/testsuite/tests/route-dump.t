@@ -0,0 +1,49 @@
+#!/bin/bash
+# vim: ft=sh
+#
+# Route dump throughput: fill a table, then time the live dump and the
+# replay of a dump captured with "ip route save" (rtnl_from_file), both
+# in the default and the -compact output format.
+
+source lib/generic.sh
+
+ROUTES=${ROUTES:-100000}
+TABLE=${TABLE:-100}
+
+TMP_BATCH=`mktemp /tmp/tc_testsuite.XXXXXX` || exit
+TMP_DUMP=`mktemp /tmp/tc_testsuite.XXXXXX` || exit
+
+ts_bench()
+{
+	DESC=$1; shift
+	START=`date +%s%N`
+	LINES=`"$@" | wc -l`
+	END=`date +%s%N`
+	ts_log "route-dump: $DESC: $LINES routes in $(( (END - START) / 1000000 ))ms"
+	if [ "$LINES" -ne "$ROUTES" ]; then
+		ts_err "route-dump: $DESC: expected $ROUTES routes, got $LINES"
+	fi
+}
+
+awk -v n=$ROUTES -v t=$TABLE 'BEGIN {
+	for (i = 0; i < n; i++)
+		printf "route add blackhole 10.%d.%d.%d/32 table %d\n",
+			int(i / 65536), int(i / 256) % 256, i % 256, t
+}' > $TMP_BATCH
+
+$IP route flush table $TABLE >/dev/null 2>&1
+if ! $IP -window 256 -batch $TMP_BATCH; then
+	ts_err "route-dump: cannot populate table $TABLE"
+	rm $TMP_BATCH $TMP_DUMP
+	exit 1
+fi
+
+ts_bench "show" $IP route show table $TABLE
+ts_bench "show -compact" $IP -compact route show table $TABLE
+
+$IP route save table $TABLE > $TMP_DUMP
+ts_bench "showdump" $IP route showdump < $TMP_DUMP
+ts_bench "showdump -compact" $IP -compact route showdump < $TMP_DUMP
+
+$IP route flush table $TABLE
+rm $TMP_BATCH $TMP_DUMP
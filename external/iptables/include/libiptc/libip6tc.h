@@ -142,6 +142,10 @@ int ip6tc_set_counter(const ip6t_chainlabel chain,
 /* Makes the actual changes. */
 int ip6tc_commit(ip6tc_handle_t *handle);
 
+/* Makes the actual changes, but keeps the handle for further changes,
+   which are then committed incrementally. */
+int ip6tc_commit_keep(ip6tc_handle_t *handle);
+
 /* Get raw socket. */
 int ip6tc_get_raw_socket();
 
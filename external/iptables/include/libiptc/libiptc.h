@@ -152,6 +152,10 @@ int iptc_set_counter(const ipt_chainlabel chain,
 /* Makes the actual changes. */
 int iptc_commit(iptc_handle_t *handle);
 
+/* Makes the actual changes, but keeps the handle for further changes,
+   which are then committed incrementally. */
+int iptc_commit_keep(iptc_handle_t *handle);
+
 /* Get raw socket. */
 int iptc_get_raw_socket();
 
@@ -80,12 +80,25 @@ static int parse_counters(char *string, struct ipt_counters *ctr)
 static char *newargv[255];
 static int newargc;
 
+/* the arguments themselves, one line at a time, so that restoring
+ * large rule sets doesn't malloc() and free() every word */
+static char newargbuf[10240 + 1024];
+static unsigned int newarglen;
+
 /* function adding one argument to newargv, updating newargc 
  * returns true if argument added, false otherwise */
 static int add_argv(char *what) {
+	size_t len;
+
 	DEBUGP("add_argv: %s\n", what);
-	if (what && ((newargc + 1) < sizeof(newargv)/sizeof(char *))) {
-		newargv[newargc] = strdup(what);
+	if (!what)
+		return 0;
+
+	len = strlen(what) + 1;
+	if (((newargc + 1) < sizeof(newargv)/sizeof(char *))
+	    && newarglen + len <= sizeof(newargbuf)) {
+		newargv[newargc] = memcpy(newargbuf + newarglen, what, len);
+		newarglen += len;
 		newargc++;
 		return 1;
 	} else 
@@ -93,10 +106,8 @@ static int add_argv(char *what) {
 }
 
 static void free_argv(void) {
-	int i;
-
-	for (i = 0; i < newargc; i++)
-		free(newargv[i]);
+	newargc = 0;
+	newarglen = 0;
 }
 
 #ifdef IPTABLES_MULTI
@@ -37,6 +37,165 @@
 #include <string.h>
 #include <iptables.h>
 
+/* iptables --batch [file]: run one iptables command per line, sharing
+ * one handle per table.  A line reading COMMIT commits what has been
+ * done so far, the rest is committed at the end of input.  Nothing is
+ * committed past a failing command. */
+
+#define BATCH_MAX_ARGS		255
+#define BATCH_MAX_TABLES	8
+
+static struct {
+	char *name;
+	iptc_handle_t handle;
+} batch_tables[BATCH_MAX_TABLES];
+
+/* split a line into arguments, honouring "double quotes" */
+static int batch_split(char *buf, char *argv[])
+{
+	int argc = 1;
+	char *p = buf;
+
+	while (*p) {
+		char *arg;
+
+		while (*p == ' ' || *p == '\t' || *p == '\n')
+			p++;
+		if (!*p || *p == '#')
+			break;
+
+		if (argc == BATCH_MAX_ARGS - 1)
+			exit_error(PARAMETER_PROBLEM, "too many arguments");
+
+		arg = p;
+		if (*p == '"') {
+			arg = ++p;
+			while (*p && *p != '"')
+				p++;
+			if (!*p)
+				exit_error(PARAMETER_PROBLEM,
+					   "unterminated quote");
+		} else {
+			while (*p && *p != ' ' && *p != '\t' && *p != '\n')
+				p++;
+		}
+		if (*p)
+			*p++ = '\0';
+		argv[argc++] = arg;
+	}
+	argv[argc] = NULL;
+
+	return argc;
+}
+
+/* the table a command line works on, do_command() parses it again */
+static const char *batch_table(int argc, char *argv[])
+{
+	const char *table = "filter";
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--table")) {
+			if (i + 1 < argc)
+				table = argv[++i];
+		} else if (!strncmp(argv[i], "--table=", 8))
+			table = argv[i] + 8;
+		else if (argv[i][0] == '-' && argv[i][1] == 't')
+			table = argv[i] + 2;
+	}
+
+	return table;
+}
+
+static iptc_handle_t *batch_handle(const char *table)
+{
+	int i;
+
+	for (i = 0; i < BATCH_MAX_TABLES && batch_tables[i].name; i++) {
+		if (!strcmp(batch_tables[i].name, table))
+			return &batch_tables[i].handle;
+	}
+	if (i == BATCH_MAX_TABLES)
+		exit_error(PARAMETER_PROBLEM, "too many tables");
+
+	batch_tables[i].name = strdup(table);
+	return &batch_tables[i].handle;
+}
+
+static int batch_commit(int keep)
+{
+	int i;
+
+	for (i = 0; i < BATCH_MAX_TABLES && batch_tables[i].name; i++) {
+		iptc_handle_t *handle = &batch_tables[i].handle;
+		int ret;
+
+		if (!*handle)
+			continue;
+		if (keep)
+			ret = iptc_commit_keep(handle);
+		else
+			ret = iptc_commit(handle);
+		if (!ret)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int batch(const char *file)
+{
+	char buf[8192];
+	char *argv[BATCH_MAX_ARGS];
+	FILE *in = stdin;
+	int ret = 1;
+
+	if (file && strcmp(file, "-")) {
+		in = fopen(file, "r");
+		if (!in) {
+			fprintf(stderr, "Can't open %s: %s\n", file,
+				strerror(errno));
+			exit(1);
+		}
+	}
+
+	argv[0] = (char *)program_name;
+	line = 0;
+
+	while (ret && fgets(buf, sizeof(buf), in)) {
+		char *table;
+		int argc;
+
+		line++;
+		argc = batch_split(buf, argv);
+		/* allow lines copied from shell scripts */
+		if (argc > 1 && !strcmp(argv[1], "iptables")) {
+			memmove(&argv[1], &argv[2], (argc - 1) * sizeof(char *));
+			argc--;
+		}
+		if (argc == 1)
+			continue;
+
+		if (argc == 2 && !strcmp(argv[1], "COMMIT")) {
+			ret = batch_commit(1);
+			continue;
+		}
+
+		table = (char *)batch_table(argc, argv);
+		ret = do_command(argc, argv, &table, batch_handle(table));
+	}
+
+	if (in != stdin)
+		fclose(in);
+
+	if (ret)
+		ret = batch_commit(0);
+	else
+		fprintf(stderr, "%s: line %d failed\n", program_name, line);
+
+	return ret;
+}
+
 #ifdef IPTABLES_MULTI
 int
 iptables_main(int argc, char *argv[])
@@ -60,9 +219,13 @@ main(int argc, char *argv[])
 	init_extensions();
 #endif
 
-	ret = do_command(argc, argv, &table, &handle);
-	if (ret)
-		ret = iptc_commit(&handle);
+	if (argc > 1 && !strcmp(argv[1], "--batch"))
+		ret = batch(argc > 2 ? argv[2] : NULL);
+	else {
+		ret = do_command(argc, argv, &table, &handle);
+		if (ret)
+			ret = iptc_commit(&handle);
+	}
 
 	if (!ret) {
 		fprintf(stderr, "iptables: %s\n",
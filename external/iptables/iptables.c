@@ -235,15 +235,28 @@ static const struct pprot chain_protos[] = {
 	{ "sctp", IPPROTO_SCTP },
 };
 
+/* getprotobyname() and getprotobynumber() read /etc/protocols on every
+ * call, which shows with thousands of rules: remember their answers */
+static struct pprot proto_cache[16];
+static unsigned int proto_cached;
+
+static char *proto_names[256];
+static unsigned char proto_named[256];
+
 static char *
 proto_to_name(u_int8_t proto, int nolookup)
 {
 	unsigned int i;
 
 	if (proto && !nolookup) {
-		struct protoent *pent = getprotobynumber(proto);
-		if (pent)
-			return pent->p_name;
+		if (!proto_named[proto]) {
+			struct protoent *pent = getprotobynumber(proto);
+			if (pent)
+				proto_names[proto] = strdup(pent->p_name);
+			proto_named[proto] = 1;
+		}
+		if (proto_names[proto])
+			return proto_names[proto];
 	}
 
 	for (i = 0; i < sizeof(chain_protos)/sizeof(struct pprot); i++)
@@ -366,11 +379,27 @@ inaddrcpy(struct in_addr *dst, struct in_addr *src)
 	dst->s_addr = src->s_addr;
 }
 
+/* iptables-restore merges the same extension options into the same
+ * tables for every rule.  Merged tables built on original_opts are
+ * kept and reused, opts_cached says whether opts is one of them. */
+#define OPTS_CACHE_SIZE	64
+
+static struct {
+	const struct option *oldopts;
+	const struct option *newopts;
+	unsigned int offset;
+	struct option *merged;
+} opts_cache[OPTS_CACHE_SIZE];
+static unsigned int opts_cache_len;
+static int opts_cached = 1;
+
 static void free_opts(int reset_offset)
 {
 	if (opts != original_opts) {
-		free(opts);
+		if (!opts_cached)
+			free(opts);
 		opts = original_opts;
+		opts_cached = 1;
 		if (reset_offset)
 			global_option_offset = 0;
 	}
@@ -826,7 +855,7 @@ find_proto(const char *pname, enum ipt_tryload tryload, int nolookup, struct ipt
 u_int16_t
 parse_protocol(const char *s)
 {
-	unsigned int proto;
+	unsigned int proto, i;
 
 	if (string_to_number(s, 0, 255, &proto) == -1) {
 		struct protoent *pent;
@@ -838,10 +867,13 @@ parse_protocol(const char *s)
 		if (!strcmp(s, "all"))
 			return 0;
 
+		for (i = 0; i < proto_cached; i++)
+			if (strcmp(s, proto_cache[i].name) == 0)
+				return proto_cache[i].num;
+
 		if ((pent = getprotobyname(s)))
 			proto = pent->p_proto;
 		else {
-			unsigned int i;
 			for (i = 0;
 			     i < sizeof(chain_protos)/sizeof(struct pprot);
 			     i++) {
@@ -855,6 +887,10 @@ parse_protocol(const char *s)
 					   "unknown protocol `%s' specified",
 					   s);
 		}
+
+		if (proto_cached < sizeof(proto_cache)/sizeof(struct pprot)
+		    && (proto_cache[proto_cached].name = strdup(s)))
+			proto_cache[proto_cached++].num = proto;
 	}
 
 	return (u_int16_t)proto;
@@ -1118,13 +1154,23 @@ merge_options(struct option *oldopts, const struct option *newopts,
 {
 	unsigned int num_old, num_new, i;
 	struct option *merge;
-
-	for (num_old = 0; oldopts[num_old].name; num_old++);
-	for (num_new = 0; newopts[num_new].name; num_new++);
+	int cached = opts_cached;
 
 	global_option_offset += OPTION_OFFSET;
 	*option_offset = global_option_offset;
 
+	if (cached) {
+		for (i = 0; i < opts_cache_len; i++) {
+			if (opts_cache[i].oldopts == oldopts
+			    && opts_cache[i].newopts == newopts
+			    && opts_cache[i].offset == *option_offset)
+				return opts_cache[i].merged;
+		}
+	}
+
+	for (num_old = 0; oldopts[num_old].name; num_old++);
+	for (num_new = 0; newopts[num_new].name; num_new++);
+
 	merge = malloc(sizeof(struct option) * (num_new + num_old + 1));
 	memcpy(merge, oldopts, num_old * sizeof(struct option));
 	free_opts(0); /* Release previous options merged if any */
@@ -1134,6 +1180,14 @@ merge_options(struct option *oldopts, const struct option *newopts,
 	}
 	memset(merge + num_old + num_new, 0, sizeof(struct option));
 
+	if (cached && opts_cache_len < OPTS_CACHE_SIZE) {
+		opts_cache[opts_cache_len].oldopts = oldopts;
+		opts_cache[opts_cache_len].newopts = newopts;
+		opts_cache[opts_cache_len].offset = *option_offset;
+		opts_cache[opts_cache_len++].merged = merge;
+	} else
+		opts_cached = 0;
+
 	return merge;
 }
 
@@ -90,6 +90,7 @@
 #define TC_INIT			iptc_init
 #define TC_FREE			iptc_free
 #define TC_COMMIT		iptc_commit
+#define TC_COMMIT_KEEP		iptc_commit_keep
 #define TC_STRERROR		iptc_strerror
 #define TC_NUM_RULES		iptc_num_rules
 #define TC_GET_RULE		iptc_get_rule
@@ -88,6 +88,7 @@ typedef unsigned int socklen_t;
 #define TC_INIT			ip6tc_init
 #define TC_FREE			ip6tc_free
 #define TC_COMMIT		ip6tc_commit
+#define TC_COMMIT_KEEP		ip6tc_commit_keep
 #define TC_STRERROR		ip6tc_strerror
 #define TC_NUM_RULES		ip6tc_num_rules
 #define TC_GET_RULE		ip6tc_get_rule
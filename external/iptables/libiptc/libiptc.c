@@ -106,6 +106,7 @@ struct rule_head
 struct chain_head
 {
 	struct list_head list;
+	struct hlist_node hash;		/* in handle->chain_hash */
 	char name[TABLE_MAXNAMELEN];
 	unsigned int hooknum;		/* hook number+1 if builtin */
 	unsigned int references;	/* how many jumps reference us */
@@ -116,11 +117,16 @@ struct chain_head
 
 	unsigned int num_rules;		/* number of rules in list */
 	struct list_head rules;		/* list of rules */
+	struct rule_head **rule_index;	/* rules by number, built on demand */
+	unsigned int rule_index_alloc;	/* slots allocated in rule_index */
 
 	unsigned int index;		/* index (needed for jump resolval) */
 	unsigned int head_offset;	/* offset in rule blob */
 	unsigned int foot_index;	/* index (needed for counter_map) */
 	unsigned int foot_offset;	/* offset in rule blob */
+
+	int changed;			/* differs from handle blob? */
+	unsigned int blob_offset;	/* head_offset in handle blob */
 };
 
 STRUCT_TC_HANDLE
@@ -128,12 +134,20 @@ STRUCT_TC_HANDLE
 	int changed;			 /* Have changes been made? */
 
 	struct list_head chains;
+	struct hlist_head *chain_hash;	/* chains by name */
+	unsigned int chain_hash_size;	/* power of two */
+	unsigned int num_chains;
 	
 	struct chain_head *chain_iterator_cur;
 	struct rule_head *rule_iterator_cur;
 
 	STRUCT_GETINFO info;
 	STRUCT_GET_ENTRIES *entries;
+	STRUCT_REPLACE *repl;		/* last table we committed */
+
+	char *rule_arena;		/* rules parsed from entries */
+	unsigned int rule_arena_size;
+	unsigned int rule_arena_used;
 };
 
 /* allocate a new chain head for the cache */
@@ -165,6 +179,37 @@ static struct rule_head *iptcc_alloc_rule(struct chain_head *c, unsigned int siz
 	return r;
 }
 
+/* rules of the table we read are carved from one block sized by
+ * alloc_handle(), instead of one malloc() each */
+static struct rule_head *iptcc_arena_alloc_rule(TC_HANDLE_T h,
+						struct chain_head *c,
+						unsigned int size)
+{
+	struct rule_head *r;
+	unsigned int len = ALIGN(sizeof(*r) + size);
+
+	if (h->rule_arena_size - h->rule_arena_used < len)
+		return iptcc_alloc_rule(c, size);
+
+	r = (struct rule_head *)(h->rule_arena + h->rule_arena_used);
+	h->rule_arena_used += len;
+	memset(r, 0, sizeof(*r));
+
+	r->chain = c;
+	r->size = size;
+
+	return r;
+}
+
+static void iptcc_free_rule(TC_HANDLE_T h, struct rule_head *r)
+{
+	if ((char *)r >= h->rule_arena
+	    && (char *)r < h->rule_arena + h->rule_arena_size)
+		return;
+
+	free(r);
+}
+
 /* notify us that the ruleset has been modified by the user */
 static void
 set_changed(TC_HANDLE_T h)
@@ -172,6 +217,15 @@ set_changed(TC_HANDLE_T h)
 	h->changed = 1;
 }
 
+/* notify us that the blob of a chain has to be compiled again.  Counter
+ * changes don't count, the kernel ignores the counters in the blob. */
+static void
+set_chain_changed(TC_HANDLE_T h, struct chain_head *c)
+{
+	c->changed = 1;
+	set_changed(h);
+}
+
 #ifdef IPTC_DEBUG
 static void do_check(TC_HANDLE_T h, unsigned int line);
 #define CHECK(h) do { if (!getenv("IPTC_NO_CHECK")) do_check((h), __LINE__); } while(0)
@@ -273,64 +327,192 @@ static unsigned int iptcc_is_builtin(struct chain_head *c)
 	return (c->hooknum ? 1 : 0);
 }
 
-/* Get a specific rule within a chain */
-static struct rule_head *iptcc_get_rule_num(struct chain_head *c,
-					    unsigned int rulenum)
+/* The rule index of a chain is an array of its rules in list order.
+ * It is built the first time a rule is looked up by number and then
+ * kept up to date by the insert/delete paths.  If memory runs out it
+ * is dropped, and lookups walk the list instead. */
+static void iptcc_rule_index_drop(struct chain_head *c)
+{
+	free(c->rule_index);
+	c->rule_index = NULL;
+	c->rule_index_alloc = 0;
+}
+
+static int iptcc_rule_index_grow(struct chain_head *c, unsigned int num)
+{
+	struct rule_head **index;
+	unsigned int alloc = c->rule_index_alloc ? c->rule_index_alloc : 16;
+
+	while (alloc < num)
+		alloc *= 2;
+	if (alloc == c->rule_index_alloc)
+		return 1;
+
+	index = realloc(c->rule_index, alloc * sizeof(*index));
+	if (!index) {
+		iptcc_rule_index_drop(c);
+		return 0;
+	}
+	c->rule_index = index;
+	c->rule_index_alloc = alloc;
+	return 1;
+}
+
+static void iptcc_rule_index_build(struct chain_head *c)
 {
 	struct rule_head *r;
 	unsigned int num = 0;
 
-	list_for_each_entry(r, &c->rules, list) {
-		num++;
-		if (num == rulenum)
-			return r;
-	}
-	return NULL;
+	if (!iptcc_rule_index_grow(c, c->num_rules))
+		return;
+
+	list_for_each_entry(r, &c->rules, list)
+		c->rule_index[num++] = r;
+}
+
+/* Rule `r' is being inserted at position `pos' (0 = first) of the chain.
+ * Call before c->num_rules is incremented. */
+static void iptcc_rule_index_insert(struct chain_head *c, struct rule_head *r,
+				    unsigned int pos)
+{
+	if (!c->rule_index || !iptcc_rule_index_grow(c, c->num_rules + 1))
+		return;
+
+	memmove(&c->rule_index[pos + 1], &c->rule_index[pos],
+		(c->num_rules - pos) * sizeof(*c->rule_index));
+	c->rule_index[pos] = r;
+}
+
+/* The rule at position `pos' is being removed from the chain.
+ * Call before c->num_rules is decremented. */
+static void iptcc_rule_index_delete(struct chain_head *c, unsigned int pos)
+{
+	if (!c->rule_index)
+		return;
+
+	memmove(&c->rule_index[pos], &c->rule_index[pos + 1],
+		(c->num_rules - pos - 1) * sizeof(*c->rule_index));
 }
 
-/* Get a specific rule within a chain backwards */
-static struct rule_head *iptcc_get_rule_num_reverse(struct chain_head *c,
+/* Get a specific rule within a chain */
+static struct rule_head *iptcc_get_rule_num(struct chain_head *c,
 					    unsigned int rulenum)
 {
 	struct rule_head *r;
 	unsigned int num = 0;
 
-	list_for_each_entry_reverse(r, &c->rules, list) {
-		num++;
-		if (num == rulenum)
-			return r;
+	if (rulenum == 0 || rulenum > c->num_rules)
+		return NULL;
+
+	if (!c->rule_index)
+		iptcc_rule_index_build(c);
+	if (c->rule_index)
+		return c->rule_index[rulenum - 1];
+
+	/* No index, take advantage of the double linked list. */
+	if (rulenum <= c->num_rules/2) {
+		list_for_each_entry(r, &c->rules, list) {
+			if (++num == rulenum)
+				return r;
+		}
+	} else {
+		rulenum = c->num_rules - rulenum + 1;
+		list_for_each_entry_reverse(r, &c->rules, list) {
+			if (++num == rulenum)
+				return r;
+		}
 	}
 	return NULL;
 }
 
-/* Returns chain head if found, otherwise NULL. */
+/* Returns chain head if found, otherwise NULL.  `chains' is sorted by
+ * offset, as they are while parsing the blob. */
 static struct chain_head *
-iptcc_find_chain_by_offset(TC_HANDLE_T handle, unsigned int offset)
+iptcc_find_chain_by_offset(struct chain_head **chains, unsigned int num,
+			   unsigned int offset)
 {
-	struct list_head *pos;
+	unsigned int lo = 0, hi = num;
+
+	/* find the last chain starting at or before offset */
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (chains[mid]->head_offset <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	if (list_empty(&handle->chains))
+	if (lo == 0 || offset > chains[lo - 1]->foot_offset)
 		return NULL;
 
-	list_for_each(pos, &handle->chains) {
-		struct chain_head *c = list_entry(pos, struct chain_head, list);
-		if (offset >= c->head_offset && offset <= c->foot_offset)
-			return c;
+	return chains[lo - 1];
+}
+
+static unsigned int iptcc_hash_name(const char *name)
+{
+	unsigned int hash = 0;
+
+	while (*name)
+		hash = hash * 31 + (unsigned char)*name++;
+
+	return hash;
+}
+
+static struct hlist_head *
+iptcc_chain_bucket(TC_HANDLE_T h, const char *name)
+{
+	return &h->chain_hash[iptcc_hash_name(name) & (h->chain_hash_size - 1)];
+}
+
+/* Double the chain name hash.  If that fails we carry on with longer
+ * hash chains. */
+static void iptcc_chain_hash_grow(TC_HANDLE_T h)
+{
+	struct hlist_head *old = h->chain_hash;
+	unsigned int i, old_size = h->chain_hash_size;
+
+	h->chain_hash = calloc(old_size * 2, sizeof(struct hlist_head));
+	if (!h->chain_hash) {
+		h->chain_hash = old;
+		return;
 	}
+	h->chain_hash_size = old_size * 2;
 
-	return NULL;
+	for (i = 0; i < old_size; i++) {
+		struct chain_head *c;
+		struct hlist_node *pos, *n;
+
+		hlist_for_each_entry_safe(c, pos, n, &old[i], hash) {
+			hlist_del(&c->hash);
+			hlist_add_head(&c->hash, iptcc_chain_bucket(h, c->name));
+		}
+	}
+	free(old);
 }
+
+static void iptcc_chain_hash_add(TC_HANDLE_T h, struct chain_head *c)
+{
+	if (h->num_chains >= h->chain_hash_size)
+		iptcc_chain_hash_grow(h);
+
+	hlist_add_head(&c->hash, iptcc_chain_bucket(h, c->name));
+	h->num_chains++;
+}
+
+static void iptcc_chain_hash_del(TC_HANDLE_T h, struct chain_head *c)
+{
+	hlist_del(&c->hash);
+	h->num_chains--;
+}
+
 /* Returns chain head if found, otherwise NULL. */
 static struct chain_head *
 iptcc_find_label(const char *name, TC_HANDLE_T handle)
 {
-	struct list_head *pos;
-
-	if (list_empty(&handle->chains))
-		return NULL;
+	struct chain_head *c;
+	struct hlist_node *pos;
 
-	list_for_each(pos, &handle->chains) {
-		struct chain_head *c = list_entry(pos, struct chain_head, list);
+	hlist_for_each_entry(c, pos, iptcc_chain_bucket(handle, name), hash) {
 		if (!strcmp(c->name, name))
 			return c;
 	}
@@ -339,7 +521,7 @@ iptcc_find_label(const char *name, TC_HANDLE_T handle)
 }
 
 /* called when rule is to be removed from cache */
-static void iptcc_delete_rule(struct rule_head *r)
+static void iptcc_delete_rule(TC_HANDLE_T h, struct rule_head *r)
 {
 	DEBUGP("deleting rule %p (offset %u)\n", r, r->offset);
 	/* clean up reference count of called chain */
@@ -348,7 +530,7 @@ static void iptcc_delete_rule(struct rule_head *r)
 		r->jump->references--;
 
 	list_del(&r->list);
-	free(r);
+	iptcc_free_rule(h, r);
 }
 
 
@@ -379,11 +561,13 @@ static int __iptcc_p_del_policy(TC_HANDLE_T h, unsigned int num)
 			sizeof(h->chain_iterator_cur->counters));
 
 		/* foot_offset points to verdict rule */
-		h->chain_iterator_cur->foot_index = num;
+		h->chain_iterator_cur->foot_index = num-1;
 		h->chain_iterator_cur->foot_offset = pr->offset;
 
 		/* delete rule from cache */
-		iptcc_delete_rule(pr);
+		iptcc_rule_index_delete(h->chain_iterator_cur,
+					h->chain_iterator_cur->num_rules - 1);
+		iptcc_delete_rule(h, pr);
 		h->chain_iterator_cur->num_rules--;
 
 		return 1;
@@ -391,27 +575,9 @@ static int __iptcc_p_del_policy(TC_HANDLE_T h, unsigned int num)
 	return 0;
 }
 
-/* alphabetically insert a chain into the list */
-static inline void iptc_insert_chain(TC_HANDLE_T h, struct chain_head *c)
-{
-	struct chain_head *tmp;
-
-	/* sort only user defined chains */
-	if (!c->hooknum) {
-		list_for_each_entry(tmp, &h->chains, list) {
-			if (!tmp->hooknum && strcmp(c->name, tmp->name) <= 0) {
-				list_add(&c->list, tmp->list.prev);
-				return;
-			}
-		}
-	}
-
-	/* survived till end of list: add at tail */
-	list_add_tail(&c->list, &h->chains);
-}
-
 /* Another ugly helper function split out of cache_add_entry to make it less
- * spaghetti code */
+ * spaghetti code.  Chains are kept in blob order here, parse_table()
+ * sorts the user defined ones once the whole blob has been read. */
 static void __iptcc_p_add_chain(TC_HANDLE_T h, struct chain_head *c,
 				unsigned int offset, unsigned int *num)
 {
@@ -420,7 +586,8 @@ static void __iptcc_p_add_chain(TC_HANDLE_T h, struct chain_head *c,
 	c->head_offset = offset;
 	c->index = *num;
 
-	iptc_insert_chain(h, c);
+	list_add_tail(&c->list, &h->chains);
+	iptcc_chain_hash_add(h, c);
 	
 	h->chain_iterator_cur = c;
 }
@@ -484,8 +651,8 @@ static int cache_add_entry(STRUCT_ENTRY *e,
 		struct rule_head *r;
 new_rule:
 
-		if (!(r = iptcc_alloc_rule(h->chain_iterator_cur, 
-					   e->next_offset))) {
+		if (!(r = iptcc_arena_alloc_rule(h, h->chain_iterator_cur,
+						 e->next_offset))) {
 			errno = ENOMEM;
 			return -1;
 		}
@@ -527,6 +694,8 @@ new_rule:
 		}
 
 		list_add_tail(&r->list, &h->chain_iterator_cur->rules);
+		iptcc_rule_index_insert(h->chain_iterator_cur, r,
+					h->chain_iterator_cur->num_rules);
 		h->chain_iterator_cur->num_rules++;
 	}
 out_inc:
@@ -535,21 +704,37 @@ out_inc:
 }
 
 
+static int iptcc_chain_name_cmp(const void *a, const void *b)
+{
+	return strcmp((*(struct chain_head **)a)->name,
+		      (*(struct chain_head **)b)->name);
+}
+
 /* parse an iptables blob into it's pieces */
 static int parse_table(TC_HANDLE_T h)
 {
 	STRUCT_ENTRY *prev;
-	unsigned int num = 0;
-	struct chain_head *c;
+	unsigned int num = 0, i, user;
+	struct chain_head *c, **chains;
 
 	/* First pass: over ruleset blob */
 	ENTRY_ITERATE(h->entries->entrytable, h->entries->size,
 			cache_add_entry, h, &prev, &num);
 
+	/* The chain list is still in blob order, hence sorted by offset */
+	chains = malloc(h->num_chains * sizeof(*chains) + 1);
+	if (!chains) {
+		errno = ENOMEM;
+		return -1;
+	}
+	num = 0;
+	list_for_each_entry(c, &h->chains, list)
+		chains[num++] = c;
+
 	/* Second pass: fixup parsed data from first pass */
-	list_for_each_entry(c, &h->chains, list) {
+	for (i = 0; i < num; i++) {
 		struct rule_head *r;
-		list_for_each_entry(r, &c->rules, list) {
+		list_for_each_entry(r, &chains[i]->rules, list) {
 			struct chain_head *c;
 			STRUCT_STANDARD_TARGET *t;
 
@@ -557,16 +742,29 @@ static int parse_table(TC_HANDLE_T h)
 				continue;
 
 			t = (STRUCT_STANDARD_TARGET *)GET_TARGET(r->entry);
-			c = iptcc_find_chain_by_offset(h, t->verdict);
-			if (!c)
+			c = iptcc_find_chain_by_offset(chains, num, t->verdict);
+			if (!c) {
+				free(chains);
 				return -1;
+			}
 			r->jump = c;
 			c->references++;
 		}
 	}
 
-	/* FIXME: sort chains */
+	/* Builtin chains first, then user defined chains alphabetically */
+	INIT_LIST_HEAD(&h->chains);
+	for (i = 0, user = 0; i < num; i++) {
+		if (iptcc_is_builtin(chains[i]))
+			list_add_tail(&chains[i]->list, &h->chains);
+		else
+			chains[user++] = chains[i];
+	}
+	qsort(chains, user, sizeof(*chains), iptcc_chain_name_cmp);
+	for (i = 0; i < user; i++)
+		list_add_tail(&chains[i]->list, &h->chains);
 
+	free(chains);
 	return 1;
 }
 
@@ -672,13 +870,47 @@ static int iptcc_compile_chain(TC_HANDLE_T h, STRUCT_REPLACE *repl, struct chain
 	return 0;
 }
 
+/* an unchanged chain is copied from the blob we read or committed last,
+ * it only needs moving to its new place */
+static void iptcc_move_chain(struct chain_head *c, unsigned int offset,
+			     unsigned int num)
+{
+	struct rule_head *r;
+	unsigned int delta = offset - c->head_offset;
+	unsigned int idelta = num - c->index;
+
+	if (!delta && !idelta)
+		return;
+
+	DEBUGP("%s: moving chain from %u to %u\n", c->name,
+	       c->head_offset, offset);
+	c->head_offset += delta;
+	c->foot_offset += delta;
+	c->index += idelta;
+	c->foot_index += idelta;
+
+	list_for_each_entry(r, &c->rules, list) {
+		r->offset += delta;
+		r->index += idelta;
+	}
+}
+
 /* calculate offset and number for every rule in the cache */
 static int iptcc_compile_chain_offsets(TC_HANDLE_T h, struct chain_head *c,
 				       unsigned int *offset, unsigned int *num)
 {
 	struct rule_head *r;
 
+	c->blob_offset = c->head_offset;
+	if (!c->changed) {
+		iptcc_move_chain(c, *offset, *num);
+		*offset = c->foot_offset + IPTCB_CHAIN_FOOT_SIZE;
+		*num = c->foot_index + 1;
+		return 1;
+	}
+
 	c->head_offset = *offset;
+	c->index = *num;
 	DEBUGP("%s: chain_head %u, offset=%u\n", c->name, *num, *offset);
 
 	if (!iptcc_is_builtin(c))  {
@@ -707,18 +939,24 @@ static int iptcc_compile_chain_offsets(TC_HANDLE_T h, struct chain_head *c,
 	return 1;
 }
 
-/* put the pieces back together again */
-static int iptcc_compile_table_prep(TC_HANDLE_T h, unsigned int *size)
+/* put the pieces back together again.  *moved is set if any chain
+ * starts at a different offset than in the old blob. */
+static int iptcc_compile_table_prep(TC_HANDLE_T h, unsigned int *size,
+				    int *moved)
 {
 	struct chain_head *c;
 	unsigned int offset = 0, num = 0;
 	int ret = 0;
 
+	*moved = 0;
+
 	/* First pass: calculate offset for every rule */
 	list_for_each_entry(c, &h->chains, list) {
 		ret = iptcc_compile_chain_offsets(h, c, &offset, &num);
 		if (ret < 0)
 			return ret;
+		if (c->head_offset != c->blob_offset)
+			*moved = 1;
 	}
 
 	/* Append one error rule at end of chain */
@@ -731,14 +969,63 @@ static int iptcc_compile_table_prep(TC_HANDLE_T h, unsigned int *size)
 	return num;
 }
 
-static int iptcc_compile_table(TC_HANDLE_T h, STRUCT_REPLACE *repl)
+/* copy an unchanged chain from the old blob, fixing up jumps if chains
+ * have moved */
+static void iptcc_copy_chain(TC_HANDLE_T h, STRUCT_REPLACE *repl,
+			     struct chain_head *c, const void *blob,
+			     int moved)
+{
+	struct rule_head *r;
+
+	memcpy((void *)repl->entries + c->head_offset, blob + c->blob_offset,
+	       c->foot_offset + IPTCB_CHAIN_FOOT_SIZE - c->head_offset);
+
+	if (iptcc_is_builtin(c)) {
+		repl->hook_entry[c->hooknum-1] = c->head_offset;
+		repl->underflow[c->hooknum-1] = c->foot_offset;
+	}
+
+	if (!moved)
+		return;
+
+	list_for_each_entry(r, &c->rules, list) {
+		STRUCT_STANDARD_TARGET *t;
+
+		if (r->type != IPTCC_R_JUMP && r->type != IPTCC_R_FALLTHROUGH)
+			continue;
+
+		t = (STRUCT_STANDARD_TARGET *)
+			GET_TARGET((STRUCT_ENTRY *)((void *)repl->entries
+						    + r->offset));
+		if (r->type == IPTCC_R_JUMP)
+			t->verdict = r->jump->head_offset
+				     + IPTCB_CHAIN_START_SIZE;
+		else
+			t->verdict = r->offset + r->size;
+	}
+}
+
+static int iptcc_compile_table(TC_HANDLE_T h, STRUCT_REPLACE *repl, int moved)
 {
 	struct chain_head *c;
 	struct iptcb_chain_error *error;
+	const void *blob;
+
+	/* the table as it is in the kernel */
+	if (h->repl)
+		blob = h->repl->entries;
+	else
+		blob = h->entries->entrytable;
 
 	/* Second pass: copy from cache to offsets, fill in jumps */
 	list_for_each_entry(c, &h->chains, list) {
-		int ret = iptcc_compile_chain(h, repl, c);
+		int ret;
+
+		if (!c->changed) {
+			iptcc_copy_chain(h, repl, c, blob, moved);
+			continue;
+		}
+		ret = iptcc_compile_chain(h, repl, c);
 		if (ret < 0)
 			return ret;
 	}
@@ -777,15 +1064,28 @@ alloc_handle(const char *tablename, unsigned int size, unsigned int num_rules)
 	INIT_LIST_HEAD(&h->chains);
 	strcpy(h->info.name, tablename);
 
+	h->chain_hash_size = 64;
+	h->chain_hash = calloc(h->chain_hash_size, sizeof(struct hlist_head));
+	if (!h->chain_hash)
+		goto out_free_handle;
+
 	h->entries = malloc(sizeof(STRUCT_GET_ENTRIES) + size);
 	if (!h->entries)
-		goto out_free_handle;
+		goto out_free_hash;
 
 	strcpy(h->entries->name, tablename);
 	h->entries->size = size;
 
+	/* optional, rules are malloc()ed one by one without it */
+	h->rule_arena_size = size + num_rules * ALIGN(sizeof(struct rule_head));
+	h->rule_arena = malloc(h->rule_arena_size);
+	if (!h->rule_arena)
+		h->rule_arena_size = 0;
+
 	return h;
 
+out_free_hash:
+	free(h->chain_hash);
 out_free_handle:
 	free(h);
 
@@ -889,12 +1189,19 @@ TC_FREE(TC_HANDLE_T *h)
 		struct rule_head *r, *rtmp;
 
 		list_for_each_entry_safe(r, rtmp, &c->rules, list) {
-			free(r);
+			iptcc_free_rule(*h, r);
 		}
 
+		free(c->rule_index);
 		free(c);
 	}
 
+	if ((*h)->repl) {
+		free((*h)->repl->counters);
+		free((*h)->repl);
+	}
+	free((*h)->rule_arena);
+	free((*h)->chain_hash);
 	free((*h)->entries);
 	free(*h);
 
@@ -1303,11 +1610,8 @@ TC_INSERT_ENTRY(const IPT_CHAINLABEL chain,
 	   prev points to. */
 	if (rulenum == c->num_rules) {
 		prev = &c->rules;
-	} else if (rulenum + 1 <= c->num_rules/2) {
-		r = iptcc_get_rule_num(c, rulenum + 1);
-		prev = &r->list;
 	} else {
-		r = iptcc_get_rule_num_reverse(c, c->num_rules - rulenum);
+		r = iptcc_get_rule_num(c, rulenum + 1);
 		prev = &r->list;
 	}
 
@@ -1325,9 +1629,10 @@ TC_INSERT_ENTRY(const IPT_CHAINLABEL chain,
 	}
 
 	list_add_tail(&r->list, prev);
+	iptcc_rule_index_insert(c, r, rulenum);
 	c->num_rules++;
 
-	set_changed(*handle);
+	set_chain_changed(*handle, c);
 
 	return 1;
 }
@@ -1354,12 +1659,7 @@ TC_REPLACE_ENTRY(const IPT_CHAINLABEL chain,
 		return 0;
 	}
 
-	/* Take advantage of the double linked list if possible. */
-	if (rulenum + 1 <= c->num_rules/2) {
-		old = iptcc_get_rule_num(c, rulenum + 1);
-	} else {
-		old = iptcc_get_rule_num_reverse(c, c->num_rules - rulenum);
-	}
+	old = iptcc_get_rule_num(c, rulenum + 1);
 
 	if (!(r = iptcc_alloc_rule(c, e->next_offset))) {
 		errno = ENOMEM;
@@ -1375,9 +1675,11 @@ TC_REPLACE_ENTRY(const IPT_CHAINLABEL chain,
 	}
 
 	list_add(&r->list, &old->list);
-	iptcc_delete_rule(old);
+	if (c->rule_index)
+		c->rule_index[rulenum] = r;
+	iptcc_delete_rule(*handle, old);
 
-	set_changed(*handle);
+	set_chain_changed(*handle, c);
 
 	return 1;
 }
@@ -1415,9 +1717,10 @@ TC_APPEND_ENTRY(const IPT_CHAINLABEL chain,
 	}
 
 	list_add_tail(&r->list, &c->rules);
+	iptcc_rule_index_insert(c, r, c->num_rules);
 	c->num_rules++;
 
-	set_changed(*handle);
+	set_chain_changed(*handle, c);
 
 	return 1;
 }
@@ -1499,6 +1802,7 @@ TC_DELETE_ENTRY(const IPT_CHAINLABEL chain,
 {
 	struct chain_head *c;
 	struct rule_head *r, *i;
+	unsigned int pos = 0;
 
 	iptc_fn = TC_DELETE_ENTRY;
 	if (!(c = iptcc_find_label(chain, *handle))) {
@@ -1532,6 +1836,7 @@ TC_DELETE_ENTRY(const IPT_CHAINLABEL chain,
 	list_for_each_entry(i, &c->rules, list) {
 		unsigned char *mask;
 
+		pos++;
 		mask = is_same(r->entry, i->entry, matchmask);
 		if (!mask)
 			continue;
@@ -1548,10 +1853,11 @@ TC_DELETE_ENTRY(const IPT_CHAINLABEL chain,
 					   struct rule_head, list);
 		}
 
+		iptcc_rule_index_delete(c, pos - 1);
 		c->num_rules--;
-		iptcc_delete_rule(i);
+		iptcc_delete_rule(*handle, i);
 
-		set_changed(*handle);
+		set_chain_changed(*handle, c);
 		free(r);
 		return 1;
 	}
@@ -1583,12 +1889,7 @@ TC_DELETE_NUM_ENTRY(const IPT_CHAINLABEL chain,
 		return 0;
 	}
 
-	/* Take advantage of the double linked list if possible. */
-	if (rulenum + 1 <= c->num_rules/2) {
-		r = iptcc_get_rule_num(c, rulenum + 1);
-	} else {
-		r = iptcc_get_rule_num_reverse(c, c->num_rules - rulenum);
-	}
+	r = iptcc_get_rule_num(c, rulenum + 1);
 
 	/* If we are about to delete the rule that is the current
 	 * iterator, move rule iterator back.  next pointer will then
@@ -1599,10 +1900,11 @@ TC_DELETE_NUM_ENTRY(const IPT_CHAINLABEL chain,
 				   struct rule_head, list);
 	}
 
+	iptcc_rule_index_delete(c, rulenum);
 	c->num_rules--;
-	iptcc_delete_rule(r);
+	iptcc_delete_rule(*handle, r);
 
-	set_changed(*handle);
+	set_chain_changed(*handle, c);
 
 	return 1;
 }
@@ -1633,12 +1935,13 @@ TC_FLUSH_ENTRIES(const IPT_CHAINLABEL chain, TC_HANDLE_T *handle)
 	}
 
 	list_for_each_entry_safe(r, tmp, &c->rules, list) {
-		iptcc_delete_rule(r);
+		iptcc_delete_rule(*handle, r);
 	}
 
+	iptcc_rule_index_drop(c);
 	c->num_rules = 0;
 
-	set_changed(*handle);
+	set_chain_changed(*handle, c);
 
 	return 1;
 }
@@ -1793,8 +2096,9 @@ TC_CREATE_CHAIN(const IPT_CHAINLABEL chain, TC_HANDLE_T *handle)
 
 	DEBUGP("Creating chain `%s'\n", chain);
 	list_add_tail(&c->list, &(*handle)->chains);
+	iptcc_chain_hash_add(*handle, c);
 
-	set_changed(*handle);
+	set_chain_changed(*handle, c);
 
 	return 1;
 }
@@ -1861,6 +2165,8 @@ TC_DELETE_CHAIN(const IPT_CHAINLABEL chain, TC_HANDLE_T *handle)
 		iptcc_chain_iterator_advance(*handle);
 
 	list_del(&c->list);
+	iptcc_chain_hash_del(*handle, c);
+	free(c->rule_index);
 	free(c);
 
 	DEBUGP("chain `%s' deleted\n", chain);
@@ -1900,9 +2206,11 @@ int TC_RENAME_CHAIN(const IPT_CHAINLABEL oldname,
 		return 0;
 	}
 
+	iptcc_chain_hash_del(*handle, c);
 	strncpy(c->name, newname, sizeof(IPT_CHAINLABEL));
+	iptcc_chain_hash_add(*handle, c);
 	
-	set_changed(*handle);
+	set_chain_changed(*handle, c);
 
 	return 1;
 }
@@ -1947,7 +2255,7 @@ TC_SET_POLICY(const IPT_CHAINLABEL chain,
 		c->counter_map.maptype = COUNTER_MAP_NOMAP;
 	}
 
-	set_changed(*handle);
+	set_chain_changed(*handle, c);
 
 	return 1;
 }
@@ -2023,10 +2331,52 @@ static void counters_map_set(STRUCT_COUNTERS_INFO *newcounters,
 }
 
 
-int
-TC_COMMIT(TC_HANDLE_T *handle)
+/* after a failed commit the offsets no longer match the old blob */
+static void iptcc_set_all_changed(TC_HANDLE_T h)
+{
+	struct chain_head *c;
+
+	list_for_each_entry(c, &h->chains, list)
+		c->changed = 1;
+}
+
+/* the table we just committed is what the kernel has now, keep it as
+ * the blob for the next commit and map counters to the new indices */
+static void iptcc_committed(TC_HANDLE_T h, STRUCT_REPLACE *repl)
+{
+	struct chain_head *c;
+
+	if (h->repl) {
+		free(h->repl->counters);
+		free(h->repl);
+	}
+	free(repl->counters);
+	repl->counters = NULL;
+	h->repl = repl;
+
+	h->info.num_entries = repl->num_entries;
+	h->info.size = repl->size;
+
+	list_for_each_entry(c, &h->chains, list) {
+		struct rule_head *r;
+
+		c->changed = 0;
+		c->counter_map.maptype = COUNTER_MAP_NORMAL_MAP;
+		c->counter_map.mappos = c->foot_index;
+
+		list_for_each_entry(r, &c->rules, list) {
+			r->counter_map.maptype = COUNTER_MAP_NORMAL_MAP;
+			r->counter_map.mappos = r->index;
+		}
+	}
+
+	h->changed = 0;
+}
+
+/* Replace, then map back the counters. */
+static int
+iptcc_commit(TC_HANDLE_T h)
 {
-	/* Replace, then map back the counters. */
 	STRUCT_REPLACE *repl;
 	STRUCT_COUNTERS_INFO *newcounters;
 	struct chain_head *c;
@@ -2034,15 +2384,9 @@ TC_COMMIT(TC_HANDLE_T *handle)
 	size_t counterlen;
 	int new_number;
 	unsigned int new_size;
+	int moved;
 
-	iptc_fn = TC_COMMIT;
-	CHECK(*handle);
-
-	/* Don't commit if nothing changed. */
-	if (!(*handle)->changed)
-		goto finished;
-
-	new_number = iptcc_compile_table_prep(*handle, &new_size);
+	new_number = iptcc_compile_table_prep(h, &new_size, &moved);
 	if (new_number < 0) {
 		errno = ENOMEM;
 		goto out_zero;
@@ -2056,7 +2400,7 @@ TC_COMMIT(TC_HANDLE_T *handle)
 	memset(repl, 0, sizeof(*repl) + new_size);
 
 #if 0
-	TC_DUMP_ENTRIES(*handle);
+	TC_DUMP_ENTRIES(h);
 #endif
 
 	counterlen = sizeof(STRUCT_COUNTERS_INFO)
@@ -2064,7 +2408,7 @@ TC_COMMIT(TC_HANDLE_T *handle)
 
 	/* These are the old counters we will get from kernel */
 	repl->counters = malloc(sizeof(STRUCT_COUNTERS)
-				* (*handle)->info.num_entries);
+				* h->info.num_entries);
 	if (!repl->counters) {
 		errno = ENOMEM;
 		goto out_free_repl;
@@ -2077,17 +2421,17 @@ TC_COMMIT(TC_HANDLE_T *handle)
 	}
 	memset(newcounters, 0, counterlen);
 
-	strcpy(repl->name, (*handle)->info.name);
+	strcpy(repl->name, h->info.name);
 	repl->num_entries = new_number;
 	repl->size = new_size;
 
-	repl->num_counters = (*handle)->info.num_entries;
-	repl->valid_hooks = (*handle)->info.valid_hooks;
+	repl->num_counters = h->info.num_entries;
+	repl->valid_hooks = h->info.valid_hooks;
 
 	DEBUGP("num_entries=%u, size=%u, num_counters=%u\n",
 		repl->num_entries, repl->size, repl->num_counters);
 
-	ret = iptcc_compile_table(*handle, repl);
+	ret = iptcc_compile_table(h, repl, moved);
 	if (ret < 0) {
 		errno = ret;
 		goto out_free_newcounters;
@@ -2111,10 +2455,10 @@ TC_COMMIT(TC_HANDLE_T *handle)
 		goto out_free_newcounters;
 
 	/* Put counters back. */
-	strcpy(newcounters->name, (*handle)->info.name);
+	strcpy(newcounters->name, h->info.name);
 	newcounters->num_counters = new_number;
 
-	list_for_each_entry(c, &(*handle)->chains, list) {
+	list_for_each_entry(c, &h->chains, list) {
 		struct rule_head *r;
 
 		/* Builtin chains have their own counters */
@@ -2202,12 +2546,9 @@ TC_COMMIT(TC_HANDLE_T *handle)
 	if (ret < 0)
 		goto out_free_newcounters;
 
-	free(repl->counters);
-	free(repl);
 	free(newcounters);
+	iptcc_committed(h, repl);
 
-finished:
-	TC_FREE(handle);
 	return 1;
 
 out_free_newcounters:
@@ -2217,9 +2558,40 @@ out_free_repl_counters:
 out_free_repl:
 	free(repl);
 out_zero:
+	iptcc_set_all_changed(h);
 	return 0;
 }
 
+int
+TC_COMMIT(TC_HANDLE_T *handle)
+{
+	iptc_fn = TC_COMMIT;
+	CHECK(*handle);
+
+	/* Don't commit if nothing changed. */
+	if ((*handle)->changed && !iptcc_commit(*handle))
+		return 0;
+
+	TC_FREE(handle);
+	return 1;
+}
+
+/* Like TC_COMMIT, but the handle stays valid so a batch of changes can
+ * be committed in steps without reading the table again.  Chains that
+ * were not touched since the last commit are copied from the blob we
+ * committed then. */
+int
+TC_COMMIT_KEEP(TC_HANDLE_T *handle)
+{
+	iptc_fn = TC_COMMIT_KEEP;
+	CHECK(*handle);
+
+	if ((*handle)->changed && !iptcc_commit(*handle))
+		return 0;
+
+	return 1;
+}
+
 /* Get raw socket. */
 int
 TC_GET_RAW_SOCKET()
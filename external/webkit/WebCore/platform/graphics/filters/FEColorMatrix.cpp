@@ -32,6 +32,12 @@
 #include <math.h>
 #include <wtf/MathExtras.h>
 
+#if (CPU(X86) || CPU(X86_64)) && defined(__SSE2__)
+#include <emmintrin.h>
+#elif CPU(ARM) && defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 namespace WebCore {
 
 FEColorMatrix::FEColorMatrix(FilterEffect* in, ColorMatrixType type, const Vector<float>& values)
@@ -67,93 +73,140 @@ void FEColorMatrix::setValues(const Vector<float> &values)
     m_values = values;
 }
 
-inline void matrix(double& red, double& green, double& blue, double& alpha, const Vector<float>& values)
-{
-    double r = values[0]  * red + values[1]  * green + values[2]  * blue + values[3]  * alpha;
-    double g = values[5]  * red + values[6]  * green + values[7]  * blue + values[8]  * alpha;
-    double b = values[10]  * red + values[11]  * green + values[12] * blue + values[13] * alpha;
-    double a = values[15] * red + values[16] * green + values[17] * blue + values[18] * alpha;
+// Every matrix type is linear in (r, g, b, a), so each one is reduced to a
+// single 4x4 matrix before touching any pixels.  The matrix is stored row by
+// row: the new red value is m[0] * r + m[1] * g + m[2] * b + m[3] * a.
 
-    red = r;
-    green = g;
-    blue = b;
-    alpha = a;
+static void matrix(float* m, const Vector<float>& values)
+{
+    for (int row = 0; row < 4; ++row) {
+        for (int column = 0; column < 4; ++column)
+            m[row * 4 + column] = values[row * 5 + column];
+    }
 }
 
-inline void saturate(double& red, double& green, double& blue, const float& s)
+static void saturate(float* m, const float& s)
 {
-    double r = (0.213 + 0.787 * s) * red + (0.715 - 0.715 * s) * green + (0.072 - 0.072 * s) * blue;
-    double g = (0.213 - 0.213 * s) * red + (0.715 + 0.285 * s) * green + (0.072 - 0.072 * s) * blue;
-    double b = (0.213 - 0.213 * s) * red + (0.715 - 0.715 * s) * green + (0.072 + 0.928 * s) * blue;
-
-    red = r;
-    green = g;
-    blue = b;
+    const float saturateMatrix[16] = {
+        0.213f + 0.787f * s, 0.715f - 0.715f * s, 0.072f - 0.072f * s, 0,
+        0.213f - 0.213f * s, 0.715f + 0.285f * s, 0.072f - 0.072f * s, 0,
+        0.213f - 0.213f * s, 0.715f - 0.715f * s, 0.072f + 0.928f * s, 0,
+        0, 0, 0, 1
+    };
+    memcpy(m, saturateMatrix, sizeof(saturateMatrix));
 }
 
-inline void huerotate(double& red, double& green, double& blue, const float& hue)
+static void huerotate(float* m, const float& hue)
 {
-    double cosHue = cos(hue * piDouble / 180); 
-    double sinHue = sin(hue * piDouble / 180); 
-    double r = red   * (0.213 + cosHue * 0.787 - sinHue * 0.213) +
-               green * (0.715 - cosHue * 0.715 - sinHue * 0.715) +
-               blue  * (0.072 - cosHue * 0.072 + sinHue * 0.928);
-    double g = red   * (0.213 - cosHue * 0.213 + sinHue * 0.143) +
-               green * (0.715 + cosHue * 0.285 + sinHue * 0.140) +
-               blue  * (0.072 - cosHue * 0.072 - sinHue * 0.283);
-    double b = red   * (0.213 - cosHue * 0.213 - sinHue * 0.787) +
-               green * (0.715 - cosHue * 0.715 + sinHue * 0.715) +
-               blue  * (0.072 + cosHue * 0.928 + sinHue * 0.072);
+    float cosHue = cos(hue * piDouble / 180);
+    float sinHue = sin(hue * piDouble / 180);
+    const float hueRotateMatrix[16] = {
+        0.213f + cosHue * 0.787f - sinHue * 0.213f, 0.715f - cosHue * 0.715f - sinHue * 0.715f, 0.072f - cosHue * 0.072f + sinHue * 0.928f, 0,
+        0.213f - cosHue * 0.213f + sinHue * 0.143f, 0.715f + cosHue * 0.285f + sinHue * 0.140f, 0.072f - cosHue * 0.072f - sinHue * 0.283f, 0,
+        0.213f - cosHue * 0.213f - sinHue * 0.787f, 0.715f - cosHue * 0.715f + sinHue * 0.715f, 0.072f + cosHue * 0.928f + sinHue * 0.072f, 0,
+        0, 0, 0, 1
+    };
+    memcpy(m, hueRotateMatrix, sizeof(hueRotateMatrix));
+}
 
-    red = r;
-    green = g;
-    blue = b;
+static void luminance(float* m)
+{
+    const float luminanceMatrix[16] = {
+        0, 0, 0, 0,
+        0, 0, 0, 0,
+        0, 0, 0, 0,
+        0.2125f, 0.7154f, 0.0721f, 0
+    };
+    memcpy(m, luminanceMatrix, sizeof(luminanceMatrix));
 }
 
-inline void luminance(double& red, double& green, double& blue, double& alpha)
+// Results are clamped to [0, 255] and rounded the same way
+// CanvasPixelArray::set() does.
+#if (CPU(X86) || CPU(X86_64)) && defined(__SSE2__)
+
+static void applyMatrix(unsigned char* pixels, unsigned pixelCount, const float* m)
 {
-    alpha = 0.2125 * red + 0.7154 * green + 0.0721 * blue;
-    red = 0.;
-    green = 0.;
-    blue = 0.;
+    // Load the matrix by columns, so one multiply-add per input channel
+    // produces all four output channels at once.
+    const __m128 column0 = _mm_setr_ps(m[0], m[4], m[8], m[12]);
+    const __m128 column1 = _mm_setr_ps(m[1], m[5], m[9], m[13]);
+    const __m128 column2 = _mm_setr_ps(m[2], m[6], m[10], m[14]);
+    const __m128 column3 = _mm_setr_ps(m[3], m[7], m[11], m[15]);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 maxValue = _mm_set1_ps(255);
+    const __m128 half = _mm_set1_ps(0.5f);
+
+    for (unsigned i = 0; i < pixelCount; ++i) {
+        unsigned char* pixel = pixels + i * 4;
+        __m128 result = _mm_mul_ps(column0, _mm_set1_ps(pixel[0]));
+        result = _mm_add_ps(result, _mm_mul_ps(column1, _mm_set1_ps(pixel[1])));
+        result = _mm_add_ps(result, _mm_mul_ps(column2, _mm_set1_ps(pixel[2])));
+        result = _mm_add_ps(result, _mm_mul_ps(column3, _mm_set1_ps(pixel[3])));
+        // _mm_max_ps returns its second operand for NaN, so NaN clamps to 0.
+        result = _mm_min_ps(_mm_max_ps(result, zero), maxValue);
+        __m128i bytes = _mm_cvttps_epi32(_mm_add_ps(result, half));
+        bytes = _mm_packs_epi32(bytes, bytes);
+        bytes = _mm_packus_epi16(bytes, bytes);
+        *reinterpret_cast<int*>(pixel) = _mm_cvtsi128_si32(bytes);
+    }
 }
 
-template<ColorMatrixType filterType>
-void effectType(const PassRefPtr<CanvasPixelArray>& srcPixelArray, PassRefPtr<ImageData>& imageData, const Vector<float>& values)
+#elif CPU(ARM) && defined(__ARM_NEON__)
+
+static void applyMatrix(unsigned char* pixels, unsigned pixelCount, const float* m)
 {
-    for (unsigned pixelOffset = 0; pixelOffset < srcPixelArray->length(); pixelOffset++) {
-        unsigned pixelByteOffset = pixelOffset * 4;
+    const float32_t columns[16] = {
+        m[0], m[4], m[8], m[12],
+        m[1], m[5], m[9], m[13],
+        m[2], m[6], m[10], m[14],
+        m[3], m[7], m[11], m[15]
+    };
+    const float32x4_t column0 = vld1q_f32(columns);
+    const float32x4_t column1 = vld1q_f32(columns + 4);
+    const float32x4_t column2 = vld1q_f32(columns + 8);
+    const float32x4_t column3 = vld1q_f32(columns + 12);
+    const float32x4_t zero = vdupq_n_f32(0);
+    const float32x4_t maxValue = vdupq_n_f32(255);
+    const float32x4_t half = vdupq_n_f32(0.5f);
+
+    for (unsigned i = 0; i < pixelCount; ++i) {
+        unsigned char* pixel = pixels + i * 4;
+        float32x4_t result = vmulq_n_f32(column0, pixel[0]);
+        result = vmlaq_n_f32(result, column1, pixel[1]);
+        result = vmlaq_n_f32(result, column2, pixel[2]);
+        result = vmlaq_n_f32(result, column3, pixel[3]);
+        result = vminq_f32(vmaxq_f32(result, zero), maxValue);
+        uint16x4_t narrowed = vmovn_u32(vcvtq_u32_f32(vaddq_f32(result, half)));
+        uint8x8_t bytes = vmovn_u16(vcombine_u16(narrowed, narrowed));
+        vst1_lane_u32(reinterpret_cast<uint32_t*>(pixel), vreinterpret_u32_u8(bytes), 0);
+    }
+}
 
-        unsigned char r = 0, g = 0, b = 0, a = 0;
-        srcPixelArray->get(pixelByteOffset, r);
-        srcPixelArray->get(pixelByteOffset + 1, g);
-        srcPixelArray->get(pixelByteOffset + 2, b);
-        srcPixelArray->get(pixelByteOffset + 3, a);
+#else
 
-        double red = r, green = g, blue = b, alpha = a;
-        
-        switch (filterType) {
-            case FECOLORMATRIX_TYPE_MATRIX:
-                matrix(red, green, blue, alpha, values);
-                break;
-            case FECOLORMATRIX_TYPE_SATURATE: 
-                saturate(red, green, blue, values[0]);
-                break;
-            case FECOLORMATRIX_TYPE_HUEROTATE:
-                huerotate(red, green, blue, values[0]);
-                break;
-            case FECOLORMATRIX_TYPE_LUMINANCETOALPHA:
-                luminance(red, green, blue, alpha);
-                break;
-        }
+static inline unsigned char clampToByte(float value)
+{
+    if (!(value > 0)) // Clamp NaN to 0
+        return 0;
+    if (value > 255)
+        return 255;
+    return static_cast<unsigned char>(value + 0.5f);
+}
 
-        imageData->data()->set(pixelByteOffset, red);
-        imageData->data()->set(pixelByteOffset + 1, green);
-        imageData->data()->set(pixelByteOffset + 2, blue);
-        imageData->data()->set(pixelByteOffset + 3, alpha);
+static void applyMatrix(unsigned char* pixels, unsigned pixelCount, const float* m)
+{
+    for (unsigned i = 0; i < pixelCount; ++i) {
+        unsigned char* pixel = pixels + i * 4;
+        float red = pixel[0], green = pixel[1], blue = pixel[2], alpha = pixel[3];
+        for (int channel = 0; channel < 4; ++channel) {
+            const float* row = m + channel * 4;
+            pixel[channel] = clampToByte(row[0] * red + row[1] * green + row[2] * blue + row[3] * alpha);
+        }
     }
 }
 
+#endif
+
 void FEColorMatrix::apply(Filter* filter)
 {
     m_in->apply(filter);
@@ -166,28 +219,31 @@ void FEColorMatrix::apply(Filter* filter)
 
     filterContext->drawImage(m_in->resultImage()->image(), DeviceColorSpace, calculateDrawingRect(m_in->scaledSubRegion()));
 
-    IntRect imageRect(IntPoint(), resultImage()->size());
-    PassRefPtr<ImageData> imageData(resultImage()->getUnmultipliedImageData(imageRect));
-    PassRefPtr<CanvasPixelArray> srcPixelArray(imageData->data());
-
+    float m[16];
     switch (m_type) {
         case FECOLORMATRIX_TYPE_UNKNOWN:
-            break;
+            return;
         case FECOLORMATRIX_TYPE_MATRIX:
-            effectType<FECOLORMATRIX_TYPE_MATRIX>(srcPixelArray, imageData, m_values);
+            matrix(m, m_values);
             break;
         case FECOLORMATRIX_TYPE_SATURATE: 
-            effectType<FECOLORMATRIX_TYPE_SATURATE>(srcPixelArray, imageData, m_values);
+            saturate(m, m_values[0]);
             break;
         case FECOLORMATRIX_TYPE_HUEROTATE:
-            effectType<FECOLORMATRIX_TYPE_HUEROTATE>(srcPixelArray, imageData, m_values);
+            huerotate(m, m_values[0]);
             break;
         case FECOLORMATRIX_TYPE_LUMINANCETOALPHA:
-            effectType<FECOLORMATRIX_TYPE_LUMINANCETOALPHA>(srcPixelArray, imageData, m_values);
+            luminance(m);
             setIsAlphaImage(true);
             break;
     }
 
+    IntRect imageRect(IntPoint(), resultImage()->size());
+    RefPtr<ImageData> imageData(resultImage()->getUnmultipliedImageData(imageRect));
+    CanvasPixelArray* pixelArray = imageData->data();
+
+    applyMatrix(pixelArray->data()->data(), pixelArray->length() / 4, m);
+
     resultImage()->putUnmultipliedImageData(imageData.get(), imageRect, IntPoint());
 }
 
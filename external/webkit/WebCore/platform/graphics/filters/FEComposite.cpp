@@ -30,6 +30,12 @@
 #include "GraphicsContext.h"
 #include "ImageData.h"
 
+#if (CPU(X86) || CPU(X86_64)) && defined(__SSE2__)
+#include <emmintrin.h>
+#elif CPU(ARM) && defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 namespace WebCore {
 
 FEComposite::FEComposite(FilterEffect* in, FilterEffect* in2, const CompositeOperationType& type,
@@ -101,22 +107,98 @@ void FEComposite::setK4(float k4)
     m_k4 = k4;
 }
 
-inline void arithmetic(const RefPtr<CanvasPixelArray>& srcPixelArrayA, CanvasPixelArray*& srcPixelArrayB,
-                       float k1, float k2, float k3, float k4)
+// Results are clamped to [0, 255] and rounded the same way
+// CanvasPixelArray::set() does.
+#if (CPU(X86) || CPU(X86_64)) && defined(__SSE2__)
+
+static inline __m128 loadPixel(const unsigned char* pixel)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i bytes = _mm_cvtsi32_si128(*reinterpret_cast<const int*>(pixel));
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+}
+
+static inline void arithmetic(const unsigned char* pixelsA, unsigned char* pixelsB, unsigned length,
+                              float k1, float k2, float k3, float k4)
+{
+    const __m128 scaledK1 = _mm_set1_ps(k1 / 255.f);
+    const __m128 vectorK2 = _mm_set1_ps(k2);
+    const __m128 vectorK3 = _mm_set1_ps(k3);
+    const __m128 scaledK4 = _mm_set1_ps(k4 * 255.f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 maxValue = _mm_set1_ps(255);
+    const __m128 half = _mm_set1_ps(0.5f);
+
+    // All four channels of a pixel are computed together.
+    for (unsigned pixelOffset = 0; pixelOffset < length; pixelOffset += 4) {
+        __m128 i1 = loadPixel(pixelsA + pixelOffset);
+        __m128 i2 = loadPixel(pixelsB + pixelOffset);
+        __m128 result = _mm_mul_ps(_mm_mul_ps(scaledK1, i1), i2);
+        result = _mm_add_ps(result, _mm_mul_ps(vectorK2, i1));
+        result = _mm_add_ps(result, _mm_mul_ps(vectorK3, i2));
+        result = _mm_add_ps(result, scaledK4);
+        // _mm_max_ps returns its second operand for NaN, so NaN clamps to 0.
+        result = _mm_min_ps(_mm_max_ps(result, zero), maxValue);
+        __m128i bytes = _mm_cvttps_epi32(_mm_add_ps(result, half));
+        bytes = _mm_packs_epi32(bytes, bytes);
+        bytes = _mm_packus_epi16(bytes, bytes);
+        *reinterpret_cast<int*>(pixelsB + pixelOffset) = _mm_cvtsi128_si32(bytes);
+    }
+}
+
+#elif CPU(ARM) && defined(__ARM_NEON__)
+
+static inline float32x4_t loadPixel(const unsigned char* pixel)
+{
+    uint8x8_t bytes = vreinterpret_u8_u32(vld1_dup_u32(reinterpret_cast<const uint32_t*>(pixel)));
+    return vcvtq_f32_u32(vmovl_u16(vget_low_u16(vmovl_u8(bytes))));
+}
+
+static inline void arithmetic(const unsigned char* pixelsA, unsigned char* pixelsB, unsigned length,
+                              float k1, float k2, float k3, float k4)
+{
+    const float32x4_t scaledK4 = vdupq_n_f32(k4 * 255.f);
+    const float32x4_t zero = vdupq_n_f32(0);
+    const float32x4_t maxValue = vdupq_n_f32(255);
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    float scaledK1 = k1 / 255.f;
+
+    // All four channels of a pixel are computed together.
+    for (unsigned pixelOffset = 0; pixelOffset < length; pixelOffset += 4) {
+        float32x4_t i1 = loadPixel(pixelsA + pixelOffset);
+        float32x4_t i2 = loadPixel(pixelsB + pixelOffset);
+        float32x4_t result = vmlaq_f32(scaledK4, vmulq_n_f32(i1, scaledK1), i2);
+        result = vmlaq_n_f32(result, i1, k2);
+        result = vmlaq_n_f32(result, i2, k3);
+        result = vminq_f32(vmaxq_f32(result, zero), maxValue);
+        uint16x4_t narrowed = vmovn_u32(vcvtq_u32_f32(vaddq_f32(result, half)));
+        uint8x8_t bytes = vmovn_u16(vcombine_u16(narrowed, narrowed));
+        vst1_lane_u32(reinterpret_cast<uint32_t*>(pixelsB + pixelOffset), vreinterpret_u32_u8(bytes), 0);
+    }
+}
+
+#else
+
+static inline void arithmetic(const unsigned char* pixelsA, unsigned char* pixelsB, unsigned length,
+                              float k1, float k2, float k3, float k4)
 {
     float scaledK1 = k1 / 255.f;
     float scaledK4 = k4 * 255.f;
-    for (unsigned pixelOffset = 0; pixelOffset < srcPixelArrayA->length(); pixelOffset += 4) {
-        for (unsigned channel = 0; channel < 4; ++channel) {
-            unsigned char i1 = srcPixelArrayA->get(pixelOffset + channel);
-            unsigned char i2 = srcPixelArrayB->get(pixelOffset + channel);
+    for (unsigned byteOffset = 0; byteOffset < length; ++byteOffset) {
+        unsigned char i1 = pixelsA[byteOffset];
+        unsigned char i2 = pixelsB[byteOffset];
 
-            double result = scaledK1 * i1 * i2 + k2 * i1 + k3 * i2 + scaledK4;
-            srcPixelArrayB->set(pixelOffset + channel, result);
-        }
+        float result = scaledK1 * i1 * i2 + k2 * i1 + k3 * i2 + scaledK4;
+        if (!(result > 0)) // Clamp NaN to 0
+            result = 0;
+        else if (result > 255)
+            result = 255;
+        pixelsB[byteOffset] = static_cast<unsigned char>(result + 0.5f);
     }
 }
 
+#endif
+
 void FEComposite::apply(Filter* filter)
 {
     m_in->apply(filter);
@@ -160,7 +242,8 @@ void FEComposite::apply(Filter* filter)
         RefPtr<ImageData> imageData(m_in2->resultImage()->getPremultipliedImageData(effectBDrawingRect));
         CanvasPixelArray* srcPixelArrayB(imageData->data());
 
-        arithmetic(srcPixelArrayA, srcPixelArrayB, m_k1, m_k2, m_k3, m_k4);
+        ASSERT(srcPixelArrayA->length() == srcPixelArrayB->length());
+        arithmetic(srcPixelArrayA->data()->data(), srcPixelArrayB->data()->data(), srcPixelArrayB->length(), m_k1, m_k2, m_k3, m_k4);
         resultImage()->putPremultipliedImageData(imageData.get(), IntRect(IntPoint(), resultImage()->size()), IntPoint());
         }
         break;
@@ -31,6 +31,15 @@
 #include "ImageData.h"
 #include <math.h>
 #include <wtf/MathExtras.h>
+#include <wtf/Threading.h>
+
+#if (CPU(X86) || CPU(X86_64)) && defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_BOX_BLUR_SIMD 1
+#elif CPU(ARM) && defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define USE_BOX_BLUR_SIMD 1
+#endif
 
 using std::max;
 
@@ -69,36 +78,208 @@ void FEGaussianBlur::setStdDeviationY(float y)
     m_y = y;
 }
 
-static void boxBlur(CanvasPixelArray*& srcPixelArray, CanvasPixelArray*& dstPixelArray,
-                 unsigned dx, int stride, int strideLine, int effectWidth, int effectHeight, bool alphaImage)
+// Filter regions with at least this many pixels are blurred on several
+// threads; below it the cost of starting the threads outweighs the gain.
+static const int minPixelsForThreadedBlur = 256 * 256;
+static const int maxBlurThreads = 4;
+#if USE_BOX_BLUR_SIMD
+static const unsigned maxSIMDKernelSize = 4096;
+#endif
+
+struct BoxBlurJob {
+    const unsigned char* src;
+    unsigned char* dst;
+    unsigned dx;
+    int stride;
+    int strideLine;
+    int effectWidth;
+    int startLine;
+    int endLine;
+    bool alphaImage;
+};
+
+static void boxBlurLine(const unsigned char* src, unsigned char* dst, unsigned dx, int stride, int effectWidth)
 {
     int dxLeft = dx / 2;
     int dxRight = dx - dxLeft;
 
-    for (int y = 0; y < effectHeight; ++y) {
-        int line = y * strideLine;
-        for (int channel = 3; channel >= 0; --channel) {
-            int sum = 0;
-            // Fill the kernel
-            int maxKernelSize = std::min(dxRight, effectWidth);
-            for (int i = 0; i < maxKernelSize; ++i)
-                sum += srcPixelArray->get(line + i * stride + channel);
-
-            // Blurring
-            for (int x = 0; x < effectWidth; ++x) {
-                int pixelByteOffset = line + x * stride + channel;
-                dstPixelArray->set(pixelByteOffset, static_cast<unsigned char>(sum / dx));
-                if (x >= dxLeft)
-                    sum -= srcPixelArray->get(pixelByteOffset - dxLeft * stride);
-                if (x + dxRight < effectWidth)
-                    sum += srcPixelArray->get(pixelByteOffset + dxRight * stride);
-            }
-            if (alphaImage) // Source image is black, it just has different alpha values
-                break;
+    int sum[4] = { 0, 0, 0, 0 };
+    int maxKernelSize = std::min(dxRight, effectWidth);
+    for (int i = 0; i < maxKernelSize; ++i) {
+        const unsigned char* pixel = src + i * stride;
+        for (int channel = 0; channel < 4; ++channel)
+            sum[channel] += pixel[channel];
+    }
+
+    for (int x = 0; x < effectWidth; ++x) {
+        int pixelByteOffset = x * stride;
+        for (int channel = 0; channel < 4; ++channel)
+            dst[pixelByteOffset + channel] = static_cast<unsigned char>(sum[channel] / dx);
+        if (x >= dxLeft) {
+            const unsigned char* pixel = src + pixelByteOffset - dxLeft * stride;
+            for (int channel = 0; channel < 4; ++channel)
+                sum[channel] -= pixel[channel];
+        }
+        if (x + dxRight < effectWidth) {
+            const unsigned char* pixel = src + pixelByteOffset + dxRight * stride;
+            for (int channel = 0; channel < 4; ++channel)
+                sum[channel] += pixel[channel];
         }
     }
 }
 
+// Source image is black, it just has different alpha values.
+static void boxBlurAlphaLine(const unsigned char* src, unsigned char* dst, unsigned dx, int stride, int effectWidth)
+{
+    int dxLeft = dx / 2;
+    int dxRight = dx - dxLeft;
+
+    int sum = 0;
+    // Fill the kernel
+    int maxKernelSize = std::min(dxRight, effectWidth);
+    for (int i = 0; i < maxKernelSize; ++i)
+        sum += src[i * stride + 3];
+
+    // Blurring
+    for (int x = 0; x < effectWidth; ++x) {
+        int pixelByteOffset = x * stride + 3;
+        dst[pixelByteOffset] = static_cast<unsigned char>(sum / dx);
+        if (x >= dxLeft)
+            sum -= src[pixelByteOffset - dxLeft * stride];
+        if (x + dxRight < effectWidth)
+            sum += src[pixelByteOffset + dxRight * stride];
+    }
+}
+
+#if (CPU(X86) || CPU(X86_64)) && defined(__SSE2__)
+
+// The four channel sums of a pixel live in one register.  Dividing by dx is
+// done as (sum + 0.5) / dx in single precision, which truncates to the same
+// value as the integer division sum / dx as long as dx is at most
+// maxSIMDKernelSize.
+static inline __m128i loadPixel(const unsigned char* pixel)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i bytes = _mm_cvtsi32_si128(*reinterpret_cast<const int*>(pixel));
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero);
+}
+
+static void boxBlurLineSIMD(const unsigned char* src, unsigned char* dst, unsigned dx, int stride, int effectWidth)
+{
+    int dxLeft = dx / 2;
+    int dxRight = dx - dxLeft;
+
+    __m128i sum = _mm_setzero_si128();
+    int maxKernelSize = std::min(dxRight, effectWidth);
+    for (int i = 0; i < maxKernelSize; ++i)
+        sum = _mm_add_epi32(sum, loadPixel(src + i * stride));
+
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 inverseDx = _mm_set1_ps(1.f / dx);
+    for (int x = 0; x < effectWidth; ++x) {
+        int pixelByteOffset = x * stride;
+        __m128i result = _mm_cvttps_epi32(_mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(sum), half), inverseDx));
+        result = _mm_packs_epi32(result, result);
+        result = _mm_packus_epi16(result, result);
+        *reinterpret_cast<int*>(dst + pixelByteOffset) = _mm_cvtsi128_si32(result);
+        if (x >= dxLeft)
+            sum = _mm_sub_epi32(sum, loadPixel(src + pixelByteOffset - dxLeft * stride));
+        if (x + dxRight < effectWidth)
+            sum = _mm_add_epi32(sum, loadPixel(src + pixelByteOffset + dxRight * stride));
+    }
+}
+
+#elif CPU(ARM) && defined(__ARM_NEON__)
+
+// See the SSE2 version above for the reasoning behind the division.
+static inline uint32x4_t loadPixel(const unsigned char* pixel)
+{
+    uint8x8_t bytes = vreinterpret_u8_u32(vld1_dup_u32(reinterpret_cast<const uint32_t*>(pixel)));
+    return vmovl_u16(vget_low_u16(vmovl_u8(bytes)));
+}
+
+static void boxBlurLineSIMD(const unsigned char* src, unsigned char* dst, unsigned dx, int stride, int effectWidth)
+{
+    int dxLeft = dx / 2;
+    int dxRight = dx - dxLeft;
+
+    uint32x4_t sum = vdupq_n_u32(0);
+    int maxKernelSize = std::min(dxRight, effectWidth);
+    for (int i = 0; i < maxKernelSize; ++i)
+        sum = vaddq_u32(sum, loadPixel(src + i * stride));
+
+    const float32x4_t half = vdupq_n_f32(0.5f);
+    const float32x4_t inverseDx = vdupq_n_f32(1.f / dx);
+    for (int x = 0; x < effectWidth; ++x) {
+        int pixelByteOffset = x * stride;
+        uint32x4_t result = vcvtq_u32_f32(vmulq_f32(vaddq_f32(vcvtq_f32_u32(sum), half), inverseDx));
+        uint16x4_t narrowed = vmovn_u32(result);
+        uint8x8_t bytes = vmovn_u16(vcombine_u16(narrowed, narrowed));
+        vst1_lane_u32(reinterpret_cast<uint32_t*>(dst + pixelByteOffset), vreinterpret_u32_u8(bytes), 0);
+        if (x >= dxLeft)
+            sum = vsubq_u32(sum, loadPixel(src + pixelByteOffset - dxLeft * stride));
+        if (x + dxRight < effectWidth)
+            sum = vaddq_u32(sum, loadPixel(src + pixelByteOffset + dxRight * stride));
+    }
+}
+
+#endif
+
+static void boxBlurLines(const BoxBlurJob& job)
+{
+    for (int y = job.startLine; y < job.endLine; ++y) {
+        int line = y * job.strideLine;
+        if (job.alphaImage)
+            boxBlurAlphaLine(job.src + line, job.dst + line, job.dx, job.stride, job.effectWidth);
+#if USE_BOX_BLUR_SIMD
+        else if (job.dx <= maxSIMDKernelSize)
+            boxBlurLineSIMD(job.src + line, job.dst + line, job.dx, job.stride, job.effectWidth);
+#endif
+        else
+            boxBlurLine(job.src + line, job.dst + line, job.dx, job.stride, job.effectWidth);
+    }
+}
+
+static void* boxBlurThread(void* data)
+{
+    boxBlurLines(*static_cast<BoxBlurJob*>(data));
+    return 0;
+}
+
+static void boxBlur(CanvasPixelArray* srcPixelArray, CanvasPixelArray* dstPixelArray,
+                 unsigned dx, int stride, int strideLine, int effectWidth, int effectHeight, bool alphaImage)
+{
+    BoxBlurJob jobs[maxBlurThreads];
+    int jobCount = (effectWidth * effectHeight >= minPixelsForThreadedBlur) ? std::min(maxBlurThreads, effectHeight) : 1;
+    int linesPerJob = (effectHeight + jobCount - 1) / jobCount;
+    for (int i = 0; i < jobCount; ++i) {
+        BoxBlurJob& job = jobs[i];
+        job.src = srcPixelArray->data()->data();
+        job.dst = dstPixelArray->data()->data();
+        job.dx = dx;
+        job.stride = stride;
+        job.strideLine = strideLine;
+        job.effectWidth = effectWidth;
+        job.startLine = std::min(i * linesPerJob, effectHeight);
+        job.endLine = std::min(job.startLine + linesPerJob, effectHeight);
+        job.alphaImage = alphaImage;
+    }
+
+    // Every line is independent, so hand all but the first band to helper
+    // threads and blur the first one here.  If a thread can't be started,
+    // its band is blurred on this thread instead.
+    ThreadIdentifier threads[maxBlurThreads];
+    for (int i = 1; i < jobCount; ++i)
+        threads[i] = createThread(boxBlurThread, &jobs[i], "WebCore: FEGaussianBlur");
+    boxBlurLines(jobs[0]);
+    for (int i = 1; i < jobCount; ++i) {
+        if (threads[i])
+            waitForThreadCompletion(threads[i], 0);
+        else
+            boxBlurLines(jobs[i]);
+    }
+}
+
 void FEGaussianBlur::apply(Filter* filter)
 {
     m_in->apply(filter);
@@ -248,6 +248,28 @@ void ImageDecoder::prepareScaleDataIfNecessary()
     }
 }
 
+void ImageDecoder::prepareScaleDataForDecodedSize(const IntSize& decodedSize)
+{
+    if (decodedSize == size()) {
+        prepareScaleDataIfNecessary();
+        return;
+    }
+
+    // The codec has already shrunk the image, so the frame buffer must use the
+    // decoded size even when no further sampling is needed.
+    int width = decodedSize.width();
+    int height = decodedSize.height();
+    int numPixels = height * width;
+    double scale = 1.;
+    if (m_maxNumPixels > 0 && numPixels > m_maxNumPixels)
+        scale = sqrt(m_maxNumPixels / (double)numPixels);
+    m_scaled = true;
+    m_scaledColumns.clear();
+    m_scaledRows.clear();
+    fillScaledValues(m_scaledColumns, scale, width);
+    fillScaledValues(m_scaledRows, scale, height);
+}
+
 int ImageDecoder::upperBoundScaledX(int origX, int searchStart)
 {
     return getScaledValue<UpperBound>(m_scaledColumns, origX, searchStart);
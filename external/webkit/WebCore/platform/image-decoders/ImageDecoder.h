@@ -314,6 +314,12 @@ namespace WebCore {
 
     protected:
         void prepareScaleDataIfNecessary();
+        // Like prepareScaleDataIfNecessary(), but for decoders whose codec can
+        // itself reduce the image (e.g. JPEG DCT scaling) and so hands us rows
+        // of |decodedSize| rather than size().  Any remaining reduction needed
+        // to fit m_maxNumPixels is done by sampling the decoded rows.
+        void prepareScaleDataForDecodedSize(const IntSize& decodedSize);
+        int maxNumPixels() const { return m_maxNumPixels; }
         int upperBoundScaledX(int origX, int searchStart = 0);
         int lowerBoundScaledX(int origX, int searchStart = 0);
         int upperBoundScaledY(int origY, int searchStart = 0);
@@ -208,8 +208,25 @@ public:
                  */
                 m_info.buffered_image = jpeg_has_multiple_scans(&m_info);
 
+                // We can fill in the size now that the header is available.
+                // This is always the intrinsic size, even if we end up
+                // decoding to a smaller bitmap below.
+                if (!m_decoder->setSize(m_info.image_width, m_info.image_height)) {
+                    m_state = JPEG_ERROR;
+                    return false;
+                }
+
+                /*
+                 * Let the IDCT do as much of any required down sampling as
+                 * it can; this is far cheaper than decoding every pixel and
+                 * throwing most of them away.
+                 */
+                m_info.scale_num = 1;
+                m_info.scale_denom = m_decoder->scaleDenominator();
+
                 /* Used to set up image size so arrays can be allocated */
                 jpeg_calc_output_dimensions(&m_info);
+                m_decoder->setDecodedSize(m_info.output_width, m_info.output_height);
 
                 /*
                  * Make a one-row-high sample array that will go away
@@ -227,12 +244,6 @@ public:
 
                 m_state = JPEG_START_DECOMPRESS;
 
-                // We can fill in the size now that the header is available.
-                if (!m_decoder->setSize(m_info.image_width, m_info.image_height)) {
-                    m_state = JPEG_ERROR;
-                    return false;
-                }
-
                 if (m_decodingSizeOnly) {
                     // We can stop here.
                     // Reduce our buffer length and available data.
@@ -430,12 +441,25 @@ bool JPEGImageDecoder::isSizeAvailable()
     return ImageDecoder::isSizeAvailable();
 }
 
-bool JPEGImageDecoder::setSize(unsigned width, unsigned height)
+unsigned JPEGImageDecoder::scaleDenominator() const
 {
-    if (!ImageDecoder::setSize(width, height))
-        return false;
-    prepareScaleDataIfNecessary();
-    return true;
+    // libjpeg can scale by 1/1, 1/2, 1/4 and 1/8 while decoding.  Pick the
+    // smallest of these that still leaves at least maxNumPixels() pixels, so
+    // that any further reduction is done by sampling a larger image and we
+    // never lose detail we were asked to keep.
+    if (maxNumPixels() <= 0)
+        return 1;
+
+    unsigned long long numPixels = static_cast<unsigned long long>(size().width()) * size().height();
+    unsigned denominator = 1;
+    while (denominator < 8 && numPixels / ((denominator * 2) * (denominator * 2)) >= static_cast<unsigned long long>(maxNumPixels()))
+        denominator *= 2;
+    return denominator;
+}
+
+void JPEGImageDecoder::setDecodedSize(unsigned width, unsigned height)
+{
+    prepareScaleDataForDecodedSize(IntSize(width, height));
 }
 
 RGBA32Buffer* JPEGImageDecoder::frameBufferAtIndex(size_t index)
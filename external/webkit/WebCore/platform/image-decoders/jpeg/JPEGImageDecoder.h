@@ -48,14 +48,20 @@ namespace WebCore {
         // Whether or not the size information has been decoded yet.
         virtual bool isSizeAvailable();
 
-        virtual bool setSize(unsigned width, unsigned height);
-
         virtual RGBA32Buffer* frameBufferAtIndex(size_t index);
         
         virtual bool supportsAlpha() const { return false; }
 
         void decode(bool sizeOnly = false);
 
+        // The libjpeg DCT scaling denominator to decode with, based on
+        // size() and the maximum number of pixels we may decode.
+        unsigned scaleDenominator() const;
+
+        // Called once libjpeg has computed its output dimensions, which are
+        // smaller than size() when DCT scaling is in effect.
+        void setDecodedSize(unsigned width, unsigned height);
+
         bool outputScanlines();
         void jpegComplete();
 
@@ -138,6 +138,10 @@ public:
         m_interlaceBuffer = new png_byte[size];
     }
 
+    // Per-channel running sums for the destination row currently being box
+    // filtered when down sampling; four entries per destination pixel.
+    Vector<unsigned long long>& scaledRowSums() { return m_scaledRowSums; }
+
 private:
     unsigned m_readOffset;
     bool m_decodingSizeOnly;
@@ -147,6 +151,7 @@ private:
     bool m_hasAlpha;
     bool m_hasFinishedDecoding;
     unsigned m_currentBufferSize;
+    Vector<unsigned long long> m_scaledRowSums;
 };
 
 PNGImageDecoder::PNGImageDecoder()
@@ -382,6 +387,15 @@ void PNGImageDecoder::rowAvailable(unsigned char* rowBuffer, unsigned rowIndex,
     else
         row = rowBuffer;
 
+    // Rows of non-interlaced images arrive exactly once and in order, so we
+    // can average every source pixel into the smaller buffer instead of
+    // point sampling.  Interlaced images are refined over several passes and
+    // keep using the sampling path below.
+    if (m_scaled && !interlaceBuffer) {
+        accumulateScaledRow(buffer, row, rowIndex, hasAlpha);
+        return;
+    }
+
     // Copy the data into our buffer.
     int width = scaledSize().width();
     int destY = scaledY(rowIndex);
@@ -399,6 +413,59 @@ void PNGImageDecoder::rowAvailable(unsigned char* rowBuffer, unsigned rowIndex,
     }
 }
 
+void PNGImageDecoder::accumulateScaledRow(RGBA32Buffer& buffer, png_bytep row, unsigned rowIndex, bool hasAlpha)
+{
+    int destY = lowerBoundScaledY(rowIndex);
+    if (destY < 0)
+        return;
+
+    const int width = scaledSize().width();
+    const unsigned colorChannels = hasAlpha ? 4 : 3;
+    Vector<unsigned long long>& sums = m_reader->scaledRowSums();
+    if (sums.isEmpty()) {
+        sums.resize(width * 4);
+        sums.fill(0);
+    }
+
+    // Color channels are summed weighted by alpha, so that fully transparent
+    // pixels don't darken their neighbours.
+    for (int x = 0; x < width; ++x) {
+        int sourceXEnd = (x + 1 < width) ? m_scaledColumns[x + 1] : size().width();
+        unsigned long long* sum = sums.data() + x * 4;
+        for (int sourceX = m_scaledColumns[x]; sourceX < sourceXEnd; ++sourceX) {
+            png_bytep pixel = row + sourceX * colorChannels;
+            unsigned alpha = hasAlpha ? pixel[3] : 255;
+            sum[0] += pixel[0] * alpha;
+            sum[1] += pixel[1] * alpha;
+            sum[2] += pixel[2] * alpha;
+            sum[3] += alpha;
+        }
+    }
+
+    // Wait until the last source row belonging to this destination row.
+    int sourceYEnd = (destY + 1 < static_cast<int>(m_scaledRows.size())) ? m_scaledRows[destY + 1] : size().height();
+    if (static_cast<int>(rowIndex) != sourceYEnd - 1)
+        return;
+
+    const int rowsInBox = sourceYEnd - m_scaledRows[destY];
+    bool sawAlpha = buffer.hasAlpha();
+    for (int x = 0; x < width; ++x) {
+        int sourceXEnd = (x + 1 < width) ? m_scaledColumns[x + 1] : size().width();
+        unsigned long long pixelsInBox = (sourceXEnd - m_scaledColumns[x]) * rowsInBox;
+        unsigned long long* sum = sums.data() + x * 4;
+        unsigned alpha = pixelsInBox ? static_cast<unsigned>(sum[3] / pixelsInBox) : 0;
+        if (alpha)
+            buffer.setRGBA(x, destY, sum[0] / sum[3], sum[1] / sum[3], sum[2] / sum[3], alpha);
+        else
+            buffer.setRGBA(x, destY, 0, 0, 0, 0);
+        if (!sawAlpha && alpha < 255) {
+            sawAlpha = true;
+            buffer.setHasAlpha(true);
+        }
+    }
+    sums.fill(0);
+}
+
 void pngComplete(png_structp png, png_infop info)
 {
     static_cast<PNGImageDecoder*>(png_get_progressive_ptr(png))->pngComplete();
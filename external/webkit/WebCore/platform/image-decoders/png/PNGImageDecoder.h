@@ -58,6 +58,9 @@ namespace WebCore {
         void pngComplete();
 
     private:
+        // Box filters a non-interlaced row into the down sampled frame buffer.
+        void accumulateScaledRow(RGBA32Buffer&, unsigned char* row, unsigned rowIndex, bool hasAlpha);
+
         OwnPtr<PNGImageReader> m_reader;
     };
 
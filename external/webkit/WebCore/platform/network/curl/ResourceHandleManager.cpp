@@ -44,8 +44,10 @@
 #include "ResourceHandleInternal.h"
 #include "TextEncoding.h"
 
+#include <algorithm>
 #include <errno.h>
 #include <stdio.h>
+#include <wtf/MainThread.h>
 #include <wtf/Threading.h>
 #include <wtf/Vector.h>
 
@@ -54,11 +56,21 @@
 #define MAX_PATH MAXPATHLEN
 #endif
 
+#if OS(LINUX)
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
 namespace WebCore {
 
 const int selectTimeoutMS = 5;
 const double pollTimeSeconds = 0.05;
-const int maxRunningJobs = 5;
+const unsigned defaultMaxRunningJobs = 16;
+const unsigned defaultMaxRunningJobsPerHost = 6;
+#if OS(LINUX)
+const int maxSocketEvents = 32;
+#endif
 
 static const bool ignoreSSLErrors = getenv("WEBKIT_IGNORE_SSL_ERRORS");
 
@@ -117,9 +129,17 @@ static void curl_unlock_callback(CURL* handle, curl_lock_data data, void* userPt
 
 ResourceHandleManager::ResourceHandleManager()
     : m_downloadTimer(this, &ResourceHandleManager::downloadTimerCallback)
+    , m_scheduledJobsTimer(this, &ResourceHandleManager::scheduledJobsTimerCallback)
+    , m_socketPollTimer(this, &ResourceHandleManager::socketPollTimerCallback)
     , m_cookieJarFileName(0)
     , m_runningJobs(0)
     , m_certificatePath (certificatePath())
+    , m_maxRunningJobs(defaultMaxRunningJobs)
+    , m_maxRunningJobsPerHost(defaultMaxRunningJobsPerHost)
+#if OS(LINUX)
+    , m_epollFD(-1)
+    , m_watcherThread(0)
+#endif
 {
     curl_global_init(CURL_GLOBAL_ALL);
     m_curlMultiHandle = curl_multi_init();
@@ -128,10 +148,24 @@ ResourceHandleManager::ResourceHandleManager()
     curl_share_setopt(m_curlShareHandle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
     curl_share_setopt(m_curlShareHandle, CURLSHOPT_LOCKFUNC, curl_lock_callback);
     curl_share_setopt(m_curlShareHandle, CURLSHOPT_UNLOCKFUNC, curl_unlock_callback);
+
+    // Let curl tell us which sockets to watch and when its next timeout is,
+    // rather than polling every handle on a timer.
+    curl_multi_setopt(m_curlMultiHandle, CURLMOPT_SOCKETFUNCTION, socketCallback);
+    curl_multi_setopt(m_curlMultiHandle, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(m_curlMultiHandle, CURLMOPT_TIMERFUNCTION, timerCallback);
+    curl_multi_setopt(m_curlMultiHandle, CURLMOPT_TIMERDATA, this);
+
+#if OS(LINUX)
+    startSocketWatcher();
+#endif
 }
 
 ResourceHandleManager::~ResourceHandleManager()
 {
+#if OS(LINUX)
+    stopSocketWatcher();
+#endif
     curl_multi_cleanup(m_curlMultiHandle);
     curl_share_cleanup(m_curlShareHandle);
     if (m_cookieJarFileName)
@@ -319,14 +353,219 @@ size_t readCallback(void* ptr, size_t size, size_t nmemb, void* data)
     return sent;
 }
 
-void ResourceHandleManager::downloadTimerCallback(Timer<ResourceHandleManager>* timer)
+int ResourceHandleManager::socketCallback(CURL*, curl_socket_t socket, int action, void* userData, void*)
 {
-    startScheduledJobs();
+    ResourceHandleManager* manager = static_cast<ResourceHandleManager*>(userData);
+    if (action == CURL_POLL_REMOVE)
+        manager->unwatchSocket(socket);
+    else
+        manager->watchSocket(socket, action);
+    return 0;
+}
+
+int ResourceHandleManager::timerCallback(CURLM*, long timeoutMS, void* userData)
+{
+    // curl must not be re-entered from here, so even a zero timeout goes
+    // through the timer.
+    ResourceHandleManager* manager = static_cast<ResourceHandleManager*>(userData);
+    if (timeoutMS < 0)
+        manager->m_downloadTimer.stop();
+    else
+        manager->m_downloadTimer.startOneShot(timeoutMS / 1000.0);
+    return 0;
+}
+
+#if OS(LINUX)
+static bool epollWatch(int epollFD, int socket, int action)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLONESHOT;
+    if (action & CURL_POLL_IN)
+        event.events |= EPOLLIN;
+    if (action & CURL_POLL_OUT)
+        event.events |= EPOLLOUT;
+    event.data.fd = socket;
+
+    if (!epoll_ctl(epollFD, EPOLL_CTL_MOD, socket, &event))
+        return true;
+    return errno == ENOENT && !epoll_ctl(epollFD, EPOLL_CTL_ADD, socket, &event);
+}
+#endif
+
+void ResourceHandleManager::watchSocket(curl_socket_t socket, int action)
+{
+    m_sockets.set(socket, action);
+
+#if OS(LINUX)
+    if (m_watcherThread) {
+        if (epollWatch(m_epollFD, socket, action))
+            return;
+#ifndef NDEBUG
+        perror("bad: epoll_ctl() failed, falling back to select(): ");
+#endif
+        stopSocketWatcher();
+    }
+#endif
+
+    if (!m_socketPollTimer.isActive())
+        m_socketPollTimer.startOneShot(0);
+}
+
+void ResourceHandleManager::unwatchSocket(curl_socket_t socket)
+{
+    m_sockets.remove(socket);
+
+#if OS(LINUX)
+    if (m_watcherThread)
+        epoll_ctl(m_epollFD, EPOLL_CTL_DEL, socket, 0);
+#endif
+}
+
+// Lets curl handle activity on one socket.  With the socket watcher, the
+// socket is re-armed afterwards if curl still wants it watched.
+void ResourceHandleManager::socketActivity(curl_socket_t socket, int action)
+{
+    int runningHandles = 0;
+    while (curl_multi_socket_action(m_curlMultiHandle, socket, action, &runningHandles) == CURLM_CALL_MULTI_PERFORM) { }
+
+#if OS(LINUX)
+    if (!m_watcherThread)
+        return;
+    SocketMap::iterator it = m_sockets.find(socket);
+    if (it != m_sockets.end())
+        epollWatch(m_epollFD, socket, it->second);
+#endif
+}
+
+#if OS(LINUX)
+void ResourceHandleManager::startSocketWatcher()
+{
+    m_epollFD = epoll_create(maxSocketEvents);
+    if (m_epollFD == -1)
+        return;
+
+    if (pipe(m_watcherWakeupPipe) == -1) {
+        close(m_epollFD);
+        m_epollFD = -1;
+        return;
+    }
+    fcntl(m_epollFD, F_SETFD, FD_CLOEXEC);
+    fcntl(m_watcherWakeupPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(m_watcherWakeupPipe[1], F_SETFD, FD_CLOEXEC);
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = m_watcherWakeupPipe[0];
+    if (!epoll_ctl(m_epollFD, EPOLL_CTL_ADD, m_watcherWakeupPipe[0], &event))
+        m_watcherThread = createThread(socketWatcherThreadStart, this, "WebCore: Curl Socket Watcher");
+
+    // Without the thread the sockets are polled with select() instead.
+    if (!m_watcherThread) {
+        close(m_watcherWakeupPipe[0]);
+        close(m_watcherWakeupPipe[1]);
+        close(m_epollFD);
+        m_epollFD = -1;
+    }
+}
+
+void ResourceHandleManager::stopSocketWatcher()
+{
+    if (!m_watcherThread)
+        return;
+
+    char wakeup = 0;
+    while (write(m_watcherWakeupPipe[1], &wakeup, 1) == -1 && errno == EINTR) { }
+    waitForThreadCompletion(m_watcherThread, 0);
+    m_watcherThread = 0;
+
+    close(m_watcherWakeupPipe[0]);
+    close(m_watcherWakeupPipe[1]);
+    close(m_epollFD);
+    m_epollFD = -1;
+
+    // Events the thread already posted are still dispatched, and then the
+    // remaining sockets are picked up by the select() fallback.
+    if (!m_sockets.isEmpty() && !m_socketPollTimer.isActive())
+        m_socketPollTimer.startOneShot(0);
+}
+
+void* ResourceHandleManager::socketWatcherThreadStart(void* manager)
+{
+    static_cast<ResourceHandleManager*>(manager)->socketWatcherThread();
+    return 0;
+}
+
+void ResourceHandleManager::socketWatcherThread()
+{
+    struct epoll_event events[maxSocketEvents];
+    while (true) {
+        int count = epoll_wait(m_epollFD, events, maxSocketEvents, -1);
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        MutexLocker locker(m_pendingSocketEventsMutex);
+        // A dispatch is already pending if earlier events haven't been taken yet.
+        bool dispatchPending = !m_pendingSocketEvents.isEmpty();
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.fd == m_watcherWakeupPipe[0])
+                return;
+
+            int action = 0;
+            if (events[i].events & (EPOLLIN | EPOLLHUP))
+                action |= CURL_CSELECT_IN;
+            if (events[i].events & EPOLLOUT)
+                action |= CURL_CSELECT_OUT;
+            if (events[i].events & EPOLLERR)
+                action |= CURL_CSELECT_ERR;
+            m_pendingSocketEvents.append(std::make_pair(events[i].data.fd, action));
+        }
+
+        if (!dispatchPending)
+            callOnMainThread(dispatchSocketEvents, this);
+    }
+}
+
+void ResourceHandleManager::dispatchSocketEvents(void* context)
+{
+    ResourceHandleManager* manager = static_cast<ResourceHandleManager*>(context);
+
+    Vector<std::pair<int, int> > events;
+    {
+        MutexLocker locker(manager->m_pendingSocketEventsMutex);
+        events.swap(manager->m_pendingSocketEvents);
+    }
+
+    // A socket may have been removed, or even closed and reused, since its
+    // event was queued; curl ignores sockets it doesn't know about.
+    for (size_t i = 0; i < events.size(); ++i)
+        manager->socketActivity(events[i].first, events[i].second);
+
+    manager->processCompletedTransfers();
+}
+#endif
+
+void ResourceHandleManager::downloadTimerCallback(Timer<ResourceHandleManager>*)
+{
+    int runningHandles = 0;
+    while (curl_multi_socket_action(m_curlMultiHandle, CURL_SOCKET_TIMEOUT, 0, &runningHandles) == CURLM_CALL_MULTI_PERFORM) { }
+
+    processCompletedTransfers();
+}
+
+void ResourceHandleManager::socketPollTimerCallback(Timer<ResourceHandleManager>*)
+{
+    if (m_sockets.isEmpty())
+        return;
 
     fd_set fdread;
     fd_set fdwrite;
     fd_set fdexcep;
-    int maxfd = 0;
+    int maxfd = -1;
 
     struct timeval timeout;
     timeout.tv_sec = 0;
@@ -338,12 +577,16 @@ void ResourceHandleManager::downloadTimerCallback(Timer<ResourceHandleManager>*
         FD_ZERO(&fdread);
         FD_ZERO(&fdwrite);
         FD_ZERO(&fdexcep);
-        curl_multi_fdset(m_curlMultiHandle, &fdread, &fdwrite, &fdexcep, &maxfd);
-        // When the 3 file descriptors are empty, winsock will return -1
-        // and bail out, stopping the file download. So make sure we
-        // have valid file descriptors before calling select.
-        if (maxfd >= 0)
-            rc = ::select(maxfd + 1, &fdread, &fdwrite, &fdexcep, &timeout);
+        SocketMap::iterator end = m_sockets.end();
+        for (SocketMap::iterator it = m_sockets.begin(); it != end; ++it) {
+            if (it->second & CURL_POLL_IN)
+                FD_SET(it->first, &fdread);
+            if (it->second & CURL_POLL_OUT)
+                FD_SET(it->first, &fdwrite);
+            FD_SET(it->first, &fdexcep);
+            maxfd = std::max(maxfd, it->first);
+        }
+        rc = ::select(maxfd + 1, &fdread, &fdwrite, &fdexcep, &timeout);
     } while (rc == -1 && errno == EINTR);
 
     if (-1 == rc) {
@@ -353,9 +596,51 @@ void ResourceHandleManager::downloadTimerCallback(Timer<ResourceHandleManager>*
         return;
     }
 
-    int runningHandles = 0;
-    while (curl_multi_perform(m_curlMultiHandle, &runningHandles) == CURLM_CALL_MULTI_PERFORM) { }
+    if (rc > 0) {
+        // curl may add or remove sockets while handling one, so collect the
+        // ready ones first.
+        Vector<std::pair<int, int> > events;
+        SocketMap::iterator end = m_sockets.end();
+        for (SocketMap::iterator it = m_sockets.begin(); it != end; ++it) {
+            int action = 0;
+            if (FD_ISSET(it->first, &fdread))
+                action |= CURL_CSELECT_IN;
+            if (FD_ISSET(it->first, &fdwrite))
+                action |= CURL_CSELECT_OUT;
+            if (FD_ISSET(it->first, &fdexcep))
+                action |= CURL_CSELECT_ERR;
+            if (action)
+                events.append(std::make_pair(it->first, action));
+        }
+
+        for (size_t i = 0; i < events.size(); ++i)
+            socketActivity(events[i].first, events[i].second);
+
+        processCompletedTransfers();
+    }
+
+    if (!m_sockets.isEmpty() && !m_socketPollTimer.isActive())
+        m_socketPollTimer.startOneShot(pollTimeSeconds);
+}
+
+void ResourceHandleManager::scheduledJobsTimerCallback(Timer<ResourceHandleManager>*)
+{
+    // Cancelled jobs can't be removed from within the curl callbacks that
+    // usually cancel them, so it happens here.
+    Vector<ResourceHandle*> cancelledJobs;
+    HashMap<ResourceHandle*, String>::iterator end = m_runningJobHosts.end();
+    for (HashMap<ResourceHandle*, String>::iterator it = m_runningJobHosts.begin(); it != end; ++it) {
+        if (it->first->getInternal()->m_cancelled)
+            cancelledJobs.append(it->first);
+    }
+    for (size_t i = 0; i < cancelledJobs.size(); ++i)
+        removeFromCurl(cancelledJobs[i]);
 
+    startScheduledJobs();
+}
+
+void ResourceHandleManager::processCompletedTransfers()
+{
     // check the curl messages indicating completed transfers
     // and free their resources
     while (true) {
@@ -408,10 +693,7 @@ void ResourceHandleManager::downloadTimerCallback(Timer<ResourceHandleManager>*
         removeFromCurl(job);
     }
 
-    bool started = startScheduledJobs(); // new jobs might have been added in the meantime
-
-    if (!m_downloadTimer.isActive() && (started || (runningHandles > 0)))
-        m_downloadTimer.startOneShot(pollTimeSeconds);
+    startScheduledJobs(); // new jobs might have been added in the meantime
 }
 
 void ResourceHandleManager::setProxyInfo(const String& host,
@@ -433,6 +715,22 @@ void ResourceHandleManager::setProxyInfo(const String& host,
     }
 }
 
+void ResourceHandleManager::setMaxRunningJobs(unsigned maxRunningJobs)
+{
+    ASSERT(maxRunningJobs);
+    m_maxRunningJobs = maxRunningJobs;
+    if (!m_scheduledJobsTimer.isActive())
+        m_scheduledJobsTimer.startOneShot(0);
+}
+
+void ResourceHandleManager::setMaxRunningJobsPerHost(unsigned maxRunningJobsPerHost)
+{
+    ASSERT(maxRunningJobsPerHost);
+    m_maxRunningJobsPerHost = maxRunningJobsPerHost;
+    if (!m_scheduledJobsTimer.isActive())
+        m_scheduledJobsTimer.startOneShot(0);
+}
+
 void ResourceHandleManager::removeFromCurl(ResourceHandle* job)
 {
     ResourceHandleInternal* d = job->getInternal();
@@ -440,6 +738,16 @@ void ResourceHandleManager::removeFromCurl(ResourceHandle* job)
     if (!d->m_handle)
         return;
     m_runningJobs--;
+
+    HashMap<ResourceHandle*, String>::iterator hostIt = m_runningJobHosts.find(job);
+    ASSERT(hostIt != m_runningJobHosts.end());
+    if (hostIt != m_runningJobHosts.end()) {
+        HashMap<String, unsigned>::iterator countIt = m_runningJobsPerHost.find(hostIt->second);
+        if (countIt != m_runningJobsPerHost.end() && !--countIt->second)
+            m_runningJobsPerHost.remove(countIt);
+        m_runningJobHosts.remove(hostIt);
+    }
+
     curl_multi_remove_handle(m_curlMultiHandle, d->m_handle);
     curl_easy_cleanup(d->m_handle);
     d->m_handle = 0;
@@ -538,8 +846,8 @@ void ResourceHandleManager::add(ResourceHandle* job)
     // schedule this job to be added the next time we enter curl download loop
     job->ref();
     m_resourceHandleList.append(job);
-    if (!m_downloadTimer.isActive())
-        m_downloadTimer.startOneShot(pollTimeSeconds);
+    if (!m_scheduledJobsTimer.isActive())
+        m_scheduledJobsTimer.startOneShot(0);
 }
 
 bool ResourceHandleManager::removeScheduledJob(ResourceHandle* job)
@@ -557,12 +865,19 @@ bool ResourceHandleManager::removeScheduledJob(ResourceHandle* job)
 
 bool ResourceHandleManager::startScheduledJobs()
 {
-    // TODO: Create a separate stack of jobs for each domain.
-
+    // Jobs start in the order they were added, except that a job to a host
+    // which already has its share of running jobs lets later jobs to other
+    // hosts go first.
     bool started = false;
-    while (!m_resourceHandleList.isEmpty() && m_runningJobs < maxRunningJobs) {
-        ResourceHandle* job = m_resourceHandleList[0];
-        m_resourceHandleList.remove(0);
+    size_t i = 0;
+    while (i < m_resourceHandleList.size() && m_runningJobs < static_cast<int>(m_maxRunningJobs)) {
+        ResourceHandle* job = m_resourceHandleList[i];
+        HashMap<String, unsigned>::iterator it = m_runningJobsPerHost.find(job->request().url().host());
+        if (it != m_runningJobsPerHost.end() && it->second >= m_maxRunningJobsPerHost) {
+            ++i;
+            continue;
+        }
+        m_resourceHandleList.remove(i);
         startJob(job);
         started = true;
     }
@@ -666,9 +981,14 @@ void ResourceHandleManager::startJob(ResourceHandle* job)
     initializeHandle(job);
 
     m_runningJobs++;
+    String host = kurl.host();
+    m_runningJobHosts.set(job, host);
+    std::pair<HashMap<String, unsigned>::iterator, bool> count = m_runningJobsPerHost.add(host, 0);
+    ++count.first->second;
+
     CURLMcode ret = curl_multi_add_handle(m_curlMultiHandle, job->getInternal()->m_handle);
-    // don't call perform, because events must be async
-    // timeout will occur and do curl_multi_perform
+    // don't call curl here, because events must be async
+    // curl sets a timeout which will kick off the transfer
     if (ret && ret != CURLM_CALL_MULTI_PERFORM) {
 #ifndef NDEBUG
         fprintf(stderr, "Error %d starting job %s\n", ret, encodeWithURLEscapeSequences(job->request().url().string()).latin1().data());
@@ -797,8 +1117,8 @@ void ResourceHandleManager::cancel(ResourceHandle* job)
 
     ResourceHandleInternal* d = job->getInternal();
     d->m_cancelled = true;
-    if (!m_downloadTimer.isActive())
-        m_downloadTimer.startOneShot(pollTimeSeconds);
+    if (!m_scheduledJobsTimer.isActive())
+        m_scheduledJobsTimer.startOneShot(0);
 }
 
 } // namespace WebCore
@@ -31,6 +31,7 @@
 #include "CString.h"
 #include "Frame.h"
 #include "PlatformString.h"
+#include "StringHash.h"
 #include "Timer.h"
 #include "ResourceHandleClient.h"
 
@@ -40,6 +41,8 @@
 #endif
 
 #include <curl/curl.h>
+#include <wtf/HashMap.h>
+#include <wtf/Threading.h>
 #include <wtf/Vector.h>
 
 namespace WebCore {
@@ -69,10 +72,33 @@ public:
                       const String& username = "",
                       const String& password = "");
 
+    // Jobs beyond these limits wait in the queue until a running job to the
+    // same host, or any running job, finishes.
+    void setMaxRunningJobs(unsigned);
+    void setMaxRunningJobsPerHost(unsigned);
+
 private:
     ResourceHandleManager();
     ~ResourceHandleManager();
+
+    static int socketCallback(CURL*, curl_socket_t, int action, void* userData, void* socketData);
+    static int timerCallback(CURLM*, long timeoutMS, void* userData);
+    void watchSocket(curl_socket_t, int action);
+    void unwatchSocket(curl_socket_t);
+    void socketActivity(curl_socket_t, int action);
+
+#if OS(LINUX)
+    void startSocketWatcher();
+    void stopSocketWatcher();
+    static void* socketWatcherThreadStart(void*);
+    void socketWatcherThread();
+    static void dispatchSocketEvents(void*);
+#endif
+
     void downloadTimerCallback(Timer<ResourceHandleManager>*);
+    void scheduledJobsTimerCallback(Timer<ResourceHandleManager>*);
+    void socketPollTimerCallback(Timer<ResourceHandleManager>*);
+    void processCompletedTransfers();
     void removeFromCurl(ResourceHandle*);
     bool removeScheduledJob(ResourceHandle*);
     void startJob(ResourceHandle*);
@@ -80,7 +106,12 @@ private:
 
     void initializeHandle(ResourceHandle*);
 
+    // Fires when curl's own timeout expires.
     Timer<ResourceHandleManager> m_downloadTimer;
+    // Starts queued jobs and removes cancelled ones outside of curl callbacks.
+    Timer<ResourceHandleManager> m_scheduledJobsTimer;
+    // Polls the sockets with select() when the socket watcher isn't running.
+    Timer<ResourceHandleManager> m_socketPollTimer;
     CURLM* m_curlMultiHandle;
     CURLSH* m_curlShareHandle;
     char* m_cookieJarFileName;
@@ -88,7 +119,26 @@ private:
     Vector<ResourceHandle*> m_resourceHandleList;
     const CString m_certificatePath;
     int m_runningJobs;
-    
+    unsigned m_maxRunningJobs;
+    unsigned m_maxRunningJobsPerHost;
+    HashMap<String, unsigned> m_runningJobsPerHost;
+    HashMap<ResourceHandle*, String> m_runningJobHosts;
+
+    // The sockets curl has asked us to watch, mapped to CURL_POLL_IN/OUT/INOUT.
+    typedef HashMap<int, int, DefaultHash<int>::Hash, WTF::UnsignedWithZeroKeyHashTraits<int> > SocketMap;
+    SocketMap m_sockets;
+
+#if OS(LINUX)
+    // Sockets are watched with epoll on a background thread, which hands the
+    // ready ones to the main thread.  Each socket is registered one-shot and
+    // only re-armed once curl has handled it.
+    int m_epollFD;
+    int m_watcherWakeupPipe[2];
+    ThreadIdentifier m_watcherThread;
+    Mutex m_pendingSocketEventsMutex;
+    Vector<std::pair<int, int> > m_pendingSocketEvents;
+#endif
+
     String m_proxy;
     ProxyType m_proxyType;
 };
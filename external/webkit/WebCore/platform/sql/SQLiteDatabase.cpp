@@ -57,7 +57,7 @@ SQLiteDatabase::~SQLiteDatabase()
     close();
 }
 
-bool SQLiteDatabase::open(const String& filename)
+bool SQLiteDatabase::open(const String& filename, JournalMode journalMode)
 {
     close();
     
@@ -76,6 +76,18 @@ bool SQLiteDatabase::open(const String& filename)
     if (!SQLiteStatement(*this, "PRAGMA temp_store = MEMORY;").executeCommand())
         LOG_ERROR("SQLite database could not set temp_store to memory");
 
+    if (journalMode == JournalModeWAL) {
+#if SQLITE_VERSION_NUMBER >= 3007000
+        // The pragma returns the journal mode actually in effect, which stays
+        // the old one if WAL can't be used (e.g. on an in-memory database).
+        SQLiteStatement walStatement(*this, "PRAGMA journal_mode = WAL;");
+        if (walStatement.prepareAndStep() != SQLResultRow || !equalIgnoringCase(walStatement.getColumnText(0), "wal"))
+            LOG_ERROR("SQLite database could not set journal_mode to WAL");
+#else
+        LOG_ERROR("SQLite library is too old to support journal_mode WAL");
+#endif
+    }
+
     return isOpen();
 }
 
@@ -55,7 +55,11 @@ public:
     SQLiteDatabase();
     ~SQLiteDatabase();
 
-    bool open(const String& filename);
+    // JournalModeWAL switches the database to SQLite's write-ahead log, which
+    // lets readers proceed during a write and makes commits cheaper.  It is
+    // ignored if the SQLite library is too old to support it.
+    enum JournalMode { JournalModeDefault, JournalModeWAL };
+    bool open(const String& filename, JournalMode = JournalModeDefault);
     bool isOpen() const { return m_db; }
     void close();
 
@@ -108,6 +108,15 @@ int SQLiteStatement::reset()
     return sqlite3_reset(m_statement);
 }
 
+int SQLiteStatement::clearBindings()
+{
+    ASSERT(m_isPrepared);
+    if (!m_statement)
+        return SQLITE_OK;
+    LOG(SQLDatabase, "SQL - clearBindings - %s", m_query.ascii().data());
+    return sqlite3_clear_bindings(m_statement);
+}
+
 bool SQLiteStatement::executeCommand()
 {
     if (!m_statement && prepare() != SQLITE_OK)
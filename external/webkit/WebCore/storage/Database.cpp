@@ -75,6 +75,18 @@ const String& Database::databaseInfoTableName()
 
 static bool isDatabaseAvailable = true;
 
+static bool isWriteAheadLoggingEnabled = false;
+
+void Database::setWriteAheadLoggingEnabled(bool enabled)
+{
+    isWriteAheadLoggingEnabled = enabled;
+}
+
+bool Database::writeAheadLoggingEnabled()
+{
+    return isWriteAheadLoggingEnabled;
+}
+
 void Database::setIsAvailable(bool available)
 {
     isDatabaseAvailable = available;
@@ -222,6 +234,9 @@ public:
 
 Database::~Database()
 {
+    // The statements must be finalized before the SQLite handle is closed.
+    clearStatementCache();
+
     // The reference to the ScriptExecutionContext needs to be cleared on the JavaScript thread.  If we're on that thread already, we can just let the RefPtr's destruction do the dereffing.
     if (!m_scriptExecutionContext->isContextThread()) {
         m_scriptExecutionContext->postTask(DerefContextTask::create());
@@ -387,6 +402,7 @@ void Database::close()
 
     ASSERT(m_scriptExecutionContext->databaseThread());
     ASSERT(currentThread() == m_scriptExecutionContext->databaseThread()->getThreadID());
+    clearStatementCache();
     m_sqliteDatabase.close();
     // Must ref() before calling databaseThread()->recordDatabaseClosed().
     m_scriptExecutionContext->databaseThread()->recordDatabaseClosed(this);
@@ -481,6 +497,70 @@ void Database::resetAuthorizer()
         m_databaseAuthorizer->reset();
 }
 
+// Enough for the handful of distinct statements a typical page issues in a
+// loop, while bounding the memory held by compiled statements.
+static const unsigned maxCachedStatements = 32;
+
+struct Database::CachedStatement {
+    CachedStatement(SQLiteStatement* statement, bool readOnly, bool lastActionWasInsert, bool lastActionChangedDatabase)
+        : statement(statement)
+        , readOnly(readOnly)
+        , lastActionWasInsert(lastActionWasInsert)
+        , lastActionChangedDatabase(lastActionChangedDatabase)
+    {
+    }
+
+    OwnPtr<SQLiteStatement> statement;
+    // The authorizer decides what a statement may do when it is compiled, so
+    // a statement prepared for a read-write transaction can't be handed to a
+    // read-only one and vice versa.
+    bool readOnly;
+    bool lastActionWasInsert;
+    bool lastActionChangedDatabase;
+};
+
+SQLiteStatement* Database::cachedStatement(const String& sql, bool readOnly, int& result)
+{
+    StatementCache::iterator it = m_statementCache.find(sql);
+    if (it != m_statementCache.end()) {
+        CachedStatement* cached = it->second;
+        if (cached->readOnly == readOnly) {
+            m_statementCacheOrder.remove(sql);
+            m_statementCacheOrder.add(sql);
+            m_databaseAuthorizer->setLastActions(cached->lastActionWasInsert, cached->lastActionChangedDatabase);
+            result = SQLResultOk;
+            return cached->statement.get();
+        }
+        delete cached;
+        m_statementCache.remove(it);
+        m_statementCacheOrder.remove(sql);
+    }
+
+    OwnPtr<SQLiteStatement> statement(new SQLiteStatement(m_sqliteDatabase, sql));
+    result = statement->prepare();
+    if (result != SQLResultOk)
+        return 0;
+
+    if (m_statementCache.size() >= maxCachedStatements) {
+        ListHashSet<String>::iterator leastRecentlyUsed = m_statementCacheOrder.begin();
+        delete m_statementCache.take(*leastRecentlyUsed);
+        m_statementCacheOrder.remove(leastRecentlyUsed);
+    }
+
+    CachedStatement* cached = new CachedStatement(statement.release(), readOnly,
+        m_databaseAuthorizer->lastActionWasInsert(), m_databaseAuthorizer->lastActionChangedDatabase());
+    m_statementCache.set(sql, cached);
+    m_statementCacheOrder.add(sql);
+    return cached->statement.get();
+}
+
+void Database::clearStatementCache()
+{
+    deleteAllValues(m_statementCache);
+    m_statementCache.clear();
+    m_statementCacheOrder.clear();
+}
+
 void Database::performPolicyChecks()
 {
     // FIXME: Code similar to the following will need to be run to enforce the per-origin size limit the spec mandates.
@@ -497,7 +577,7 @@ void Database::performPolicyChecks()
 
 bool Database::performOpenAndVerify(ExceptionCode& e)
 {
-    if (!m_sqliteDatabase.open(m_filename)) {
+    if (!m_sqliteDatabase.open(m_filename, isWriteAheadLoggingEnabled ? SQLiteDatabase::JournalModeWAL : SQLiteDatabase::JournalModeDefault)) {
         LOG_ERROR("Unable to open database at path %s", m_filename.ascii().data());
         e = INVALID_STATE_ERR;
         return false;
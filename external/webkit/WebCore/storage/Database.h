@@ -39,7 +39,9 @@
 #include "VoidCallback.h"
 
 #include <wtf/Forward.h>
+#include <wtf/HashMap.h>
 #include <wtf/HashSet.h>
+#include <wtf/ListHashSet.h>
 #include <wtf/PassRefPtr.h>
 #include <wtf/RefPtr.h>
 #include <wtf/Deque.h>
@@ -54,6 +56,7 @@ class DatabaseAuthorizer;
 class DatabaseThread;
 class ScriptExecutionContext;
 class SQLResultSet;
+class SQLiteStatement;
 class SQLTransactionCallback;
 class SQLTransactionClient;
 class SQLTransactionCoordinator;
@@ -70,6 +73,11 @@ public:
     static void setIsAvailable(bool);
     static bool isAvailable();
 
+    // Databases opened after this is set use SQLite's write-ahead log
+    // instead of a rollback journal, where the SQLite library supports it.
+    static void setWriteAheadLoggingEnabled(bool);
+    static bool writeAheadLoggingEnabled();
+
     ~Database();
 
 // Direct support for the DOM API
@@ -120,6 +128,13 @@ public:
 
     bool performOpenAndVerify(ExceptionCode&);
 
+    // Returns a prepared statement for |sql|, compiling it only if it isn't
+    // already in the cache.  The caller must reset() the statement when it
+    // is done with it, and must not use it after the next call.  Returns 0
+    // and sets |result| to the SQLite error if the statement doesn't compile.
+    SQLiteStatement* cachedStatement(const String& sql, bool readOnly, int& result);
+    void clearStatementCache();
+
     Vector<String> performGetTableNames();
 
     SQLTransactionClient* transactionClient() const;
@@ -162,6 +177,12 @@ private:
     SQLiteDatabase m_sqliteDatabase;
     RefPtr<DatabaseAuthorizer> m_databaseAuthorizer;
 
+    // Only used on the database thread.
+    struct CachedStatement;
+    typedef HashMap<String, CachedStatement*> StatementCache;
+    StatementCache m_statementCache;
+    ListHashSet<String> m_statementCacheOrder; // Least recently used first.
+
 #ifndef NDEBUG
     String databaseDebugName() const { return m_mainThreadSecurityOrigin->toString() + "::" + m_name; }
 #endif
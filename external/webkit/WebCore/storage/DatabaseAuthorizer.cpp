@@ -360,6 +360,12 @@ void DatabaseAuthorizer::enable()
     m_securityEnabled = true;
 }
 
+void DatabaseAuthorizer::setLastActions(bool wasInsert, bool changedDatabase)
+{
+    m_lastActionWasInsert = wasInsert;
+    m_lastActionChangedDatabase = changedDatabase;
+}
+
 void DatabaseAuthorizer::setReadOnly()
 {
     m_readOnly = true;
@@ -94,6 +94,11 @@ public:
     bool lastActionWasInsert() const { return m_lastActionWasInsert; }
     bool lastActionChangedDatabase() const { return m_lastActionChangedDatabase; }
 
+    // A statement taken from the prepared statement cache is not compiled
+    // again, so the authorizer never sees its actions; the ones recorded when
+    // it was first prepared are restored through this instead.
+    void setLastActions(bool wasInsert, bool changedDatabase);
+
 private:
     DatabaseAuthorizer();
     void addWhitelistedFunctions();
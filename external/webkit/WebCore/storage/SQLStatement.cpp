@@ -58,6 +58,29 @@ SQLStatement::SQLStatement(const String& statement, const Vector<SQLValue>& argu
 {
 }
 
+namespace {
+
+// Returns a cached statement to its initial state however execute() exits,
+// so it doesn't hold locks or argument values until it is next used.
+class ResetStatementScope : public Noncopyable {
+public:
+    ResetStatementScope(SQLiteStatement& statement)
+        : m_statement(statement)
+    {
+    }
+
+    ~ResetStatementScope()
+    {
+        m_statement.reset();
+        m_statement.clearBindings();
+    }
+
+private:
+    SQLiteStatement& m_statement;
+};
+
+} // namespace
+
 bool SQLStatement::execute(Database* db)
 {
     ASSERT(!m_resultSet);
@@ -75,15 +98,21 @@ bool SQLStatement::execute(Database* db)
 
     SQLiteDatabase* database = &db->m_sqliteDatabase;
 
-    SQLiteStatement statement(*database, m_statement);
-    int result = statement.prepare();
+    // The same SQL text is often executed many times in one transaction, so
+    // the compiled statement is kept in a cache on the Database and only reset
+    // and rebound here.
+    int result;
+    SQLiteStatement* cachedStatement = db->cachedStatement(m_statement, m_readOnly, result);
 
-    if (result != SQLResultOk) {
+    if (!cachedStatement) {
         LOG(StorageAPI, "Unable to verify correctness of statement %s - error %i (%s)", m_statement.ascii().data(), result, database->lastErrorMsg());
         m_error = SQLError::create(1, database->lastErrorMsg());
         return false;
     }
 
+    SQLiteStatement& statement = *cachedStatement;
+    ResetStatementScope resetStatement(statement);
+
     // FIXME:  If the statement uses the ?### syntax supported by sqlite, the bind parameter count is very likely off from the number of question marks.
     // If this is the case, they might be trying to do something fishy or malicious
     if (statement.bindParameterCount() != m_arguments.size()) {
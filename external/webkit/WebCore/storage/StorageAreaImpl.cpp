@@ -127,6 +127,9 @@ String StorageAreaImpl::key(unsigned index) const
 String StorageAreaImpl::getItem(const String& key) const
 {
     ASSERT(!m_isShutdown);
+    String value;
+    if (m_storageAreaSync && m_storageAreaSync->getItemDuringImport(key, value))
+        return value;
     blockUntilImportComplete();
 
     return m_storageMap->getItem(key);
@@ -208,6 +211,9 @@ bool StorageAreaImpl::clear(Frame* frame)
 bool StorageAreaImpl::contains(const String& key) const
 {
     ASSERT(!m_isShutdown);
+    String value;
+    if (m_storageAreaSync && m_storageAreaSync->getItemDuringImport(key, value))
+        return !value.isNull();
     blockUntilImportComplete();
 
     return m_storageMap->contains(key);
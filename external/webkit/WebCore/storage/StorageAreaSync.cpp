@@ -33,6 +33,7 @@
 #include "HTMLElement.h"
 #include "SecurityOrigin.h"
 #include "SQLiteStatement.h"
+#include "SQLiteTransaction.h"
 #include "StorageAreaImpl.h"
 #include "StorageSyncManager.h"
 #include "SuddenTermination.h"
@@ -196,25 +197,17 @@ void StorageAreaSync::performImport()
         return;
     }
 
-    HashMap<String, String> itemMap;
-
+    // Rows go straight into the StorageMap rather than through an intermediate
+    // HashMap, so the import never holds two copies of the origin's data.
+    // The key column is UNIQUE, so each key is only seen once.
     int result = query.step();
     while (result == SQLResultRow) {
-        itemMap.set(query.getColumnText(0), query.getColumnText(1));
+        m_storageArea->importItem(query.getColumnText(0), query.getColumnText(1));
         result = query.step();
     }
 
-    if (result != SQLResultDone) {
+    if (result != SQLResultDone)
         LOG_ERROR("Error reading items from ItemTable for local storage");
-        markImported();
-        return;
-    }
-
-    HashMap<String, String>::iterator it = itemMap.begin();
-    HashMap<String, String>::iterator end = itemMap.end();
-
-    for (; it != end; ++it)
-        m_storageArea->importItem(it->first, it->second);
 
     markImported();
 }
@@ -241,10 +234,56 @@ void StorageAreaSync::blockUntilImportComplete()
     if (!m_storageArea)
         return;
 
-    MutexLocker locker(m_importLock);
-    while (!m_importComplete)
-        m_importCondition.wait(m_importLock);
-    m_storageArea = 0;
+    {
+        MutexLocker locker(m_importLock);
+        while (!m_importComplete)
+            m_importCondition.wait(m_importLock);
+        m_storageArea = 0;
+    }
+
+    m_lookupStatement.clear();
+    m_lookupDatabase.close();
+}
+
+// Every write blocks until the import is complete, so until then the database
+// holds exactly what the imported map will hold and can answer single-key
+// reads through the index on the key column.
+bool StorageAreaSync::getItemDuringImport(const String& key, String& value)
+{
+    ASSERT(isMainThread());
+
+    if (!m_storageArea)
+        return false;
+
+    {
+        MutexLocker locker(m_importLock);
+        if (m_importComplete)
+            return false;
+    }
+
+    if (!m_lookupStatement) {
+        String databaseFilename = m_syncManager->fullDatabaseFilename(m_databaseIdentifier);
+        if (databaseFilename.isEmpty() || !m_lookupDatabase.open(databaseFilename))
+            return false;
+
+        // The table may not exist yet if performImport() hasn't created it.
+        OwnPtr<SQLiteStatement> statement(new SQLiteStatement(m_lookupDatabase, "SELECT value FROM ItemTable WHERE key=?"));
+        if (statement->prepare() != SQLResultOk) {
+            m_lookupDatabase.close();
+            return false;
+        }
+        m_lookupStatement.set(statement.release());
+    }
+
+    m_lookupStatement->bindText(1, key);
+    int result = m_lookupStatement->step();
+    if (result == SQLResultRow)
+        value = m_lookupStatement->getColumnText(0);
+    else if (result == SQLResultDone)
+        value = String();
+    m_lookupStatement->reset();
+
+    return result == SQLResultRow || result == SQLResultDone;
 }
 
 void StorageAreaSync::sync(bool clearItems, const HashMap<String, String>& items)
@@ -254,6 +293,33 @@ void StorageAreaSync::sync(bool clearItems, const HashMap<String, String>& items
     if (!m_database.isOpen())
         return;
 
+    // The insert and delete statements are kept prepared for the lifetime of
+    // the database connection, since every sync uses them. They are prepared
+    // before the transaction starts, so that failing to prepare them cannot
+    // roll back the clear below.
+    if (!m_insertStatement) {
+        OwnPtr<SQLiteStatement> insert(new SQLiteStatement(m_database, "INSERT INTO ItemTable VALUES (?, ?)"));
+        if (insert->prepare() != SQLResultOk) {
+            LOG_ERROR("Failed to prepare insert statement - cannot write to local storage database");
+            return;
+        }
+        m_insertStatement.set(insert.release());
+    }
+
+    if (!m_removeStatement) {
+        OwnPtr<SQLiteStatement> remove(new SQLiteStatement(m_database, "DELETE FROM ItemTable WHERE key=?"));
+        if (remove->prepare() != SQLResultOk) {
+            LOG_ERROR("Failed to prepare delete statement - cannot write to local storage database");
+            return;
+        }
+        m_removeStatement.set(remove.release());
+    }
+
+    // Write the whole batch in one transaction, so that it costs one journal
+    // commit rather than one per changed item.
+    SQLiteTransaction transaction(m_database);
+    transaction.begin();
+
     // If the clear flag is set, then we clear all items out before we write any new ones in.
     if (clearItems) {
         SQLiteStatement clear(m_database, "DELETE FROM ItemTable");
@@ -269,23 +335,11 @@ void StorageAreaSync::sync(bool clearItems, const HashMap<String, String>& items
         }
     }
 
-    SQLiteStatement insert(m_database, "INSERT INTO ItemTable VALUES (?, ?)");
-    if (insert.prepare() != SQLResultOk) {
-        LOG_ERROR("Failed to prepare insert statement - cannot write to local storage database");
-        return;
-    }
-
-    SQLiteStatement remove(m_database, "DELETE FROM ItemTable WHERE key=?");
-    if (remove.prepare() != SQLResultOk) {
-        LOG_ERROR("Failed to prepare delete statement - cannot write to local storage database");
-        return;
-    }
-
     HashMap<String, String>::const_iterator end = items.end();
 
     for (HashMap<String, String>::const_iterator it = items.begin(); it != end; ++it) {
         // Based on the null-ness of the second argument, decide whether this is an insert or a delete.
-        SQLiteStatement& query = it->second.isNull() ? remove : insert;
+        SQLiteStatement& query = it->second.isNull() ? *m_removeStatement : *m_insertStatement;
 
         query.bindText(1, it->first);
 
@@ -294,13 +348,16 @@ void StorageAreaSync::sync(bool clearItems, const HashMap<String, String>& items
             query.bindText(2, it->second);
 
         int result = query.step();
+        query.reset();
         if (result != SQLResultDone) {
             LOG_ERROR("Failed to update item in the local storage database - %i", result);
             break;
         }
-
-        query.reset();
     }
+
+    // As before batching, the clear and the items written before a failure
+    // are kept.
+    transaction.commit();
 }
 
 void StorageAreaSync::performSync()
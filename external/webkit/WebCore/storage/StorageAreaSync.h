@@ -33,10 +33,12 @@
 #include "StringHash.h"
 #include "Timer.h"
 #include <wtf/HashMap.h>
+#include <wtf/OwnPtr.h>
 
 namespace WebCore {
 
     class Frame;
+    class SQLiteStatement;
     class StorageAreaImpl;
     class StorageSyncManager;
 
@@ -48,6 +50,12 @@ namespace WebCore {
         void scheduleFinalSync();
         void blockUntilImportComplete();
 
+        // While the import is still running, reads a single item straight
+        // from the database so that getItem() doesn't have to wait for every
+        // item to be imported.  Returns false once the import is complete, or
+        // if the item couldn't be read, in which case the caller should block.
+        bool getItemDuringImport(const String& key, String& value);
+
         void scheduleItemForSync(const String& key, const String& value);
         void scheduleClear();
 
@@ -67,6 +75,13 @@ namespace WebCore {
 
         // The database handle will only ever be opened and used on the background thread.
         SQLiteDatabase m_database;
+        OwnPtr<SQLiteStatement> m_insertStatement;
+        OwnPtr<SQLiteStatement> m_removeStatement;
+
+        // A second, read-only handle used on the main thread by
+        // getItemDuringImport(); it is closed once the import is complete.
+        SQLiteDatabase m_lookupDatabase;
+        OwnPtr<SQLiteStatement> m_lookupStatement;
 
     // The following members are subject to thread synchronization issues.
     public:
@@ -171,9 +171,10 @@ bool StorageMap::contains(const String& key) const
 
 void StorageMap::importItem(const String& key, const String& value)
 {
-    // Be sure to copy the keys/values as items imported on a background thread are destined
-    // to cross a thread boundary
-    pair<HashMap<String, String>::iterator, bool> result = m_map.add(key.threadsafeCopy(), value.threadsafeCopy());
+    // Items imported on a background thread are destined to cross a thread boundary.  The
+    // strings come straight from the database and aren't shared yet, so their buffers can be
+    // handed over without copying them.
+    pair<HashMap<String, String>::iterator, bool> result = m_map.add(key.crossThreadString(), value.crossThreadString());
     ASSERT(result.second);  // True if the key didn't exist previously.
 
     ASSERT(m_currentLength + key.length() >= m_currentLength);